@@ -0,0 +1,378 @@
+// Benchmark suite: matrix multiplication, every elementwise/broadcast mode, reductions and slicing,
+// on the CPU and OpenCL backends, or on the Dispatcher's choice per operation (auto). Each case
+// runs warmup iterations and then timed repetitions; the median, minimum and mean latency are
+// reported with GFLOPS and GB/s (from the median) as JSON.
+//
+// Usage: TensorBenchmark [--device cpu|gpu|auto|all] [--warmup N] [--repetitions N]
+//                        [--filter TEXT] [--output FILE]
+// --filter keeps the cases whose name contains TEXT; without --output the JSON goes to stdout.
+
+#include "Tensor.hpp"
+#include "TensorFuture.hpp"
+#include "cpu_gemm.h"
+#include "cpu_elementwise.h"
+#include "thread_pool.h"
+#include "opencl_setup.h"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+#ifndef TENSOR_BUILD_TYPE
+#define TENSOR_BUILD_TYPE "unknown"
+#endif
+
+Device UseDevice = Device::cpu;
+
+namespace {
+
+struct BenchmarkOptions {
+    std::vector<Device> devices{ Device::cpu };
+    int warmup = 2;
+    int repetitions = 10;
+    std::string filter;
+    std::string output;
+};
+
+struct BenchmarkResult {
+    std::string name;
+    std::string group;
+    std::string device;
+    std::string dtype;
+    std::vector<int> shape;
+    int repetitions = 0;
+    double medianMs = 0;
+    double minMs = 0;
+    double meanMs = 0;
+    double flops = 0; // Per call; 0 when not meaningful
+    double bytes = 0; // Minimum bytes moved per call
+};
+
+const char* DeviceName(Device aDevice) {
+    return aDevice == Device::cpu ? "cpu" : aDevice == Device::gpu ? "gpu" : "auto";
+}
+
+std::string ShapeName(const std::vector<int>& aShape) {
+    std::ostringstream name;
+    for (size_t d = 0; d < aShape.size(); ++d) {
+        name << (d ? "x" : "") << aShape[d];
+    }
+    return name.str();
+}
+
+// Deterministic, non-trivial values in [-1, 1)
+Tensor MakeTensor(const std::vector<int>& aShape, DType aDType = DType::float32) {
+    int count = 1;
+    for (int dim : aShape) count *= dim;
+    std::vector<float> values(count);
+    unsigned state = 12345u + (unsigned)count;
+    for (float& value : values) {
+        state = state * 1664525u + 1013904223u;
+        value = (float)(state >> 8) / (float)(1u << 23) - 1.0f;
+    }
+    Tensor tensor(aShape, values);
+    return aDType == DType::float32 ? tensor : tensor.astype(aDType);
+}
+
+class BenchmarkRunner {
+public:
+    explicit BenchmarkRunner(const BenchmarkOptions& aOptions) : options(aOptions) {}
+
+    // Time aBody on the current UseDevice. aFlops and aBytes are per call.
+    void run(const std::string& aGroup, const std::string& aCase, DType aDType, const std::vector<int>& aShape,
+        double aFlops, double aBytes, const std::function<void()>& aBody) {
+        BenchmarkResult result;
+        result.group = aGroup;
+        result.device = DeviceName(UseDevice);
+        result.dtype = DTypeName(aDType);
+        result.shape = aShape;
+        result.name = aGroup + "/" + aCase + "/" + result.dtype + "/" + ShapeName(aShape) + "/" + result.device;
+        if (!options.filter.empty() && result.name.find(options.filter) == std::string::npos) return;
+
+        for (int i = 0; i < options.warmup; ++i) aBody();
+        std::vector<double> times(options.repetitions);
+        for (double& time : times) {
+            const auto start = std::chrono::steady_clock::now();
+            aBody();
+            time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        std::vector<double> sorted = times;
+        std::sort(sorted.begin(), sorted.end());
+        const size_t n = sorted.size();
+        result.repetitions = (int)n;
+        result.medianMs = n % 2 ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+        result.minMs = sorted.front();
+        for (double time : times) result.meanMs += time / n;
+        result.flops = aFlops;
+        result.bytes = aBytes;
+        results.push_back(result);
+        std::cerr << result.name << ": " << result.medianMs << " ms" << std::endl;
+    }
+
+    const std::vector<BenchmarkResult>& getResults() const { return results; }
+
+private:
+    BenchmarkOptions options;
+    std::vector<BenchmarkResult> results;
+};
+
+
+/*********** Cases *************/
+
+void MatmulBenchmarks(BenchmarkRunner& runner) {
+    // { M, K, N }: square sizes, then tall, wide and inner-product-heavy rectangles
+    const std::vector<std::vector<int>> shapes{
+        { 64, 64, 64 }, { 128, 128, 128 }, { 256, 256, 256 }, { 512, 512, 512 }, { 1024, 1024, 1024 },
+        { 2048, 512, 128 }, { 128, 512, 2048 }, { 256, 4096, 256 }
+    };
+    for (const auto& mkn : shapes) {
+        for (DType dtype : { DType::float32, DType::float64, DType::bfloat16 }) {
+            // Every size in float32; the other dtypes at one representative size
+            if (dtype != DType::float32 && mkn != std::vector<int>{ 512, 512, 512 }) continue;
+            const int M = mkn[0], K = mkn[1], N = mkn[2];
+            Tensor a = MakeTensor({ M, K }, dtype), b = MakeTensor({ K, N }, dtype);
+            Tensor c({ M, N }, dtype);
+            const double bytes = ((double)M * K + (double)K * N + (double)M * N) * DTypeSize(dtype);
+            runner.run("matmul", "gemm", dtype, mkn, 2.0 * M * K * N, bytes, [&]() { matmul(a, b, c); });
+        }
+    }
+    // Operands that are views of larger tensors (strided rows)
+    Tensor parentA = MakeTensor({ 1024, 1024 }), parentB = MakeTensor({ 1024, 1024 });
+    Tensor c({ 512, 512 });
+    const double bytes = 3.0 * 512 * 512 * sizeof(float);
+    runner.run("matmul", "views", DType::float32, { 512, 512, 512 }, 2.0 * 512 * 512 * 512, bytes, [&]() {
+        matmul(parentA(Slice(0, 512), Slice(0, 512)), parentB(Slice(256, 768), Slice(256, 768)), c);
+    });
+
+    // Batches of small products: one batched operation, and with the weight shared by the batch
+    for (const auto& bmkn : std::vector<std::vector<int>>{ { 64, 64, 64, 64 }, { 16, 256, 256, 256 } }) {
+        const int B = bmkn[0], M = bmkn[1], K = bmkn[2], N = bmkn[3];
+        Tensor x = MakeTensor({ B, M, K }), y = MakeTensor({ B, K, N }), w = MakeTensor({ K, N });
+        Tensor out({ B, M, N });
+        const double flops = 2.0 * B * M * K * N;
+        const double bytes = ((double)B * M * K + (double)B * K * N + (double)B * M * N) * sizeof(float);
+        const double sharedBytes = ((double)B * M * K + (double)K * N + (double)B * M * N) * sizeof(float);
+        runner.run("matmul", "batched", DType::float32, bmkn, flops, bytes, [&]() { matmul(x, y, out); });
+        runner.run("matmul", "batched_shared_weight", DType::float32, bmkn, flops, sharedBytes, [&]() { matmul(x, w, out); });
+    }
+
+    // Independent products issued together with matmulAsync, then collected
+    const int pipelined = 8, size = 256;
+    std::vector<Tensor> lhs, rhs;
+    for (int i = 0; i < pipelined; ++i) {
+        lhs.push_back(MakeTensor({ size, size }));
+        rhs.push_back(MakeTensor({ size, size }));
+    }
+    runner.run("matmul", "async_pipeline", DType::float32, { pipelined, size, size, size },
+        2.0 * pipelined * size * size * size, 3.0 * pipelined * size * size * sizeof(float), [&]() {
+        std::vector<TensorFuture> products;
+        for (int i = 0; i < pipelined; ++i) products.push_back(matmulAsync(lhs[i], rhs[i]));
+        for (TensorFuture& product : products) product.wait();
+    });
+}
+
+void ElementwiseBenchmarks(BenchmarkRunner& runner) {
+    const int cols = 1024;
+    for (int rows : { 4, 64, 1024, 16384 }) {
+        const std::vector<int> shape{ rows, cols };
+        const double n = (double)rows * cols;
+        for (DType dtype : { DType::float32, DType::float64, DType::int32, DType::float16 }) {
+            const double s = DTypeSize(dtype);
+            Tensor a = MakeTensor(shape, dtype), b = MakeTensor(shape, dtype), c = MakeTensor(shape, dtype);
+            Tensor out(shape, dtype);
+            runner.run("elementwise", "same_shape_add", dtype, shape, n, 3 * n * s, [&]() { add(a, b, out); });
+            if (dtype != DType::float32) continue; // Broadcast modes in float32 only
+
+            Tensor row = MakeTensor({ 1, cols }), column = MakeTensor({ rows, 1 });
+            runner.run("elementwise", "same_shape_div", dtype, shape, n, 3 * n * s, [&]() { divide(a, b, out); });
+            runner.run("elementwise", "scalar_mul", dtype, shape, n, 2 * n * s, [&]() { multiply(a, 1.5f, out); });
+            runner.run("elementwise", "row_broadcast", dtype, shape, n, (2 * n + cols) * s, [&]() { add(a, row, out); });
+            runner.run("elementwise", "column_broadcast", dtype, shape, n, (2 * n + rows) * s, [&]() { add(a, column, out); });
+            runner.run("elementwise", "in_place_add", dtype, shape, n, 3 * n * s, [&]() { out += a; });
+            runner.run("elementwise", "fused_chain", dtype, shape, 3 * n, 4 * n * s, [&]() { out.assign(a * b + c - 2.0f); });
+            runner.run("elementwise", "allocating_add", dtype, shape, n, 3 * n * s, [&]() { Tensor result = a + b; });
+
+            // [B, T, C] activation plus a [C] bias
+            if (rows >= 64) {
+                const std::vector<int> activationShape{ 16, rows / 16, cols };
+                Tensor activation = MakeTensor(activationShape), bias = MakeTensor({ cols });
+                Tensor result(activationShape);
+                runner.run("elementwise", "nd_bias_broadcast", dtype, activationShape, n, (2 * n + cols) * s,
+                    [&]() { add(activation, bias, result); });
+            }
+        }
+    }
+}
+
+void ReductionBenchmarks(BenchmarkRunner& runner) {
+    const int cols = 1024;
+    for (int rows : { 64, 1024, 16384 }) {
+        const std::vector<int> shape{ rows, cols };
+        const double n = (double)rows * cols;
+        for (DType dtype : { DType::float32, DType::float64, DType::int32 }) {
+            const double s = DTypeSize(dtype);
+            Tensor a = MakeTensor(shape, dtype);
+            runner.run("reduction", "sum_all", dtype, shape, n, n * s, [&]() { Tensor result = a.sum(); });
+            if (dtype != DType::float32) continue; // Axis and argmax variants in float32 only
+            runner.run("reduction", "sum_rows", dtype, shape, n, (n + rows) * s, [&]() { Tensor result = a.sum(1); });
+            runner.run("reduction", "sum_columns", dtype, shape, n, (n + cols) * s, [&]() { Tensor result = a.sum(0); });
+            runner.run("reduction", "max_columns", dtype, shape, n, (n + cols) * s, [&]() { Tensor result = a.max(0); });
+            runner.run("reduction", "argmax_rows", dtype, shape, n, n * s + rows * 4.0, [&]() { Tensor result = a.argmax(1); });
+        }
+    }
+}
+
+void SlicingBenchmarks(BenchmarkRunner& runner) {
+    const int size = 2048;
+    const double s = sizeof(float);
+    Tensor matrix = MakeTensor({ size, size });
+    Tensor block({ 1024, 1024 });
+
+    runner.run("slicing", "row_views", DType::float32, { size, size }, 0, 0, [&]() {
+        for (int i = 0; i < size; ++i) Tensor view = matrix(i, Tensor::all);
+    });
+    runner.run("slicing", "column_copy", DType::float32, { size, 1 }, 0, 2 * size * s, [&]() {
+        Tensor column = Tensor(matrix(Tensor::all, 7)).contiguous();
+    });
+    runner.run("slicing", "submatrix_copy", DType::float32, { 1024, 1024 }, 0, 2.0 * 1024 * 1024 * s, [&]() {
+        Tensor copy = Tensor(matrix(Slice(512, 1536), Slice(512, 1536))).contiguous();
+    });
+    runner.run("slicing", "submatrix_assign", DType::float32, { 1024, 1024 }, 0, 2.0 * 1024 * 1024 * s, [&]() {
+        matrix(Slice(0, 1024), Slice(1024, 2048)) = block;
+    });
+    runner.run("slicing", "strided_add", DType::float32, { 1024, 1024 }, 1024.0 * 1024, 3.0 * 1024 * 1024 * s, [&]() {
+        add(matrix(Slice(0, 1024), Slice(0, 1024)), matrix(Slice(1024, 2048), Slice(1024, 2048)), block);
+    });
+}
+
+
+/*********** Report *************/
+
+std::string Timestamp() {
+    std::time_t now = std::time(nullptr);
+    char buffer[32];
+    std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    return buffer;
+}
+
+std::string JsonString(const std::string& aText) {
+    std::string quoted = "\"";
+    for (char c : aText) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+void WriteJson(std::ostream& out, const std::vector<BenchmarkResult>& aResults, const BenchmarkOptions& aOptions,
+    const std::string& aOpenCLDevice) {
+    out.precision(6);
+    out << "{\n  \"context\": {\n";
+    out << "    \"date\": " << JsonString(Timestamp()) << ",\n";
+    out << "    \"build_type\": " << JsonString(TENSOR_BUILD_TYPE) << ",\n";
+    out << "    \"omp_max_threads\": " << omp_get_max_threads() << ",\n";
+    out << "    \"pool_threads\": " << ThreadPool::Instance().Threads() << ",\n";
+    out << "    \"cpu_sgemm_kernel\": " << JsonString(SgemmCPUKernelName()) << ",\n";
+    out << "    \"cpu_dgemm_kernel\": " << JsonString(DgemmCPUKernelName()) << ",\n";
+    out << "    \"cpu_elementwise_kernel\": " << JsonString(ElementwiseCPUKernelName()) << ",\n";
+    out << "    \"opencl_device\": " << (aOpenCLDevice.empty() ? "null" : JsonString(aOpenCLDevice)) << ",\n";
+    out << "    \"warmup\": " << aOptions.warmup << ",\n";
+    out << "    \"repetitions\": " << aOptions.repetitions << "\n";
+    out << "  },\n  \"benchmarks\": [";
+    for (size_t i = 0; i < aResults.size(); ++i) {
+        const BenchmarkResult& result = aResults[i];
+        const double seconds = result.medianMs * 1e-3;
+        out << (i ? ",\n" : "\n") << "    {";
+        out << "\"name\": " << JsonString(result.name);
+        out << ", \"group\": " << JsonString(result.group);
+        out << ", \"device\": " << JsonString(result.device);
+        out << ", \"dtype\": " << JsonString(result.dtype);
+        out << ", \"shape\": [";
+        for (size_t d = 0; d < result.shape.size(); ++d) out << (d ? ", " : "") << result.shape[d];
+        out << "], \"repetitions\": " << result.repetitions;
+        out << ", \"median_ms\": " << result.medianMs;
+        out << ", \"min_ms\": " << result.minMs;
+        out << ", \"mean_ms\": " << result.meanMs;
+        out << ", \"gflops\": ";
+        if (result.flops > 0 && seconds > 0) out << result.flops / seconds * 1e-9; else out << "null";
+        out << ", \"gb_per_s\": ";
+        if (result.bytes > 0 && seconds > 0) out << result.bytes / seconds * 1e-9; else out << "null";
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+bool ParseOptions(int argc, const char* argv[], BenchmarkOptions& aOptions) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--device" && hasValue) {
+            const std::string device = argv[++i];
+            if (device == "cpu") aOptions.devices = { Device::cpu };
+            else if (device == "gpu") aOptions.devices = { Device::gpu };
+            else if (device == "auto") aOptions.devices = { Device::automatic };
+            else if (device == "all") aOptions.devices = { Device::cpu, Device::gpu };
+            else return false;
+        }
+        else if (arg == "--warmup" && hasValue) aOptions.warmup = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--repetitions" && hasValue) aOptions.repetitions = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--filter" && hasValue) aOptions.filter = argv[++i];
+        else if (arg == "--output" && hasValue) aOptions.output = argv[++i];
+        else return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    BenchmarkOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        std::cerr << "Usage: TensorBenchmark [--device cpu|gpu|auto|all] [--warmup N] [--repetitions N] "
+                     "[--filter TEXT] [--output FILE]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (std::string(TENSOR_BUILD_TYPE) == "Debug") {
+        std::cerr << "Warning: benchmarking a Debug build. Configure with -DCMAKE_BUILD_TYPE=Release." << std::endl;
+    }
+
+    BenchmarkRunner runner(options);
+    std::string openclDevice;
+    for (Device device : options.devices) {
+        if (device == Device::gpu) {
+            if (!OpenCLAvailable()) {
+                std::cerr << "No OpenCL platform found; skipping the gpu device." << std::endl;
+                continue;
+            }
+            openclDevice = OpenCLRuntime::Instance().DeviceName();
+        }
+        else if (device == Device::automatic && OpenCLAvailable()) {
+            openclDevice = OpenCLRuntime::Instance().DeviceName();
+        }
+        UseDevice = device;
+        MatmulBenchmarks(runner);
+        ElementwiseBenchmarks(runner);
+        ReductionBenchmarks(runner);
+        SlicingBenchmarks(runner);
+    }
+    UseDevice = Device::cpu;
+
+    if (options.output.empty()) {
+        WriteJson(std::cout, runner.getResults(), options, openclDevice);
+    }
+    else {
+        std::ofstream file(options.output);
+        if (!file) {
+            std::cerr << "Error: Cannot write " << options.output << std::endl;
+            return EXIT_FAILURE;
+        }
+        WriteJson(file, runner.getResults(), options, openclDevice);
+    }
+    return 0;
+}
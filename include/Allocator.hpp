@@ -0,0 +1,109 @@
+#ifndef ALLOCATOR_HPP
+#define ALLOCATOR_HPP
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <memory>
+#include <vector>
+
+// Source of tensor storage memory. Implementations must be thread-safe, and an allocator must
+// outlive every storage it handed out.
+class Allocator {
+public:
+    static constexpr size_t Alignment = 64; // Cache line, and one AVX-512 register
+
+    virtual ~Allocator() = default;
+    virtual void* allocate(size_t aBytes) = 0;
+    virtual void deallocate(void* aPointer, size_t aBytes) = 0;
+};
+
+// Every request goes to the system (aligned operator new/delete). The pages of large blocks are
+// first touched by the thread pool, so they are spread over the NUMA nodes its threads run on.
+class SystemAllocator : public Allocator {
+public:
+    static SystemAllocator& Instance();
+
+    void* allocate(size_t aBytes) override;
+    void deallocate(void* aPointer, size_t aBytes) override;
+};
+
+struct AllocatorStats {
+    size_t hits = 0; // Allocations served from a cache
+    size_t misses = 0; // Allocations that went to the system
+    size_t bytesCached = 0; // Bytes held in free lists, ready for reuse
+    size_t bytesInUse = 0; // Bytes handed out and not yet returned
+};
+
+// Caching allocator with size classes. Requests are rounded up to a class (4 classes per power of
+// two, so at most 25% is wasted) and freed blocks are kept in per-class free lists instead of
+// going back to the system, so steady-state loops stop paying for malloc, free and the page faults
+// of fresh large buffers. Blocks up to ThreadCacheMaxBytes first go to a small cache of the
+// freeing thread, which needs no lock; the rest, and thread-cache overflow, go to a shared pool.
+// The cache holds at most maxCachedBytes; blocks freed beyond that are released.
+class CachingAllocator : public Allocator {
+public:
+    static constexpr size_t ThreadCacheMaxBytes = 1 << 20;
+    static constexpr int ThreadCacheBlocksPerClass = 4;
+
+    static CachingAllocator& Instance(); // Process-wide pool; never destroyed
+
+    void* allocate(size_t aBytes) override;
+    void deallocate(void* aPointer, size_t aBytes) override;
+
+    AllocatorStats stats() const;
+    void setMaxCachedBytes(size_t aBytes); // 1 GiB by default
+    void releaseCached(); // Return the shared pool and the calling thread's cache to the system
+
+    static size_t SizeClass(size_t aBytes); // Bytes actually reserved for a request
+
+private:
+    CachingAllocator() = default;
+    CachingAllocator(const CachingAllocator&) = delete;
+    CachingAllocator& operator=(const CachingAllocator&) = delete;
+
+    friend struct ThreadCache;
+    void* takeShared(size_t aClassBytes);
+    void putShared(void* aPointer, size_t aClassBytes);
+
+    std::mutex poolMutex;
+    std::map<size_t, std::vector<void*>> pool; // Shared free lists by class size
+    std::atomic<size_t> maxCachedBytes{ size_t(1) << 30 };
+    std::atomic<size_t> hits{ 0 };
+    std::atomic<size_t> misses{ 0 };
+    std::atomic<size_t> bytesCached{ 0 };
+    std::atomic<size_t> bytesInUse{ 0 };
+};
+
+// Allocator of new tensor storage. Defaults to CachingAllocator::Instance(); storage already
+// allocated keeps the allocator it came from.
+Allocator& GetTensorAllocator();
+void SetTensorAllocator(Allocator& aAllocator);
+
+enum class StorageInit { Zero, Uninitialized };
+
+// Flat, aligned bytes of a tensor's elements, obtained from the tensor allocator, or owned by
+// another object such as a mapped file
+class TensorStorage {
+public:
+    TensorStorage() = default;
+    explicit TensorStorage(size_t aBytes, StorageInit aInit = StorageInit::Zero);
+    // aBytes belong to aOwner, which the storage keeps alive instead of going through an allocator
+    TensorStorage(unsigned char* aBytes, size_t aSize, std::shared_ptr<const void> aOwner);
+    ~TensorStorage();
+    TensorStorage(const TensorStorage&) = delete;
+    TensorStorage& operator=(const TensorStorage&) = delete;
+
+    unsigned char* data() { return bytes; }
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return numBytes; }
+
+private:
+    unsigned char* bytes = nullptr;
+    size_t numBytes = 0;
+    Allocator* allocator = nullptr;
+    std::shared_ptr<const void> owner;
+};
+
+#endif // ALLOCATOR_HPP
@@ -0,0 +1,47 @@
+#ifndef DTYPE_HPP
+#define DTYPE_HPP
+
+#include "Globals.hpp"
+#include <cstdint>
+#include <cstddef>
+
+// Storage types for the 16-bit formats. They only hold the bit pattern.
+struct float16 { uint16_t bits; };
+struct bfloat16 { uint16_t bits; };
+
+// C++ element type of each DType
+template<class T> struct DTypeOf;
+template<> struct DTypeOf<float> { static constexpr DType value = DType::float32; };
+template<> struct DTypeOf<double> { static constexpr DType value = DType::float64; };
+template<> struct DTypeOf<float16> { static constexpr DType value = DType::float16; };
+template<> struct DTypeOf<bfloat16> { static constexpr DType value = DType::bfloat16; };
+template<> struct DTypeOf<int32_t> { static constexpr DType value = DType::int32; };
+
+size_t DTypeSize(DType aDType); // Bytes per element
+const char* DTypeName(DType aDType);
+bool IsFloatingPoint(DType aDType);
+// Type arithmetic is carried out in: float16 and bfloat16 widen to float32, the others are unchanged
+DType ComputeDType(DType aDType);
+
+// Result type of a binary operation between two tensors: the wider float type wins, the two
+// 16-bit formats meet at float32, and any float beats int32.
+DType PromoteTypes(DType a, DType b);
+// Result type of a binary operation between a tensor and a scalar. Scalars do not widen a
+// tensor's type, except that a floating-point scalar turns an int32 tensor into float32.
+DType PromoteWithScalar(DType aDType, bool scalarIsIntegral);
+
+// Scalar conversions (round to nearest even)
+float HalfToFloat(uint16_t aBits);
+uint16_t FloatToHalf(float aValue);
+float BFloat16ToFloat(uint16_t aBits);
+uint16_t FloatToBFloat16(float aValue);
+
+// Convert count contiguous elements from srcType to dstType. Uses F16C for float16 and
+// compiler-vectorized loops elsewhere; large conversions are split over the thread pool.
+void ConvertElements(const void* src, DType srcType, void* dst, DType dstType, size_t count);
+
+// Single element access through a double (exact for every supported type)
+double LoadElement(const void* base, DType aDType, size_t index);
+void StoreElement(void* base, DType aDType, size_t index, double aValue);
+
+#endif // DTYPE_HPP
@@ -3,10 +3,21 @@
 
 enum class Device {
     cpu,
-    gpu
+    gpu,
+    automatic // Per operation, by the Dispatcher's cost model (dispatcher.h)
+};
+
+// Element type of a Tensor's storage. float16/bfloat16 are storage formats: arithmetic on them is
+// carried out in float32 and rounded back when stored.
+enum class DType {
+    float32,
+    float64,
+    float16,
+    bfloat16,
+    int32
 };
 
 extern Device UseDevice;
-using dataType = float;
+using dataType = float; // Default element type (DType::float32)
 
-#endif // GLOBALS_HPP
\ No newline at end of file
+#endif // GLOBALS_HPP
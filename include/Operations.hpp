@@ -5,6 +5,7 @@
 #include <vector>
 #include <numeric>
 #include "Globals.hpp"
+#include "DType.hpp"
 
 enum class OperationType {
     Addition,
@@ -14,54 +15,205 @@ enum class OperationType {
     MatrixMultiplication
 };
 
+enum class ReductionType {
+    Sum,
+    Mean,
+    Max,
+    Min,
+    ArgMax // Index along the axis of the first maximum, as int32
+};
+constexpr int AllAxes = -1; // Reduce every element
+
+enum class Activation {
+    None,
+    ReLU, // max(x, 0)
+    GELU, // x * (1 + erf(x / sqrt(2))) / 2
+    Tanh
+};
+
 enum class ShapeCompatibility {
-    ShapeMatch,
-    RowVector,
-    ColVector,
-    ColsRowsMatch,
-    IsScalar,
+    ShapeMatch, // Elementwise, identical shapes
+    Broadcast, // Elementwise, shapes broadcast to a common shape (NumPy rules)
+    ColsRowsMatch, // Matrix multiplication
     Incompatible
 };
 
+// Non-owning description of an operand handed to the backends. Element (i0, i1, ...) lives at
+// data[i0 * strides[0] + i1 * strides[1] + ...], so views of a parent tensor (rows, columns,
+// slices) reach the kernels without being copied. Strides are in elements of dtype.
+struct TensorRef {
+    static constexpr int MaxDims = 8;
+
+    void* data = nullptr;
+    DType dtype = DType::float32;
+    int ndim = 0;
+    int shape[MaxDims] = {};
+    int strides[MaxDims] = {};
+
+    template<class T> T* as() const { return static_cast<T*>(data); } // Typed base pointer
+    size_t numel() const;
+    bool isContiguous() const; // Dense row-major layout
+};
+
+// Non-owning description of a float32 sparse matrix in CSR form, handed to the backends. The
+// nonzeros of row r are values[k] at columns columnIndices[k] for k in [rowPointers[r],
+// rowPointers[r + 1]), with ascending columns.
+struct CSRRef {
+    int rows = 0;
+    int cols = 0;
+    const int* rowPointers = nullptr; // rows + 1 entries, starting at 0
+    const int* columnIndices = nullptr;
+    const float* values = nullptr;
+
+    size_t nnz() const { return rows > 0 ? (size_t)rowPointers[rows] : 0; }
+};
+
+// Last step of a matrix multiplication, applied to each element of the product before it is
+// stored: output(i, j) = activation(scale * product(i, j) + bias(j)). bias is a row of N elements
+// of any dtype (ndim 1, with its stride), or has null data for none.
+struct MatmulEpilogue {
+    TensorRef bias;
+    double scale = 1;
+    Activation activation = Activation::None;
+
+    bool IsIdentity() const { return bias.data == nullptr && scale == 1 && activation == Activation::None; }
+};
+
+// Classify how input2's shape relates to input1's for the given operation. Elementwise operands
+// may have any rank; matrix multiplication takes 2-D operands or batches of them (see MatmulShape).
+ShapeCompatibility CheckShapeCompatibility(const TensorRef& input1, const TensorRef& input2, OperationType opType);
+
+// Shape of the product input1 x input2: [M, N] for [M, K] x [K, N], and [B, M, N] when either is a
+// [B, ., .] batch. A 2-D operand, or a batch of 1, is shared by every entry of the other's batch.
+// Returns false if the shapes do not multiply.
+bool MatmulShape(const TensorRef& input1, const TensorRef& input2, std::vector<int>& outShape);
+
+// The 2-D matrix of entry index of a [B, ., .] batch operand. A 2-D operand, or a batch of 1, is
+// the same matrix for every entry.
+TensorRef BatchEntry(const TensorRef& batch, int index);
+
+// Broadcast two shapes (aligned from the right, size-1 dimensions stretch). Returns false if they
+// are incompatible.
+bool BroadcastShapes(const std::vector<int>& aShape, const std::vector<int>& bShape, std::vector<int>& outShape);
+
+// Strides of operand when it is read over an output of rank outRank that its shape broadcasts
+// to: dimensions the operand lacks or broadcasts (size 1) get stride 0.
+void BroadcastStrides(const TensorRef& operand, int outRank, int* strides);
+
+// Simplify the iteration space of an elementwise operation in place. shape is the output shape and
+// strides[k] the element strides of operand k over it. Size-1 dimensions are dropped and adjacent
+// dimensions that are contiguous in every operand are merged, so e.g. a bias added to a [B, T, C]
+// activation iterates as [B * T, C], and same-shape dense operands as one flat run. Returns the
+// new rank, which is at least 1.
+int CollapseDimensions(int ndim, int* shape, int* const* strides, int numOperands);
+
+// Copy src into dst element by element, honouring both operands' strides and converting between
+// their dtypes. Shapes must match.
+void CopyTensorRef(const TensorRef& src, const TensorRef& dst);
+
 // Abstract interface for parallel operations
+// Inputs may be strided views of any rank that broadcast to the output's shape; output refers to
+// caller-allocated storage of the result shape.
+// performOperation takes operands of the output's dtype (float32, float64 or int32); float16 and
+// bfloat16 arithmetic runs in the fused expression loop (TensorExpr.hpp). Matrix2DMulitplication
+// accepts any dtypes and converts the operands to the output's dtype where they differ. The
+// epilogue is applied by the GEMM itself, to each tile of the product as it is finished.
+// BatchedMatrixMultiplication computes outputs[i] = inputs1[i] x inputs2[i] for batch entries of
+// the same M, K and N in one parallel loop (CPU) or kernel launch (OpenCL). The entries may be
+// anywhere in memory; repeating one operand for every entry shares it across the batch.
+// Reduce reduces input of any dtype over axis (or AllAxes) into output, which has input's rank
+// with the reduced dimensions set to 1; output's dtype may differ (e.g. int32 for ArgMax).
+// SparseMatrixMultiplication computes the float32 [rows, N] output = input1 (CSR) x input2, a
+// [cols, N] operand of any dtype; N == 1 is a sparse matrix-vector product. output's rows must
+// be contiguous.
 class OperationInterface {
 public:
     virtual ~OperationInterface() {}
-    virtual void performOperation(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-        std::vector<dataType>& output, OperationType opType, 
+    virtual void performOperation(const TensorRef& input1, const TensorRef& input2,
+        const TensorRef& output, OperationType opType,
         ShapeCompatibility spCompat) const = 0;
-    virtual void Matrix2DMulitplication(std::vector<dataType>& input1, std::vector<int>& shape1,
-        std::vector<dataType>& input2, std::vector<int>& shape2,
-        std::vector<dataType>& output) = 0;
+    virtual void Matrix2DMulitplication(const TensorRef& input1, const TensorRef& input2,
+        const TensorRef& output, const MatmulEpilogue& epilogue = MatmulEpilogue()) = 0;
+    virtual void BatchedMatrixMultiplication(const TensorRef* inputs1, const TensorRef* inputs2,
+        const TensorRef* outputs, int batch, const MatmulEpilogue& epilogue = MatmulEpilogue()) = 0;
+    virtual void Reduce(const TensorRef& input, const TensorRef& output, ReductionType type,
+        int axis) const = 0;
+    virtual void SparseMatrixMultiplication(const CSRRef& input1, const TensorRef& input2,
+        const TensorRef& output) = 0;
+};
+
+// Buffers of a CPU reduction: a dense copy of a strided or 16-bit input and the per-run results.
+// Callers that repeat a reduction (TensorGraph) keep one, so it is only allocated the first time.
+struct ReductionScratch {
+    std::vector<unsigned char> input;
+    std::vector<double> values;
+    std::vector<int> indices;
 };
 
 // CPU parallel operations
 class CPUOperation : public OperationInterface {
 public:
-    virtual void performOperation(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-        std::vector<dataType>& output, OperationType opType,
+    virtual void performOperation(const TensorRef& input1, const TensorRef& input2,
+        const TensorRef& output, OperationType opType,
         ShapeCompatibility spCompat) const override;
 
-    virtual void Matrix2DMulitplication(std::vector<dataType>& input1, std::vector<int>& shape1,
-        std::vector<dataType>& input2, std::vector<int>& shape2,
-        std::vector<dataType>& output) override;
+    virtual void Matrix2DMulitplication(const TensorRef& input1, const TensorRef& input2,
+        const TensorRef& output, const MatmulEpilogue& epilogue = MatmulEpilogue()) override;
+
+    virtual void BatchedMatrixMultiplication(const TensorRef* inputs1, const TensorRef* inputs2,
+        const TensorRef* outputs, int batch, const MatmulEpilogue& epilogue = MatmulEpilogue()) override;
+
+    virtual void Reduce(const TensorRef& input, const TensorRef& output, ReductionType type,
+        int axis) const override;
+    void Reduce(const TensorRef& input, const TensorRef& output, ReductionType type, int axis,
+        ReductionScratch& scratch) const;
+
+    virtual void SparseMatrixMultiplication(const CSRRef& input1, const TensorRef& input2,
+        const TensorRef& output) override;
 
 private:
-    void OperationWithScalar(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-                            std::vector<dataType>& output, OperationType opType) const;
-    void OperationWithColVector(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-                            std::vector<dataType>& output, OperationType opType) const;
-    void OperationWithRowVector(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-                            std::vector<dataType>& output, OperationType opType) const;
-    void OperationWithSameShape(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-                            std::vector<dataType>& output, OperationType opType) const;
+    void ElementwiseBroadcast(const TensorRef& input1, const TensorRef& input2,
+                            const TensorRef& output, OperationType opType) const;
+};
+
+class PendingKernelWork; // from "opencl_setup.h"
+
+// OpenCL parallel operations
+class OpenCLOperation : public OperationInterface {
+public:
+    virtual void performOperation(const TensorRef& input1, const TensorRef& input2,
+        const TensorRef& output, OperationType opType,
+        ShapeCompatibility spCompat) const override;
+
+    virtual void Matrix2DMulitplication(const TensorRef& input1, const TensorRef& input2,
+        const TensorRef& output, const MatmulEpilogue& epilogue = MatmulEpilogue()) override;
+
+    virtual void BatchedMatrixMultiplication(const TensorRef* inputs1, const TensorRef* inputs2,
+        const TensorRef* outputs, int batch, const MatmulEpilogue& epilogue = MatmulEpilogue()) override;
+
+    virtual void Reduce(const TensorRef& input, const TensorRef& output, ReductionType type,
+        int axis) const override;
+
+    virtual void SparseMatrixMultiplication(const CSRRef& input1, const TensorRef& input2,
+        const TensorRef& output) override;
+
+    // Asynchronous forms: the work is enqueued on the device and pending tracks it until the
+    // result has reached output. The inputs must stay untouched until then. They return false,
+    // without enqueuing anything, when the device cannot run the operation: float64 without
+    // cl_khr_fp64, int32 products with an epilogue, products with K = 0 and, for performOperation,
+    // operands of another dtype, float16/bfloat16 or a strided output.
+    bool performOperationAsync(const TensorRef& input1, const TensorRef& input2,
+        const TensorRef& output, OperationType opType, PendingKernelWork& pending) const;
+    bool BatchedMatrixMultiplicationAsync(const TensorRef* inputs1, const TensorRef* inputs2,
+        const TensorRef* outputs, int batch, PendingKernelWork& pending,
+        const MatmulEpilogue& epilogue = MatmulEpilogue()) const;
 };
 
 // CUDA parallel operations
 class CUDAOperation : public OperationInterface {
 public:
-    virtual void performOperation(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-        std::vector<dataType>& output, OperationType opType,
+    virtual void performOperation(const TensorRef& input1, const TensorRef& input2,
+        const TensorRef& output, OperationType opType,
         ShapeCompatibility spCompat) const override;
 };
 
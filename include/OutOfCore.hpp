@@ -0,0 +1,34 @@
+#ifndef OUT_OF_CORE_HPP
+#define OUT_OF_CORE_HPP
+
+#include "TensorFile.hpp"
+#include <string>
+
+// What an out-of-core matmul did, and how fast
+struct OutOfCoreStats {
+    int M = 0, K = 0, N = 0;
+    int panelRows = 0; // Rows of A (and C) per panel
+    int panelCols = 0; // Columns of B (and C) per panel
+    int panels = 0; // Panel products computed
+    size_t bufferBytes = 0; // Panel buffers held at once, within the memory budget
+    size_t bytesRead = 0;
+    size_t bytesWritten = 0;
+    double seconds = 0; // Wall time
+    double computeSeconds = 0; // Multiplying panels
+    double ioSeconds = 0; // Reading and writing panels, mostly behind the multiplications
+    double stallSeconds = 0; // Multiplications waiting for a panel read
+
+    double Gflops() const { return seconds > 0 ? 2.0 * M * N * K / seconds * 1e-9 : 0; }
+    double IOGBps() const { return ioSeconds > 0 ? (bytesRead + bytesWritten) / ioSeconds * 1e-9 : 0; }
+};
+
+// C = A x B for operands too large to hold in memory: A ([M, K]) and B ([K, N]) are read from
+// tensor files (Tensor::save) and C, of the promoted dtype, is written to aPathC. Only panels are
+// held in memory, together at most aMemoryBudget bytes: one panel of B's columns at a time, and
+// two panels of A's rows and of C, so the next A panel is read and the previous C panel written
+// while the current one is multiplied. Panels are multiplied on the backend the Dispatcher selects
+// for a full panel. The budget must hold a column of B and two rows of A and of C at the least.
+OutOfCoreStats matmulOutOfCore(const std::string& aPathA, const std::string& aPathB, const std::string& aPathC,
+    size_t aMemoryBudget);
+
+#endif // OUT_OF_CORE_HPP
@@ -0,0 +1,81 @@
+#ifndef SPARSE_TENSOR_HPP
+#define SPARSE_TENSOR_HPP
+
+#include "Tensor.hpp"
+
+// float32 matrix that stores only its nonzero elements, in compressed sparse row (CSR) form: the
+// column and value of each nonzero, row by row, and where each row starts. It takes
+// nnz * 8 + (rows + 1) * 4 bytes instead of rows * cols * 4, and its products with dense tensors
+// only do the work of the nonzeros.
+class SparseTensor {
+public:
+    // Constructors
+    SparseTensor(); // 0 x 0
+    SparseTensor(int aRows, int aCols); // All zeros
+    // CSR arrays: aRowPointers has aRows + 1 entries from 0 to aValues.size(), and the nonzeros of
+    // row r are at [aRowPointers[r], aRowPointers[r + 1]) with ascending columns. Exits otherwise.
+    SparseTensor(int aRows, int aCols, std::vector<int> aRowPointers, std::vector<int> aColumnIndices,
+        std::vector<float> aValues);
+
+    // Conversions
+    // (row, column, value) triplets in any order; the values of repeated positions are summed
+    static SparseTensor fromCOO(int aRows, int aCols, const std::vector<int>& aRowIndices,
+        const std::vector<int>& aColumnIndices, const std::vector<float>& aValues);
+    static SparseTensor fromDense(const Tensor& aDense); // Nonzero elements of a 2-D tensor of any dtype (or view)
+    Tensor toDense() const; // float32 [rows, cols]
+    void toCOO(std::vector<int>& aRowIndices, std::vector<int>& aColumnIndices, std::vector<float>& aValues) const; // Row-major order
+
+    // Sparse-dense matrix multiplication. aDense is [cols, N] and gives a float32 [rows, N] tensor,
+    // or [cols] (a sparse matrix-vector product) and gives [rows]. Any dtype; the backend is chosen
+    // like for Tensor::matmul (see Dispatcher).
+    Tensor matmul(const Tensor& aDense) const;
+
+    // Elementwise operations with a dense tensor that broadcasts to [rows, cols], or a scalar.
+    // multiply and divide keep the sparsity pattern and give a SparseTensor: the implicit zeros stay
+    // zero, also where the dense operand is 0, infinite or NaN. add and subtract give a dense float32
+    // [rows, cols] tensor.
+    SparseTensor multiply(const Tensor& aDense) const;
+    SparseTensor divide(const Tensor& aDense) const;
+    SparseTensor multiply(float aScalar) const;
+    SparseTensor divide(float aScalar) const;
+    Tensor add(const Tensor& aDense) const;
+    Tensor subtract(const Tensor& aDense) const; // this - aDense
+
+    // Utility functions
+    std::vector<int> getShape() const { return { rows, cols }; }
+    size_t nnz() const { return values.size(); } // Stored elements, explicit zeros included
+    double density() const; // nnz / (rows * cols)
+    size_t memoryBytes() const; // Of the CSR arrays
+    const std::vector<int>& getRowPointers() const { return rowPointers; }
+    const std::vector<int>& getColumnIndices() const { return columnIndices; }
+    const std::vector<float>& getValues() const { return values; }
+
+    friend Tensor operator-(const Tensor& a, const SparseTensor& b);
+
+private:
+    int rows = 0;
+    int cols = 0;
+    std::vector<int> rowPointers; // rows + 1 entries
+    std::vector<int> columnIndices;
+    std::vector<float> values;
+
+    CSRRef ref() const; // Describe this matrix to the backends
+    // Same pattern, values[k] replaced by aOp(values[k], element of aDense at the nonzero's position)
+    template<class F> SparseTensor MapValues(const Tensor& aDense, F aOp) const;
+    // aDenseSign * aDense (broadcast) + aSparseSign * this, as a dense float32 [rows, cols] tensor
+    Tensor DenseCombination(const Tensor& aDense, float aDenseSign, float aSparseSign) const;
+};
+
+// Operators: sparse * dense and sparse / dense stay sparse; sums and differences are dense
+SparseTensor operator*(const SparseTensor& a, const Tensor& b);
+SparseTensor operator*(const Tensor& a, const SparseTensor& b);
+SparseTensor operator*(const SparseTensor& a, float b);
+SparseTensor operator*(float a, const SparseTensor& b);
+SparseTensor operator/(const SparseTensor& a, const Tensor& b);
+SparseTensor operator/(const SparseTensor& a, float b);
+Tensor operator+(const SparseTensor& a, const Tensor& b);
+Tensor operator+(const Tensor& a, const SparseTensor& b);
+Tensor operator-(const SparseTensor& a, const Tensor& b);
+Tensor operator-(const Tensor& a, const SparseTensor& b);
+
+#endif // SPARSE_TENSOR_HPP
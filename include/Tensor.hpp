@@ -2,6 +2,8 @@
 #define TENSOR_HPP
 
 #include "Operations.hpp"
+#include "Allocator.hpp"
+#include <memory>
 
 struct All {};
 
@@ -12,6 +14,21 @@ struct Slice {
 };
 
 class TensorAccessProxy;  // Forward declaration
+template<class E> struct TensorExpr; // Lazy elementwise expression, see TensorExpr.hpp
+struct TensorLeaf;
+
+// Reference to a single element of a tensor of any dtype. Reads and writes go through double.
+class ElementRef {
+public:
+    ElementRef(void* aAddress, DType aDType) : address(aAddress), dtype(aDType) {}
+    operator double() const { return LoadElement(address, dtype, 0); }
+    ElementRef& operator=(double aValue) { StoreElement(address, dtype, 0, aValue); return *this; }
+    ElementRef& operator=(const ElementRef& aOther) { return *this = static_cast<double>(aOther); }
+
+private:
+    void* address;
+    DType dtype;
+};
 
 class Tensor {
 public:
@@ -19,15 +36,19 @@ public:
 
     // Constructors
     Tensor(); // Default constructor
-    explicit Tensor(const std::vector<int>& aShape); // Construct tensor with a given shape
-    Tensor(const std::vector<int>& aShape, const std::vector<float>& aData); // Construct tensor with shape and data
+    explicit Tensor(const std::vector<int>& aShape, DType aDType = DType::float32); // Zero-initialized tensor with a given shape
+    Tensor(const std::vector<int>& aShape, const std::vector<float>& aData); // Construct float32 tensor with shape and data
+    template<class T>
+    Tensor(const std::vector<int>& aShape, const std::vector<T>& aData); // Data of another element type, e.g. std::vector<double> gives a float64 tensor
     Tensor(const std::vector<std::vector<float>>& aData); // Construct tensor with 2D vector
+    template<class E>
+    Tensor(const TensorExpr<E>& aExpr); // Evaluate a lazy expression such as "a * b + c - 2.0f"
 
 
     // Destructor
     ~Tensor() = default;
 
-    // Copy constructor and copy assignment operator
+    // Copy constructor and copy assignment operator. Copies are deep and contiguous, also for views.
     Tensor(const Tensor& aTensor);
     Tensor& operator=(const Tensor& aTensor);
 
@@ -36,55 +57,135 @@ public:
     Tensor& operator=(Tensor&& aTemp) noexcept;
 
     // Indexing: Access/Assign
-    // single value
-    float& operator()(int i, int j); // for non-const Tensor
-    const float& operator()(int i, int j) const; // for const Tensor
-
-    // Methods to get a proxy for row or column access
+    // single value, converted to and from double whatever the dtype
+    ElementRef operator()(int i, int j); // for non-const Tensor
+    double operator()(int i, int j) const; // for const Tensor
+    ElementRef at(const std::vector<int>& aIndex); // any rank, one index per dimension
+    double at(const std::vector<int>& aIndex) const;
+
+    // Methods to get a proxy for row or column access. Extracting a Tensor from the proxy gives a view
+    // that shares this tensor's storage.
     TensorAccessProxy operator()(int index, const All&);
     TensorAccessProxy operator()(const All&, int index);
 
     // Method to access a submatrix based on row and column slices
     TensorAccessProxy operator()(Slice rowSlice, Slice colSlice);
 
-    // Tensor operations
-    Tensor operator+(const Tensor& aTensor) const; // Addition
-    Tensor operator-(const Tensor& aTensor) const; // Subtraction
-    Tensor operator*(const Tensor& aTensor) const; // Multiplication
-    Tensor operator/(const Tensor& aTensor) const; // Division
-
-    // Operations with TensorProxy
-    Tensor operator+(const TensorAccessProxy& aTensorProxy) const; // Addition
-    Tensor operator-(const TensorAccessProxy& aTensorProxy) const; // Subtraction
-    Tensor operator*(const TensorAccessProxy& aTensorProxy) const; // Multiplication
-    Tensor operator/(const TensorAccessProxy& aTensorProxy) const; // Division
-
-    // Matrix multiplication
-    Tensor matmul(Tensor& aTensor); // const REMOVED for OpenCL. Figure out later
-
-    // Scalar operations
-    Tensor operator+(const dataType& aScalar) const; // Addition with scalar
-    Tensor operator-(const dataType& aScalar) const; // Subtraction with scalar
-    Tensor operator*(const dataType& aScalar) const; // Multiplication with scalar
-    Tensor operator/(const dataType& aScalar) const; // Division with scalar
+    // Elementwise operations (+ - * / with tensors, views and scalars) are non-member templates in
+    // TensorExpr.hpp. They build a lazy expression that is evaluated when assigned to a Tensor.
+
+    // In-place elementwise operations with a tensor, view (TensorAccessProxy), scalar or expression.
+    // The result is written into this tensor's storage (into the parent's, for a view) without
+    // allocating a new tensor. The operand must broadcast to this tensor's shape; the result keeps
+    // this tensor's dtype.
+    template<class R> Tensor& operator+=(const R& aOperand);
+    template<class R> Tensor& operator-=(const R& aOperand);
+    template<class R> Tensor& operator*=(const R& aOperand);
+    template<class R> Tensor& operator/=(const R& aOperand);
+
+    // Evaluate an expression into this tensor's existing storage, converting to its dtype. The
+    // expression must broadcast to this tensor's shape. See also add/subtract/multiply/divide.
+    template<class E> Tensor& assign(const TensorExpr<E>& aExpr);
+
+    // Matrix multiplication. The result has the promoted dtype of the operands (PromoteTypes).
+    // [B, M, K] x [B, K, N] batches give [B, M, N], computed in one batched operation (a single
+    // kernel launch on OpenCL). A 2-D operand, or a batch of 1, is broadcast across the other's batch.
+    Tensor matmul(const Tensor& aTensor) const;
+    // Fused dense layer: aActivation(aScale * (this x aTensor) + aBias), where aBias is a row of
+    // the product's N columns ([N] or [1, N]) added to every row. The GEMM applies the scale, bias
+    // and activation to each tile of the product as it finishes it, so the output is written once.
+    Tensor matmul(const Tensor& aTensor, const Tensor& aBias, Activation aActivation = Activation::None, float aScale = 1.0f) const;
+    Tensor matmul(const Tensor& aTensor, Activation aActivation, float aScale = 1.0f) const; // Without a bias
+    // Out-parameter forms: aOut (the product's shape, any dtype) is overwritten with the product
+    friend void matmul(const Tensor& a, const Tensor& b, Tensor& aOut);
+    friend void matmul(const Tensor& a, const Tensor& b, const Tensor& aBias, Tensor& aOut,
+        Activation aActivation, float aScale);
+    // Pointer-array batches: aOut[i] = a[i] x b[i] for 2-D tensors of the same shapes anywhere in
+    // memory, as one batched operation. A single a or b is shared by every entry.
+    friend void matmul(const std::vector<Tensor>& a, const std::vector<Tensor>& b, std::vector<Tensor>& aOut);
+    friend std::vector<Tensor> matmul(const std::vector<Tensor>& a, const std::vector<Tensor>& b);
+
+    // Reductions along aAxis (negative values count from the last dimension) or, without an axis,
+    // over every element. The result keeps the reduced dimensions with size 1, so a matrix reduced
+    // over axis 0 is a [1, N] row vector and over axis 1 an [M, 1] column vector, which broadcast
+    // straight back against it (e.g. x - x.mean(1)). sum, max and min keep the dtype; mean of an
+    // int32 tensor is float32. argmax gives int32 positions along the axis, or the flat row-major
+    // position without one. max, min and argmax propagate NaN.
+    Tensor sum(int aAxis) const;
+    Tensor sum() const;
+    Tensor mean(int aAxis) const;
+    Tensor mean() const;
+    Tensor max(int aAxis) const;
+    Tensor max() const;
+    Tensor min(int aAxis) const;
+    Tensor min() const;
+    Tensor argmax(int aAxis) const;
+    Tensor argmax() const;
+
+    // Dtype
+    DType getDType() const;
+    Tensor astype(DType aDType) const; // Dense copy converted to aDType (vectorized)
 
     // Utility functions
     void print() const; // For debugging: print tensor values
     std::vector<int> getShape() const; // Get the shape of the tensor
+    std::vector<int> getStrides() const; // Get the element strides of the tensor
     int numel() const; // Number of elements in the tensor
+    bool isContiguous() const; // True when the elements are dense and row-major
+    bool isView() const; // True when the storage is shared with another tensor
+    Tensor contiguous() const; // This tensor if already contiguous, otherwise a dense copy
+    Tensor reshape(const std::vector<int>& aShape) const; // Same elements in a new shape; a view when contiguous
+
+    // Binary tensor files (see TensorFile.hpp). save writes the dtype, shape and elements (row-major,
+    // also for views). load maps the file and backs the tensor with the mapped pages, so it takes
+    // the same time for any size and the elements are read from disk on first access. Writes to a
+    // loaded tensor change private copies of the pages, never the file.
+    void save(const std::string& aPath) const;
+    static Tensor load(const std::string& aPath);
 
     // friends 
     friend class TensorAccessProxy;
     friend class ParallelOperation; // from "Operations.hpp"
+    friend struct TensorLeaf; // from "TensorExpr.hpp"
+    friend class TensorFuture; // from "TensorFuture.hpp"
+    friend class SparseTensor; // from "SparseTensor.hpp"
+    friend class TensorGraph; // from "TensorGraph.hpp"
     
 private:
     std::vector<int> shape; // Shape of the tensor
-    std::vector<float> data; // Data of the tensor, stored in a flat array
+    std::vector<int> strides; // Element strides of each dimension
+    size_t offset = 0; // Offset of the first element in the storage, in elements
+    DType dtype = DType::float32; // Element type of the storage
+    std::shared_ptr<TensorStorage> storage; // Flat storage, shared between a tensor and its views
+
+    // View constructor: shares aStorage
+    Tensor(std::shared_ptr<TensorStorage> aStorage, size_t aOffset, DType aDType,
+        const std::vector<int>& aShape, const std::vector<int>& aStrides);
+    // Fresh contiguous storage, left uninitialized when every element is about to be written
+    Tensor(const std::vector<int>& aShape, DType aDType, StorageInit aInit);
+
+    void InitFromData(const void* aData, DType aDType, size_t aCount); // Copy into fresh storage
+    void CopyFrom(const Tensor& aSource); // Copy aSource's elements (same shape) into this tensor's; recorded by a capturing graph
+    size_t ElementOffset(const std::vector<int>& aIndex) const; // Storage offset of an N-D index
 
     // Private methods for internal use
     ShapeCompatibility CheckShapeCompatibility(const Tensor& aTensor, const OperationType opType) const; // Check shape compatibility for operations
+    TensorRef ref() const; // Describe this tensor (or view) to the backends
+    Tensor Reduce(ReductionType aType, int aAxis) const; // aAxis in [0, rank) or AllAxes
+    // aOut = aActivation(aScale * (a x b) + *aBias); aBias may be null
+    static void MatmulInto(const Tensor& a, const Tensor& b, const Tensor* aBias, Activation aActivation,
+        float aScale, Tensor& aOut);
+    int NormalizeAxis(int aAxis) const; // Resolve a negative axis; exits if out of range
+    static std::vector<int> ContiguousStrides(const std::vector<int>& aShape);
 };
 
+// Out-parameter and pointer-array batched matrix multiplication (see Tensor::matmul)
+void matmul(const Tensor& a, const Tensor& b, Tensor& aOut);
+void matmul(const Tensor& a, const Tensor& b, const Tensor& aBias, Tensor& aOut,
+    Activation aActivation = Activation::None, float aScale = 1.0f);
+void matmul(const std::vector<Tensor>& a, const std::vector<Tensor>& b, std::vector<Tensor>& aOut);
+std::vector<Tensor> matmul(const std::vector<Tensor>& a, const std::vector<Tensor>& b); // aOut of the promoted dtype
+
 class TensorAccessProxy {
 public:
     enum class AccessMode { Row, Column, Submatrix};
@@ -93,32 +194,23 @@ public:
     TensorAccessProxy(Tensor& tensor, int index, std::vector<Slice> slice, AccessMode mode);
 
     TensorAccessProxy& operator=(const Tensor& src); // Assignment operator for both row and column
+    TensorAccessProxy& operator=(const TensorAccessProxy& src); // Assign from another row, column or submatrix
     operator Tensor() const; // Conversion operator to support extraction as a Tensor. Usage: "aTensorProxy.operator Tensor()".
-                                //Works for "Tensor aTensor = aTensorProxy". 
+                                //Works for "Tensor aTensor = aTensorProxy". The result is a view, no data is copied.
 
-    // Extract the Tensor
-    Tensor& getTensor() const;
+    // Extract the Tensor (a view sharing the parent's storage)
+    Tensor getTensor() const;
 
     // Move, copy operators?
 
-    
-    // Operations with TensorProxy
-    Tensor operator+(const TensorAccessProxy& aTensorProxy) const; // Addition
-    Tensor operator-(const TensorAccessProxy& aTensorProxy) const; // Subtraction
-    Tensor operator*(const TensorAccessProxy& aTensorProxy) const; // Multiplication
-    Tensor operator/(const TensorAccessProxy& aTensorProxy) const; // Division
-
-    // Operations with Tensor
-    Tensor operator+(const Tensor& aTensor) const; // Addition
-    Tensor operator-(const Tensor& aTensor) const; // Subtraction
-    Tensor operator*(const Tensor& aTensor) const; // Multiplication
-    Tensor operator/(const Tensor& aTensor) const; // Division
-
-    // Operations with Scalar
-    Tensor operator+(const dataType& aScalar) const; // Addition
-    Tensor operator-(const dataType& aScalar) const; // Subtraction
-    Tensor operator*(const dataType& aScalar) const; // Multiplication
-    Tensor operator/(const dataType& aScalar) const; // Division
+    // Arithmetic with tensors, other proxies and scalars goes through the expression operators
+    // in TensorExpr.hpp, reading the view directly.
+
+    // In-place arithmetic on the row, column or submatrix of the parent
+    template<class R> TensorAccessProxy& operator+=(const R& aOperand) { getTensor() += aOperand; return *this; }
+    template<class R> TensorAccessProxy& operator-=(const R& aOperand) { getTensor() -= aOperand; return *this; }
+    template<class R> TensorAccessProxy& operator*=(const R& aOperand) { getTensor() *= aOperand; return *this; }
+    template<class R> TensorAccessProxy& operator/=(const R& aOperand) { getTensor() /= aOperand; return *this; }
 
     // Utility functions
     void print() const; // For debugging: print tensor values
@@ -133,21 +225,11 @@ private:
 };
 
 
-/******************************************************** NON-MEMBER FUNCTIONS *********************************************************/
-// Operations with Scalar on the left
-// aScalar + aTensor
-Tensor operator+(const dataType& aScalar, const Tensor& aTensor);
-Tensor operator-(const dataType& aScalar, const Tensor& aTensor);
-Tensor operator*(const dataType& aScalar, const Tensor& aTensor);
-Tensor operator/(const dataType& aScalar, const Tensor& aTensor);
-
-// aScalar + aTensorProxy
-Tensor operator+(const dataType& aScalar, const TensorAccessProxy& aTensorProxy);
-Tensor operator-(const dataType& aScalar, const TensorAccessProxy& aTensorProxy);
-Tensor operator*(const dataType& aScalar, const TensorAccessProxy& aTensorProxy);
-Tensor operator/(const dataType& aScalar, const TensorAccessProxy& aTensorProxy);
-
-
+template<class T>
+Tensor::Tensor(const std::vector<int>& aShape, const std::vector<T>& aData) : shape(aShape), strides(ContiguousStrides(aShape)) {
+    InitFromData(aData.data(), DTypeOf<T>::value, aData.size());
+}
 
+#include "TensorExpr.hpp" // Lazy elementwise expressions and the arithmetic operators
 
 #endif // TENSOR_HPP
\ No newline at end of file
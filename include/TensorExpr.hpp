@@ -0,0 +1,494 @@
+#ifndef TENSOR_EXPR_HPP
+#define TENSOR_EXPR_HPP
+
+// Lazy elementwise expressions. Included at the end of Tensor.hpp.
+//
+// "a * b + c - 2.0f" builds a small tree of nodes instead of computing a temporary Tensor per
+// operator. The tree is evaluated when it is converted to a Tensor:
+//  - a single operation on tensors (e.g. "a + b") is handed to the selected backend
+//    (OperationInterface::performOperation) as before,
+//  - longer chains run as one fused loop over the output, shared out over the thread pool. Each
+//    iteration evaluates a block of ExprBlockSize elements of one output row, so intermediates
+//    live in L1 and every operand is read from memory exactly once.
+// Operands broadcast NumPy-style (dimensions aligned from the right, size-1 dimensions stretch).
+//
+// Every node has a result dtype (PromoteTypes / PromoteWithScalar over its operands). The whole
+// tree is evaluated in ComputeDType of the root's dtype: float for float32, float16 and bfloat16,
+// double for float64, int32_t for int32. Operands of another dtype are converted block by block
+// as they are read, and the result is rounded to the output's dtype when it is stored.
+
+#include "tracer.h"
+#include "thread_pool.h"
+#include "TensorGraph.hpp"
+#include <algorithm>
+#include <type_traits>
+
+constexpr int ExprBlockSize = 256; // Elements evaluated per block; intermediates stay in L1
+constexpr size_t ExprParallelThreshold = 1 << 15; // Below this many elements the loop runs serially
+
+/*********** Elementwise functors *************/
+struct AddOp {
+    static constexpr OperationType type = OperationType::Addition;
+    template<class T> static T apply(T a, T b) { return a + b; }
+};
+struct SubOp {
+    static constexpr OperationType type = OperationType::Subtraction;
+    template<class T> static T apply(T a, T b) { return a - b; }
+};
+struct MulOp {
+    static constexpr OperationType type = OperationType::Multiplication;
+    template<class T> static T apply(T a, T b) { return a * b; }
+};
+struct DivOp {
+    static constexpr OperationType type = OperationType::Division;
+    // Same semantics as the CPU kernels: IEEE division for floating point (x / 0 is +-inf), and
+    // 0 for int32 division by zero
+    template<class T> static T apply(T a, T b) {
+        if constexpr (std::is_integral<T>::value) return b == 0 ? T(0) : a / b;
+        else return a / b;
+    }
+};
+
+/*********** Expression nodes *************/
+// CRTP base of every node
+template<class E>
+struct TensorExpr {
+    const E& self() const { return static_cast<const E&>(*this); }
+
+    std::vector<int> getShape() const { return self().shape(); }
+    DType getDType() const { return self().dtype(); }
+    Tensor eval() const { return Tensor(*this); } // Materialize the expression
+    void print() const { eval().print(); }
+};
+
+// A Tensor (or view) operand. Shares the operand's storage, so the expression stays valid even
+// if it outlives a temporary operand.
+struct TensorLeaf : TensorExpr<TensorLeaf> {
+    explicit TensorLeaf(const Tensor& aTensor) : storage(aTensor.storage), ref(aTensor.ref()) {}
+
+    std::vector<int> shape() const { return std::vector<int>(ref.shape, ref.shape + ref.ndim); }
+    DType dtype() const { return ref.dtype; }
+
+    // Align this operand to the output shape: broadcast dimensions get stride 0
+    void bind(const int*, int outRank) {
+        rank = outRank;
+        BroadcastStrides(ref, outRank, boundStrides);
+    }
+    template<class F>
+    void forEachLeaf(F&& f) { f(*this); }
+
+    // Element offset of the row; index holds the output coordinates of every dimension but the last
+    size_t rowOffset(const int* index) const {
+        size_t offset = 0;
+        for (int d = 0; d < rank - 1; ++d) offset += (size_t)index[d] * boundStrides[d];
+        return offset;
+    }
+
+    template<class T>
+    void evalRow(const int* index, int col0, int count, T* out) const {
+        const int colStride = boundStrides[rank - 1];
+        if (ref.dtype == DTypeOf<T>::value) {
+            const T* src = ref.as<T>() + rowOffset(index);
+            if (colStride == 1) {
+                std::copy(src + col0, src + col0 + count, out);
+            }
+            else if (colStride == 0) {
+                std::fill(out, out + count, src[0]);
+            }
+            else {
+                for (int k = 0; k < count; ++k) out[k] = src[(size_t)(col0 + k) * colStride];
+            }
+            return;
+        }
+        // Another dtype: convert while reading
+        const size_t first = rowOffset(index);
+        if (colStride == 1) {
+            const unsigned char* src = ref.as<unsigned char>() + (first + col0) * DTypeSize(ref.dtype);
+            ConvertElements(src, ref.dtype, out, DTypeOf<T>::value, count);
+        }
+        else if (colStride == 0) {
+            std::fill(out, out + count, static_cast<T>(LoadElement(ref.data, ref.dtype, first)));
+        }
+        else {
+            for (int k = 0; k < count; ++k) {
+                out[k] = static_cast<T>(LoadElement(ref.data, ref.dtype, first + (size_t)(col0 + k) * colStride));
+            }
+        }
+    }
+
+    // Unit-stride rows of the compute type are read in place; anything else is gathered into scratch
+    template<class T>
+    const T* rowPointer(const int* index, int col0, int count, T* scratch) const {
+        if (ref.dtype == DTypeOf<T>::value && boundStrides[rank - 1] == 1) return ref.as<T>() + rowOffset(index) + col0;
+        evalRow(index, col0, count, scratch);
+        return scratch;
+    }
+
+    std::shared_ptr<TensorStorage> storage;
+    TensorRef ref;
+    int rank = 0;
+    int boundStrides[TensorRef::MaxDims] = {};
+};
+
+// A scalar operand. Scalars do not widen a tensor's dtype (PromoteWithScalar), so "halfTensor * 2.0"
+// stays float16.
+struct ScalarExpr : TensorExpr<ScalarExpr> {
+    ScalarExpr(double aValue, bool aIsIntegral) : value(aValue), isIntegral(aIsIntegral) {}
+
+    std::vector<int> shape() const { return {}; }
+    void bind(const int*, int) {}
+    template<class F>
+    void forEachLeaf(F&&) {}
+    template<class T>
+    void evalRow(const int*, int, int count, T* out) const { std::fill(out, out + count, static_cast<T>(value)); }
+    template<class T>
+    const T* rowPointer(const int* index, int col0, int count, T* scratch) const {
+        evalRow(index, col0, count, scratch);
+        return scratch;
+    }
+
+    double value;
+    bool isIntegral;
+};
+
+template<class Op, class L, class R>
+struct BinaryExpr : TensorExpr<BinaryExpr<Op, L, R>> {
+    BinaryExpr(const L& aLhs, const R& aRhs) : lhs(aLhs), rhs(aRhs) {
+        if (!BroadcastShapes(lhs.shape(), rhs.shape(), outShape)) {
+            std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
+            std::exit(EXIT_FAILURE);
+        }
+        if constexpr (std::is_same<L, ScalarExpr>::value) {
+            outDType = PromoteWithScalar(rhs.dtype(), lhs.isIntegral);
+        }
+        else if constexpr (std::is_same<R, ScalarExpr>::value) {
+            outDType = PromoteWithScalar(lhs.dtype(), rhs.isIntegral);
+        }
+        else {
+            outDType = PromoteTypes(lhs.dtype(), rhs.dtype());
+        }
+    }
+
+    std::vector<int> shape() const { return outShape; }
+    DType dtype() const { return outDType; }
+    void bind(const int* shape, int rank) {
+        lhs.bind(shape, rank);
+        rhs.bind(shape, rank);
+    }
+    template<class F>
+    void forEachLeaf(F&& f) {
+        lhs.forEachLeaf(f);
+        rhs.forEachLeaf(f);
+    }
+
+    template<class T>
+    void evalRow(const int* index, int col0, int count, T* out) const {
+        if constexpr (std::is_same<L, ScalarExpr>::value) {
+            const T a = static_cast<T>(lhs.value);
+            const T* b = rhs.rowPointer(index, col0, count, out);
+            #pragma omp simd
+            for (int k = 0; k < count; ++k) out[k] = Op::apply(a, b[k]);
+        }
+        else if constexpr (std::is_same<R, ScalarExpr>::value) {
+            const T* a = lhs.rowPointer(index, col0, count, out);
+            const T b = static_cast<T>(rhs.value);
+            #pragma omp simd
+            for (int k = 0; k < count; ++k) out[k] = Op::apply(a[k], b);
+        }
+        else {
+            T scratch[ExprBlockSize];
+            const T* a = lhs.rowPointer(index, col0, count, out);
+            const T* b = rhs.rowPointer(index, col0, count, scratch);
+            #pragma omp simd
+            for (int k = 0; k < count; ++k) out[k] = Op::apply(a[k], b[k]);
+        }
+    }
+
+    template<class T>
+    const T* rowPointer(const int* index, int col0, int count, T* scratch) const {
+        evalRow(index, col0, count, scratch);
+        return scratch;
+    }
+
+    L lhs;
+    R rhs;
+    std::vector<int> outShape;
+    DType outDType;
+};
+
+/*********** Evaluation *************/
+// Runs one elementwise operation on the selected backend. Returns false when the operands are not
+// of a dtype the backends take; the fused loop handles those instead.
+bool RunElementwiseOnBackend(const TensorRef& lhs, const TensorRef& rhs, const TensorRef& output, OperationType opType);
+
+template<class E>
+bool DispatchToBackend(const E&, const TensorRef&) {
+    return false;
+}
+template<class Op>
+bool DispatchToBackend(const BinaryExpr<Op, TensorLeaf, TensorLeaf>& aExpr, const TensorRef& output) {
+    return RunElementwiseOnBackend(aExpr.lhs.ref, aExpr.rhs.ref, output, Op::type);
+}
+template<class Op>
+bool DispatchToBackend(const BinaryExpr<Op, TensorLeaf, ScalarExpr>& aExpr, const TensorRef& output) {
+    // The scalar is handed over as a 1x1 operand of the output's dtype. That is only exact when the
+    // output has the expression's dtype; "int32Tensor *= 2.5" computes in float32.
+    if (aExpr.dtype() != output.dtype) return false;
+    alignas(8) unsigned char scalarBytes[8];
+    StoreElement(scalarBytes, output.dtype, 0, aExpr.rhs.value);
+    TensorRef scalar;
+    scalar.data = scalarBytes;
+    scalar.dtype = output.dtype;
+    scalar.ndim = 2;
+    scalar.shape[0] = scalar.shape[1] = 1;
+    scalar.strides[0] = scalar.strides[1] = 1;
+    return RunElementwiseOnBackend(aExpr.lhs.ref, scalar, output, Op::type);
+}
+
+// Bind aBound's leaves to aOutput (a shape the expression broadcasts to) and collapse the
+// iteration space over the output and every leaf (CollapseDimensions), so e.g. a [B, T, C]
+// activation plus a [C] bias runs as B * T rows of C elements and same-shape dense operands as a
+// single row split into blocks. aOutput is collapsed with them.
+template<class E>
+void BindExpression(E& aBound, TensorRef& aOutput) {
+    aBound.bind(aOutput.shape, aOutput.ndim);
+    std::vector<int*> strides{ aOutput.strides };
+    aBound.forEachLeaf([&strides](TensorLeaf& leaf) { strides.push_back(leaf.boundStrides); });
+    aOutput.ndim = CollapseDimensions(aOutput.ndim, aOutput.shape, strides.data(), (int)strides.size());
+    aBound.forEachLeaf([&aOutput](TensorLeaf& leaf) { leaf.rank = aOutput.ndim; });
+}
+
+// The fused loop over a bound expression and its collapsed output, computing in T and converting
+// to the output's dtype on the way out. When an operand is the output itself (aOutputAliased,
+// e.g. "a += b"), every block is computed in scratch before it is stored, so no element is
+// overwritten before it has been read.
+template<class T, class E>
+void RunBoundExpression(const E& bound, const TensorRef& output, bool aOutputAliased) {
+    const size_t numel = output.numel();
+    const int rank = output.ndim;
+    const int numCols = output.shape[rank - 1];
+    const long long numRows = (long long)(numel / numCols);
+    const int blocksPerRow = (numCols + ExprBlockSize - 1) / ExprBlockSize;
+    const long long numBlocks = numRows * blocksPerRow;
+    const int outColStride = output.strides[rank - 1];
+    const bool sameType = output.dtype == DTypeOf<T>::value;
+    const size_t outSize = DTypeSize(output.dtype);
+
+    const size_t grain = numel >= ExprParallelThreshold ? 1 : (size_t)numBlocks;
+    ThreadPool::Instance().ParallelFor((size_t)numBlocks, grain, [&](size_t aBegin, size_t aEnd) {
+        for (long long block = (long long)aBegin; block < (long long)aEnd; ++block) {
+            long long row = block / blocksPerRow;
+            const int col0 = (int)(block % blocksPerRow) * ExprBlockSize;
+            const int count = std::min(ExprBlockSize, numCols - col0);
+
+            // Output coordinates of the leading dimensions
+            int index[TensorRef::MaxDims] = {};
+            size_t outOffset = 0;
+            for (int d = rank - 2; d >= 0; --d) {
+                index[d] = (int)(row % output.shape[d]);
+                row /= output.shape[d];
+                outOffset += (size_t)index[d] * output.strides[d];
+            }
+
+            const size_t first = outOffset + (size_t)col0 * outColStride;
+            if (sameType && outColStride == 1 && !aOutputAliased) {
+                bound.evalRow(index, col0, count, output.as<T>() + first);
+                continue;
+            }
+            T scratch[ExprBlockSize];
+            bound.evalRow(index, col0, count, scratch);
+            if (sameType) {
+                T* dst = output.as<T>() + first;
+                for (int k = 0; k < count; ++k) dst[(size_t)k * outColStride] = scratch[k];
+            }
+            else if (outColStride == 1) {
+                ConvertElements(scratch, DTypeOf<T>::value, output.as<unsigned char>() + first * outSize, output.dtype, count);
+            }
+            else {
+                for (int k = 0; k < count; ++k) StoreElement(output.data, output.dtype, first + (size_t)k * outColStride, scratch[k]);
+            }
+        }
+    });
+}
+
+// Evaluate aExpr into aOutput in one fused loop (see BindExpression and RunBoundExpression)
+template<class T, class E>
+void EvaluateExpressionAs(const E& aExpr, const TensorRef& aOutput, bool aOutputAliased) {
+    if (aOutput.numel() == 0) return;
+    E bound = aExpr;
+    TensorRef output = aOutput;
+    BindExpression(bound, output);
+    RunBoundExpression<T>(bound, output, aOutputAliased);
+}
+
+template<class E>
+void EvaluateExpression(const E& aExpr, const TensorRef& output, bool aOutputAliased = false) {
+    // The backends read each element before writing the same position, so aliasing is safe there
+    if (DispatchToBackend(aExpr, output)) return;
+
+    TraceScope trace("elementwise_fused");
+    if (trace.Active()) {
+        E leaves = aExpr;
+        leaves.forEachLeaf([&trace](TensorLeaf& leaf) { trace.Input(leaf.ref); });
+        trace.Output(output);
+    }
+    switch (ComputeDType(aExpr.dtype())) {
+    case DType::float64:
+        return EvaluateExpressionAs<double>(aExpr, output, aOutputAliased);
+    case DType::int32:
+        return EvaluateExpressionAs<int32_t>(aExpr, output, aOutputAliased);
+    default:
+        return EvaluateExpressionAs<float>(aExpr, output, aOutputAliased);
+    }
+}
+
+/*********** Graph capture *************/
+// An expression recorded by a capturing TensorGraph: bound and collapsed once, so a replay only
+// runs the fused loop. Single operations on tensors, which run on the backends when evaluated
+// eagerly, replay as the fused loop too.
+template<class T, class E>
+struct CapturedExpression {
+    E bound;
+    TensorRef output;
+    bool aliased = false;
+
+    static void Run(void* aState) {
+        const CapturedExpression& captured = *static_cast<const CapturedExpression*>(aState);
+        RunBoundExpression<T>(captured.bound, captured.output, captured.aliased);
+    }
+};
+
+template<class T, class E>
+void CaptureExpressionAs(const E& aExpr, const TensorRef& aOutput, bool aOutputAliased,
+    const std::shared_ptr<TensorStorage>& aOutputStorage) {
+    auto captured = std::make_shared<CapturedExpression<T, E>>(CapturedExpression<T, E>{ aExpr, aOutput, aOutputAliased });
+    BindExpression(captured->bound, captured->output);
+
+    GraphStep step;
+    step.name = "elementwise_fused";
+    step.run = &CapturedExpression<T, E>::Run;
+    // The step's operands keep the storages alive; the leaves let go of theirs, so the graph can
+    // release the intermediates once they have moved into its arena
+    captured->bound.forEachLeaf([&step](TensorLeaf& leaf) {
+        step.operands.push_back(GraphOperand{ &leaf.ref, std::move(leaf.storage), false });
+    });
+    step.operands.push_back(GraphOperand{ &captured->output, aOutputStorage, true });
+    step.state = captured;
+    TensorGraph::Record(std::move(step));
+}
+
+// Record the evaluation of aExpr into aOutput, which lives in aOutputStorage
+template<class E>
+void CaptureExpression(const E& aExpr, const TensorRef& aOutput, bool aOutputAliased,
+    const std::shared_ptr<TensorStorage>& aOutputStorage) {
+    if (aOutput.numel() == 0) return;
+    switch (ComputeDType(aExpr.dtype())) {
+    case DType::float64:
+        return CaptureExpressionAs<double>(aExpr, aOutput, aOutputAliased, aOutputStorage);
+    case DType::int32:
+        return CaptureExpressionAs<int32_t>(aExpr, aOutput, aOutputAliased, aOutputStorage);
+    default:
+        return CaptureExpressionAs<float>(aExpr, aOutput, aOutputAliased, aOutputStorage);
+    }
+}
+
+// True when both refs describe the same elements of the same dtype
+inline bool SameElements(const TensorRef& a, const TensorRef& b) {
+    return a.data == b.data && a.dtype == b.dtype && a.ndim == b.ndim &&
+        std::equal(a.shape, a.shape + a.ndim, b.shape) && std::equal(a.strides, a.strides + a.ndim, b.strides);
+}
+
+template<class E>
+Tensor::Tensor(const TensorExpr<E>& aExpr) : Tensor(aExpr.self().shape(), aExpr.self().dtype(), StorageInit::Uninitialized) {
+    EvaluateExpression(aExpr.self(), this->ref());
+    if (TensorGraph::Capturing()) CaptureExpression(aExpr.self(), this->ref(), false, storage);
+}
+
+/*********** Operators *************/
+// Operands: Tensor, TensorAccessProxy (row/column/slice views) or another expression
+template<class T>
+struct IsExprOperand : std::integral_constant<bool,
+    std::is_same<T, Tensor>::value || std::is_same<T, TensorAccessProxy>::value ||
+    std::is_base_of<TensorExpr<T>, T>::value> {};
+
+inline TensorLeaf AsExprNode(const Tensor& aTensor) { return TensorLeaf(aTensor); }
+inline TensorLeaf AsExprNode(const TensorAccessProxy& aTensorProxy) { return TensorLeaf(aTensorProxy.getTensor()); }
+template<class E>
+const E& AsExprNode(const TensorExpr<E>& aExpr) { return aExpr.self(); }
+
+template<class T>
+using ExprNodeType = typename std::decay<decltype(AsExprNode(std::declval<const T&>()))>::type;
+
+// Scalars: any arithmetic type; integral scalars keep int32 tensors int32
+template<class S>
+ScalarExpr AsScalarNode(S aScalar) { return ScalarExpr(static_cast<double>(aScalar), std::is_integral<S>::value); }
+
+#define TENSOR_EXPR_OPERATOR(symbol, OpType) \
+    template<class L, class R, typename std::enable_if<IsExprOperand<L>::value && IsExprOperand<R>::value, int>::type = 0> \
+    BinaryExpr<OpType, ExprNodeType<L>, ExprNodeType<R>> operator symbol(const L& lhs, const R& rhs) { \
+        return BinaryExpr<OpType, ExprNodeType<L>, ExprNodeType<R>>(AsExprNode(lhs), AsExprNode(rhs)); \
+    } \
+    template<class L, class S, typename std::enable_if<IsExprOperand<L>::value && std::is_arithmetic<S>::value, int>::type = 0> \
+    BinaryExpr<OpType, ExprNodeType<L>, ScalarExpr> operator symbol(const L& lhs, S aScalar) { \
+        return BinaryExpr<OpType, ExprNodeType<L>, ScalarExpr>(AsExprNode(lhs), AsScalarNode(aScalar)); \
+    } \
+    template<class S, class R, typename std::enable_if<std::is_arithmetic<S>::value && IsExprOperand<R>::value, int>::type = 0> \
+    BinaryExpr<OpType, ScalarExpr, ExprNodeType<R>> operator symbol(S aScalar, const R& rhs) { \
+        return BinaryExpr<OpType, ScalarExpr, ExprNodeType<R>>(AsScalarNode(aScalar), AsExprNode(rhs)); \
+    }
+
+TENSOR_EXPR_OPERATOR(+, AddOp) // Addition
+TENSOR_EXPR_OPERATOR(-, SubOp) // Subtraction
+TENSOR_EXPR_OPERATOR(*, MulOp) // Multiplication
+TENSOR_EXPR_OPERATOR(/, DivOp) // Division
+
+#undef TENSOR_EXPR_OPERATOR
+
+/*********** In-place evaluation *************/
+template<class E>
+Tensor& Tensor::assign(const TensorExpr<E>& aExpr) {
+    const E& expr = aExpr.self();
+    std::vector<int> resultShape;
+    if (!BroadcastShapes(expr.shape(), shape, resultShape) || resultShape != shape) {
+        std::cerr << "Error: Result does not broadcast to the target tensor's shape." << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    // An operand that is this tensor itself is read in place. Any other operand sharing the storage
+    // (an overlapping view) could be overwritten before it is read, so the result goes through a
+    // temporary then.
+    const TensorRef target = ref();
+    bool aliased = false, overlapping = false;
+    E leaves = expr;
+    leaves.forEachLeaf([&](TensorLeaf& leaf) {
+        if (leaf.storage != storage) return;
+        if (SameElements(leaf.ref, target)) aliased = true;
+        else overlapping = true;
+    });
+    if (overlapping) {
+        Tensor result(shape, dtype, StorageInit::Uninitialized);
+        EvaluateExpression(expr, result.ref());
+        if (TensorGraph::Capturing()) CaptureExpression(expr, result.ref(), false, result.storage);
+        CopyFrom(result);
+    }
+    else {
+        EvaluateExpression(expr, target, aliased);
+        if (TensorGraph::Capturing()) CaptureExpression(expr, target, aliased, storage);
+    }
+    return *this;
+}
+
+template<class R> Tensor& Tensor::operator+=(const R& aOperand) { return assign(*this + aOperand); }
+template<class R> Tensor& Tensor::operator-=(const R& aOperand) { return assign(*this - aOperand); }
+template<class R> Tensor& Tensor::operator*=(const R& aOperand) { return assign(*this * aOperand); }
+template<class R> Tensor& Tensor::operator/=(const R& aOperand) { return assign(*this / aOperand); }
+
+// Out-parameter forms of the elementwise operators: aOut keeps its storage and dtype and is
+// overwritten with the result, so steady-state loops allocate no tensors. Operands are tensors,
+// views, scalars or expressions whose result broadcasts to aOut's shape.
+template<class L, class R> Tensor& add(const L& a, const R& b, Tensor& aOut) { return aOut.assign(a + b); }
+template<class L, class R> Tensor& subtract(const L& a, const R& b, Tensor& aOut) { return aOut.assign(a - b); }
+template<class L, class R> Tensor& multiply(const L& a, const R& b, Tensor& aOut) { return aOut.assign(a * b); }
+template<class L, class R> Tensor& divide(const L& a, const R& b, Tensor& aOut) { return aOut.assign(a / b); }
+
+#endif // TENSOR_EXPR_HPP
@@ -0,0 +1,66 @@
+#ifndef TENSOR_FILE_HPP
+#define TENSOR_FILE_HPP
+
+#include "Tensor.hpp"
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Binary tensor file (Tensor::save / Tensor::load), little-endian:
+//   TensorFileHeader, then ndim int64 dimensions, then padding up to dataOffset,
+//   then dataBytes of elements in row-major order.
+// dataOffset is a multiple of alignment (Allocator::Alignment when written), so the elements of a
+// mapped file are as aligned as those of allocated storage.
+struct TensorFileHeader {
+    static constexpr char Magic[8] = { 'T', 'N', 'S', 'R', 'F', 'I', 'L', 'E' };
+    static constexpr uint32_t CurrentVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype; // TensorFileDType, stable across releases unlike the DType enum
+    uint32_t ndim;
+    uint32_t alignment; // Of dataOffset, in bytes
+    uint64_t dataOffset; // From the start of the file
+    uint64_t dataBytes;
+};
+
+uint32_t TensorFileDType(DType aDType);
+bool DTypeFromTensorFile(uint32_t aCode, DType& aDType); // False for an unknown code
+
+// What a tensor file holds, and where its elements are
+struct TensorFileInfo {
+    DType dtype = DType::float32;
+    std::vector<int> shape;
+    uint64_t dataOffset = 0;
+    uint64_t dataBytes = 0;
+};
+// Parse the header from the first aAvailable bytes of a file of aFileSize bytes (the header and
+// dimensions take at most TensorFileMaxHeaderBytes). Exits with an error naming aPath if malformed.
+constexpr size_t TensorFileMaxHeaderBytes = sizeof(TensorFileHeader) + TensorRef::MaxDims * sizeof(int64_t);
+TensorFileInfo ReadTensorFileInfo(const unsigned char* aBytes, size_t aAvailable, uint64_t aFileSize, const std::string& aPath);
+// Write the header and dimensions of a tensor of aDType and aShape, padded up to its elements,
+// which the caller writes next. Returns the header for the element offset and size.
+TensorFileHeader WriteTensorFileHeader(std::ostream& aFile, DType aDType, const std::vector<int>& aShape);
+
+// A whole file mapped copy-on-write: pages are read from the file on first access, and writes go
+// to private copies of the pages, never to the file. Unmapped when the last reference goes.
+class MappedFile {
+public:
+    static std::shared_ptr<MappedFile> Open(const std::string& aPath); // nullptr when it cannot be mapped
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    unsigned char* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile() = default;
+
+    unsigned char* base = nullptr;
+    size_t length = 0;
+};
+
+#endif // TENSOR_FILE_HPP
@@ -0,0 +1,57 @@
+#ifndef TENSOR_FUTURE_HPP
+#define TENSOR_FUTURE_HPP
+
+#include "Tensor.hpp"
+#include "opencl_setup.h"
+#include <future>
+
+// Result of an asynchronous tensor operation (matmulAsync, addAsync, ...). The operation has been
+// issued when the handle is returned, and the calling thread is free to go on with other work:
+// - On the device (UseDevice == Device::gpu, or the Dispatcher's choice), the operands are
+//   uploaded, computed and downloaded on the runtime's upload, compute and download queues,
+//   chained by OpenCL events. Operations issued back to back form a pipeline: the next one's
+//   uploads overlap the current one's kernel.
+// - On the CPU, and for work the device cannot run, the operation runs on a worker thread.
+// The handle keeps the operands' storage alive, but they must not be written to until the result
+// is ready. get() waits and hands the result over; destroying a pending handle also waits.
+class TensorFuture {
+public:
+    TensorFuture() = default;
+    TensorFuture(TensorFuture&&) noexcept = default;
+    TensorFuture& operator=(TensorFuture&&) noexcept = default; // Waits for the replaced operation
+    ~TensorFuture() = default;
+
+    bool valid() const { return state != nullptr; } // False when default-constructed or after get()
+    bool ready() const; // The result is available; never blocks
+    void wait(); // Block until the result is available
+    Tensor get(); // wait(), then move the result out
+
+    friend TensorFuture matmulAsync(const Tensor& a, const Tensor& b);
+    friend TensorFuture addAsync(const Tensor& a, const Tensor& b);
+    friend TensorFuture subtractAsync(const Tensor& a, const Tensor& b);
+    friend TensorFuture multiplyAsync(const Tensor& a, const Tensor& b);
+    friend TensorFuture divideAsync(const Tensor& a, const Tensor& b);
+
+private:
+    // Members are destroyed bottom up: the work is waited for before the memory it uses is released
+    struct State {
+        Tensor result;
+        std::vector<std::shared_ptr<TensorStorage>> operands; // Read by the operation until it is done
+        PendingKernelWork deviceWork;
+        std::future<void> hostWork;
+    };
+    std::unique_ptr<State> state;
+
+    static TensorFuture Matmul(const Tensor& a, const Tensor& b);
+    static TensorFuture Elementwise(const Tensor& a, const Tensor& b, OperationType opType);
+};
+
+// Asynchronous forms of matmul (2-D or batched, see Tensor::matmul) and of the elementwise
+// operations on two tensors (broadcasting, result of the promoted dtype)
+TensorFuture matmulAsync(const Tensor& a, const Tensor& b);
+TensorFuture addAsync(const Tensor& a, const Tensor& b);
+TensorFuture subtractAsync(const Tensor& a, const Tensor& b);
+TensorFuture multiplyAsync(const Tensor& a, const Tensor& b);
+TensorFuture divideAsync(const Tensor& a, const Tensor& b);
+
+#endif // TENSOR_FUTURE_HPP
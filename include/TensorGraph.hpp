@@ -0,0 +1,93 @@
+#ifndef TENSOR_GRAPH_HPP
+#define TENSOR_GRAPH_HPP
+
+#include "Operations.hpp"
+#include "Allocator.hpp"
+#include <map>
+#include <memory>
+#include <vector>
+
+class Tensor; // from "Tensor.hpp"
+
+// Operand of a recorded step: a TensorRef inside the step's state and the storage it points into
+struct GraphOperand {
+    TensorRef* ref = nullptr;
+    std::shared_ptr<TensorStorage> storage;
+    bool written = false;
+};
+
+// One operation recorded by a capturing graph. run(state) repeats it, on the CPU, with the
+// operands' refs as they are then, which the graph moves into its arena when capture ends.
+struct GraphStep {
+    const char* name = "";
+    void (*run)(void* state) = nullptr;
+    std::shared_ptr<void> state;
+    std::vector<GraphOperand> operands; // Reads before writes
+};
+
+struct GraphStats {
+    size_t steps = 0;
+    size_t inputs = 0; // Storages read in place on every replay
+    size_t intermediates = 0; // Storages planned into the arena
+    size_t arenaBytes = 0;
+    size_t intermediateBytes = 0; // What the intermediates take without reuse
+};
+
+// Records the Tensor operations a thread runs between beginCapture() and endCapture() and replays
+// them. Capture runs the operations as usual, and each one also leaves a step with its shapes,
+// strides and kernel resolved: elementwise expressions (also in place) as their fused loop,
+// matmul, reductions, astype and copies. Views cost nothing and are followed through.
+//
+// A storage whose first use in the capture is to be written in full by an operation is an
+// intermediate. When capture ends, a liveness-based planner gives every intermediate a place in
+// one arena, reusing the space of those whose last use has passed (largest first, at the lowest
+// free offset), and the steps are pointed into it. Any other storage is an input: the weights
+// and the tensors fed to the graph, which are read (and written) in place, so new inputs go into
+// the same tensors, e.g. with assign. The graph keeps them alive.
+//
+// replay() then runs the steps one after the other on the CPU kernels: no allocation (for matmuls
+// whose operands have the product's float32 or float64 dtype), no shape checks and no backend
+// dispatch. The outputs passed to endCapture are rebound to their place in the arena, so they
+// hold the new results after every replay; other tensors of the capture keep the captured values.
+// Element access, the pointer-array matmul, sparse tensors and asynchronous operations are not
+// recorded.
+class TensorGraph {
+public:
+    TensorGraph() = default;
+    ~TensorGraph();
+    TensorGraph(const TensorGraph&) = delete;
+    TensorGraph& operator=(const TensorGraph&) = delete;
+
+    void beginCapture(); // Record the calling thread's operations from now on
+    void endCapture(const std::vector<Tensor*>& aOutputs); // Stop recording, plan the arena and rebind aOutputs
+    void replay(); // Run the recorded steps again
+    GraphStats stats() const;
+
+    // Recording hooks of the Tensor operations
+    static bool Capturing() { return capturing != nullptr; } // The calling thread is capturing
+    static void Record(GraphStep aStep);
+    static void CaptureMatmul(const Tensor& a, const Tensor& b, const Tensor* aBias, const MatmulEpilogue& aEpilogue,
+        const Tensor& aOut);
+    static void CaptureReduction(const Tensor& aInput, const Tensor& aOutput, ReductionType aType, int aAxis);
+    static void CaptureCopy(const Tensor& aSource, const Tensor& aTarget);
+
+private:
+    struct Usage {
+        bool intermediate = false;
+        size_t first = 0; // Step of the first and last use
+        size_t last = 0;
+        size_t offset = 0; // In the arena
+    };
+
+    static thread_local TensorGraph* capturing;
+
+    void PlanArena(const std::vector<TensorStorage*>& aOutputs);
+
+    std::vector<GraphStep> steps;
+    std::map<TensorStorage*, Usage> usages;
+    std::shared_ptr<TensorStorage> arena;
+    bool captured = false;
+    GraphStats summary;
+};
+
+#endif // TENSOR_GRAPH_HPP
@@ -2,7 +2,20 @@
 #define Testing_h
 
 #include "Tensor.hpp"
+#include "opencl_tuner.h"
+#include "TensorFuture.hpp"
+#include "tracer.h"
+#include "TensorFile.hpp"
+#include "OutOfCore.hpp"
+#include "dispatcher.h"
+#include "thread_pool.h"
+#include "SparseTensor.hpp"
+#include "TensorGraph.hpp"
 #include <random>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
 
 class Testing {
 public:
@@ -58,6 +71,38 @@ public:
         myTensor.print();
     }
 
+    void TestViews() {
+        Tensor myTensor({ 4, 4 }, {
+            1, 2, 3, 4,
+            5, 6, 7, 8,
+            9, 10, 11, 12,
+            13, 14, 15, 16
+            });
+
+        // Rows, columns and slices are views: no data is copied and writes to the parent show through
+        Tensor colView = myTensor(Tensor::all, 1);
+        Tensor subView = myTensor(Slice(1, 3), Slice(1, 4));
+        std::cout << "Column view shares storage: " << colView.isView() << ", contiguous: " << colView.isContiguous() << std::endl;
+        myTensor(1, 1) = 60;
+        std::cout << "Column view after modifying the parent:" << std::endl;
+        colView.print();
+
+        // Elementwise operations and matmul consume the views directly
+        std::cout << "Submatrix view + column vector:" << std::endl;
+        Tensor colVector({ 2, 1 }, { 10, 20 });
+        (subView + colVector).print();
+        std::cout << "Row view matmul column view:" << std::endl;
+        Tensor rowView = myTensor(0, Tensor::all);
+        Tensor colView2 = myTensor(Tensor::all, 2);
+        rowView.matmul(colView2).print();
+
+        // Copies are deep
+        Tensor subCopy = subView;
+        subCopy(0, 0) = -1;
+        std::cout << "Parent is unchanged by writes to a copy:" << std::endl;
+        myTensor.print();
+    }
+
     void TestElementWiseOperations() {  // NEEDS MORE TEST EXAMPLES
         // Create tensors for testing
         Tensor tensor1({ 2, 3 }, { 1, 2, 3, 4, 5, 6 });
@@ -106,6 +151,561 @@ public:
         std::cout << "Addition between tensor matrices:\n";
         Tensor resultAdditionMatrices = tensor1 + tensor2;
         resultAdditionMatrices.print();
+
+        // Test division by zero: IEEE results (inf, -inf, nan) for floats, 0 for int32
+        std::cout << "Division by zero (float32 and int32):\n";
+        Tensor numerators({ 1, 3 }, { 1, -1, 0 });
+        Tensor zeros({ 1, 3 }, { 0, 0, 0 });
+        Tensor resultDivisionByZero = numerators / zeros;
+        resultDivisionByZero.print();
+        Tensor resultIntDivisionByZero = numerators.astype(DType::int32) / zeros.astype(DType::int32);
+        resultIntDivisionByZero.print();
+    }
+
+    void TestBroadcasting() {
+        // A [B, T, C] activation with a [C] bias, a [B, 1, 1] per-batch scale and a [T, 1] offset
+        Tensor activation({ 2, 3, 4 }, {
+            1, 2, 3, 4,   5, 6, 7, 8,   9, 10, 11, 12,
+            13, 14, 15, 16,   17, 18, 19, 20,   21, 22, 23, 24
+            });
+        Tensor bias({ 4 }, { 0.5, 0.25, 0.125, 0 });
+        Tensor scale({ 2, 1, 1 }, { 1, -1 });
+        Tensor offset({ 3, 1 }, { 100, 200, 300 });
+
+        std::cout << "Activation + bias:" << std::endl;
+        (activation + bias).print();
+        std::cout << "Activation * scale + offset:" << std::endl;
+        (activation * scale + offset).print();
+
+        // Column vector and row vector broadcast to a matrix
+        std::cout << "Column vector * row vector:" << std::endl;
+        (Tensor({ 3, 1 }, { 1, 2, 3 }) * Tensor({ 1, 4 }, { 1, 10, 100, 1000 })).print();
+
+        // Reshape shares the storage of a contiguous tensor
+        std::cout << "Activation reshaped to (6, 4):" << std::endl;
+        activation.reshape({ 6, 4 }).print();
+    }
+
+    void TestDTypes() {
+        Tensor tensor1({ 2, 3 }, { 1, 2, 3, 4, 5, 6 });
+        Tensor doubles({ 2, 3 }, std::vector<double>{ 0.5, 0.25, 0.125, 1, 2, 3 });
+        Tensor labels({ 2, 3 }, std::vector<int>{ 7, 8, 9, 10, 11, 12 });
+
+        // Half precision storage: half the memory, arithmetic in float32
+        Tensor halfTensor = tensor1.astype(DType::float16);
+        std::cout << "float16 tensor * 2.5 + 1:" << std::endl;
+        (halfTensor * 2.5 + 1).print();
+
+        // Mixed operands promote: float16 + float64 gives float64
+        std::cout << "float16 + float64:" << std::endl;
+        (halfTensor + doubles).print();
+
+        // Integer tensors stay integer with integral scalars
+        std::cout << "int32 / 2 and int32 / 2.0:" << std::endl;
+        (labels / 2).print();
+        (labels / 2.0).print();
+
+        // Matrix multiplication accumulates 16-bit operands in float32
+        Tensor bf16 = Tensor({ 3, 2 }, { 2, 4, 5, 6, 1, 3 }).astype(DType::bfloat16);
+        std::cout << "bfloat16 matmul:" << std::endl;
+        tensor1.astype(DType::bfloat16).matmul(bf16).print();
+    }
+
+    void TestOpenCLElementWiseOperations() {
+        // The same expressions on the host and on the OpenCL device (any platform, e.g. PoCL)
+        std::vector<int> shape{ 300, 257 };
+        Tensor matrix(shape, generateRandomVector<dataType>(shape[0] * shape[1], -25, 25));
+        Tensor other(shape, generateRandomVector<dataType>(shape[0] * shape[1], -25, 25));
+        Tensor rowVector({ 1, shape[1] }, generateRandomVector<dataType>(shape[1], 1, 5));
+        Tensor colVector({ shape[0], 1 }, generateRandomVector<dataType>(shape[0], 1, 5));
+        Tensor integers = matrix.astype(DType::int32);
+
+        std::vector<std::function<Tensor()>> cases{
+            [&]() { return Tensor(matrix + other); },
+            [&]() { return Tensor(matrix - rowVector); },
+            [&]() { return Tensor(matrix * colVector); },
+            [&]() { return Tensor(matrix / 3.0f); },
+            [&]() { return Tensor(Tensor(matrix(Slice(0, 100), Slice(0, 100))) / other(Slice(100, 200), Slice(0, 100))); },
+            [&]() { return Tensor(integers / 7); }
+        };
+        const char* names[] = { "matrix + matrix", "matrix - row vector", "matrix * column vector",
+            "matrix / scalar", "slice / slice", "int32 / scalar" };
+        for (size_t c = 0; c < cases.size(); ++c) {
+            UseDevice = Device::cpu;
+            Tensor expected = cases[c]();
+            UseDevice = Device::gpu;
+            Tensor actual = cases[c]();
+            UseDevice = Device::cpu;
+
+            std::cout << names[c] << ": max difference CPU vs OpenCL = " << MaxDifference(expected, actual) << std::endl;
+        }
+    }
+
+    void TestInPlaceOperations() {
+        Tensor acc({ 2, 3 });
+        Tensor x({ 2, 3 }, { 1, 2, 3, 4, 5, 6 });
+        Tensor bias({ 1, 3 }, { 0.5, 0.5, 0.5 });
+
+        // Compound assignment with tensors, broadcast rows, scalars and views
+        for (int step = 0; step < 3; ++step) {
+            acc += x;
+        }
+        acc -= bias;
+        acc *= 2;
+        acc(1, Tensor::all) /= x(0, Tensor::all);
+        std::cout << "acc after += x (3 times), -= bias, *= 2, row 1 /= row 0 of x:" << std::endl;
+        acc.print();
+
+        // Out-parameter forms write into preallocated tensors
+        Tensor out({ 2, 3 });
+        add(x, bias, out);
+        std::cout << "add(x, bias, out):" << std::endl;
+        out.print();
+        Tensor product({ 2, 2 });
+        matmul(x, Tensor({ 3, 2 }, { 1, 0, 0, 1, 1, 1 }), product);
+        std::cout << "matmul(x, w, product):" << std::endl;
+        product.print();
+    }
+
+    void TestAllocator() {
+        // Results of a steady-state loop reuse the blocks freed by the previous iteration
+        CachingAllocator& allocator = CachingAllocator::Instance();
+        std::vector<int> shape{ 512, 512 };
+        Tensor weights(shape, generateRandomVector<dataType>(shape[0] * shape[1], -1, 1));
+        Tensor input(shape, generateRandomVector<dataType>(shape[0] * shape[1], -1, 1));
+
+        const AllocatorStats before = allocator.stats();
+        Tensor acc(shape);
+        for (int iteration = 0; iteration < 100; ++iteration) {
+            acc = acc + weights * input;
+        }
+        const AllocatorStats after = allocator.stats();
+        std::cout << "100 iterations of acc = acc + weights * input:" << std::endl;
+        std::cout << "  hits: " << after.hits - before.hits << ", misses: " << after.misses - before.misses << std::endl;
+        std::cout << "  bytes cached: " << after.bytesCached << ", bytes in use: " << after.bytesInUse << std::endl;
+
+        allocator.releaseCached();
+        std::cout << "  bytes cached after releaseCached(): " << allocator.stats().bytesCached << std::endl;
+    }
+
+    void TestReductions() {
+        Tensor x({ 2, 3 }, { 1, 5, 3, 4, 2, 6 });
+        std::cout << "x:" << std::endl;
+        x.print();
+        std::cout << "x.sum(0), a row vector:" << std::endl;
+        x.sum(0).print();
+        std::cout << "x.max(1), a column vector:" << std::endl;
+        x.max(1).print();
+        std::cout << "x.argmax(1):" << std::endl;
+        x.argmax(1).print();
+        std::cout << "x - x.mean(1) (the mean broadcasts back over the rows):" << std::endl;
+        Tensor(x - x.mean(1)).print();
+        std::cout << "x.sum(), x.min(), x.argmax():" << std::endl;
+        x.sum().print();
+        x.min().print();
+        x.argmax().print();
+
+        // Large reductions on the host and on the OpenCL device
+        std::vector<int> shape{ 1000, 3000 };
+        Tensor large(shape, generateRandomVector<dataType>(shape[0] * shape[1], -25, 25));
+        std::vector<Device> devices{ Device::cpu };
+        if (OpenCLAvailable()) devices.push_back(Device::gpu);
+        for (Device device : devices) {
+            UseDevice = device;
+            Tensor rowSums = large.sum(1);
+            Tensor columnMax = large.max(0);
+            Tensor total = large.sum();
+            UseDevice = Device::cpu;
+
+            Tensor expectedSums({ shape[0], 1 }, DType::float64), expectedMax({ 1, shape[1] });
+            for (int i = 0; i < shape[0]; ++i) {
+                double sum = 0;
+                for (int j = 0; j < shape[1]; ++j) sum += large(i, j);
+                expectedSums(i, 0) = sum;
+            }
+            for (int j = 0; j < shape[1]; ++j) {
+                double columnMaximum = large(0, j);
+                for (int i = 1; i < shape[0]; ++i) columnMaximum = std::max(columnMaximum, (double)large(i, j));
+                expectedMax(0, j) = columnMaximum;
+            }
+            const double maxError = std::max(MaxDifference(expectedSums, rowSums), MaxDifference(expectedMax, columnMax));
+            std::cout << (device == Device::cpu ? "CPU" : "OpenCL") << ": sum = " << total(0, 0)
+                << ", max difference of row sums and column maxima from a serial loop = " << maxError << std::endl;
+        }
+    }
+
+    void TestGemmTuner() {
+        // Tune the OpenCL GEMM for a few shapes, then check that the tuned kernels match the CPU
+        if (!OpenCLAvailable()) {
+            std::cout << "No OpenCL platform found." << std::endl;
+            return;
+        }
+        GemmTuner& tuner = GemmTuner::Instance();
+        std::cout << "Candidates on " << OpenCLRuntime::Instance().DeviceName() << ":";
+        for (const GemmKernelConfig& config : tuner.Candidates(DType::float32)) {
+            std::cout << " [" << config.Name() << "]";
+        }
+        std::cout << std::endl;
+
+        const std::vector<std::vector<int>> shapes{ { 256, 256, 256 }, { 512, 128, 384 }, { 97, 200, 41 }, { 1, 300, 7 } }; // M, K, N
+        for (const std::vector<int>& mkn : shapes) {
+            const GemmKernelConfig tuned = tuner.Tune(mkn[0], mkn[1], mkn[2], DType::float32);
+            const GemmKernelConfig selected = tuner.Select(mkn[0], mkn[1], mkn[2], DType::float32);
+            Tensor a({ mkn[0], mkn[1] }, generateRandomVector<dataType>(mkn[0] * mkn[1], -1, 1));
+            Tensor b({ mkn[1], mkn[2] }, generateRandomVector<dataType>(mkn[1] * mkn[2], -1, 1));
+            UseDevice = Device::cpu;
+            Tensor expected = a.matmul(b);
+            UseDevice = Device::gpu;
+            Tensor actual = a.matmul(b);
+            UseDevice = Device::cpu;
+
+            std::cout << GemmTuner::ShapeClass(mkn[0], mkn[1], mkn[2]) << ": " << tuned.Name()
+                << (selected == tuned ? " (selected)" : " (not selected)")
+                << ", max difference CPU vs OpenCL = " << MaxDifference(expected, actual) << std::endl;
+        }
+    }
+
+    void TestBatchedMatmul() {
+        // [2, 2, 3] x [2, 3, 2]: one product per batch entry
+        Tensor a({ 2, 2, 3 }, { 1, 2, 3, 4, 5, 6, 1, 0, 0, 0, 1, 0 });
+        Tensor b({ 2, 3, 2 }, { 1, 0, 0, 1, 1, 1, 1, 2, 3, 4, 5, 6 });
+        std::cout << "a.matmul(b), [2, 2, 3] x [2, 3, 2]:" << std::endl;
+        a.matmul(b).print();
+        std::cout << "a.matmul(w), w [3, 2] shared by the batch:" << std::endl;
+        Tensor w({ 3, 2 }, { 1, 0, 0, 1, 1, 1 });
+        a.matmul(w).print();
+        std::cout << "matmul({ a0, a1 }, { w }), pointer-array form:" << std::endl;
+        for (const Tensor& product : matmul({ Tensor({ 1, 3 }, { 1, 2, 3 }), Tensor({ 1, 3 }, { 4, 5, 6 }) }, { w })) {
+            product.print();
+        }
+
+        // A large batch on the host and on the OpenCL device, against one 2-D matmul per entry
+        const int batch = 16, M = 96, K = 80, N = 72;
+        Tensor x({ batch, M, K }, generateRandomVector<dataType>(batch * M * K, -5, 5));
+        Tensor y({ batch, K, N }, generateRandomVector<dataType>(batch * K * N, -5, 5));
+        std::vector<Device> devices{ Device::cpu };
+        if (OpenCLAvailable()) devices.push_back(Device::gpu);
+        for (Device device : devices) {
+            UseDevice = device;
+            Tensor products = x.matmul(y);
+            UseDevice = Device::cpu;
+
+            Tensor rows = products.reshape({ batch * M, N }); // The entries one above the other
+            double maxError = 0;
+            for (int i = 0; i < batch; ++i) {
+                Tensor xi({ M, K }), yi({ K, N });
+                for (int r = 0; r < M; ++r) for (int k = 0; k < K; ++k) xi(r, k) = x.at({ i, r, k });
+                for (int k = 0; k < K; ++k) for (int c = 0; c < N; ++c) yi(k, c) = y.at({ i, k, c });
+                Tensor product = rows(Slice(i * M, (i + 1) * M), Slice(0, N));
+                maxError = std::max(maxError, MaxDifference(xi.matmul(yi), product));
+            }
+            std::cout << (device == Device::cpu ? "CPU" : "OpenCL") << ": " << batch << " x [" << M << ", " << K
+                << "] x [" << K << ", " << N << "], max difference from per-entry matmul = " << maxError << std::endl;
+        }
+    }
+
+    void TestAsync() {
+        // Issue several products at once, keep the host busy, then collect the results
+        const int count = 4, size = 384;
+        std::vector<Tensor> lhs, rhs;
+        for (int i = 0; i < count; ++i) {
+            lhs.emplace_back(std::vector<int>{ size, size }, generateRandomVector<dataType>(size * size, -5, 5));
+            rhs.emplace_back(std::vector<int>{ size, size }, generateRandomVector<dataType>(size * size, -5, 5));
+        }
+        std::vector<Device> devices{ Device::cpu };
+        if (OpenCLAvailable()) devices.push_back(Device::gpu);
+        for (Device device : devices) {
+            UseDevice = device;
+            std::vector<TensorFuture> products;
+            for (int i = 0; i < count; ++i) {
+                products.push_back(matmulAsync(lhs[i], rhs[i])); // the next uploads overlap this kernel
+            }
+            TensorFuture sum = addAsync(lhs[0], rhs[0]);
+            UseDevice = Device::cpu;
+
+            long long hostWork = 0; // Host work while the operations run
+            while (!products.back().ready()) ++hostWork;
+
+            double maxError = 0;
+            for (int i = 0; i < count; ++i) {
+                Tensor product = products[i].get();
+                maxError = std::max(maxError, MaxDifference(lhs[i].matmul(rhs[i]), product));
+            }
+            Tensor total = sum.get();
+            maxError = std::max(maxError, std::abs(total(1, 2) - (lhs[0](1, 2) + rhs[0](1, 2))));
+            std::cout << (device == Device::cpu ? "CPU" : "OpenCL") << ": " << count << " async matmuls and an add, "
+                << hostWork << " host iterations while waiting, max difference from matmul = " << maxError << std::endl;
+        }
+    }
+
+    void TestProgramCache() {
+        // The first OpenCL launch of a kernel loads its program from the binary cache or compiles
+        // it; run this twice to see the second run load every program from disk
+        if (!OpenCLAvailable()) {
+            std::cout << "No OpenCL platform found." << std::endl;
+            return;
+        }
+        ProgramBinaryCache& cache = OpenCLRuntime::Instance().BinaryCache();
+        if (!cache.Enabled()) {
+            std::cout << "The program binary cache is disabled (TENSOR_KERNEL_CACHE_DIR is empty)." << std::endl;
+        }
+        Tensor a({ 64, 64 }, generateRandomVector<dataType>(64 * 64, -1, 1));
+        Tensor b({ 64, 64 }, generateRandomVector<dataType>(64 * 64, -1, 1));
+        UseDevice = Device::gpu;
+        Tensor product, sum;
+        auto launch = [&]() {
+            product = a.matmul(b);
+            sum = a + b;
+        };
+        const double firstMs = TimeMs(launch);
+        const double secondMs = TimeMs(launch);
+        UseDevice = Device::cpu;
+
+        std::cout << "Cache directory: " << cache.Directory() << ", programs loaded from binaries: " << cache.Hits()
+            << ", built from source: " << cache.Misses() << std::endl;
+        std::cout << "matmul and add, first launch (with program setup): " << firstMs << " ms, second launch: "
+            << secondMs << " ms" << std::endl;
+    }
+
+    void TestTracing() {
+        // Trace a few operations of every kind on each device and write them as Chrome trace JSON
+        Tracer& tracer = Tracer::Instance();
+        tracer.Start();
+        Tensor a({ 128, 256 }, generateRandomVector<dataType>(128 * 256, -1, 1));
+        Tensor b({ 256, 64 }, generateRandomVector<dataType>(256 * 64, -1, 1));
+        Tensor bias({ 1, 256 }, generateRandomVector<dataType>(256, -1, 1));
+        std::vector<Device> devices{ Device::cpu };
+        if (OpenCLAvailable()) devices.push_back(Device::gpu);
+        for (Device device : devices) {
+            UseDevice = device;
+            Tensor shifted = a + bias; // Broadcast
+            Tensor scaled = a * a - 2.0f; // Fused
+            Tensor product = shifted.matmul(b);
+            Tensor rows = product.sum(1);
+            Tensor block = product(Slice(0, 16), Slice(0, 16));
+            Tensor pending = matmulAsync(a, b).get();
+        }
+        UseDevice = Device::cpu;
+        tracer.Stop();
+
+        const std::string path = "tensor_trace.json";
+        if (tracer.Write(path)) {
+            std::cout << tracer.EventCount() << " events written to " << path
+                << "; open it in chrome://tracing or https://ui.perfetto.dev" << std::endl;
+        }
+    }
+
+    void TestTensorFile() {
+        // Save tensors of several dtypes (and a view), load them back mapped, and compare
+        Tensor weights({ 3, 4 }, { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 });
+        weights.save("weights.tensor");
+        Tensor loaded = Tensor::load("weights.tensor");
+        std::cout << "Loaded weights.tensor:" << std::endl;
+        loaded.print();
+        Tensor block = weights(Slice(1, 3), Slice(1, 3));
+        block.astype(DType::float16).save("block.tensor");
+        std::cout << "A float16 copy of a [2, 2] view:" << std::endl;
+        Tensor::load("block.tensor").print();
+        loaded += 100; // Changes the mapped pages in memory only
+        std::cout << "After loaded += 100, the file still holds " << Tensor::load("weights.tensor")(0, 0) << std::endl;
+
+        // Load time does not grow with the size: only the header is read until elements are used
+        const int rows = 2048, cols = 4096;
+        Tensor large({ rows, cols }, generateRandomVector<dataType>(rows * cols, -1, 1));
+        large.save("large.tensor");
+        Tensor mapped;
+        const double loadMs = TimeMs([&]() { mapped = Tensor::load("large.tensor"); });
+        std::cout << "Loaded a [" << rows << ", " << cols << "] tensor (" << rows * cols * 4 / (1 << 20) << " MiB) in "
+            << loadMs << " ms, max difference from the saved one = " << MaxDifference(large, mapped, 97, 89) << std::endl;
+    }
+
+    void TestOutOfCore() {
+        // Multiply two tensor files within a 4 MiB budget and compare with an in-memory matmul
+        const int M = 1024, K = 768, N = 1536;
+        Tensor a({ M, K }, generateRandomVector<dataType>(M * K, -1, 1));
+        Tensor b({ K, N }, generateRandomVector<dataType>(K * N, -1, 1));
+        a.save("ooc_a.tensor");
+        b.save("ooc_b.tensor");
+        Tensor expected = a.matmul(b);
+
+        std::vector<Device> devices{ Device::cpu };
+        if (OpenCLAvailable()) devices.push_back(Device::gpu);
+        for (Device device : devices) {
+            UseDevice = device;
+            const OutOfCoreStats stats = matmulOutOfCore("ooc_a.tensor", "ooc_b.tensor", "ooc_c.tensor", 4 << 20);
+            UseDevice = Device::cpu;
+
+            Tensor product = Tensor::load("ooc_c.tensor");
+            std::cout << (device == Device::cpu ? "CPU" : "OpenCL") << ": " << stats.panels << " panels of "
+                << stats.panelRows << " x " << stats.panelCols << " in " << stats.bufferBytes / 1024 << " KiB, "
+                << stats.Gflops() << " GFLOPS, I/O " << stats.IOGBps() << " GB/s (" << (stats.bytesRead + stats.bytesWritten) / (1 << 20)
+                << " MiB, " << stats.stallSeconds * 1000 << " ms not hidden), max difference from matmul = " << MaxDifference(expected, product) << std::endl;
+        }
+    }
+
+    void TestDispatcher() {
+        // The calibrated profile, and where operations of a few sizes would run
+        Dispatcher& dispatcher = Dispatcher::Instance();
+        dispatcher.Calibrate();
+        const DeviceProfile profile = dispatcher.Profile();
+        std::cout << "Host: " << profile.hostGflops << " GFLOPS, " << profile.hostGBps << " GB/s" << std::endl;
+        if (OpenCLAvailable()) {
+            std::cout << "Device: " << profile.deviceGflops << " GFLOPS, transfers " << profile.transferGBps
+                << " GB/s, round trip " << profile.launchSeconds * 1e6 << " us" << std::endl;
+        }
+        else {
+            std::cout << "No OpenCL platform: every operation stays on the host" << std::endl;
+        }
+
+        UseDevice = Device::automatic;
+        auto report = [](const std::string& aName, Device aDevice) {
+            std::cout << aName << " -> " << (aDevice == Device::cpu ? "CPU" : "OpenCL") << std::endl;
+        };
+        report("matmul [2, 3] x [3, 2]", dispatcher.SelectMatmul(2, 3, 2, 1, DType::float32));
+        report("matmul [2048, 2048] x [2048, 2048]", dispatcher.SelectMatmul(2048, 2048, 2048, 1, DType::float32));
+        report("add of 2 x 1M floats", dispatcher.SelectElementwise(1 << 20, 3 * (4 << 20), DType::float32));
+        report("sum of 16M floats", dispatcher.SelectReduction(16 << 20, DType::float32));
+        {
+            ScopedDevice pinned(Device::cpu);
+            report("matmul [2048, 2048] x [2048, 2048], pinned to the host",
+                dispatcher.SelectMatmul(2048, 2048, 2048, 1, DType::float32));
+        }
+
+        // Operations on automatic give the results of the host
+        Tensor a({ 256, 384 }, generateRandomVector<dataType>(256 * 384, -1, 1));
+        Tensor b({ 384, 128 }, generateRandomVector<dataType>(384 * 128, -1, 1));
+        Tensor automatic = a.matmul(b) * b(Slice(0, 1), Slice(0, 128));
+        UseDevice = Device::cpu;
+        Tensor host = a.matmul(b) * b(Slice(0, 1), Slice(0, 128));
+        std::cout << "Automatic vs host: max difference = " << MaxDifference(host, automatic) << std::endl;
+    }
+
+    void TestThreadPool() {
+        // A GEMM, elementwise operations and a reduction on the pool, then what each thread did
+        ThreadPool& pool = ThreadPool::Instance();
+        std::cout << "Threads: " << pool.Threads() << std::endl;
+        pool.ResetStats();
+        const int n = 768;
+        Tensor a({ n, n }, generateRandomVector<dataType>(n * n, -1, 1));
+        Tensor b({ n, n }, generateRandomVector<dataType>(n * n, -1, 1));
+        Tensor product = a.matmul(b);
+        Tensor combined = product * a + b;
+        Tensor total = combined.sum();
+        std::cout << "Sum of (a x b) * a + b = " << total(0, 0) << std::endl;
+
+        const ThreadPoolStats stats = pool.Stats();
+        std::cout << stats.jobs << " parallel loops (" << stats.inlineJobs << " run inline), " << stats.tasks
+            << " chunks, " << stats.steals << " stolen, busy " << stats.busySeconds * 1000 << " ms, idle "
+            << stats.idleSeconds * 1000 << " ms" << std::endl;
+        for (size_t t = 0; t < stats.perThread.size(); ++t) {
+            const ThreadStats& thread = stats.perThread[t];
+            std::cout << "  thread " << t << (thread.cpu >= 0 ? " on CPU " + std::to_string(thread.cpu) : std::string(" unpinned"))
+                << ": " << thread.tasks << " chunks, " << thread.steals << " stolen, busy " << thread.busySeconds * 1000
+                << " ms, idle " << thread.idleSeconds * 1000 << " ms" << std::endl;
+        }
+    }
+
+    void TestSparse() {
+        // A 99% sparse matrix against its dense copy: memory, matmul time and results
+        const int M = 4096, K = 4096, N = 64;
+        std::mt19937 gen(7);
+        std::uniform_int_distribution<int> row(0, M - 1), col(0, K - 1);
+        std::vector<int> rows, cols;
+        for (int i = 0; i < M * K / 100; ++i) {
+            rows.push_back(row(gen));
+            cols.push_back(col(gen));
+        }
+        SparseTensor sparse = SparseTensor::fromCOO(M, K, rows, cols, generateRandomVector<dataType>((int)rows.size(), -1, 1));
+        Tensor dense = sparse.toDense();
+        Tensor b({ K, N }, generateRandomVector<dataType>(K * N, -1, 1));
+        std::cout << "Sparse " << M << " x " << K << ", density " << sparse.density() * 100 << "%: "
+            << sparse.memoryBytes() / 1024 << " KiB (dense " << (size_t)M * K * sizeof(float) / 1024 << " KiB)" << std::endl;
+
+        Tensor expected, product, expectedVector, productVector;
+        const double denseMs = TimeMs([&]() { expected = dense.matmul(b); });
+        const double sparseMs = TimeMs([&]() { product = sparse.matmul(b); });
+        Tensor x = b(Tensor::all, 0); // A [K, 1] column view, multiplied as a vector
+        const double denseVectorMs = TimeMs([&]() { expectedVector = dense.matmul(x); });
+        const double sparseVectorMs = TimeMs([&]() { productVector = sparse.matmul(x); });
+        std::cout << "SpMM x [" << K << ", " << N << "]: " << sparseMs << " ms (dense " << denseMs << " ms), max difference "
+            << MaxDifference(expected, product) << std::endl;
+        std::cout << "SpMV: " << sparseVectorMs << " ms (dense " << denseVectorMs << " ms), max difference "
+            << MaxDifference(expectedVector, productVector) << std::endl;
+
+        // Elementwise with a broadcast row: the product stays sparse, the sum is dense
+        Tensor scale({ 1, K }, generateRandomVector<dataType>(K, 1, 2));
+        SparseTensor scaled = sparse * scale;
+        Tensor shifted = sparse + scale;
+        Tensor expectedScaled = dense * scale;
+        Tensor expectedShifted = dense + scale;
+        const double maxElementwiseError = std::max(MaxDifference(expectedScaled, scaled.toDense(), 97),
+            MaxDifference(expectedShifted, shifted, 97));
+        std::cout << "Sparse * row keeps " << scaled.nnz() << " nonzeros, sparse + row is dense; max difference "
+            << maxElementwiseError << std::endl;
+    }
+
+    void TestGraph() {
+        // The forward step of a small two-layer network, captured once and replayed on new inputs
+        const int batch = 32, features = 256, hidden = 512, classes = 10;
+        Tensor x({ batch, features }, generateRandomVector<dataType>(batch * features, -1, 1));
+        Tensor w1({ features, hidden }, generateRandomVector<dataType>(features * hidden, -0.1, 0.1));
+        Tensor b1({ 1, hidden }, generateRandomVector<dataType>(hidden, -0.1, 0.1));
+        Tensor w2({ hidden, classes }, generateRandomVector<dataType>(hidden * classes, -0.1, 0.1));
+        auto forward = [&]() {
+            Tensor h = x.matmul(w1) + b1;
+            h.assign(h * h * 0.5f + h); // A smooth activation, in place
+            Tensor logits = h.matmul(w2);
+            Tensor centered = logits - logits.mean(1);
+            Tensor squares = centered * centered;
+            return squares.sum(1);
+        };
+
+        TensorGraph graph;
+        graph.beginCapture();
+        Tensor output = forward();
+        graph.endCapture({ &output });
+        const GraphStats stats = graph.stats();
+        std::cout << "Captured " << stats.steps << " steps: " << stats.inputs << " inputs, " << stats.intermediates
+            << " intermediates in a " << stats.arenaBytes / 1024 << " KiB arena (" << stats.intermediateBytes / 1024
+            << " KiB without reuse)" << std::endl;
+
+        const int runs = 200;
+        Tensor expected;
+        const double eagerMs = TimeMs([&]() { expected = forward(); }, runs);
+        const double replayMs = TimeMs([&]() { graph.replay(); }, runs);
+        std::cout << "Step: eager " << eagerMs << " ms, replay " << replayMs << " ms" << std::endl;
+
+        // New inputs go into the captured tensors; the output follows on the next replay
+        x.assign(x * -0.5f + 0.25f);
+        graph.replay();
+        expected = forward();
+        std::cout << "After new inputs, max difference from eager " << MaxDifference(expected, output) << std::endl;
+    }
+
+    void TestFusedMatmul() {
+        // A dense layer with a short K, where the passes over the output cost as much as the product
+        const int batch = 2048, features = 64, units = 2048;
+        Tensor x({ batch, features }, generateRandomVector<dataType>(batch * features, -1, 1));
+        Tensor w({ features, units }, generateRandomVector<dataType>(features * units, -0.5, 0.5));
+        Tensor b({ units }, generateRandomVector<dataType>(units, -0.5, 0.5));
+
+        const int runs = 10;
+        Tensor separate, fused, relu, gelu;
+        const double separateMs = TimeMs([&]() { separate = Tensor(x.matmul(w) * 0.5f + b); }, runs, 1);
+        const double fusedMs = TimeMs([&]() { fused = x.matmul(w, b, Activation::None, 0.5f); }, runs, 1);
+        const double reluMs = TimeMs([&]() { relu = x.matmul(w, b, Activation::ReLU, 0.5f); }, runs, 1);
+        const double geluMs = TimeMs([&]() { gelu = x.matmul(w, b, Activation::GELU, 0.5f); }, runs, 1);
+
+        double maxReluError = 0;
+        for (int i = 0; i < batch; i += 31) {
+            for (int j = 0; j < units; ++j) {
+                maxReluError = std::max(maxReluError, std::abs(std::max((double)separate(i, j), 0.0) - relu(i, j)));
+            }
+        }
+        std::cout << "[" << batch << ", " << features << "] x [" << features << ", " << units << "] * 0.5 + bias: separate "
+            << separateMs << " ms, fused " << fusedMs << " ms, max difference " << MaxDifference(separate, fused, 31) << std::endl;
+        std::cout << "Fused with ReLU " << reluMs << " ms (max difference " << maxReluError << "), with GELU "
+            << geluMs << " ms" << std::endl;
     }
 
     void TestMatrixMultiplication() {
@@ -135,6 +735,27 @@ public:
     }
 
  private:
+     // Milliseconds per run of aRun, averaged over aRuns runs after aWarmUpRuns untimed ones
+     double TimeMs(const std::function<void()>& aRun, int aRuns = 1, int aWarmUpRuns = 0) {
+         for (int i = 0; i < aWarmUpRuns; ++i) aRun();
+         const auto start = std::chrono::steady_clock::now();
+         for (int i = 0; i < aRuns; ++i) aRun();
+         return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / aRuns;
+     }
+
+     // Largest absolute difference between two 2-D tensors of the same shape, over every aRowStep-th
+     // row and aColumnStep-th column
+     double MaxDifference(const Tensor& aExpected, const Tensor& aActual, int aRowStep = 1, int aColumnStep = 1) {
+         const std::vector<int> shape = aExpected.getShape();
+         double maxDifference = 0;
+         for (int i = 0; i < shape[0]; i += aRowStep) {
+             for (int j = 0; j < shape[1]; j += aColumnStep) {
+                 maxDifference = std::max(maxDifference, std::abs(aExpected(i, j) - aActual(i, j)));
+             }
+         }
+         return maxDifference;
+     }
+
      // Random vector generation
      template<typename T>
      std::vector<T> generateRandomVector(int size, T minVal, T maxVal) {
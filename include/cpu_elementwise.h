@@ -0,0 +1,20 @@
+#ifndef CPU_ELEMENTWISE_H
+#define CPU_ELEMENTWISE_H
+
+#include "Operations.hpp"
+
+// One strided run of an elementwise operation on the host: out[k * so] = a[k * sa] op b[k * sb]
+// for k < n, all three of one dtype. A stride of 0 broadcasts that operand.
+using ElementwiseKernel = void (*)(const void* a, int sa, const void* b, int sb, void* out, int so, int n);
+
+// Kernel specialized at compile time for the operation and dtype (float32, float64 or int32).
+// Unit-stride and broadcast runs of float32/float64 use AVX-512 or AVX2 bodies picked at runtime;
+// everything else runs a portable 'omp simd' loop. There are no per-element branches: floating-point
+// results follow IEEE arithmetic (x / 0 is +-inf, 0 / 0 and NaN operands give NaN). int32 division
+// by zero gives 0.
+ElementwiseKernel SelectElementwiseKernel(OperationType opType, DType dtype);
+
+// Name of the SIMD body selected for float32 on this host ("avx512", "avx2" or "generic")
+const char* ElementwiseCPUKernelName();
+
+#endif // CPU_ELEMENTWISE_H
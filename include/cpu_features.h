@@ -0,0 +1,30 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TENSOR_X86 1
+#endif
+
+// Function-level target attributes let AVX2/AVX-512 code paths live in a translation unit that is
+// compiled for the baseline ISA. MSVC accepts the intrinsics without any attribute.
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx2,fma")))
+#define TARGET_F16C __attribute__((target("f16c,avx2")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define TARGET_F16C
+#endif
+
+// SIMD capabilities of the host, detected once at runtime
+struct CPUFeatures {
+    bool avx2 = false;
+    bool fma = false;
+    bool avx512f = false;
+    bool f16c = false; // float16 <-> float32 conversion instructions
+};
+
+const CPUFeatures& GetCPUFeatures();
+
+#endif // CPU_FEATURES_H
@@ -0,0 +1,42 @@
+#ifndef CPU_GEMM_H
+#define CPU_GEMM_H
+
+#include "Operations.hpp"
+
+// Last step of a product, applied to each MR x NR tile of C right after its final depth block,
+// while the tile is still in L1: C(i, j) = activation(scale * (A * B)(i, j) + bias[j]). bias holds
+// N elements of the GEMM's type, or is null.
+template<class T>
+struct GemmEpilogue {
+    const T* bias = nullptr;
+    T scale = 1;
+    Activation activation = Activation::None;
+
+    bool Active() const { return bias != nullptr || scale != T(1) || activation != Activation::None; }
+};
+
+// Single precision GEMM on the host: C = A * B
+// A is M x K, B is K x N and C is M x N. Element (i, j) of A lives at A[i * rsA + j * csA], and
+// likewise for B, so row-major, column-major and strided (view) operands are all accepted.
+// C is row-major with leading dimension ldc.
+//
+// The implementation follows the GotoBLAS/BLIS layering: the operands are cache-blocked
+// (NC x KC panels of B, MC x KC blocks of A), packed into contiguous micro-panels, and a
+// register-tiled MR x NR micro-kernel (AVX-512, AVX2/FMA or portable, picked at runtime) runs over
+// the packed data. Macro-tiles are distributed over the thread pool (thread_pool.h).
+void SgemmCPU(int M, int N, int K,
+    const float* A, int rsA, int csA,
+    const float* B, int rsB, int csB,
+    float* C, int ldc, const GemmEpilogue<float>& epilogue = GemmEpilogue<float>());
+
+// Double precision GEMM, same layout and blocking scheme. Also used for int32 products.
+void DgemmCPU(int M, int N, int K,
+    const double* A, int rsA, int csA,
+    const double* B, int rsB, int csB,
+    double* C, int ldc, const GemmEpilogue<double>& epilogue = GemmEpilogue<double>());
+
+// Name of the micro-kernel selected for this host ("avx512", "avx2" or "generic")
+const char* SgemmCPUKernelName();
+const char* DgemmCPUKernelName();
+
+#endif // CPU_GEMM_H
@@ -0,0 +1,17 @@
+#ifndef CPU_REDUCTION_H
+#define CPU_REDUCTION_H
+
+#include "Operations.hpp"
+
+// Reduce a dense row-major [outer, n, inner] array of dtype (float32, float64 or int32) over its
+// middle dimension. values[o * inner + i] receives the sum, maximum or minimum of element (o, :, i)
+// (the maximum for ArgMax; Mean is the caller's Sum / n). For ArgMax, indices receives the
+// position along n of the first maximum. Maximum and minimum propagate NaN, whose first
+// position is the ArgMax. Sums accumulate in double (int64 for int32).
+// Contiguous runs (inner == 1) are reduced with 'omp simd' loops, each split into parts over the
+// thread pool when there are fewer runs than threads. Otherwise blocks of columns are accumulated
+// across n, vectorized along inner.
+void ReduceCPU(const void* data, DType dtype, int outer, int n, int inner, ReductionType type,
+    double* values, int* indices);
+
+#endif // CPU_REDUCTION_H
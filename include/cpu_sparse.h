@@ -0,0 +1,17 @@
+#ifndef CPU_SPARSE_H
+#define CPU_SPARSE_H
+
+#include "Operations.hpp"
+
+// Sparse work (nonzeros times N plus rows for a product, elements for a conversion) below this
+// runs on the calling thread
+constexpr size_t SparseParallelThreshold = 1 << 15;
+
+// C (A.rows x N, row stride ldc) = A (CSR) * B (A.cols x N, row stride ldb), all float32 with
+// contiguous rows. The rows of A are cut into ranges of about equal nonzeros plus rows, so a few
+// long rows or many empty ones do not leave threads idle, and the ranges are shared out over the
+// thread pool. For N == 1 (SpMV) each row is a dot product with B; otherwise every nonzero adds a
+// scaled row of B to the row of C, in an 'omp simd' loop along N.
+void SpmmCPU(const CSRRef& A, const float* B, int ldb, float* C, int ldc, int N);
+
+#endif // CPU_SPARSE_H
@@ -0,0 +1,82 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include "Operations.hpp"
+#include <mutex>
+
+// Calibrated throughput of the host and the OpenCL device, the inputs of the cost model
+struct DeviceProfile {
+    double hostGflops = 50; // Host GEMM
+    double hostGBps = 10; // Host memory traffic of elementwise operations and reductions
+    double deviceGflops = 200; // Device GEMM, data resident
+    double transferGBps = 4; // Host <-> device transfers, both directions together
+    double launchSeconds = 200e-6; // Fixed cost of a device round trip: buffers, launch, synchronization
+    bool calibrated = false;
+};
+
+// Work of one operation, as the cost model sees it
+struct OperationCost {
+    double flops = 0;
+    double hostBytes = 0; // Memory traffic on the host
+    double transferBytes = 0; // Uploads and downloads on the device
+    bool deviceCapable = true; // False when the device cannot run it (e.g. float64 without cl_khr_fp64)
+};
+
+// Picks the backend of each operation when UseDevice is Device::automatic. An operation is
+// estimated on the host as max(flops / hostGflops, bytes / hostGBps), and on the device as
+// launchSeconds + transferBytes / transferGBps + flops / deviceGflops, and runs where it is
+// estimated to finish first: small operations stay on the host, and only work that amortizes the
+// round trip (large GEMMs, mostly) goes to the device. The profile is calibrated on the first
+// automatic decision by timing a few operations on each backend, or set with setProfile().
+//
+// Choices are pinned by setting UseDevice to Device::cpu or Device::gpu, or for the calling thread
+// with a ScopedDevice, which takes precedence over UseDevice.
+class Dispatcher {
+public:
+    static Dispatcher& Instance();
+
+    // Backend (Device::cpu or Device::gpu) of an operation
+    Device Select(const OperationCost& aCost);
+    Device SelectMatmul(int M, int K, int N, int batch, DType dtype);
+    Device SelectElementwise(size_t numel, size_t bytes, DType dtype); // bytes of the operands and the result
+    Device SelectReduction(size_t numel, DType dtype);
+    Device SelectSparseMatmul(size_t nnz, int rows, int cols, int N); // CSR [rows, cols] x float32 [cols, N]
+
+    double HostSeconds(const OperationCost& aCost);
+    double DeviceSeconds(const OperationCost& aCost);
+
+    DeviceProfile Profile();
+    void setProfile(const DeviceProfile& aProfile); // Used as given, without calibration
+    void Calibrate(); // Time the backends now
+
+    static Device Requested(); // The calling thread's ScopedDevice, else UseDevice
+
+private:
+    Dispatcher() = default;
+    Dispatcher(const Dispatcher&) = delete;
+    Dispatcher& operator=(const Dispatcher&) = delete;
+
+    bool DeviceAvailable();
+    bool SupportsFP64();
+    DeviceProfile CalibratedProfile(); // Calibrating first if needed
+
+    DeviceProfile profile;
+    int openCL = -1; // OpenCLAvailable(), once known
+    bool fp64 = false;
+    std::mutex profileMutex;
+};
+
+// Pins the operations of the calling thread to aDevice (Device::automatic lets the dispatcher
+// choose) until it goes out of scope, whatever UseDevice says. Scopes nest.
+class ScopedDevice {
+public:
+    explicit ScopedDevice(Device aDevice);
+    ~ScopedDevice();
+    ScopedDevice(const ScopedDevice&) = delete;
+    ScopedDevice& operator=(const ScopedDevice&) = delete;
+
+private:
+    int previous;
+};
+
+#endif // DISPATCHER_H
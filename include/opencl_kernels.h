@@ -1,63 +1,216 @@
 // Assuming the kernel source is defined somewhere
 // For the sake of simplicity, let's define it here as a global string.
+
+// Element type definitions prepended to the kernels below. The program is built with one of
+// -D DTYPE_FLOAT64 / DTYPE_FLOAT16 / DTYPE_BFLOAT16 / DTYPE_INT32 (float32 otherwise).
+// ELEM is the buffer element type and ACC the (widened) type the kernels compute and accumulate
+// in; LOAD and STORE convert between the two.
+extern const char* const elementTypeKernelPrelude;
+
 // The kernel for matrix multiplication iterates through the elements in col-major order.
 extern const char* matrixMultNaiveKernelSource = R"CLC(
-    __kernel void matrix_multiply(const __global float* A, const __global float* B, __global float* C, 
+    __kernel void matrix_multiply(const __global ELEM* A, const __global ELEM* B, __global ELEM* C, 
                                   const int M, const int N, const int K) {
         int row = get_global_id(0);
         int col = get_global_id(1);
         if(row < M && col < K) {
-            float sum = 0.0;
+            ACC sum = 0;
             for(int i = 0; i < N; ++i) {
-                sum += A[row * N + i] * B[i * K + col];
+                sum += LOAD(A, row * N + i) * LOAD(B, i * K + col);
             }
-            C[row * K + col] = sum;
+            STORE(C, row * K + col, sum);
         }
     }
 )CLC";
 
-// Tiled and coalesced version
+// Register-blocked GEMM for row-major A (M x K), B (K x N) and C (M x N) of any size. Each
+// work-group computes a TSM x TSN tile of C, stepping through K by TSK with the matching tiles of
+// A and B staged in local memory. Each work-item accumulates a WPTM x WPTN micro-tile in
+// registers, with rows RTSM apart and columns RTSN apart, so neighbouring work-items touch
+// neighbouring columns. Tiles are loaded in runs of WIDTH consecutive elements, with vector loads
+// for float32/float64 runs that lie inside the matrix. Loads past the edges read zeros and stores
+// past them are skipped, so M, N and K need not be multiples of anything. The parameters are
+// compiled in with -D (see GemmKernelConfig, which also lists the divisibility they need).
+// Batches of products run in one launch: work-group dimension 2 selects the matrices, which lie
+// batchStrideA / batchStrideB elements apart in A and B (0 shares one operand across the batch)
+// and M * N apart in C.
+// Built with -D EPILOGUE, the kernel finishes each accumulator in registers before storing it:
+// acc * scale, plus bias[column] with -D HAS_BIAS, through the activation chosen by -D ACT_RELU,
+// ACT_GELU or ACT_TANH (see GemmKernelEpilogue). The epilogue needs a floating-point ACC.
 extern const char* matrixMultTilingKernelSource = R"CLC(
-__kernel void matrix_multiply(const __global float* A, const __global float* B, __global float* C, 
-                                  const int M, const int N, const int K) {
+#ifndef TSM
+#define TSM 64
+#endif
+#ifndef TSN
+#define TSN 64
+#endif
+#ifndef TSK
+#define TSK 16
+#endif
+#ifndef WPTM
+#define WPTM 4
+#endif
+#ifndef WPTN
+#define WPTN 4
+#endif
+#ifndef WIDTH
+#define WIDTH 4
+#endif
+#if defined(ACT_RELU)
+    #define ACTIVATE(x) fmax((x), (ACC)0)
+#elif defined(ACT_GELU)
+    #define ACTIVATE(x) ((ACC)0.5 * (x) * ((ACC)1 + erf((x) * (ACC)0.70710678118654752)))
+#elif defined(ACT_TANH)
+    #define ACTIVATE(x) tanh(x)
+#else
+    #define ACTIVATE(x) (x)
+#endif
+#define RTSM (TSM / WPTM) // Work-items along M (dimension 1)
+#define RTSN (TSN / WPTN) // Work-items along N (dimension 0)
+#define THREADS (RTSM * RTSN)
+
+#if WIDTH > 1 && !defined(DTYPE_FLOAT16) && !defined(DTYPE_BFLOAT16) && !defined(DTYPE_INT32)
+    #define VECTOR_LOADS // ELEM and ACC are the same type, so a vector moves straight to local memory
+    #if WIDTH == 2
+        #define VLOAD vload2
+        #define VSTORE vstore2
+    #elif WIDTH == 4
+        #define VLOAD vload4
+        #define VSTORE vstore4
+    #else
+        #define VLOAD vload8
+        #define VSTORE vstore8
+    #endif
+#endif
+
+// Copy a rows x cols tile starting at (row0, col0) of a matrix with ld elements per row into tile
+// (cols elements per row), zero-filling outside the matrix. Work-item tid copies every THREADS-th run.
+#define LOAD_TILE(src, numRows, numCols, ld, row0, col0, tile, rows, cols)                     \
+    for (int run = tid; run < (rows) * (cols) / WIDTH; run += THREADS) {                         \
+        const int r = run / ((cols) / WIDTH);                                                    \
+        const int c = run % ((cols) / WIDTH) * WIDTH;                                            \
+        const int globalR = (row0) + r;                                                          \
+        const int globalC = (col0) + c;                                                          \
+        LOAD_RUN(src, numRows, numCols, ld, globalR, globalC, tile, r, c, cols)                  \
+    }
+
+#ifdef VECTOR_LOADS
+#define LOAD_RUN(src, numRows, numCols, ld, globalR, globalC, tile, r, c, cols)                  \
+    if (globalR < (numRows) && globalC + WIDTH <= (numCols)) {                                   \
+        VSTORE(VLOAD(0, (src) + (size_t)globalR * (ld) + globalC), 0, &tile[r][c]);              \
+    } else {                                                                                     \
+        LOAD_SCALARS(src, numRows, numCols, ld, globalR, globalC, tile, r, c)                    \
+    }
+#else
+#define LOAD_RUN(src, numRows, numCols, ld, globalR, globalC, tile, r, c, cols)                  \
+    LOAD_SCALARS(src, numRows, numCols, ld, globalR, globalC, tile, r, c)
+#endif
+
+#define LOAD_SCALARS(src, numRows, numCols, ld, globalR, globalC, tile, r, c)                    \
+    for (int w = 0; w < WIDTH; w++) {                                                            \
+        const bool inside = globalR < (numRows) && globalC + w < (numCols);                      \
+        tile[r][c + w] = inside ? (ACC)LOAD(src, (size_t)globalR * (ld) + globalC + w) : (ACC)0; \
+    }
+
+__kernel void matrix_multiply(const __global ELEM* A, const __global ELEM* B, __global ELEM* C,
+                              const int M, const int K, const int N,
+                              const ulong batchStrideA, const ulong batchStrideB
+#ifdef EPILOGUE
+                              , const float scale
+#ifdef HAS_BIAS
+                              , const __global ELEM* bias
+#endif
+#endif
+                              ) {
+
+    // Matrices of this batch entry
+    const size_t entry = get_group_id(2);
+    A += entry * batchStrideA;
+    B += entry * batchStrideB;
+    C += entry * (size_t)M * N;
 
     // Thread identifiers
-    const int TS = 16;
-    const int row = get_local_id(0); // Local row ID (max: TS)
-    const int col = get_local_id(1); // Local col ID (max: TS)
-    const int globalRow = TS * get_group_id(0) + row; // Row ID of C (0..M)
-    const int globalCol = TS * get_group_id(1) + col; // Col ID of C (0..N)
+    const int col = get_local_id(0); // Local col ID (max: RTSN)
+    const int row = get_local_id(1); // Local row ID (max: RTSM)
+    const int tid = row * RTSN + col;
+    const int tileRow = TSM * get_group_id(1); // First row of the C tile
+    const int tileCol = TSN * get_group_id(0); // First col of the C tile
 
-    // Local memory to fit a tile of TS*TS elements of A and B
-    __local float Asub[TS][TS];
-    __local float Bsub[TS][TS];
+    // Local memory for a TSM x TSK tile of A and a TSK x TSN tile of B
+    __local ACC Asub[TSM][TSK];
+    __local ACC Bsub[TSK][TSN];
 
-    // Initialise the accumulation register
-    float acc = 0.0f;
+    // Accumulation registers of the micro-tile, and a cache of the B values it uses per k
+    ACC acc[WPTM][WPTN];
+    ACC Breg[WPTN];
+    for (int wm = 0; wm < WPTM; wm++) {
+        for (int wn = 0; wn < WPTN; wn++) {
+            acc[wm][wn] = 0;
+        }
+    }
 
-    // Loop over all tiles
-    const int numTiles = K / TS;
+    // Loop over all tiles, the last one possibly partial
+    const int numTiles = (K + TSK - 1) / TSK;
     for (int t = 0; t < numTiles; t++) {
 
         // Load one tile of A and B into local memory
-        const int tiledRow = TS * t + row;
-        const int tiledCol = TS * t + col;
-        Asub[col][row] = A[tiledCol * M + globalRow];
-        Bsub[col][row] = B[globalCol * K + tiledRow];
+        LOAD_TILE(A, M, K, K, tileRow, TSK * t, Asub, TSM, TSK)
+        LOAD_TILE(B, K, N, N, TSK * t, tileCol, Bsub, TSK, TSN)
 
-        // Synchronise to make sure the tile is loaded
+        // Synchronise to make sure the tiles are loaded
         barrier(CLK_LOCAL_MEM_FENCE);
 
         // Perform the computation for a single tile
-        for (int k = 0; k < TS; k++) {
-            acc += Asub[k][row] * Bsub[col][k];
+        for (int k = 0; k < TSK; k++) {
+            for (int wn = 0; wn < WPTN; wn++) {
+                Breg[wn] = Bsub[k][col + wn * RTSN];
+            }
+            for (int wm = 0; wm < WPTM; wm++) {
+                const ACC a = Asub[row + wm * RTSM][k];
+                for (int wn = 0; wn < WPTN; wn++) {
+                    acc[wm][wn] += a * Breg[wn];
+                }
+            }
         }
 
-        // Synchronise before loading the next tile
+        // Synchronise before loading the next tiles
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    // Store the final result in C
-    C[globalCol * M + globalRow] = acc;
+    // Store the final results in C, skipping the part of the tile outside the matrix
+    for (int wm = 0; wm < WPTM; wm++) {
+        const int globalRow = tileRow + row + wm * RTSM;
+        for (int wn = 0; wn < WPTN; wn++) {
+            const int globalCol = tileCol + col + wn * RTSN;
+            if (globalRow < M && globalCol < N) {
+#ifdef EPILOGUE
+                ACC value = acc[wm][wn] * (ACC)scale;
+#ifdef HAS_BIAS
+                value += (ACC)LOAD(bias, globalCol);
+#endif
+                acc[wm][wn] = ACTIVATE(value);
+#endif
+                STORE(C, (size_t)globalRow * N + globalCol, acc[wm][wn]);
+            }
+        }
+    }
 }
 )CLC";
+
+// Elementwise arithmetic for float32, float64 and int32 (the 16-bit formats are computed on the
+// host). The program is built with one of -D OP_ADD / OP_SUB / OP_MUL / OP_DIV on top of the
+// element type option, so every kernel is specialized for its operation. Division follows IEEE
+// arithmetic for floating point; int32 division by zero gives 0.
+extern const char* const elementwiseKernelSource;
+
+// Reductions over the middle dimension of a dense [outer, n, inner] array, built with one of
+// -D RED_SUM / RED_MAX / RED_MIN / RED_ARGMAX and -D GROUP_SIZE=<power of two>. Each run along n
+// is split into parts chunks and every chunk gives one (ACC value, int index) partial result at
+// partialValues[run * parts + part], which the host combines. The index is the position along n of
+// the chosen element: NaN beats any number, then the larger (smaller, for RED_MIN) value, then the
+// lower index. Chunks without elements give (IDENTITY, INT_MAX).
+extern const char* const reductionKernelSource;
+
+// Sparse (CSR, float32) times dense products, C (rows x N) = A * B with B of row stride ldb and
+// C of row stride ldc. Built with -D GROUP_SIZE=<power of two> for spmv_csr.
+extern const char* const sparseKernelSource;
@@ -0,0 +1,43 @@
+#ifndef OPENCL_PROGRAM_CACHE_H
+#define OPENCL_PROGRAM_CACHE_H
+
+#include <CL/cl.h>
+#include <string>
+
+// On-disk cache of compiled OpenCL programs, so that later runs skip compiling the kernel sources.
+// After a source build the device binary (CL_PROGRAM_BINARIES) is stored in one file per program,
+// named by a hash of the device name, driver version, kernel source and build options; that key
+// is also written into the file and checked on load. A missing, stale or rejected binary returns
+// NULL from Load(), and the caller builds from source and stores the result again.
+//
+// The cache directory is "opencl_kernel_cache" in the working directory, or the path in the
+// TENSOR_KERNEL_CACHE_DIR environment variable; an empty path disables the cache. The runtime
+// calls Load() and Store() under its program cache lock.
+class ProgramBinaryCache {
+public:
+    explicit ProgramBinaryCache(cl_device_id aDevice);
+
+    // Program built from the cached binary, or NULL
+    cl_program Load(cl_context context, const char* kernelSource, const std::string& buildOptions);
+    // Save the binary of a program built from source for this device
+    void Store(cl_program program, const char* kernelSource, const std::string& buildOptions);
+
+    bool Enabled() const { return !directory.empty(); }
+    const std::string& Directory() const { return directory; }
+    void setDirectory(const std::string& aDirectory) { directory = aDirectory; } // "" disables the cache
+    int Hits() const { return hits; } // Programs loaded from binaries by this process
+    int Misses() const { return misses; } // Lookups that fell back to a source build
+
+private:
+    std::string Header(const char* kernelSource, const std::string& buildOptions) const; // Key written before the binary
+    std::string FilePath(const std::string& aHeader) const;
+
+    cl_device_id device;
+    std::string deviceName;
+    std::string driverVersion;
+    std::string directory;
+    int hits = 0;
+    int misses = 0;
+};
+
+#endif // OPENCL_PROGRAM_CACHE_H
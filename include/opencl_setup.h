@@ -3,18 +3,221 @@
 
 #include <CL/cl.h> // OpenCL for parallel programming from Intel oneAPI
 #include "Globals.hpp"
+#include "DType.hpp"
+#include "opencl_program_cache.h"
+#include <memory>
 #include <vector>
+#include <string>
+#include <map>
+#include <mutex>
 
 
 // Function prototypes
+bool OpenCLAvailable(); // True when at least one OpenCL platform is installed; never exits
 void SelectTargetDevice(cl_platform_id* selectedPlatform, cl_device_id* selectedDevice);
 cl_context CreateOpenCLContext(cl_platform_id* selectedPlatform, cl_device_id* selectedDevice);
 cl_command_queue CreateCommandQueue(cl_context context, cl_device_id* device);
 
+// A cached kernel, locked from the first argument set to the launch: the kernel object is shared by
+// every caller, and OpenCL does not allow two threads to set its arguments at the same time.
+// SetArg keeps the first failure, so Status() covers every argument.
+class LockedKernel {
+public:
+    LockedKernel(cl_kernel aKernel, std::mutex& aMutex) : kernel(aKernel), lock(aMutex) {}
+
+    template<class T>
+    void SetArg(cl_uint index, const T& value) {
+        if (status == CL_SUCCESS) status = clSetKernelArg(kernel, index, sizeof(T), &value);
+    }
+    cl_kernel get() const { return kernel; }
+    cl_int Status() const { return status; }
+
+private:
+    cl_kernel kernel;
+    std::unique_lock<std::mutex> lock;
+    cl_int status = CL_SUCCESS;
+};
+
+// Process-wide OpenCL runtime. Platform, device, context and command queues are created once,
+// on first use, and released when the process exits. Compiled programs and kernels are cached
+// by (kernel source, build options) so repeated launches only pay for transfers and execution,
+// and their binaries are kept on disk (ProgramBinaryCache) so later runs skip the compiler too.
+// Besides the compute queue there are in-order queues for uploads and downloads, so that one
+// operation's transfers can overlap another's kernel; events order the steps of each operation.
+class OpenCLRuntime {
+public:
+    static OpenCLRuntime& Instance();
+
+    cl_platform_id Platform() const { return platform; }
+    cl_device_id DeviceId() const { return device; }
+    cl_context Context() const { return context; }
+    cl_command_queue Queue() const { return queue; } // Kernels
+    cl_command_queue UploadQueue() const { return uploadQueue; } // Host to device transfers
+    cl_command_queue DownloadQueue() const { return downloadQueue; } // Device to host transfers
+    bool SupportsFP64() const { return fp64; } // Device reports cl_khr_fp64
+    std::string DeviceName() const;
+    size_t MaxWorkGroupSize() const { return maxWorkGroupSize; } // Work-items per work-group
+    size_t LocalMemSize() const { return localMemSize; } // Bytes of __local memory per work-group
+    ProgramBinaryCache& BinaryCache() { return *binaryCache; } // On-disk program binaries
+
+    // Get a kernel from the cache, compiling its program on the first request. It stays locked
+    // until the returned handle goes out of scope, so set its arguments and enqueue it through that.
+    LockedKernel GetKernel(const char* kernelSource, const char* kernelName, const std::string& buildOptions = "");
+
+    // Release every cached kernel, program, the queue and the context. Called automatically at exit.
+    void Shutdown();
+
+private:
+    OpenCLRuntime();
+    ~OpenCLRuntime();
+    OpenCLRuntime(const OpenCLRuntime&) = delete;
+    OpenCLRuntime& operator=(const OpenCLRuntime&) = delete;
+
+    cl_program GetProgram(const char* kernelSource, const std::string& buildOptions);
+
+    cl_platform_id platform = NULL;
+    cl_device_id device = NULL;
+    cl_context context = NULL;
+    cl_command_queue queue = NULL;
+    cl_command_queue uploadQueue = NULL;
+    cl_command_queue downloadQueue = NULL;
+    bool fp64 = false;
+    size_t maxWorkGroupSize = 1;
+    size_t localMemSize = 0;
+    std::unique_ptr<ProgramBinaryCache> binaryCache;
+
+    using ProgramKey = std::pair<std::string, std::string>; // (source, build options)
+    std::map<ProgramKey, cl_program> programs;
+    struct CachedKernel {
+        cl_kernel kernel = NULL;
+        std::mutex launchMutex; // Held by the LockedKernel of the current launch
+    };
+    std::map<std::pair<cl_program, std::string>, CachedKernel> kernels; // (program, kernel name)
+    std::mutex cacheMutex;
+};
+
+// Device work of an operation issued without waiting: the event that completes it (the download
+// of its result) and the device and host buffers it uses until then. Wait() (or the destructor)
+// blocks until the work is done and releases them.
+class PendingKernelWork {
+public:
+    PendingKernelWork() = default;
+    ~PendingKernelWork() { Wait(); }
+    PendingKernelWork(PendingKernelWork&& aOther) noexcept;
+    PendingKernelWork& operator=(PendingKernelWork&& aOther) noexcept;
+    PendingKernelWork(const PendingKernelWork&) = delete;
+    PendingKernelWork& operator=(const PendingKernelWork&) = delete;
+
+    bool Pending() const { return done != NULL; }
+    bool Ready() const; // Done, or nothing pending; never blocks
+    cl_int Wait(); // CL_SUCCESS, or the failed command's status
+
+    cl_event done = NULL;
+    std::vector<cl_mem> deviceBuffers;
+    std::vector<std::vector<unsigned char>> hostBuffers; // Uploaded from, e.g. operands converted on the host
+};
+
 // Kernel based operations
-void MatrixMultiplyKernelBased(std::vector<dataType>& input1, std::vector<int>& shape1,
-    std::vector<dataType>& input2, std::vector<int>& shape2,
-    std::vector<dataType>& output, const char** KernelSource);
+// Compile-time parameters of matrixMultTilingKernelSource, passed to the compiler as -D defines.
+// The best values depend on the device and the matrix shape; see GemmTuner (opencl_tuner.h).
+struct GemmKernelConfig {
+    int tileM = 64; // TSM: rows of the tile of C computed by a work-group
+    int tileN = 64; // TSN: columns of that tile
+    int tileK = 16; // TSK: step along K, staged in local memory
+    int workPerThreadM = 4; // WPTM: rows of the micro-tile accumulated by a work-item
+    int workPerThreadN = 4; // WPTN: columns of that micro-tile
+    int vectorWidth = 4; // WIDTH: consecutive elements loaded per run (1, 2, 4 or 8)
+
+    std::string BuildOptions() const; // "-D TSM=64 -D TSN=64 ..."
+    std::string Name() const; // "64x64x16 4x4 w4": tile, micro-tile and vector width
+    // The work-group is (TSN / WPTN) x (TSM / WPTM) items, and each tile of A and B must split
+    // evenly into runs of WIDTH shared by those items
+    bool IsValid() const;
+    size_t WorkGroupSize() const { return (size_t)(tileM / workPerThreadM) * (tileN / workPerThreadN); }
+    size_t LocalMemBytes(DType dtype) const; // Tiles of A and B, held in the accumulator type
+    bool operator==(const GemmKernelConfig& aOther) const {
+        return tileM == aOther.tileM && tileN == aOther.tileN && tileK == aOther.tileK &&
+            workPerThreadM == aOther.workPerThreadM && workPerThreadN == aOther.workPerThreadN &&
+            vectorWidth == aOther.vectorWidth;
+    }
+};
+
+// Epilogue of the tiling kernel, applied to each accumulator in registers before it is stored:
+// C(i, j) = activation(scale * (A * B)(i, j) + bias[j]). bias is a host row of N elements of the
+// kernel's dtype, or null; activationBuildOption is "-D ACT_RELU", "-D ACT_GELU", "-D ACT_TANH" or "".
+struct GemmKernelEpilogue {
+    const void* bias = nullptr;
+    float scale = 1;
+    const char* activationBuildOption = "";
+
+    std::string BuildOptions() const; // "-D EPILOGUE -D HAS_BIAS -D ACT_RELU"
+};
+
+// C (M x N) = A (M x K) * B (K x N), all three of dtype. Rows are contiguous; lda, ldb and ldc are
+// the row strides in elements, so row views and slices of larger tensors are transferred without
+// host copies. The kernel is compiled once per dtype (see elementTypeKernelPrelude) and config.
+// With config, KernelSource is the tiling kernel; without, one work-item computes each output.
+// Any M, K and N work with either. An epilogue needs the tiling kernel.
+void MatrixMultiplyKernelBased(int M, int K, int N,
+    const void* A, int lda, const void* B, int ldb,
+    void* C, int ldc, DType dtype, const char** KernelSource, const GemmKernelConfig* config = nullptr,
+    const GemmKernelEpilogue* epilogue = nullptr);
+
+// batch products C[i] (M x N) = A[i] (M x K) * B[i] (K x N) in a single launch of the tiling
+// kernel. A[i], B[i] and C[i] are host matrices with row strides lda[i], ldb[i] and ldc[i]. When
+// every A[i] (or B[i]) is the same matrix it is uploaded once and shared by the whole batch;
+// matrices an equal distance apart, such as the entries of a [batch, rows, cols] tensor, move in
+// one transfer, and the others (pointer arrays) are packed into one buffer.
+// Uploads, kernel and downloads go to the runtime's three queues, chained by events. With
+// pending the call returns as soon as they are enqueued and pending tracks them; the host
+// matrices must stay untouched until pending is done. Without, it returns with C written.
+void BatchedMatrixMultiplyKernelBased(int batch, int M, int K, int N,
+    const void* const* A, const int* lda, const void* const* B, const int* ldb,
+    void* const* C, const int* ldc, DType dtype, const char** KernelSource, const GemmKernelConfig& config,
+    PendingKernelWork* pending = nullptr, const GemmKernelEpilogue* epilogue = nullptr);
+
+// Enqueue the matrix multiplication on device buffers, without transfers or waiting. event (may
+// be null) receives the kernel's profiling event. With an epilogue (tiling kernel only), bias is
+// the device copy of its row, or NULL.
+cl_int EnqueueMatrixMultiply(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, DType dtype,
+    const char** KernelSource, const GemmKernelConfig* config, cl_event* event,
+    const GemmKernelEpilogue* epilogue = nullptr, cl_mem bias = NULL);
+// Batched form for the tiling kernel: batch products of dense matrices, the i-th at A +
+// i * batchStrideA, B + i * batchStrideB (in elements; 0 shares the operand) and C + i * M * N.
+// The kernel starts once waitFor (may be null) has completed.
+cl_int EnqueueBatchedMatrixMultiply(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, int batch,
+    size_t batchStrideA, size_t batchStrideB, DType dtype, const char** KernelSource,
+    const GemmKernelConfig& config, cl_event waitFor, cl_event* event,
+    const GemmKernelEpilogue* epilogue = nullptr, cl_mem bias = NULL);
+
+// C (dense, numel elements of dtype) = A op B over the shape[0] x ... x shape[rank - 1] iteration
+// space. A and B are read through per-dimension element strides, where 0 broadcasts a dimension;
+// spanA and spanB are the number of elements those strides reach, which is what gets transferred.
+// operationBuildOption ("-D OP_ADD", ...) selects the operation the kernels are compiled for.
+// As for BatchedMatrixMultiplyKernelBased, pending makes the call return once the work is enqueued.
+void ElementwiseKernelBased(int rank, const int* shape,
+    const void* A, const int* stridesA, size_t spanA,
+    const void* B, const int* stridesB, size_t spanB,
+    void* C, DType dtype, const char* operationBuildOption, const char* const* KernelSource,
+    PendingKernelWork* pending = nullptr);
+
+// Partial reductions over the middle dimension of a dense [outer, n, inner] array A of dtype.
+// Each of the outer * inner runs along n is split into the returned number of parts; run r's
+// partial results are partialValues/partialIndices[r * parts + p] (see reductionKernelSource), to
+// be combined by the caller. reductionBuildOption ("-D RED_SUM", ...) selects the reduction.
+int ReduceKernelBased(int outer, int n, int inner, const void* A, DType dtype,
+    const char* reductionBuildOption, std::vector<double>& partialValues, std::vector<int>& partialIndices,
+    const char* const* KernelSource);
+
+// C (rows x N, row stride ldc) = A (rows x cols, CSR arrays rowPointers, columnIndices and values)
+// * B (cols x N, row stride ldb), float32. N == 1 runs spmv_csr, a work-group per row, and
+// otherwise spmm_csr, a work-item per output (see sparseKernelSource).
+void SparseMatrixMultiplyKernelBased(int rows, int cols, int N,
+    const int* rowPointers, const int* columnIndices, const float* values,
+    const float* B, int ldb, float* C, int ldc, const char* const* KernelSource);
+
+// Build option selecting the element type of the kernels in opencl_kernels.h
+const char* KernelTypeBuildOption(DType aDType);
 
 void PrintKernelBuildLog(cl_program program, cl_device_id device);
 
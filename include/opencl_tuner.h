@@ -0,0 +1,65 @@
+#ifndef OPENCL_TUNER_H
+#define OPENCL_TUNER_H
+
+#include "opencl_setup.h"
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Auto-tuner of the OpenCL GEMM kernel (matrixMultTilingKernelSource). Tuning a shape times every
+// candidate GemmKernelConfig the device can run on it, and the fastest is recorded for the
+// device, dtype and shape class and appended to the tuning file. Select() reads that file on first
+// use, so a tuned configuration is picked automatically by every later launch and later run.
+//
+// The tuning file is "opencl_gemm_tuning.txt" in the working directory, or the path in the
+// TENSOR_GEMM_TUNING_FILE environment variable. Shapes without an entry use the default
+// configuration, or are tuned on first use when auto-tuning is on (TENSOR_GEMM_AUTOTUNE=1).
+class GemmTuner {
+public:
+    static GemmTuner& Instance();
+
+    // Configuration for C (M x N) = A (M x K) * B (K x N) on the current device
+    GemmKernelConfig Select(int M, int K, int N, DType dtype);
+
+    // Time the candidates on this shape and record the fastest. Returns the winner.
+    GemmKernelConfig Tune(int M, int K, int N, DType dtype);
+
+    // Configurations tried by Tune() that the current device can run: square tiles of 32 to 128,
+    // K steps of 8 to 32, micro-tiles of 2x2 to 8x8 and scalar or float4-wide loads
+    std::vector<GemmKernelConfig> Candidates(DType dtype) const;
+    bool Supports(const GemmKernelConfig& aConfig, DType dtype) const; // Valid and within the device limits
+
+    // Class a shape is tuned for, e.g. "1024x256x1024": each of M, K and N rounded up to a power of
+    // two, at least 64 and at most 4096
+    static std::string ShapeClass(int M, int K, int N);
+
+    void setAutoTune(bool aAutoTune);
+    void setTuningFile(const std::string& aPath); // Reloaded on the next Select()
+
+private:
+    GemmTuner();
+    GemmTuner(const GemmTuner&) = delete;
+    GemmTuner& operator=(const GemmTuner&) = delete;
+
+    struct Entry {
+        GemmKernelConfig config;
+        double milliseconds = 0; // Kernel time of the winner when it was tuned
+    };
+    using Key = std::tuple<std::string, std::string, std::string>; // (device, dtype, shape class)
+
+    GemmKernelConfig Untuned(DType dtype) const; // The default configuration, or the first candidate when the device cannot run it
+    void Load(); // Caller holds tableMutex
+    void Append(const Key& aKey, const Entry& aEntry); // Caller holds tableMutex
+    double TimeConfig(const GemmKernelConfig& aConfig, int M, int K, int N, DType dtype,
+        cl_mem A, cl_mem B, cl_mem C);
+
+    std::map<Key, Entry> table;
+    std::string tuningFile;
+    bool loaded = false;
+    bool autoTune = false;
+    std::mutex tableMutex;
+};
+
+#endif // OPENCL_TUNER_H
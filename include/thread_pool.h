@@ -0,0 +1,93 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct ThreadStats {
+    int cpu = -1; // CPU the thread is pinned to, or -1
+    size_t tasks = 0; // Chunks run
+    size_t steals = 0; // Chunks taken from another thread's queue
+    double busySeconds = 0; // Running chunks
+    double idleSeconds = 0; // Out of chunks while others still ran theirs
+};
+
+struct ThreadPoolStats {
+    int threads = 0;
+    size_t jobs = 0; // Loops shared out over the pool
+    size_t inlineJobs = 0; // Loops run on the calling thread alone: too small, or nested in a job
+    size_t tasks = 0;
+    size_t steals = 0;
+    double busySeconds = 0;
+    double idleSeconds = 0;
+    std::vector<ThreadStats> perThread; // [0] is the calling thread, the others the workers
+};
+
+// Library-owned work-stealing pool that the CPU kernels (GEMM tiles, elementwise chunks,
+// reductions, conversions, fused expressions) run on. A loop is split into at most
+// ChunksPerThread chunks per thread, and each thread starts on its own contiguous share of them,
+// so a loop over a buffer touches the same part of it from the same thread every time. A thread
+// that runs out steals chunks from the far end of another's share.
+//
+// Threads: TENSOR_NUM_THREADS, else omp_get_max_threads(). The caller of a loop takes part as
+// thread 0; the workers are pinned to the CPUs the process may run on, one each, unless
+// TENSOR_PIN_THREADS=0 or there are more threads than CPUs. Pinned threads keep the pages they
+// first touch on their NUMA node, which is why large fresh tensor storage is first touched (and
+// zero-filled) through the pool rather than on one thread: see FirstTouch and Fill.
+//
+// Loops issued from inside a chunk run inline on that thread. Loops issued by several threads at
+// once take turns.
+class ThreadPool {
+public:
+    static constexpr int ChunksPerThread = 4;
+
+    static ThreadPool& Instance(); // Never destroyed
+
+    int Threads() const { return numThreads; }
+
+    // Call aBody(begin, end) on chunks of at least aGrain iterations covering [0, aCount), and
+    // return when every chunk is done. aBody must not throw.
+    template<class F>
+    void ParallelFor(size_t aCount, size_t aGrain, const F& aBody) {
+        Run(aCount, aGrain, [](const void* aFunction, size_t aBegin, size_t aEnd) {
+            (*static_cast<const F*>(aFunction))(aBegin, aEnd);
+        }, &aBody);
+    }
+
+    void FirstTouch(void* aData, size_t aBytes); // Write one byte of each page of a fresh block
+    void Fill(void* aData, size_t aBytes, unsigned char aValue); // memset, shared out like a loop over the bytes
+
+    ThreadPoolStats Stats() const;
+    void ResetStats();
+
+private:
+    using RangeFunction = void (*)(const void*, size_t, size_t);
+    struct Job;
+    struct Slot;
+
+    ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void Run(size_t aCount, size_t aGrain, RangeFunction aFunction, const void* aBody);
+    void RunChunks(Job& aJob, int aSlot);
+    void WorkerLoop(int aSlot);
+
+    int numThreads = 1;
+    std::unique_ptr<Slot[]> slots;
+
+    std::mutex submitMutex; // One job at a time
+    std::mutex jobMutex;
+    std::condition_variable jobReady;
+    std::condition_variable jobDone;
+    Job* current = nullptr;
+    unsigned long long generation = 0; // Of the current job
+    std::atomic<size_t> jobs{ 0 };
+    std::atomic<size_t> inlineJobs{ 0 };
+};
+
+#endif // THREAD_POOL_H
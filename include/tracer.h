@@ -0,0 +1,129 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <CL/cl.h>
+#include "Operations.hpp"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Built-in tracer of Tensor operations, written as Chrome trace JSON (chrome://tracing, or
+// https://ui.perfetto.dev). While it runs, every operation records its wall time, operand shapes
+// and dtypes, bytes read and written, and device; on OpenCL each upload, kernel and download is
+// also recorded with its queued, submit, start and end times from the event profiling info,
+// aligned to the host clock and tagged with the operation that issued it.
+//
+// Tracing starts with Start(), or at launch when the TENSOR_TRACE_FILE environment variable
+// names a file, which is then written at exit. When off, an operation only pays for one atomic load.
+class Tracer {
+public:
+    static Tracer& Instance();
+    static bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+
+    void Start(); // Discard earlier events and record from now on
+    void Stop(); // Stop recording; pending OpenCL commands are waited for and kept
+    bool Write(const std::string& aPath); // Write the events recorded so far; false when the file cannot be written
+    size_t EventCount();
+
+    // Recording, used by TraceScope and TracedCommand
+    struct Event {
+        std::string name;
+        const char* category;
+        int pid;
+        int tid;
+        double start; // Microseconds since the tracer was created
+        double duration;
+        std::string args; // JSON members, without the braces
+    };
+    void Record(Event aEvent);
+    void RecordCommand(cl_event aEvent, const char* aName, cl_command_queue aQueue, size_t aBytes,
+        double aEnqueued, const char* aOperation);
+    void CollectCommands(bool aWait); // Move completed OpenCL commands into the events
+    double Now() const; // Microseconds since the tracer was created
+    static int ThreadId(); // Small id of the calling thread, 1 for the first one traced
+
+private:
+    Tracer();
+    ~Tracer();
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    struct PendingCommand {
+        cl_event event;
+        std::string name;
+        std::string operation;
+        int queue;
+        size_t bytes;
+        double enqueued;
+    };
+    static std::atomic<bool> enabled;
+    std::string exitFile; // TENSOR_TRACE_FILE
+    std::chrono::steady_clock::time_point epoch;
+    std::vector<Event> events;
+    std::vector<PendingCommand> pending;
+    std::string deviceName; // Of the commands' process in the trace
+    std::mutex eventMutex;
+};
+
+// Records the operation it lives through. Operands are only described when the trace is on:
+//     TraceScope trace("matmul");
+//     if (trace.Active()) trace.Input(a.ref()).Input(b.ref()).Output(out.ref());
+class TraceScope {
+public:
+    explicit TraceScope(const char* aName, Device aDevice = UseDevice);
+    ~TraceScope();
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    bool Active() const { return active; }
+    TraceScope& Input(const TensorRef& aOperand); // Shape and dtype, bytes read
+    TraceScope& Output(const TensorRef& aOperand); // Shape and dtype, bytes written
+    TraceScope& View(const TensorRef& aResult); // Shape and dtype of a result that shares its source's storage
+    TraceScope& Arg(const char* aKey, const std::string& aValue);
+    TraceScope& Arg(const char* aKey, long long aValue);
+
+    static const char* Current(); // Innermost operation traced on this thread, or ""
+
+private:
+    const char* name;
+    Device device;
+    bool active;
+    double start = 0;
+    long long bytes = 0;
+    std::string inputs;
+    std::string output;
+    std::string args;
+    const char* enclosing = "";
+};
+
+// Names of operations in the trace: "add", "sum", "Broadcast", ...
+const char* TraceName(OperationType aType);
+const char* TraceName(ReductionType aType);
+const char* TraceName(ShapeCompatibility aMode);
+
+// Event argument of an enqueued OpenCL command. When the trace is on, the command's event is
+// handed to the tracer when this temporary goes away, at the end of the enqueue statement:
+//     clEnqueueWriteBuffer(queue, buffer, CL_FALSE, 0, bytes, host, 0, NULL, TracedCommand("upload", queue, bytes));
+// A caller that needs the event itself passes its own slot as aEvent, which is returned unchanged.
+class TracedCommand {
+public:
+    TracedCommand(const char* aName, cl_command_queue aQueue, size_t aBytes = 0, cl_event* aEvent = NULL);
+    ~TracedCommand();
+    TracedCommand(const TracedCommand&) = delete;
+    TracedCommand& operator=(const TracedCommand&) = delete;
+
+    operator cl_event*();
+
+private:
+    const char* name;
+    cl_command_queue queue;
+    size_t bytes;
+    cl_event* callerEvent;
+    cl_event event = NULL;
+    bool active;
+    double enqueued = 0;
+};
+
+#endif // TRACER_H
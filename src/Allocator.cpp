@@ -0,0 +1,241 @@
+#include "Allocator.hpp"
+#include "thread_pool.h"
+#include <cstring>
+#include <new>
+
+namespace {
+// Fresh blocks and zero-filled storage from this size up are first touched through the thread pool
+constexpr size_t ParallelInitBytes = 1 << 20;
+}
+
+/*********** SystemAllocator *************/
+
+SystemAllocator& SystemAllocator::Instance() {
+    static SystemAllocator* allocator = new SystemAllocator(); // Leaked, like CachingAllocator::Instance()
+    return *allocator;
+}
+
+// Large blocks come straight from the kernel, with no page mapped yet. Each page is mapped on the
+// NUMA node of the thread that first writes it, so the pool's threads touch the pages of the parts
+// of the block that their share of a loop over it will later read and write.
+void* SystemAllocator::allocate(size_t aBytes) {
+    void* block = ::operator new(aBytes, std::align_val_t(Alignment));
+    if (aBytes >= ParallelInitBytes) {
+        ThreadPool::Instance().FirstTouch(block, aBytes);
+    }
+    return block;
+}
+
+void SystemAllocator::deallocate(void* aPointer, size_t aBytes) {
+    ::operator delete(aPointer, aBytes, std::align_val_t(Alignment));
+}
+
+
+/*********** Size classes *************/
+namespace {
+
+constexpr size_t MinClassBytes = 64;
+
+int FloorLog2(size_t aValue) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll((unsigned long long)aValue);
+#else
+    int log = 0;
+    while (aValue >>= 1) ++log;
+    return log;
+#endif
+}
+
+// Classes are 64 bytes, then four evenly spaced sizes in each (2^k, 2^(k+1)]: 80, 96, 112, 128, 160, ...
+// Index of a class size in that sequence, used by the thread caches
+int ClassIndex(size_t aClassBytes) {
+    if (aClassBytes <= MinClassBytes) return 0;
+    const int k = FloorLog2(aClassBytes - 1);
+    const size_t step = size_t(1) << (k - 2);
+    return 1 + (k - 6) * 4 + (int)((aClassBytes - (size_t(1) << k)) / step) - 1;
+}
+
+constexpr int NumThreadClasses = 1 + (20 - 6) * 4; // Classes up to ThreadCacheMaxBytes (2^20)
+
+enum class ThreadCacheState { Unused, Alive, Destroyed };
+// Trivially destructible, so it can still be read while and after the thread's cache is destroyed
+thread_local ThreadCacheState threadCacheState = ThreadCacheState::Unused;
+
+} // namespace
+
+size_t CachingAllocator::SizeClass(size_t aBytes) {
+    if (aBytes <= MinClassBytes) return MinClassBytes;
+    const size_t step = size_t(1) << (FloorLog2(aBytes - 1) - 2);
+    return (aBytes + step - 1) / step * step;
+}
+
+
+/*********** Thread cache *************/
+// A few free blocks of each small class, owned by one thread. Blocks go back to the shared pool
+// when the thread exits.
+struct ThreadCache {
+    void* blocks[NumThreadClasses][CachingAllocator::ThreadCacheBlocksPerClass];
+    int counts[NumThreadClasses] = {};
+
+    ThreadCache() { threadCacheState = ThreadCacheState::Alive; }
+    ~ThreadCache() {
+        flush();
+        threadCacheState = ThreadCacheState::Destroyed;
+    }
+
+    void* take(size_t aClassBytes) {
+        const int index = ClassIndex(aClassBytes);
+        return counts[index] > 0 ? blocks[index][--counts[index]] : nullptr;
+    }
+    bool put(void* aPointer, size_t aClassBytes) {
+        const int index = ClassIndex(aClassBytes);
+        if (counts[index] == CachingAllocator::ThreadCacheBlocksPerClass) return false;
+        blocks[index][counts[index]++] = aPointer;
+        return true;
+    }
+    // Hand every block to the shared pool
+    void flush() {
+        CachingAllocator& allocator = CachingAllocator::Instance();
+        size_t classBytes = MinClassBytes;
+        for (int index = 0; index < NumThreadClasses; ++index) {
+            while (counts[index] > 0) {
+                allocator.putShared(blocks[index][--counts[index]], classBytes);
+            }
+            classBytes = CachingAllocator::SizeClass(classBytes + 1);
+        }
+    }
+
+    // Null once the calling thread's cache has been destroyed (during thread exit)
+    static ThreadCache* Local() {
+        if (threadCacheState == ThreadCacheState::Destroyed) return nullptr;
+        thread_local ThreadCache cache;
+        return &cache;
+    }
+};
+
+
+/*********** CachingAllocator *************/
+
+CachingAllocator& CachingAllocator::Instance() {
+    // Leaked on purpose: tensors with static storage duration may be freed after main returns
+    static CachingAllocator* allocator = new CachingAllocator();
+    return *allocator;
+}
+
+void* CachingAllocator::allocate(size_t aBytes) {
+    if (aBytes == 0) return nullptr;
+    const size_t classBytes = SizeClass(aBytes);
+
+    void* block = nullptr;
+    ThreadCache* cache = classBytes <= ThreadCacheMaxBytes ? ThreadCache::Local() : nullptr;
+    if (cache) block = cache->take(classBytes);
+    if (!block) block = takeShared(classBytes);
+
+    if (block) {
+        hits.fetch_add(1, std::memory_order_relaxed);
+        bytesCached.fetch_sub(classBytes, std::memory_order_relaxed);
+    }
+    else {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        try {
+            block = SystemAllocator::Instance().allocate(classBytes);
+        }
+        catch (const std::bad_alloc&) {
+            // Cached blocks of other sizes may be what stands in the way
+            releaseCached();
+            block = SystemAllocator::Instance().allocate(classBytes);
+        }
+    }
+    bytesInUse.fetch_add(classBytes, std::memory_order_relaxed);
+    return block;
+}
+
+void CachingAllocator::deallocate(void* aPointer, size_t aBytes) {
+    if (!aPointer) return;
+    const size_t classBytes = SizeClass(aBytes);
+    bytesInUse.fetch_sub(classBytes, std::memory_order_relaxed);
+
+    if (bytesCached.load(std::memory_order_relaxed) + classBytes > maxCachedBytes.load(std::memory_order_relaxed)) {
+        SystemAllocator::Instance().deallocate(aPointer, classBytes);
+        return;
+    }
+    bytesCached.fetch_add(classBytes, std::memory_order_relaxed);
+    ThreadCache* cache = classBytes <= ThreadCacheMaxBytes ? ThreadCache::Local() : nullptr;
+    if (cache && cache->put(aPointer, classBytes)) return;
+    putShared(aPointer, classBytes);
+}
+
+void* CachingAllocator::takeShared(size_t aClassBytes) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    auto found = pool.find(aClassBytes);
+    if (found == pool.end() || found->second.empty()) return nullptr;
+    void* block = found->second.back();
+    found->second.pop_back();
+    return block;
+}
+
+void CachingAllocator::putShared(void* aPointer, size_t aClassBytes) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    pool[aClassBytes].push_back(aPointer);
+}
+
+AllocatorStats CachingAllocator::stats() const {
+    AllocatorStats result;
+    result.hits = hits.load(std::memory_order_relaxed);
+    result.misses = misses.load(std::memory_order_relaxed);
+    result.bytesCached = bytesCached.load(std::memory_order_relaxed);
+    result.bytesInUse = bytesInUse.load(std::memory_order_relaxed);
+    return result;
+}
+
+void CachingAllocator::setMaxCachedBytes(size_t aBytes) {
+    maxCachedBytes.store(aBytes, std::memory_order_relaxed);
+}
+
+void CachingAllocator::releaseCached() {
+    if (ThreadCache* cache = ThreadCache::Local()) {
+        cache->flush();
+    }
+    std::lock_guard<std::mutex> lock(poolMutex);
+    for (auto& entry : pool) {
+        for (void* block : entry.second) {
+            SystemAllocator::Instance().deallocate(block, entry.first);
+        }
+        bytesCached.fetch_sub(entry.first * entry.second.size(), std::memory_order_relaxed);
+    }
+    pool.clear();
+}
+
+
+/*********** Tensor storage *************/
+namespace {
+std::atomic<Allocator*> tensorAllocator{ nullptr };
+}
+
+Allocator& GetTensorAllocator() {
+    Allocator* allocator = tensorAllocator.load(std::memory_order_acquire);
+    return allocator ? *allocator : CachingAllocator::Instance();
+}
+
+void SetTensorAllocator(Allocator& aAllocator) {
+    tensorAllocator.store(&aAllocator, std::memory_order_release);
+}
+
+TensorStorage::TensorStorage(size_t aBytes, StorageInit aInit) : numBytes(aBytes), allocator(&GetTensorAllocator()) {
+    bytes = static_cast<unsigned char*>(allocator->allocate(aBytes));
+    if (aInit == StorageInit::Zero && aBytes >= ParallelInitBytes) {
+        ThreadPool::Instance().Fill(bytes, aBytes, 0);
+    }
+    else if (aInit == StorageInit::Zero && aBytes > 0) {
+        std::memset(bytes, 0, aBytes);
+    }
+}
+
+TensorStorage::TensorStorage(unsigned char* aBytes, size_t aSize, std::shared_ptr<const void> aOwner)
+    : bytes(aBytes), numBytes(aSize), owner(std::move(aOwner)) {}
+
+TensorStorage::~TensorStorage() {
+    if (bytes && allocator) {
+        allocator->deallocate(bytes, numBytes);
+    }
+}
@@ -0,0 +1,289 @@
+#include "DType.hpp"
+#include "cpu_features.h"
+#include "thread_pool.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(TENSOR_X86)
+#include <immintrin.h>
+#endif
+
+/*********** DType properties *************/
+
+size_t DTypeSize(DType aDType) {
+    switch (aDType) {
+    case DType::float64: return 8;
+    case DType::float16:
+    case DType::bfloat16: return 2;
+    default: return 4; // float32, int32
+    }
+}
+
+const char* DTypeName(DType aDType) {
+    switch (aDType) {
+    case DType::float32: return "float32";
+    case DType::float64: return "float64";
+    case DType::float16: return "float16";
+    case DType::bfloat16: return "bfloat16";
+    case DType::int32: return "int32";
+    }
+    return "unknown";
+}
+
+bool IsFloatingPoint(DType aDType) {
+    return aDType != DType::int32;
+}
+
+DType ComputeDType(DType aDType) {
+    if (aDType == DType::float16 || aDType == DType::bfloat16) return DType::float32;
+    return aDType;
+}
+
+DType PromoteTypes(DType a, DType b) {
+    if (a == b) return a;
+    if (a == DType::int32) return b;
+    if (b == DType::int32) return a;
+    if (a == DType::float64 || b == DType::float64) return DType::float64;
+    return DType::float32; // float32 with a 16-bit format, or float16 with bfloat16
+}
+
+DType PromoteWithScalar(DType aDType, bool scalarIsIntegral) {
+    if (aDType == DType::int32 && !scalarIsIntegral) return DType::float32;
+    return aDType;
+}
+
+/*********** Scalar conversions *************/
+
+float HalfToFloat(uint16_t aBits) {
+    const uint32_t sign = (uint32_t)(aBits & 0x8000u) << 16;
+    const uint32_t exponent = (aBits >> 10) & 0x1f;
+    const uint32_t mantissa = aBits & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0x1f) { // inf, NaN
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    }
+    else if (exponent != 0) { // normal: rebias the exponent from 15 to 127
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    else { // zero or subnormal: mantissa * 2^-24 is exact in float
+        float value = (float)mantissa * 5.9604644775390625e-8f;
+        std::memcpy(&bits, &value, sizeof(bits));
+        bits |= sign;
+    }
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+uint16_t FloatToHalf(float aValue) {
+    uint32_t bits;
+    std::memcpy(&bits, &aValue, sizeof(bits));
+    const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000u);
+    const uint32_t magnitude = bits & 0x7fffffffu;
+
+    if (magnitude >= 0x7f800000u) { // inf stays inf, NaN stays a quiet NaN
+        return sign | 0x7c00 | (magnitude > 0x7f800000u ? 0x200 : 0);
+    }
+    if (magnitude >= 0x477ff000u) { // 65520 and above round to inf
+        return sign | 0x7c00;
+    }
+    if (magnitude < 0x38800000u) { // below 2^-14: half subnormal, value * 2^24 rounded to nearest even
+        float absValue;
+        std::memcpy(&absValue, &magnitude, sizeof(absValue));
+        return sign | (uint16_t)std::nearbyint(absValue * 16777216.0f);
+    }
+    // Normal: rebias the exponent from 127 to 15 and round the 13 dropped bits to nearest even
+    const uint32_t rounded = magnitude + 0xc8000fffu + ((magnitude >> 13) & 1);
+    return sign | (uint16_t)(rounded >> 13);
+}
+
+float BFloat16ToFloat(uint16_t aBits) {
+    const uint32_t bits = (uint32_t)aBits << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+uint16_t FloatToBFloat16(float aValue) {
+    uint32_t bits;
+    std::memcpy(&bits, &aValue, sizeof(bits));
+    if ((bits & 0x7fffffffu) > 0x7f800000u) {
+        return (uint16_t)((bits >> 16) | 0x40); // keep NaN quiet
+    }
+    return (uint16_t)((bits + 0x7fffu + ((bits >> 16) & 1)) >> 16);
+}
+
+/*********** Vectorized runs *************/
+namespace {
+
+// Above this many elements a conversion is split over the thread pool
+constexpr size_t ConvertParallelThreshold = 1 << 16;
+// Elements converted per step when a conversion goes through a float32 buffer
+constexpr size_t ConvertChunk = 512;
+
+#if defined(TENSOR_X86)
+TARGET_F16C void HalfToFloatF16C(const uint16_t* src, float* dst, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i half8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(half8));
+    }
+    for (; i < count; ++i) dst[i] = HalfToFloat(src[i]);
+}
+
+TARGET_F16C void FloatToHalfF16C(const float* src, uint16_t* dst, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i half8 = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), half8);
+    }
+    for (; i < count; ++i) dst[i] = FloatToHalf(src[i]);
+}
+#endif // TENSOR_X86
+
+void HalfToFloatRun(const uint16_t* src, float* dst, size_t count) {
+#if defined(TENSOR_X86)
+    if (GetCPUFeatures().f16c) return HalfToFloatF16C(src, dst, count);
+#endif
+    for (size_t i = 0; i < count; ++i) dst[i] = HalfToFloat(src[i]);
+}
+
+void FloatToHalfRun(const float* src, uint16_t* dst, size_t count) {
+#if defined(TENSOR_X86)
+    if (GetCPUFeatures().f16c) return FloatToHalfF16C(src, dst, count);
+#endif
+    for (size_t i = 0; i < count; ++i) dst[i] = FloatToHalf(src[i]);
+}
+
+// bfloat16 is the upper half of a float32, so both directions are integer shifts the compiler vectorizes
+void BFloat16ToFloatRun(const uint16_t* src, float* dst, size_t count) {
+    uint32_t* out = reinterpret_cast<uint32_t*>(dst);
+    #pragma omp simd
+    for (size_t i = 0; i < count; ++i) out[i] = (uint32_t)src[i] << 16;
+}
+
+void FloatToBFloat16Run(const float* src, uint16_t* dst, size_t count) {
+    const uint32_t* in = reinterpret_cast<const uint32_t*>(src);
+    #pragma omp simd
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t bits = in[i];
+        const uint32_t rounded = (bits + 0x7fffu + ((bits >> 16) & 1)) >> 16;
+        const bool isNaN = (bits & 0x7fffffffu) > 0x7f800000u;
+        dst[i] = (uint16_t)(isNaN ? ((bits >> 16) | 0x40) : rounded);
+    }
+}
+
+template<class Src, class Dst>
+void CastRun(const Src* src, Dst* dst, size_t count) {
+    #pragma omp simd
+    for (size_t i = 0; i < count; ++i) dst[i] = static_cast<Dst>(src[i]);
+}
+
+// Conversions between float32, float64 and int32
+template<class Src>
+void CastFrom(const Src* src, void* dst, DType dstType, size_t count) {
+    switch (dstType) {
+    case DType::float32: return CastRun(src, static_cast<float*>(dst), count);
+    case DType::float64: return CastRun(src, static_cast<double*>(dst), count);
+    case DType::int32: return CastRun(src, static_cast<int32_t*>(dst), count);
+    default: return;
+    }
+}
+
+void CastElements(const void* src, DType srcType, void* dst, DType dstType, size_t count) {
+    switch (srcType) {
+    case DType::float32: return CastFrom(static_cast<const float*>(src), dst, dstType, count);
+    case DType::float64: return CastFrom(static_cast<const double*>(src), dst, dstType, count);
+    case DType::int32: return CastFrom(static_cast<const int32_t*>(src), dst, dstType, count);
+    default: return;
+    }
+}
+
+void ToFloatRun(const void* src, DType srcType, float* dst, size_t count) {
+    if (srcType == DType::float16) return HalfToFloatRun(static_cast<const uint16_t*>(src), dst, count);
+    if (srcType == DType::bfloat16) return BFloat16ToFloatRun(static_cast<const uint16_t*>(src), dst, count);
+    CastElements(src, srcType, dst, DType::float32, count);
+}
+
+void FromFloatRun(const float* src, void* dst, DType dstType, size_t count) {
+    if (dstType == DType::float16) return FloatToHalfRun(src, static_cast<uint16_t*>(dst), count);
+    if (dstType == DType::bfloat16) return FloatToBFloat16Run(src, static_cast<uint16_t*>(dst), count);
+    CastElements(src, DType::float32, dst, dstType, count);
+}
+
+bool Is16Bit(DType aDType) {
+    return aDType == DType::float16 || aDType == DType::bfloat16;
+}
+
+void ConvertSerial(const unsigned char* src, DType srcType, unsigned char* dst, DType dstType, size_t count) {
+    if (srcType == dstType) {
+        std::memcpy(dst, src, count * DTypeSize(srcType));
+        return;
+    }
+    if (!Is16Bit(srcType) && !Is16Bit(dstType)) {
+        CastElements(src, srcType, dst, dstType, count);
+        return;
+    }
+    // One side is a 16-bit format: go through float32. The conversion into float32 is exact for
+    // both 16-bit formats; a float64 or int32 source is rounded to float32 first.
+    if (srcType == DType::float32) {
+        FromFloatRun(reinterpret_cast<const float*>(src), dst, dstType, count);
+        return;
+    }
+    if (dstType == DType::float32) {
+        ToFloatRun(src, srcType, reinterpret_cast<float*>(dst), count);
+        return;
+    }
+    const size_t srcSize = DTypeSize(srcType);
+    const size_t dstSize = DTypeSize(dstType);
+    float buffer[ConvertChunk];
+    for (size_t start = 0; start < count; start += ConvertChunk) {
+        const size_t n = std::min(ConvertChunk, count - start);
+        ToFloatRun(src + start * srcSize, srcType, buffer, n);
+        FromFloatRun(buffer, dst + start * dstSize, dstType, n);
+    }
+}
+
+} // namespace
+
+void ConvertElements(const void* src, DType srcType, void* dst, DType dstType, size_t count) {
+    const unsigned char* from = static_cast<const unsigned char*>(src);
+    unsigned char* to = static_cast<unsigned char*>(dst);
+    if (count < ConvertParallelThreshold) {
+        ConvertSerial(from, srcType, to, dstType, count);
+        return;
+    }
+    const size_t srcSize = DTypeSize(srcType);
+    const size_t dstSize = DTypeSize(dstType);
+    // Chunks of whole 64-element blocks over the thread pool
+    const size_t blocks = (count + 63) / 64;
+    ThreadPool::Instance().ParallelFor(blocks, 16, [=](size_t aBegin, size_t aEnd) {
+        const size_t begin = aBegin * 64;
+        const size_t end = std::min(count, aEnd * 64);
+        ConvertSerial(from + begin * srcSize, srcType, to + begin * dstSize, dstType, end - begin);
+    });
+}
+
+/*********** Single elements *************/
+
+double LoadElement(const void* base, DType aDType, size_t index) {
+    switch (aDType) {
+    case DType::float32: return static_cast<const float*>(base)[index];
+    case DType::float64: return static_cast<const double*>(base)[index];
+    case DType::float16: return HalfToFloat(static_cast<const uint16_t*>(base)[index]);
+    case DType::bfloat16: return BFloat16ToFloat(static_cast<const uint16_t*>(base)[index]);
+    case DType::int32: return static_cast<const int32_t*>(base)[index];
+    }
+    return 0.0;
+}
+
+void StoreElement(void* base, DType aDType, size_t index, double aValue) {
+    switch (aDType) {
+    case DType::float32: static_cast<float*>(base)[index] = static_cast<float>(aValue); break;
+    case DType::float64: static_cast<double*>(base)[index] = aValue; break;
+    case DType::float16: static_cast<uint16_t*>(base)[index] = FloatToHalf(static_cast<float>(aValue)); break;
+    case DType::bfloat16: static_cast<uint16_t*>(base)[index] = FloatToBFloat16(static_cast<float>(aValue)); break;
+    case DType::int32: static_cast<int32_t*>(base)[index] = static_cast<int32_t>(aValue); break;
+    }
+}
@@ -1,245 +1,718 @@
 #include "Operations.hpp"
 #include "opencl_setup.h" // OpenCL seup and execution
 #include "opencl_kernels.h" // Kernel implementations
-#include <cmath> // cmath header for std::isnan
-#include <omp.h> // OpenMP for CPU parallel programming
+#include "opencl_tuner.h" // GEMM kernel configurations tuned per device and shape
+#include "cpu_gemm.h" // Packed, SIMD CPU GEMM
+#include "cpu_elementwise.h" // Specialized, SIMD CPU elementwise kernels
+#include "cpu_reduction.h" // Tree/SIMD CPU reductions
+#include "cpu_sparse.h" // Load-balanced CSR SpMM/SpMV
+#include "thread_pool.h" // Work-stealing pool the CPU kernels run on
+#include "Allocator.hpp" // Tensor storage, for uninitialized scratch
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <stdexcept>
 
-/*********** CPUOperation *************/
+/*********** TensorRef *************/
 
-void CPUOperation::performOperation(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-                                    std::vector<dataType>& output, OperationType opType,
-                                    ShapeCompatibility spCompat) const {
-	if (ShapeCompatibility::IsScalar == spCompat)
-		return OperationWithScalar(input1, input2, output, opType);
-	if (ShapeCompatibility::ColVector == spCompat)
-		return OperationWithColVector(input1, input2, output, opType);
-	if (ShapeCompatibility::RowVector == spCompat)
-		return OperationWithRowVector(input1, input2, output, opType);
-	return OperationWithSameShape(input1, input2, output, opType);
+size_t TensorRef::numel() const {
+    size_t count = 1;
+    for (int d = 0; d < ndim; ++d) count *= shape[d];
+    return count;
 }
 
-void CPUOperation::Matrix2DMulitplication(std::vector<dataType>& input1, std::vector<int>& shape1,
-    std::vector<dataType>& input2, std::vector<int>& shape2,
-    std::vector<dataType>& output) {
+bool TensorRef::isContiguous() const {
+    int expected = 1;
+    for (int d = ndim - 1; d >= 0; --d) {
+        if (shape[d] != 1 && strides[d] != expected) return false;
+        expected *= shape[d];
+    }
+    return true;
+}
 
-    //MatrixMultiplyKernelBased(input1, shape1, input2, shape2, output, &matrixMultNaiveKernelSource);
+ShapeCompatibility CheckShapeCompatibility(const TensorRef& input1, const TensorRef& input2, OperationType opType) {
+    const int* shape = input1.shape;
+    const int* aShape = input2.shape;
 
-    MatrixMultiplyKernelBased(input1, shape1, input2, shape2, output, &matrixMultTilingKernelSource);
-    return;
+    // for matrix multiplication
+    if (OperationType::MatrixMultiplication == opType) {
+        std::vector<int> outShape;
+        return MatmulShape(input1, input2, outShape) ? ShapeCompatibility::ColsRowsMatch : ShapeCompatibility::Incompatible;
+    }
+    // for all other operations
+    if (input1.ndim == input2.ndim && std::equal(shape, shape + input1.ndim, aShape)) return ShapeCompatibility::ShapeMatch;
+    std::vector<int> outShape;
+    if (BroadcastShapes(std::vector<int>(shape, shape + input1.ndim), std::vector<int>(aShape, aShape + input2.ndim), outShape)) {
+        return ShapeCompatibility::Broadcast;
+    }
+    return ShapeCompatibility::Incompatible;
 }
 
-/*************CPUOperation private *********************/
-void CPUOperation::OperationWithScalar(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-									std::vector<dataType>& output, OperationType opType) const {
-    // Check if input2 has exactly one element
-    if (input2.size() != 1) {
-        throw std::invalid_argument("Input2 must contain exactly one element for scalar operation.");
+bool MatmulShape(const TensorRef& input1, const TensorRef& input2, std::vector<int>& outShape) {
+    const int rank1 = input1.ndim, rank2 = input2.ndim;
+    if (rank1 < 2 || rank1 > 3 || rank2 < 2 || rank2 > 3) return false;
+    const int M = input1.shape[rank1 - 2], K = input1.shape[rank1 - 1];
+    const int K2 = input2.shape[rank2 - 2], N = input2.shape[rank2 - 1];
+    if (K != K2) return false;
+    if (rank1 == 2 && rank2 == 2) {
+        outShape = { M, N };
+        return true;
     }
+    const int batch1 = rank1 == 3 ? input1.shape[0] : 1;
+    const int batch2 = rank2 == 3 ? input2.shape[0] : 1;
+    if (batch1 != batch2 && batch1 != 1 && batch2 != 1) return false;
+    outShape = { batch1 == 1 ? batch2 : batch1, M, N };
+    return true;
+}
 
-    // Get the scalar value from input2
-    dataType scalar = input2[0];
-
-    // Get the number of elements in the input vector
-    size_t numElements = input1.size();
+TensorRef BatchEntry(const TensorRef& batch, int index) {
+    if (batch.ndim == 2) return batch;
+    TensorRef entry;
+    const int position = batch.shape[0] == 1 ? 0 : index;
+    entry.data = static_cast<unsigned char*>(batch.data) + (size_t)position * batch.strides[0] * DTypeSize(batch.dtype);
+    entry.dtype = batch.dtype;
+    entry.ndim = 2;
+    for (int d = 0; d < 2; ++d) {
+        entry.shape[d] = batch.shape[d + 1];
+        entry.strides[d] = batch.strides[d + 1];
+    }
+    return entry;
+}
 
-    // Check if the scalar value is NaN
-    if (std::isnan(scalar)) {
-        // If the scalar value is NaN, set all output elements to NaN
-        output.assign(input1.size(), std::numeric_limits<dataType>::quiet_NaN());
-        return;
+bool BroadcastShapes(const std::vector<int>& aShape, const std::vector<int>& bShape, std::vector<int>& outShape) {
+    size_t rank = std::max(aShape.size(), bShape.size());
+    outShape.assign(rank, 1);
+    for (size_t d = 0; d < rank; ++d) {
+        int a = d < rank - aShape.size() ? 1 : aShape[d - (rank - aShape.size())];
+        int b = d < rank - bShape.size() ? 1 : bShape[d - (rank - bShape.size())];
+        if (a != b && a != 1 && b != 1) return false;
+        outShape[d] = (a == 1) ? b : a;
     }
+    return true;
+}
 
-    // Resize the output vector to match the input size
-    output.resize(numElements);
+void BroadcastStrides(const TensorRef& operand, int outRank, int* strides) {
+    const int shift = outRank - operand.ndim;
+    for (int d = 0; d < outRank; ++d) {
+        const int od = d - shift;
+        strides[d] = (od < 0 || operand.shape[od] == 1) ? 0 : operand.strides[od];
+    }
+}
 
-    // Parallelize the operation using OpenMP
-    #pragma omp parallel for
-    for (size_t i = 0; i < numElements; ++i) {
-        // Check if the input1 value is NaN
-        if (std::isnan(input1[i])) {
-            // If input1 is NaN, set the output to NaN
-            output[i] = std::numeric_limits<dataType>::quiet_NaN();
+int CollapseDimensions(int ndim, int* shape, int* const* strides, int numOperands) {
+    // Drop size-1 dimensions: they do not move any operand
+    int rank = 0;
+    for (int d = 0; d < ndim; ++d) {
+        if (shape[d] == 1) continue;
+        shape[rank] = shape[d];
+        for (int k = 0; k < numOperands; ++k) strides[k][rank] = strides[k][d];
+        ++rank;
+    }
+    if (rank == 0) { // a single element
+        shape[0] = 1;
+        for (int k = 0; k < numOperands; ++k) strides[k][0] = 0;
+        return 1;
+    }
+    // Fold each dimension into the one before it when every operand steps over the inner
+    // dimension exactly once per outer step
+    int current = 0;
+    for (int d = 1; d < rank; ++d) {
+        bool mergeable = true;
+        for (int k = 0; k < numOperands && mergeable; ++k) {
+            mergeable = (long long)strides[k][current] == (long long)strides[k][d] * shape[d];
+        }
+        if (mergeable) {
+            shape[current] *= shape[d];
+            for (int k = 0; k < numOperands; ++k) strides[k][current] = strides[k][d];
         }
         else {
-            // Perform the operation element-wise
-            switch (opType) {
-            case OperationType::Addition:
-                output[i] = input1[i] + scalar;
-                break;
-            case OperationType::Subtraction:
-                output[i] = input1[i] - scalar;
-                break;
-            case OperationType::Multiplication:
-                output[i] = input1[i] * scalar;
-                break;
-            case OperationType::Division:
-                // Check for division by zero
-                if (scalar == 0) {
-                    // Handle division by zero gracefully
-                    output[i] = std::numeric_limits<dataType>::quiet_NaN();
-                }
-                else {
-                    output[i] = input1[i] / scalar;
-                }
-                break;
-            default:
-                // Handle unsupported operation
-                output[i] = std::numeric_limits<dataType>::quiet_NaN();
-                break;
-            }
+            ++current;
+            shape[current] = shape[d];
+            for (int k = 0; k < numOperands; ++k) strides[k][current] = strides[k][d];
         }
     }
+    return current + 1;
+}
+
+namespace {
+
+// Elementwise loops split the collapsed iteration space into chunks of at most this many elements
+// of one innermost run, and run serially below ElementwiseParallelThreshold elements
+constexpr int ElementwiseChunk = 4096;
+constexpr size_t ElementwiseParallelThreshold = 1 << 15;
+// Batched matrix products of fewer multiply-adds than this run on the calling thread
+constexpr long long BatchedGemmParallelThreshold = 64LL * 64 * 64;
+
+// Copy count elements between strided runs of the same element size
+template<class T>
+void CopyRun(const unsigned char* from, int fromStride, unsigned char* to, int toStride, int count) {
+    const T* src = reinterpret_cast<const T*>(from);
+    T* dst = reinterpret_cast<T*>(to);
+    for (int j = 0; j < count; ++j) {
+        dst[(size_t)j * toStride] = src[(size_t)j * fromStride];
+    }
 }
 
-void CPUOperation::OperationWithColVector(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-    std::vector<dataType>& output, OperationType opType) const {
+// Dense row-major copy of src converted to dtype, stored in buffer
+TensorRef DenseCopy(const TensorRef& src, DType dtype, std::vector<unsigned char>& buffer) {
+    TensorRef dense = src;
+    buffer.resize(src.numel() * DTypeSize(dtype));
+    dense.data = buffer.data();
+    dense.dtype = dtype;
+    int stride = 1;
+    for (int d = dense.ndim - 1; d >= 0; --d) {
+        dense.strides[d] = stride;
+        stride *= dense.shape[d];
+    }
+    CopyTensorRef(src, dense);
+    return dense;
+}
+
+// A reduction over one axis (or all of them) as one over the middle dimension of a dense
+// [outer, n, inner] array
+struct ReductionLayout {
+    int outer = 1;
+    int n = 1;
+    int inner = 1;
+};
 
-    // Get the number of rows and columns in the matrix
-    int numRows = static_cast<int>(input2.size());
-    int numCols = static_cast<int>(input1.size() / numRows);
-    
-    // Resize the output vector to match the size of the matrix
-    output.resize(input1.size());
+ReductionLayout GetReductionLayout(const TensorRef& input, int axis) {
+    ReductionLayout layout;
+    for (int d = 0; d < input.ndim; ++d) {
+        if (axis == AllAxes || d == axis) layout.n *= input.shape[d];
+        else if (d < axis) layout.outer *= input.shape[d];
+        else layout.inner *= input.shape[d];
+    }
+    return layout;
+}
+
+// Input as a dense array of dtype, copied into buffer unless it already is one
+TensorRef DenseReductionInput(const TensorRef& input, DType dtype, std::vector<unsigned char>& buffer) {
+    if (input.dtype == dtype && input.isContiguous()) return input;
+    return DenseCopy(input, dtype, buffer);
+}
+
+// Write the per-run results (outer x inner, row-major) into output, converting to its dtype.
+// Mean divides the sums by n.
+void StoreReduction(std::vector<double>& values, std::vector<int>& indices, int n, ReductionType type,
+    const TensorRef& output) {
+    TensorRef result = output;
+    int stride = 1;
+    for (int d = result.ndim - 1; d >= 0; --d) {
+        result.strides[d] = stride;
+        stride *= result.shape[d];
+    }
+    if (type == ReductionType::ArgMax) {
+        result.data = indices.data();
+        result.dtype = DType::int32;
+    }
+    else {
+        if (type == ReductionType::Mean) {
+            for (double& value : values) value /= n; // 0 / 0 gives NaN for an empty axis
+        }
+        result.data = values.data();
+        result.dtype = DType::float64;
+    }
+    CopyTensorRef(result, output);
+}
 
-    // Parallelize the operation using OpenMP
-    #pragma omp parallel for
-    for (int j = 0; j < numCols; ++j) {        
-        // Perform the operation element-wise for each column
-        for (int i = 0; i < numRows; ++i) {
+} // namespace
 
-            int rowStartIdx = i * numCols;
-            // Calculate the index of the current element in the output matrix
-            int outputIdx = rowStartIdx + j;
+void CopyTensorRef(const TensorRef& src, const TensorRef& dst) {
+    if (src.isContiguous() && dst.isContiguous()) {
+        ConvertElements(src.data, src.dtype, dst.data, dst.dtype, src.numel());
+        return;
+    }
+    // Walk the leading dimensions with an index counter and copy the last dimension as a run
+    const int last = src.ndim - 1;
+    const int runLength = src.shape[last];
+    const size_t numRuns = src.numel() / (runLength > 0 ? runLength : 1);
+    if (runLength == 0) return;
+    const size_t srcSize = DTypeSize(src.dtype);
+    const size_t dstSize = DTypeSize(dst.dtype);
+    const int srcStride = src.strides[last];
+    const int dstStride = dst.strides[last];
 
-            if (std::isnan(input1[outputIdx]) || std::isnan(input2[i])) {
-                // If input1 or input2 is NaN, set the output to NaN
-                output[outputIdx] = std::numeric_limits<dataType>::quiet_NaN();
+    ThreadPool::Instance().ParallelFor(numRuns, numRuns > 64 ? 1 : numRuns, [&](size_t aBegin, size_t aEnd) {
+        for (size_t run = aBegin; run < aEnd; ++run) {
+            size_t remainder = run;
+            size_t srcOffset = 0, dstOffset = 0;
+            for (int d = last - 1; d >= 0; --d) {
+                int idx = (int)(remainder % src.shape[d]);
+                remainder /= src.shape[d];
+                srcOffset += (size_t)idx * src.strides[d];
+                dstOffset += (size_t)idx * dst.strides[d];
+            }
+            const unsigned char* from = src.as<unsigned char>() + srcOffset * srcSize;
+            unsigned char* to = dst.as<unsigned char>() + dstOffset * dstSize;
+            if (srcStride == 1 && dstStride == 1) {
+                ConvertElements(from, src.dtype, to, dst.dtype, runLength);
+            }
+            else if (src.dtype == dst.dtype) {
+                if (srcSize == 8) CopyRun<uint64_t>(from, srcStride, to, dstStride, runLength);
+                else if (srcSize == 4) CopyRun<uint32_t>(from, srcStride, to, dstStride, runLength);
+                else CopyRun<uint16_t>(from, srcStride, to, dstStride, runLength);
             }
             else {
-                switch (opType) {
-                case OperationType::Addition:
-                    output[outputIdx] = input1[outputIdx] + input2[i];
-                    break;
-                case OperationType::Subtraction:
-                    output[outputIdx] = input1[outputIdx] - input2[i];
-                    break;
-                case OperationType::Multiplication:
-                    output[outputIdx] = input1[outputIdx] * input2[i];
-                    break;
-                case OperationType::Division:
-                    // Check for division by zero
-                    if (input2[i] == 0) {
-                        // Handle division by zero gracefully
-                        output[outputIdx] = std::numeric_limits<dataType>::quiet_NaN();
-                    }
-                    else {
-                        output[outputIdx] = input1[outputIdx] / input2[i];
-                    }
-                    break;
-                default:
-                    // Handle unsupported operation
-                    output[outputIdx] = std::numeric_limits<dataType>::quiet_NaN();
-                    break;
+                for (int j = 0; j < runLength; ++j) {
+                    StoreElement(to, dst.dtype, (size_t)j * dstStride,
+                        LoadElement(from, src.dtype, (size_t)j * srcStride));
                 }
             }
         }
+    });
+}
+
+
+/*********** CPUOperation *************/
+
+void CPUOperation::performOperation(const TensorRef& input1, const TensorRef& input2,
+                                    const TensorRef& output, OperationType opType,
+                                    ShapeCompatibility) const {
+    if (input1.dtype != output.dtype || input2.dtype != output.dtype) {
+        throw std::invalid_argument("Operands must have the output's dtype.");
+    }
+    if (output.dtype == DType::float16 || output.dtype == DType::bfloat16) {
+        throw std::invalid_argument("float16 and bfloat16 operations run in the fused expression loop.");
+    }
+    // Every shape relation goes through the same broadcast loop; ShapeMatch is simply the case
+    // where no operand has a stride-0 dimension
+    ElementwiseBroadcast(input1, input2, output, opType);
+}
+
+void CPUOperation::Matrix2DMulitplication(const TensorRef& input1, const TensorRef& input2,
+    const TensorRef& output, const MatmulEpilogue& epilogue) {
+
+    // float64 and int32 run in DgemmCPU (int32 sums are exact up to 2^53); float32, float16 and
+    // bfloat16 run in SgemmCPU, so the 16-bit formats accumulate in float32.
+    const DType gemmType = (output.dtype == DType::float64 || output.dtype == DType::int32)
+        ? DType::float64 : DType::float32;
+
+    // Operands of the GEMM's type are consumed in place through their strides; the packing step
+    // gathers them into panels. Others are converted into dense temporaries first.
+    // The product of another dtype is staged in uninitialized storage, whose pages the GEMM's
+    // threads touch first, rather than in a buffer zero-filled on this thread.
+    std::vector<unsigned char> bufferA, bufferB, bufferBias;
+    const TensorRef A = input1.dtype == gemmType ? input1 : DenseCopy(input1, gemmType, bufferA);
+    const TensorRef B = input2.dtype == gemmType ? input2 : DenseCopy(input2, gemmType, bufferB);
+    TensorRef bias = epilogue.bias;
+    if (bias.data && (bias.dtype != gemmType || bias.strides[0] != 1)) {
+        bias = DenseCopy(bias, gemmType, bufferBias);
+    }
+    TensorRef C = output;
+    TensorStorage bufferC(output.dtype != gemmType ? output.numel() * DTypeSize(gemmType) : 0, StorageInit::Uninitialized);
+    if (output.dtype != gemmType) {
+        C.data = bufferC.data();
+        C.dtype = gemmType;
+        C.strides[0] = output.shape[1];
+        C.strides[1] = 1;
+    }
+
+    if (gemmType == DType::float64) {
+        DgemmCPU(A.shape[0], B.shape[1], A.shape[1],
+            A.as<double>(), A.strides[0], A.strides[1],
+            B.as<double>(), B.strides[0], B.strides[1],
+            C.as<double>(), C.strides[0],
+            GemmEpilogue<double>{ bias.as<double>(), epilogue.scale, epilogue.activation });
+    }
+    else {
+        SgemmCPU(A.shape[0], B.shape[1], A.shape[1],
+            A.as<float>(), A.strides[0], A.strides[1],
+            B.as<float>(), B.strides[0], B.strides[1],
+            C.as<float>(), C.strides[0],
+            GemmEpilogue<float>{ bias.as<float>(), (float)epilogue.scale, epilogue.activation });
     }
+    if (C.data != output.data) {
+        CopyTensorRef(C, output); // round back to the output's dtype
+    }
+    return;
+}
+
+// Batches of at least as many entries as threads are shared out over the pool, one entry at a
+// time, each in a serial GEMM (the GEMM's own loops are nested in the job and so run inline).
+// Smaller batches run their entries one after the other, each GEMM using every thread.
+void CPUOperation::BatchedMatrixMultiplication(const TensorRef* inputs1, const TensorRef* inputs2,
+    const TensorRef* outputs, int batch, const MatmulEpilogue& epilogue) {
+    const long long work = (long long)batch * outputs[0].shape[0] * outputs[0].shape[1] * inputs1[0].shape[1];
+    const bool acrossEntries = batch >= ThreadPool::Instance().Threads() && work >= BatchedGemmParallelThreshold;
+    ThreadPool::Instance().ParallelFor(batch, acrossEntries ? 1 : batch, [&](size_t aBegin, size_t aEnd) {
+        for (size_t i = aBegin; i < aEnd; ++i) {
+            Matrix2DMulitplication(inputs1[i], inputs2[i], outputs[i], epilogue);
+        }
+    });
 }
 
-void CPUOperation::OperationWithRowVector(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-    std::vector<dataType>& output, OperationType opType) const {
+// input2 is read in place when it is float32 with contiguous rows, and densified otherwise
+void CPUOperation::SparseMatrixMultiplication(const CSRRef& input1, const TensorRef& input2,
+    const TensorRef& output) {
+    std::vector<unsigned char> buffer;
+    const TensorRef B = (input2.dtype == DType::float32 && input2.strides[1] == 1)
+        ? input2 : DenseCopy(input2, DType::float32, buffer);
+    SpmmCPU(input1, B.as<float>(), B.strides[0], output.as<float>(), output.strides[0], output.shape[1]);
+}
 
-    // Get the number of rows and columns in the matrix
-    int numCols = static_cast<int>(input2.size());
-    int numRows = static_cast<int>(input1.size() / numCols);
+/*************CPUOperation private *********************/
+
+// Operands of any rank are read through their broadcast strides over the output's shape. After
+// CollapseDimensions the iteration space is usually one or two dimensions with the output's
+// innermost dimension last, so every chunk walks memory in order. Chunks of the innermost run are
+// shared out over the thread pool, and each chunk is one call of a kernel specialized for opType.
+void CPUOperation::ElementwiseBroadcast(const TensorRef& input1, const TensorRef& input2,
+    const TensorRef& output, OperationType opType) const {
+    const size_t numel = output.numel();
+    if (numel == 0) return;
+    const ElementwiseKernel kernel = SelectElementwiseKernel(opType, output.dtype);
+    if (kernel == nullptr) {
+        throw std::invalid_argument("Unsupported elementwise operation.");
+    }
 
-    // Resize the output vector to match the size of the matrix
-    output.resize(input1.size());
+    int shape[TensorRef::MaxDims];
+    int strides1[TensorRef::MaxDims], strides2[TensorRef::MaxDims], stridesOut[TensorRef::MaxDims];
+    std::copy(output.shape, output.shape + output.ndim, shape);
+    std::copy(output.strides, output.strides + output.ndim, stridesOut);
+    BroadcastStrides(input1, output.ndim, strides1);
+    BroadcastStrides(input2, output.ndim, strides2);
+    int* strides[3] = { stridesOut, strides1, strides2 };
+    const int rank = CollapseDimensions(output.ndim, shape, strides, 3);
 
-    // Parallelize the operation using OpenMP
-    #pragma omp parallel for
-    for (int i = 0; i < numRows; ++i) {
-        int rowStartIdx = i * numCols;
-        // Perform the operation element-wise for each column
-        for (int j = 0; j < numCols; ++j) {
-            // Calculate the index of the current element in the output matrix
-            int outputIdx = rowStartIdx + j;
+    const int last = rank - 1;
+    const int runLength = shape[last];
+    const long long numRuns = (long long)(numel / runLength);
+    const int chunksPerRun = (runLength + ElementwiseChunk - 1) / ElementwiseChunk;
+    const long long numChunks = numRuns * chunksPerRun;
+    const int step1 = strides1[last], step2 = strides2[last], stepOut = stridesOut[last];
+    const size_t elementSize = DTypeSize(output.dtype);
+    const unsigned char* base1 = static_cast<const unsigned char*>(input1.data);
+    const unsigned char* base2 = static_cast<const unsigned char*>(input2.data);
+    unsigned char* baseOut = static_cast<unsigned char*>(output.data);
 
-            if (std::isnan(input1[outputIdx]) || std::isnan(input2[j])) {
-                // If input1 or input2 is NaN, set the output to NaN
-                output[outputIdx] = std::numeric_limits<dataType>::quiet_NaN();
+    const size_t grain = numel >= ElementwiseParallelThreshold ? 1 : (size_t)numChunks;
+    ThreadPool::Instance().ParallelFor((size_t)numChunks, grain, [&](size_t aBegin, size_t aEnd) {
+        for (long long chunk = (long long)aBegin; chunk < (long long)aEnd; ++chunk) {
+            long long run = chunk / chunksPerRun;
+            const int start = (int)(chunk % chunksPerRun) * ElementwiseChunk;
+            const int count = std::min(ElementwiseChunk, runLength - start);
+
+            // Locate the chunk in each operand from the coordinates of its run
+            size_t offset1 = (size_t)start * step1, offset2 = (size_t)start * step2, offsetOut = (size_t)start * stepOut;
+            for (int d = last - 1; d >= 0; --d) {
+                const int idx = (int)(run % shape[d]);
+                run /= shape[d];
+                offset1 += (size_t)idx * strides1[d];
+                offset2 += (size_t)idx * strides2[d];
+                offsetOut += (size_t)idx * stridesOut[d];
             }
-            else {
-                switch (opType) {
-                case OperationType::Addition:
-                    output[outputIdx] = input1[outputIdx] + input2[j];
-                    break;
-                case OperationType::Subtraction:
-                    output[outputIdx] = input1[outputIdx] - input2[j];
-                    break;
-                case OperationType::Multiplication:
-                    output[outputIdx] = input1[outputIdx] * input2[j];
-                    break;
-                case OperationType::Division:
-                    // Check for division by zero
-                    if (input2[j] == 0) {
-                        // Handle division by zero gracefully
-                        output[outputIdx] = std::numeric_limits<dataType>::quiet_NaN();
-                    }
-                    else {
-                        output[outputIdx] = input1[outputIdx] / input2[j];
-                    }
-                    break;
-                default:
-                    // Handle unsupported operation
-                    output[outputIdx] = std::numeric_limits<dataType>::quiet_NaN();
-                    break;
-                }
+            kernel(base1 + offset1 * elementSize, step1, base2 + offset2 * elementSize, step2,
+                baseOut + offsetOut * elementSize, stepOut, count);
+        }
+    });
+}
+
+
+void CPUOperation::Reduce(const TensorRef& input, const TensorRef& output, ReductionType type, int axis) const {
+    ReductionScratch scratch;
+    Reduce(input, output, type, axis, scratch);
+}
+
+// 16-bit inputs are reduced from a float32 copy; views are made dense first
+void CPUOperation::Reduce(const TensorRef& input, const TensorRef& output, ReductionType type, int axis,
+    ReductionScratch& scratch) const {
+    const ReductionLayout layout = GetReductionLayout(input, axis);
+    const size_t numRuns = (size_t)layout.outer * layout.inner;
+    if (numRuns == 0) return;
+    if (layout.n == 0 && type != ReductionType::Sum && type != ReductionType::Mean) {
+        throw std::invalid_argument("Cannot take the maximum or minimum of an empty axis.");
+    }
+
+    const TensorRef dense = DenseReductionInput(input, ComputeDType(input.dtype), scratch.input);
+    scratch.values.resize(numRuns);
+    scratch.indices.resize(type == ReductionType::ArgMax ? numRuns : 0);
+    ReduceCPU(dense.data, dense.dtype, layout.outer, layout.n, layout.inner, type, scratch.values.data(),
+        scratch.indices.empty() ? nullptr : scratch.indices.data());
+    StoreReduction(scratch.values, scratch.indices, layout.n, type, output);
+}
+
+
+/*********** OpenCLOperation *************/
+
+namespace {
+
+// Build option selecting the operation of elementwiseKernelSource
+const char* OperationBuildOption(OperationType opType) {
+    switch (opType) {
+    case OperationType::Addition: return "-D OP_ADD";
+    case OperationType::Subtraction: return "-D OP_SUB";
+    case OperationType::Multiplication: return "-D OP_MUL";
+    case OperationType::Division: return "-D OP_DIV";
+    default: throw std::invalid_argument("Unsupported elementwise operation.");
+    }
+}
+
+// Build option selecting the reduction of reductionKernelSource (Mean is a sum divided on the host)
+const char* ReductionBuildOption(ReductionType type) {
+    switch (type) {
+    case ReductionType::Max: return "-D RED_MAX";
+    case ReductionType::Min: return "-D RED_MIN";
+    case ReductionType::ArgMax: return "-D RED_ARGMAX";
+    default: return "-D RED_SUM";
+    }
+}
+
+// Build option selecting the activation of the tiling kernel's epilogue
+const char* ActivationBuildOption(Activation activation) {
+    switch (activation) {
+    case Activation::ReLU: return "-D ACT_RELU";
+    case Activation::GELU: return "-D ACT_GELU";
+    case Activation::Tanh: return "-D ACT_TANH";
+    default: return "";
+    }
+}
+
+// The epilogue as the tiling kernel takes it, with the bias made a dense row of dtype in buffer
+// when it is not one already
+GemmKernelEpilogue KernelEpilogue(const MatmulEpilogue& epilogue, DType dtype, std::vector<unsigned char>& buffer) {
+    GemmKernelEpilogue kernelEpilogue;
+    if (epilogue.bias.data) {
+        const TensorRef bias = (epilogue.bias.dtype == dtype && epilogue.bias.strides[0] == 1)
+            ? epilogue.bias : DenseCopy(epilogue.bias, dtype, buffer);
+        kernelEpilogue.bias = bias.data;
+    }
+    kernelEpilogue.scale = (float)epilogue.scale;
+    kernelEpilogue.activationBuildOption = ActivationBuildOption(epilogue.activation);
+    return kernelEpilogue;
+}
+
+// Fold the parts partial results of each run from ReduceKernelBased, with the kernel's rules:
+// NaN first, then the larger (smaller) value, then the lower index
+void CombinePartials(ReductionType type, size_t numRuns, int parts, const std::vector<double>& partialValues,
+    const std::vector<int>& partialIndices, std::vector<double>& values, std::vector<int>& indices) {
+    const bool isMin = type == ReductionType::Min;
+    for (size_t run = 0; run < numRuns; ++run) {
+        double best = partialValues[run * parts];
+        int bestIndex = partialIndices[run * parts];
+        for (int p = 1; p < parts; ++p) {
+            const double v = partialValues[run * parts + p];
+            const int i = partialIndices[run * parts + p];
+            if (type == ReductionType::Sum || type == ReductionType::Mean) {
+                best += v;
+                continue;
+            }
+            const bool takes = std::isnan(best) ? std::isnan(v) && i < bestIndex
+                : std::isnan(v) || (isMin ? v < best : v > best) || (v == best && i < bestIndex);
+            if (takes) {
+                best = v;
+                bestIndex = i;
             }
         }
+        values[run] = best;
+        if (type == ReductionType::ArgMax) indices[run] = bestIndex;
     }
 }
 
-void CPUOperation::OperationWithSameShape(const std::vector<dataType>& input1, const std::vector<dataType>& input2,
-    std::vector<dataType>& output, OperationType opType) const {
+// Number of elements from the first to the last one reached by the (non-negative) strides
+size_t StridedSpan(int rank, const int* shape, const int* strides) {
+    size_t span = 1;
+    for (int d = 0; d < rank; ++d) span += (size_t)(shape[d] - 1) * strides[d];
+    return span;
+}
+
+} // namespace
 
-    // Resize the output vector to match the size of the matrix
-    output.resize(input1.size());
+// Same broadcast rules as CPUOperation. The iteration space is collapsed on the host: ShapeMatch
+// and scalar operands run the float8/double4 vector kernel, row, column and general broadcasts
+// the strided kernel.
+void OpenCLOperation::performOperation(const TensorRef& input1, const TensorRef& input2,
+                                    const TensorRef& output, OperationType opType,
+                                    ShapeCompatibility spCompat) const {
+    if (input1.dtype != output.dtype || input2.dtype != output.dtype) {
+        throw std::invalid_argument("Operands must have the output's dtype.");
+    }
+    if (output.dtype == DType::float16 || output.dtype == DType::bfloat16) {
+        throw std::invalid_argument("float16 and bfloat16 operations run in the fused expression loop.");
+    }
+    if (output.dtype == DType::float64 && !OpenCLRuntime::Instance().SupportsFP64()) {
+        return CPUOperation().performOperation(input1, input2, output, opType, spCompat);
+    }
+    const size_t numel = output.numel();
+    if (numel == 0) return;
 
-    // Parallelize the operation using OpenMP
-    #pragma omp parallel for
-    for (int i = 0; i < input1.size(); ++i) {
-        if (std::isnan(input1[i]) || std::isnan(input2[i])) {
-            // If input1 or input2 is NaN, set the output to NaN
-            output[i] = std::numeric_limits<dataType>::quiet_NaN();
+    // The device writes a dense result; a strided output (e.g. assignment into a column)
+    // receives it through a copy
+    std::vector<unsigned char> buffer;
+    TensorRef result = output;
+    if (!output.isContiguous()) {
+        buffer.resize(numel * DTypeSize(output.dtype));
+        result.data = buffer.data();
+        for (int d = output.ndim - 1, stride = 1; d >= 0; --d) {
+            result.strides[d] = stride;
+            stride *= output.shape[d];
         }
-        else {
-            switch (opType) {
-            case OperationType::Addition:
-                output[i] = input1[i] + input2[i];
-                break;
-            case OperationType::Subtraction:
-                output[i] = input1[i] - input2[i];
-                break;
-            case OperationType::Multiplication:
-                output[i] = input1[i] * input2[i];
-                break;
-            case OperationType::Division:
-                // Check for division by zero
-                if (input2[i] == 0) {
-                    // Handle division by zero gracefully
-                    output[i] = std::numeric_limits<dataType>::quiet_NaN();
-                }
-                else {
-                    output[i] = input1[i] / input2[i];
-                }
-                break;
-            default:
-                // Handle unsupported operation
-                output[i] = std::numeric_limits<dataType>::quiet_NaN();
-                break;
-            }
+    }
+
+    PendingKernelWork pending;
+    performOperationAsync(input1, input2, result, opType, pending);
+    pending.Wait();
+    if (result.data != output.data) {
+        CopyTensorRef(result, output);
+    }
+}
+
+bool OpenCLOperation::performOperationAsync(const TensorRef& input1, const TensorRef& input2,
+    const TensorRef& output, OperationType opType, PendingKernelWork& pending) const {
+    if (input1.dtype != output.dtype || input2.dtype != output.dtype || ComputeDType(output.dtype) != output.dtype ||
+        (output.dtype == DType::float64 && !OpenCLRuntime::Instance().SupportsFP64()) || !output.isContiguous()) {
+        return false;
+    }
+    if (output.numel() == 0) return true;
+
+    int shape[TensorRef::MaxDims];
+    int strides1[TensorRef::MaxDims], strides2[TensorRef::MaxDims], stridesOut[TensorRef::MaxDims];
+    std::copy(output.shape, output.shape + output.ndim, shape);
+    std::copy(output.strides, output.strides + output.ndim, stridesOut);
+    BroadcastStrides(input1, output.ndim, strides1);
+    BroadcastStrides(input2, output.ndim, strides2);
+    int* strides[3] = { stridesOut, strides1, strides2 };
+    const int rank = CollapseDimensions(output.ndim, shape, strides, 3);
+
+    ElementwiseKernelBased(rank, shape,
+        input1.data, strides1, StridedSpan(rank, shape, strides1),
+        input2.data, strides2, StridedSpan(rank, shape, strides2),
+        output.data, output.dtype, OperationBuildOption(opType), &elementwiseKernelSource, &pending);
+    return true;
+}
+
+void OpenCLOperation::Matrix2DMulitplication(const TensorRef& input1, const TensorRef& input2,
+    const TensorRef& output, const MatmulEpilogue& epilogue) {
+
+    // The kernel is built for the output's dtype. float64 needs cl_khr_fp64; devices without it
+    // multiply on the host, as do int32 products with an epilogue (it runs in floating point) and
+    // products with K = 0, whose output is only the epilogue of zeros (OpenCL has no empty buffers).
+    if ((output.dtype == DType::float64 && !OpenCLRuntime::Instance().SupportsFP64()) ||
+        (output.dtype == DType::int32 && !epilogue.IsIdentity()) || input1.shape[1] == 0) {
+        CPUOperation().Matrix2DMulitplication(input1, input2, output, epilogue);
+        return;
+    }
+
+    // The device needs each row to be contiguous and of the output's dtype. Row views and slices
+    // are uploaded row by row with their row stride; anything else (e.g. a column view, or an
+    // operand of another dtype) is gathered on the host first.
+    std::vector<unsigned char> packed1, packed2;
+    TensorRef A = input1;
+    TensorRef B = input2;
+    if (input1.strides[1] != 1 || input1.dtype != output.dtype) {
+        A = DenseCopy(input1, output.dtype, packed1);
+    }
+    if (input2.strides[1] != 1 || input2.dtype != output.dtype) {
+        B = DenseCopy(input2, output.dtype, packed2);
+    }
+
+    // Tile and micro-tile sizes come from the tuner; the kernel handles any M, K and N
+    const int M = input1.shape[0], K = input1.shape[1], N = input2.shape[1];
+    const GemmKernelConfig config = GemmTuner::Instance().Select(M, K, N, output.dtype);
+    std::vector<unsigned char> packedBias;
+    const GemmKernelEpilogue kernelEpilogue = KernelEpilogue(epilogue, output.dtype, packedBias);
+    MatrixMultiplyKernelBased(M, K, N, A.data, A.strides[0], B.data, B.strides[0],
+        output.data, output.strides[0], output.dtype, &matrixMultTilingKernelSource, &config,
+        epilogue.IsIdentity() ? nullptr : &kernelEpilogue);
+    return;
+}
+
+void OpenCLOperation::BatchedMatrixMultiplication(const TensorRef* inputs1, const TensorRef* inputs2,
+    const TensorRef* outputs, int batch, const MatmulEpilogue& epilogue) {
+    PendingKernelWork pending;
+    if (!BatchedMatrixMultiplicationAsync(inputs1, inputs2, outputs, batch, pending, epilogue)) {
+        CPUOperation().BatchedMatrixMultiplication(inputs1, inputs2, outputs, batch, epilogue);
+    }
+    pending.Wait();
+}
+
+bool OpenCLOperation::BatchedMatrixMultiplicationAsync(const TensorRef* inputs1, const TensorRef* inputs2,
+    const TensorRef* outputs, int batch, PendingKernelWork& pending, const MatmulEpilogue& epilogue) const {
+    const DType dtype = outputs[0].dtype;
+    if ((dtype == DType::float64 && !OpenCLRuntime::Instance().SupportsFP64()) ||
+        (dtype == DType::int32 && !epilogue.IsIdentity()) || inputs1[0].shape[1] == 0) {
+        return false;
+    }
+
+    // As for Matrix2DMulitplication, entries without contiguous rows of the output's dtype are
+    // gathered on the host. An entry repeating the previous one (a shared operand) reuses its copy.
+    std::vector<std::vector<unsigned char>> packed(2 * (size_t)batch);
+    std::vector<const void*> A(batch), B(batch);
+    std::vector<void*> C(batch);
+    std::vector<int> lda(batch), ldb(batch), ldc(batch);
+    auto prepare = [&](const TensorRef* inputs, int i, std::vector<unsigned char>& buffer,
+        std::vector<const void*>& pointers, std::vector<int>& ld) {
+        const TensorRef& input = inputs[i];
+        if (i > 0 && input.data == inputs[i - 1].data && input.dtype == inputs[i - 1].dtype &&
+            input.strides[0] == inputs[i - 1].strides[0] && input.strides[1] == inputs[i - 1].strides[1]) {
+            pointers[i] = pointers[i - 1];
+            ld[i] = ld[i - 1];
+            return;
+        }
+        TensorRef dense = input;
+        if (input.strides[1] != 1 || input.dtype != dtype) {
+            dense = DenseCopy(input, dtype, buffer);
         }
-        
+        pointers[i] = dense.data;
+        ld[i] = dense.shape[0] == 1 ? dense.shape[1] : dense.strides[0];
+    };
+    for (int i = 0; i < batch; ++i) {
+        prepare(inputs1, i, packed[2 * i], A, lda);
+        prepare(inputs2, i, packed[2 * i + 1], B, ldb);
+        C[i] = outputs[i].data;
+        ldc[i] = outputs[i].shape[0] == 1 ? outputs[i].shape[1] : outputs[i].strides[0];
+    }
+
+    const int M = inputs1[0].shape[0], K = inputs1[0].shape[1], N = inputs2[0].shape[1];
+    const GemmKernelConfig config = GemmTuner::Instance().Select(M, K, N, dtype);
+    std::vector<unsigned char> packedBias;
+    const GemmKernelEpilogue kernelEpilogue = KernelEpilogue(epilogue, dtype, packedBias);
+    BatchedMatrixMultiplyKernelBased(batch, M, K, N, A.data(), lda.data(), B.data(), ldb.data(),
+        C.data(), ldc.data(), dtype, &matrixMultTilingKernelSource, config, &pending,
+        epilogue.IsIdentity() ? nullptr : &kernelEpilogue);
+    // The uploads read the gathered copies until pending is done
+    packed.push_back(std::move(packedBias));
+    for (std::vector<unsigned char>& copy : packed) {
+        if (!copy.empty()) pending.hostBuffers.push_back(std::move(copy));
     }
+    return true;
+}
+
+// Work-group tree reductions on the device (reductionKernelSource); the partial results of long
+// runs are combined on the host. float64 without cl_khr_fp64 reduces on the host.
+void OpenCLOperation::Reduce(const TensorRef& input, const TensorRef& output, ReductionType type, int axis) const {
+    if (input.dtype == DType::float64 && !OpenCLRuntime::Instance().SupportsFP64()) {
+        return CPUOperation().Reduce(input, output, type, axis);
+    }
+    const ReductionLayout layout = GetReductionLayout(input, axis);
+    const size_t numRuns = (size_t)layout.outer * layout.inner;
+    if (numRuns == 0) return;
+    if (layout.n == 0) {
+        // Nothing for the device to do; the host handles the empty sum and the error
+        return CPUOperation().Reduce(input, output, type, axis);
+    }
+
+    std::vector<unsigned char> buffer;
+    const TensorRef dense = DenseReductionInput(input, input.dtype, buffer);
+    std::vector<double> partialValues;
+    std::vector<int> partialIndices;
+    const int parts = ReduceKernelBased(layout.outer, layout.n, layout.inner, dense.data, dense.dtype,
+        ReductionBuildOption(type), partialValues, partialIndices, &reductionKernelSource);
+
+    std::vector<double> values(numRuns);
+    std::vector<int> indices(type == ReductionType::ArgMax ? numRuns : 0);
+    CombinePartials(type, numRuns, parts, partialValues, partialIndices, values, indices);
+    StoreReduction(values, indices, layout.n, type, output);
+}
+
+// spmm_csr / spmv_csr (sparseKernelSource). The whole dense operand is uploaded, so B is first
+// made float32 with contiguous rows like for the CPU.
+void OpenCLOperation::SparseMatrixMultiplication(const CSRRef& input1, const TensorRef& input2,
+    const TensorRef& output) {
+    std::vector<unsigned char> buffer;
+    const TensorRef B = (input2.dtype == DType::float32 && input2.strides[1] == 1)
+        ? input2 : DenseCopy(input2, DType::float32, buffer);
+    SparseMatrixMultiplyKernelBased(input1.rows, input1.cols, output.shape[1],
+        input1.rowPointers, input1.columnIndices, input1.values,
+        B.as<float>(), B.strides[0], output.as<float>(), output.strides[0], &sparseKernelSource);
 }
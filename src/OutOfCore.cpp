@@ -0,0 +1,206 @@
+#include "OutOfCore.hpp"
+#include "dispatcher.h"
+#include "tracer.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point aStart) {
+	return std::chrono::duration<double>(Clock::now() - aStart).count();
+}
+
+[[noreturn]] void IOError(const char* aAction, const std::string& aPath) {
+	std::cerr << "Error: Cannot " << aAction << " " << aPath << "." << "\n";
+	std::exit(EXIT_FAILURE);
+}
+
+// Open a tensor file for panel reads
+TensorFileInfo OpenOperand(std::ifstream& aFile, const std::string& aPath) {
+	aFile.open(aPath, std::ios::binary);
+	if (!aFile) IOError("open the tensor file", aPath);
+	aFile.seekg(0, std::ios::end);
+	const uint64_t fileSize = (uint64_t)aFile.tellg();
+	aFile.seekg(0);
+	unsigned char header[TensorFileMaxHeaderBytes];
+	aFile.read(reinterpret_cast<char*>(header), sizeof(header));
+	const size_t available = (size_t)aFile.gcount();
+	aFile.clear(); // A small file ends before TensorFileMaxHeaderBytes
+	return ReadTensorFileInfo(header, available, fileSize, aPath);
+}
+
+TensorRef MatrixRef(void* aData, DType aDType, int aRows, int aCols) {
+	TensorRef matrix;
+	matrix.data = aData;
+	matrix.dtype = aDType;
+	matrix.ndim = 2;
+	matrix.shape[0] = aRows;
+	matrix.shape[1] = aCols;
+	matrix.strides[0] = aCols;
+	matrix.strides[1] = 1;
+	return matrix;
+}
+
+// Rows [row0, row0 + rows) and columns [col0, col0 + cols) of a row-major matrix with rowLength
+// columns stored at aDataOffset of a file: one transfer for whole rows, one per row otherwise
+template<class Transfer>
+void TransferBlock(uint64_t aDataOffset, int aRowLength, size_t aElementSize,
+	int row0, int rows, int col0, int cols, Transfer&& aTransfer) {
+	if (cols == aRowLength) {
+		aTransfer(aDataOffset + (uint64_t)row0 * aRowLength * aElementSize, (size_t)0, (size_t)rows * cols * aElementSize);
+		return;
+	}
+	for (int r = 0; r < rows; ++r) {
+		const uint64_t position = aDataOffset + ((uint64_t)(row0 + r) * aRowLength + col0) * aElementSize;
+		aTransfer(position, (size_t)r * cols * aElementSize, (size_t)cols * aElementSize);
+	}
+}
+
+} // namespace
+
+OutOfCoreStats matmulOutOfCore(const std::string& aPathA, const std::string& aPathB, const std::string& aPathC,
+	size_t aMemoryBudget) {
+	const Clock::time_point start = Clock::now();
+	std::ifstream fileA, fileB;
+	const TensorFileInfo infoA = OpenOperand(fileA, aPathA);
+	const TensorFileInfo infoB = OpenOperand(fileB, aPathB);
+	if (infoA.shape.size() != 2 || infoB.shape.size() != 2 || infoA.shape[1] != infoB.shape[0]) {
+		std::cerr << "Error: Out-of-core matmul needs [M, K] and [K, N] operands." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	OutOfCoreStats stats;
+	const int M = stats.M = infoA.shape[0];
+	const int K = stats.K = infoA.shape[1];
+	const int N = stats.N = infoB.shape[1];
+	const DType typeC = PromoteTypes(infoA.dtype, infoB.dtype);
+	const size_t sizeA = DTypeSize(infoA.dtype), sizeB = DTypeSize(infoB.dtype), sizeC = DTypeSize(typeC);
+
+	// C's file is created at full size up front, then filled panel by panel
+	uint64_t offsetC = 0;
+	{
+		std::ofstream created(aPathC, std::ios::binary | std::ios::trunc);
+		const TensorFileHeader header = WriteTensorFileHeader(created, typeC, { M, N });
+		offsetC = header.dataOffset;
+		if (!created) IOError("write the tensor file", aPathC);
+		created.close();
+		std::error_code ec;
+		std::filesystem::resize_file(aPathC, header.dataOffset + header.dataBytes, ec);
+		if (ec) IOError("write the tensor file", aPathC);
+	}
+	std::fstream fileC(aPathC, std::ios::binary | std::ios::in | std::ios::out);
+	if (!fileC) IOError("open the tensor file", aPathC);
+	if ((size_t)M * N * K == 0) {
+		stats.seconds = SecondsSince(start);
+		return stats;
+	}
+
+	// Panel sizes: all of B when it takes at most half the budget, else the widest column panel
+	// that does (a multiple of 64 columns when it can be); the rest is shared by two A panels
+	// and two C panels. Panels of 64 rows or more are multiples of 64.
+	const size_t columnBytes = (size_t)K * sizeB;
+	int panelCols = (int)std::min<size_t>(N, aMemoryBudget / 2 / columnBytes);
+	if (panelCols > 64 && panelCols < N) panelCols -= panelCols % 64;
+	const size_t panelBBytes = (size_t)panelCols * columnBytes;
+	const size_t rowBytes = 2 * ((size_t)K * sizeA + (size_t)panelCols * sizeC);
+	int panelRows = panelBBytes < aMemoryBudget ? (int)std::min<size_t>(M, (aMemoryBudget - panelBBytes) / rowBytes) : 0;
+	if (panelRows > 64 && panelRows < M) panelRows -= panelRows % 64;
+	if (panelCols < 1 || panelRows < 1) {
+		std::cerr << "Error: A memory budget of " << aMemoryBudget << " bytes cannot hold the panels of a matmul with K = "
+			<< K << "." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	stats.panelRows = panelRows;
+	stats.panelCols = panelCols;
+	stats.bufferBytes = panelBBytes + (size_t)panelRows * rowBytes;
+
+	std::vector<unsigned char> panelB(panelBBytes);
+	std::vector<unsigned char> panelsA[2] = { std::vector<unsigned char>((size_t)panelRows * K * sizeA),
+		std::vector<unsigned char>((size_t)panelRows * K * sizeA) };
+	std::vector<unsigned char> panelsC[2] = { std::vector<unsigned char>((size_t)panelRows * panelCols * sizeC),
+		std::vector<unsigned char>((size_t)panelRows * panelCols * sizeC) };
+
+	auto readBlock = [](std::ifstream& aFile, const std::string& aPath, const TensorFileInfo& aInfo, unsigned char* aBuffer,
+		int row0, int rows, int col0, int cols) {
+		const int rowLength = aInfo.shape[1];
+		TransferBlock(aInfo.dataOffset, rowLength, DTypeSize(aInfo.dtype), row0, rows, col0, cols,
+			[&](uint64_t aPosition, size_t aBufferOffset, size_t aBytes) {
+				aFile.seekg((std::streamoff)aPosition);
+				aFile.read(reinterpret_cast<char*>(aBuffer + aBufferOffset), (std::streamsize)aBytes);
+				if (!aFile) IOError("read the tensor file", aPath);
+			});
+		return (size_t)rows * cols * DTypeSize(aInfo.dtype);
+	};
+	auto writeBlock = [&](const unsigned char* aBuffer, int row0, int rows, int col0, int cols) {
+		TransferBlock(offsetC, N, sizeC, row0, rows, col0, cols,
+			[&](uint64_t aPosition, size_t aBufferOffset, size_t aBytes) {
+				fileC.seekp((std::streamoff)aPosition);
+				fileC.write(reinterpret_cast<const char*>(aBuffer + aBufferOffset), (std::streamsize)aBytes);
+				if (!fileC) IOError("write the tensor file", aPathC);
+			});
+		return (size_t)rows * cols * sizeC;
+	};
+
+	CPUOperation cpuPerformer;
+	OpenCLOperation openclPerformer;
+	const Device device = Dispatcher::Instance().SelectMatmul(panelRows, K, panelCols, 1, typeC);
+	OperationInterface& performer = device == Device::cpu
+		? static_cast<OperationInterface&>(cpuPerformer) : static_cast<OperationInterface&>(openclPerformer);
+	const int rowPanels = (M + panelRows - 1) / panelRows;
+	auto rowsOf = [&](int aPanel) { return std::min(panelRows, M - aPanel * panelRows); };
+
+	for (int col0 = 0; col0 < N; col0 += panelCols) {
+		const int cols = std::min(panelCols, N - col0);
+		Clock::time_point ioStart = Clock::now();
+		{
+			TraceScope trace("read_panel_b", Device::cpu);
+			stats.bytesRead += readBlock(fileB, aPathB, infoB, panelB.data(), 0, K, col0, cols);
+		}
+		stats.bytesRead += readBlock(fileA, aPathA, infoA, panelsA[0].data(), 0, rowsOf(0), 0, K);
+		const double firstReads = SecondsSince(ioStart);
+		stats.ioSeconds += firstReads;
+		stats.stallSeconds += firstReads;
+
+		// While panel p is multiplied, the I/O task writes C panel p - 1 and reads A panel p + 1
+		std::future<void> io;
+		for (int p = 0; p < rowPanels; ++p) {
+			if (io.valid()) {
+				const Clock::time_point wait = Clock::now();
+				io.get();
+				stats.stallSeconds += SecondsSince(wait);
+			}
+			io = std::async(std::launch::async, [&, p, col0, cols]() {
+				TraceScope trace("panel_io", Device::cpu);
+				const Clock::time_point begin = Clock::now();
+				if (p > 0) stats.bytesWritten += writeBlock(panelsC[(p - 1) % 2].data(), (p - 1) * panelRows, rowsOf(p - 1), col0, cols);
+				if (p + 1 < rowPanels) stats.bytesRead += readBlock(fileA, aPathA, infoA, panelsA[(p + 1) % 2].data(), (p + 1) * panelRows, rowsOf(p + 1), 0, K);
+				stats.ioSeconds += SecondsSince(begin);
+			});
+
+			const Clock::time_point compute = Clock::now();
+			TraceScope trace("matmul_panel", device);
+			const TensorRef a = MatrixRef(panelsA[p % 2].data(), infoA.dtype, rowsOf(p), K);
+			const TensorRef b = MatrixRef(panelB.data(), infoB.dtype, K, cols);
+			const TensorRef c = MatrixRef(panelsC[p % 2].data(), typeC, rowsOf(p), cols);
+			if (trace.Active()) trace.Input(a).Input(b).Output(c);
+			performer.Matrix2DMulitplication(a, b, c);
+			stats.computeSeconds += SecondsSince(compute);
+			++stats.panels;
+		}
+		io.get();
+		ioStart = Clock::now();
+		stats.bytesWritten += writeBlock(panelsC[(rowPanels - 1) % 2].data(), (rowPanels - 1) * panelRows, rowsOf(rowPanels - 1), col0, cols);
+		const double lastWrite = SecondsSince(ioStart);
+		stats.ioSeconds += lastWrite;
+		stats.stallSeconds += lastWrite;
+	}
+	fileC.flush();
+	if (!fileC) IOError("write the tensor file", aPathC);
+	stats.seconds = SecondsSince(start);
+	return stats;
+}
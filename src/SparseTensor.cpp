@@ -0,0 +1,312 @@
+#include "SparseTensor.hpp"
+#include "cpu_sparse.h"
+#include "dispatcher.h"
+#include "thread_pool.h"
+#include "tracer.h"
+#include <algorithm>
+#include <numeric>
+
+
+// Row grain of a loop over the rows of a rows x cols matrix: one chunk below SparseParallelThreshold
+static size_t RowGrain(int aRows, size_t aWork) {
+	return aWork >= SparseParallelThreshold ? 1 : (size_t)std::max(aRows, 1);
+}
+
+/*********SPARSE TENSOR CLASS************/
+
+// Constructors
+SparseTensor::SparseTensor() : rowPointers(1, 0) {}
+SparseTensor::SparseTensor(int aRows, int aCols) : rows(aRows), cols(aCols), rowPointers((size_t)std::max(aRows, 0) + 1, 0) {
+	if (aRows < 0 || aCols < 0) {
+		std::cerr << "Error: Sparse tensor dimensions must not be negative." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+}
+SparseTensor::SparseTensor(int aRows, int aCols, std::vector<int> aRowPointers, std::vector<int> aColumnIndices,
+	std::vector<float> aValues) : rows(aRows), cols(aCols), rowPointers(std::move(aRowPointers)),
+	columnIndices(std::move(aColumnIndices)), values(std::move(aValues)) {
+	if (aRows < 0 || aCols < 0) {
+		std::cerr << "Error: Sparse tensor dimensions must not be negative." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	if (rowPointers.size() != (size_t)rows + 1 || rowPointers[0] != 0 || (size_t)rowPointers[rows] != values.size() ||
+		columnIndices.size() != values.size()) {
+		std::cerr << "Error: CSR arrays do not match the number of rows and nonzeros." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	for (int r = 0; r < rows; ++r) {
+		if (rowPointers[r + 1] < rowPointers[r]) {
+			std::cerr << "Error: CSR row pointers must not decrease." << "\n";
+			std::exit(EXIT_FAILURE);
+		}
+		for (int k = rowPointers[r]; k < rowPointers[r + 1]; ++k) {
+			const bool ascending = k == rowPointers[r] || columnIndices[k] > columnIndices[k - 1];
+			if (columnIndices[k] < 0 || columnIndices[k] >= cols || !ascending) {
+				std::cerr << "Error: CSR column indices must be in range and ascending within each row." << "\n";
+				std::exit(EXIT_FAILURE);
+			}
+		}
+	}
+}
+
+// Conversions
+SparseTensor SparseTensor::fromCOO(int aRows, int aCols, const std::vector<int>& aRowIndices,
+	const std::vector<int>& aColumnIndices, const std::vector<float>& aValues) {
+	if (aRowIndices.size() != aValues.size() || aColumnIndices.size() != aValues.size()) {
+		std::cerr << "Error: COO index and value arrays must have the same length." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	SparseTensor result(aRows, aCols);
+	for (size_t i = 0; i < aValues.size(); ++i) {
+		if (aRowIndices[i] < 0 || aRowIndices[i] >= aRows || aColumnIndices[i] < 0 || aColumnIndices[i] >= aCols) {
+			std::cerr << "Error: COO index out of range." << "\n";
+			std::exit(EXIT_FAILURE);
+		}
+		++result.rowPointers[aRowIndices[i] + 1];
+	}
+
+	// Bucket the triplets by row (a counting sort), then sort each row by column and merge repeats
+	std::partial_sum(result.rowPointers.begin(), result.rowPointers.end(), result.rowPointers.begin());
+	std::vector<int> next(result.rowPointers.begin(), result.rowPointers.end() - 1);
+	std::vector<std::pair<int, float>> entries(aValues.size());
+	for (size_t i = 0; i < aValues.size(); ++i) {
+		entries[next[aRowIndices[i]]++] = { aColumnIndices[i], aValues[i] };
+	}
+	result.columnIndices.reserve(entries.size());
+	result.values.reserve(entries.size());
+	int begin = 0;
+	for (int r = 0; r < aRows; ++r) {
+		const int end = result.rowPointers[r + 1];
+		std::stable_sort(entries.begin() + begin, entries.begin() + end,
+			[](const std::pair<int, float>& a, const std::pair<int, float>& b) { return a.first < b.first; });
+		for (int k = begin; k < end; ++k) {
+			if (k > begin && entries[k].first == result.columnIndices.back()) {
+				result.values.back() += entries[k].second;
+			}
+			else {
+				result.columnIndices.push_back(entries[k].first);
+				result.values.push_back(entries[k].second);
+			}
+		}
+		begin = end;
+		result.rowPointers[r + 1] = (int)result.values.size();
+	}
+	return result;
+}
+
+// Two passes over the rows, both shared out over the thread pool: count each row's nonzeros, then
+// (after a prefix sum gives the row pointers) gather them
+SparseTensor SparseTensor::fromDense(const Tensor& aDense) {
+	if (aDense.shape.size() != 2) {
+		std::cerr << "Error: Only 2-D tensors convert to sparse tensors." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	Tensor converted;
+	TensorRef dense = aDense.ref();
+	if (dense.dtype != DType::float32) {
+		converted = aDense.astype(DType::float32);
+		dense = converted.ref();
+	}
+	SparseTensor result(dense.shape[0], dense.shape[1]);
+	const int numRows = result.rows, numCols = result.cols;
+	const int rowStride = dense.strides[0], colStride = dense.strides[1];
+	const float* data = dense.as<float>();
+	const size_t grain = RowGrain(numRows, (size_t)numRows * numCols);
+
+	ThreadPool::Instance().ParallelFor(numRows, grain, [&](size_t aBegin, size_t aEnd) {
+		for (size_t r = aBegin; r < aEnd; ++r) {
+			const float* row = data + r * rowStride;
+			int count = 0;
+			for (int c = 0; c < numCols; ++c) count += row[(size_t)c * colStride] != 0.0f;
+			result.rowPointers[r + 1] = count;
+		}
+	});
+	std::partial_sum(result.rowPointers.begin(), result.rowPointers.end(), result.rowPointers.begin());
+	result.columnIndices.resize(result.rowPointers[numRows]);
+	result.values.resize(result.rowPointers[numRows]);
+	ThreadPool::Instance().ParallelFor(numRows, grain, [&](size_t aBegin, size_t aEnd) {
+		for (size_t r = aBegin; r < aEnd; ++r) {
+			const float* row = data + r * rowStride;
+			int k = result.rowPointers[r];
+			for (int c = 0; c < numCols; ++c) {
+				const float v = row[(size_t)c * colStride];
+				if (v != 0.0f) {
+					result.columnIndices[k] = c;
+					result.values[k++] = v;
+				}
+			}
+		}
+	});
+	return result;
+}
+
+Tensor SparseTensor::toDense() const {
+	Tensor dense({ rows, cols });
+	float* data = dense.ref().as<float>();
+	ThreadPool::Instance().ParallelFor(rows, RowGrain(rows, nnz()), [&](size_t aBegin, size_t aEnd) {
+		for (size_t r = aBegin; r < aEnd; ++r) {
+			for (int k = rowPointers[r]; k < rowPointers[r + 1]; ++k) {
+				data[r * cols + columnIndices[k]] = values[k];
+			}
+		}
+	});
+	return dense;
+}
+
+void SparseTensor::toCOO(std::vector<int>& aRowIndices, std::vector<int>& aColumnIndices, std::vector<float>& aValues) const {
+	aRowIndices.resize(nnz());
+	for (int r = 0; r < rows; ++r) {
+		std::fill(aRowIndices.begin() + rowPointers[r], aRowIndices.begin() + rowPointers[r + 1], r);
+	}
+	aColumnIndices = columnIndices;
+	aValues = values;
+}
+
+// Sparse-dense matrix multiplication
+Tensor SparseTensor::matmul(const Tensor& aDense) const {
+	const size_t rank = aDense.shape.size();
+	if ((rank != 1 && rank != 2) || aDense.shape[0] != cols) {
+		std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	const int N = rank == 2 ? aDense.shape[1] : 1;
+	Tensor result(rank == 2 ? std::vector<int>{ rows, N } : std::vector<int>{ rows }, DType::float32, StorageInit::Uninitialized);
+
+	// A vector is multiplied as a [cols, 1] matrix
+	TensorRef B = aDense.ref();
+	TensorRef C = result.ref();
+	for (TensorRef* operand : { &B, &C }) {
+		if (operand->ndim == 1) {
+			operand->ndim = 2;
+			operand->shape[1] = 1;
+			operand->strides[1] = 1;
+		}
+	}
+
+	const Device device = Dispatcher::Instance().SelectSparseMatmul(nnz(), rows, cols, N);
+	TraceScope trace(N == 1 ? "spmv" : "spmm", device);
+	if (trace.Active()) trace.Input(aDense.ref()).Output(result.ref()).Arg("nnz", (long long)nnz());
+	if (device == Device::cpu) {
+		CPUOperation().SparseMatrixMultiplication(ref(), B, C);
+	}
+	else {
+		OpenCLOperation().SparseMatrixMultiplication(ref(), B, C);
+	}
+	return result;
+}
+
+// Elementwise operations
+template<class F>
+SparseTensor SparseTensor::MapValues(const Tensor& aDense, F aOp) const {
+	std::vector<int> outShape;
+	if (!BroadcastShapes(getShape(), aDense.shape, outShape) || outShape != getShape()) {
+		std::cerr << "Error: Operand tensor's shape does not broadcast to the sparse tensor's." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	Tensor converted;
+	TensorRef dense = aDense.ref();
+	if (dense.dtype != DType::float32) {
+		converted = aDense.astype(DType::float32);
+		dense = converted.ref();
+	}
+	int strides[2];
+	BroadcastStrides(dense, 2, strides);
+	const float* data = dense.as<float>();
+
+	SparseTensor result = *this;
+	ThreadPool::Instance().ParallelFor(rows, RowGrain(rows, nnz()), [&](size_t aBegin, size_t aEnd) {
+		for (size_t r = aBegin; r < aEnd; ++r) {
+			const float* row = data + r * strides[0];
+			for (int k = rowPointers[r]; k < rowPointers[r + 1]; ++k) {
+				result.values[k] = aOp(values[k], row[(size_t)columnIndices[k] * strides[1]]);
+			}
+		}
+	});
+	return result;
+}
+
+SparseTensor SparseTensor::multiply(const Tensor& aDense) const {
+	TraceScope trace("sparse_mul");
+	return MapValues(aDense, [](float a, float b) { return a * b; });
+}
+
+SparseTensor SparseTensor::divide(const Tensor& aDense) const {
+	TraceScope trace("sparse_div");
+	return MapValues(aDense, [](float a, float b) { return a / b; });
+}
+
+SparseTensor SparseTensor::multiply(float aScalar) const {
+	SparseTensor result = *this;
+	for (float& v : result.values) v *= aScalar;
+	return result;
+}
+
+SparseTensor SparseTensor::divide(float aScalar) const {
+	SparseTensor result = *this;
+	for (float& v : result.values) v /= aScalar;
+	return result;
+}
+
+// The dense operand is broadcast into a fresh tensor by the dense elementwise operations, and the
+// nonzeros are then added in, so only nnz elements are touched twice
+Tensor SparseTensor::DenseCombination(const Tensor& aDense, float aDenseSign, float aSparseSign) const {
+	std::vector<int> outShape;
+	if (!BroadcastShapes(getShape(), aDense.shape, outShape) || outShape != getShape()) {
+		std::cerr << "Error: Operand tensor's shape does not broadcast to the sparse tensor's." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	Tensor result({ rows, cols });
+	if (aDenseSign > 0) result += aDense;
+	else result -= aDense;
+	float* data = result.ref().as<float>();
+	ThreadPool::Instance().ParallelFor(rows, RowGrain(rows, nnz()), [&](size_t aBegin, size_t aEnd) {
+		for (size_t r = aBegin; r < aEnd; ++r) {
+			for (int k = rowPointers[r]; k < rowPointers[r + 1]; ++k) {
+				data[r * cols + columnIndices[k]] += aSparseSign * values[k];
+			}
+		}
+	});
+	return result;
+}
+
+Tensor SparseTensor::add(const Tensor& aDense) const {
+	return DenseCombination(aDense, 1.0f, 1.0f);
+}
+
+Tensor SparseTensor::subtract(const Tensor& aDense) const {
+	return DenseCombination(aDense, -1.0f, 1.0f);
+}
+
+// Utility functions
+double SparseTensor::density() const {
+	const double elements = (double)rows * cols;
+	return elements > 0 ? nnz() / elements : 0.0;
+}
+
+size_t SparseTensor::memoryBytes() const {
+	return rowPointers.size() * sizeof(int) + columnIndices.size() * sizeof(int) + values.size() * sizeof(float);
+}
+
+CSRRef SparseTensor::ref() const {
+	CSRRef csr;
+	csr.rows = rows;
+	csr.cols = cols;
+	csr.rowPointers = rowPointers.data();
+	csr.columnIndices = columnIndices.data();
+	csr.values = values.data();
+	return csr;
+}
+
+
+/*********OPERATORS************/
+
+SparseTensor operator*(const SparseTensor& a, const Tensor& b) { return a.multiply(b); }
+SparseTensor operator*(const Tensor& a, const SparseTensor& b) { return b.multiply(a); }
+SparseTensor operator*(const SparseTensor& a, float b) { return a.multiply(b); }
+SparseTensor operator*(float a, const SparseTensor& b) { return b.multiply(a); }
+SparseTensor operator/(const SparseTensor& a, const Tensor& b) { return a.divide(b); }
+SparseTensor operator/(const SparseTensor& a, float b) { return a.divide(b); }
+Tensor operator+(const SparseTensor& a, const Tensor& b) { return a.add(b); }
+Tensor operator+(const Tensor& a, const SparseTensor& b) { return b.add(a); }
+Tensor operator-(const SparseTensor& a, const Tensor& b) { return a.subtract(b); }
+Tensor operator-(const Tensor& a, const SparseTensor& b) { return b.DenseCombination(a, 1.0f, -1.0f); }
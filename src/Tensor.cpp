@@ -1,18 +1,22 @@
 #include "Tensor.hpp"
+#include "dispatcher.h"
+#include "tracer.h"
+#include "TensorGraph.hpp"
 #include <memory> // Include the memory header for std::shared_ptr
+#include <cstring>
+#include <algorithm>
 
 
 /*********TENSOR CLASS************/
 
 // Constructors
-Tensor::Tensor(const std::vector<int>& aShape) {
-	shape = aShape;
+Tensor::Tensor() : storage(std::make_shared<TensorStorage>()) {}
+Tensor::Tensor(const std::vector<int>& aShape, DType aDType) : Tensor(aShape, aDType, StorageInit::Zero) {}
+Tensor::Tensor(const std::vector<int>& aShape, DType aDType, StorageInit aInit) : shape(aShape), strides(ContiguousStrides(aShape)), dtype(aDType) {
+	storage = std::make_shared<TensorStorage>((size_t)numel() * DTypeSize(dtype), aInit);
 }
-Tensor::Tensor(const std::vector<int>& aShape, const std::vector<float>& aData) : shape(aShape), data(aData) { // list initilaization
-	if (std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>()) != data.size()) {
-		std::cerr << "Error: Shape and data size do not match." << "\n";
-		std::exit(EXIT_FAILURE);
-	}
+Tensor::Tensor(const std::vector<int>& aShape, const std::vector<float>& aData) : shape(aShape), strides(ContiguousStrides(aShape)) { // list initilaization
+	InitFromData(aData.data(), DType::float32, aData.size());
 }
 Tensor::Tensor(const std::vector<std::vector<float>>& aData) {
 	if (aData.empty()) {
@@ -30,41 +34,64 @@ Tensor::Tensor(const std::vector<std::vector<float>>& aData) {
 	}
 
 	this->shape = { rows, cols };
-	this->data.reserve(rows * cols);
+	this->strides = ContiguousStrides(this->shape);
+	this->storage = std::make_shared<TensorStorage>((size_t)rows * cols * sizeof(float), StorageInit::Uninitialized);
+	float* flat = reinterpret_cast<float*>(this->storage->data());
 	for (auto& row : aData) {
-		this->data.insert(this->data.end(), row.begin(), row.end()); // Flatten the 2D vector into 1D and store it in data
+		flat = std::copy(row.begin(), row.end(), flat); // Flatten the 2D vector into 1D and store it in data
 	}
 }
+// View constructor
+Tensor::Tensor(std::shared_ptr<TensorStorage> aStorage, size_t aOffset, DType aDType,
+	const std::vector<int>& aShape, const std::vector<int>& aStrides)
+	: shape(aShape), strides(aStrides), offset(aOffset), dtype(aDType), storage(std::move(aStorage)) {}
 
 // Copy constructor and copy assignment operator
-Tensor::Tensor(const Tensor& aTensor) : shape(aTensor.shape), data(aTensor.data) {} // list initilaization
+// A copy owns dense, row-major storage even when the source is a strided view
+Tensor::Tensor(const Tensor& aTensor) : shape(aTensor.shape), strides(ContiguousStrides(aTensor.shape)), dtype(aTensor.dtype) {
+	storage = std::make_shared<TensorStorage>((size_t)aTensor.numel() * DTypeSize(dtype), StorageInit::Uninitialized);
+	CopyFrom(aTensor);
+}
 Tensor& Tensor::operator=(const Tensor& aTensor) {
-	shape = aTensor.shape;
-	data = aTensor.data;
+	if (this != &aTensor) {
+		*this = Tensor(aTensor); // deep copy, then move in
+	}
 	return *this;
 }
 
 // Move constructor and move assignment operator
 // && indicates that "aTemp" is an r-value reference. 
 // Transfers resources from temporary "aTemp" to current object without copying
-Tensor::Tensor(Tensor&& aTemp) noexcept : shape(std::move(aTemp.shape)), data(std::move(aTemp.data)) {}
+Tensor::Tensor(Tensor&& aTemp) noexcept : shape(std::move(aTemp.shape)), strides(std::move(aTemp.strides)),
+	offset(aTemp.offset), dtype(aTemp.dtype), storage(std::move(aTemp.storage)) {}
 Tensor& Tensor::operator=(Tensor&& aTemp) noexcept {
 	if (this != &aTemp) { // Check for self-assignment
 		shape = std::move(aTemp.shape);
-		data = std::move(aTemp.data);
+		strides = std::move(aTemp.strides);
+		offset = aTemp.offset;
+		dtype = aTemp.dtype;
+		storage = std::move(aTemp.storage);
 	}
 	return *this;
 }
 
 // Indexing: Access and Modify
 // single value
-float& Tensor::operator()(int i, int j) {
+ElementRef Tensor::operator()(int i, int j) {
 	// for non-const Tensor
-	return data[i * shape[1] + j];
+	size_t index = offset + (size_t)i * strides[0] + (size_t)j * strides[1];
+	return ElementRef(storage->data() + index * DTypeSize(dtype), dtype);
 }
-const float& Tensor::operator()(int i, int j) const {
+double Tensor::operator()(int i, int j) const {
 	// for const Tensor
-	return data[i * shape[1] + j];
+	return LoadElement(storage->data(), dtype, offset + (size_t)i * strides[0] + (size_t)j * strides[1]);
+}
+// any rank
+ElementRef Tensor::at(const std::vector<int>& aIndex) {
+	return ElementRef(storage->data() + ElementOffset(aIndex) * DTypeSize(dtype), dtype);
+}
+double Tensor::at(const std::vector<int>& aIndex) const {
+	return LoadElement(storage->data(), dtype, ElementOffset(aIndex));
 }
 // Methods to get a proxy for row or column access
 TensorAccessProxy Tensor::operator()(int index, const All&) {
@@ -80,131 +107,295 @@ TensorAccessProxy Tensor::operator()(Slice rowSlice, Slice colSlice) {
 		TensorAccessProxy::AccessMode::Submatrix);
 }
 
-// Tensor operations
-Tensor Tensor::operator+(const Tensor& aTensor) const {
-	ShapeCompatibility curCompatability = CheckShapeCompatibility(aTensor, OperationType::Addition);
-	if (ShapeCompatibility::Incompatible == curCompatability) {
+// Matrix multiplication
+Tensor Tensor::matmul(const Tensor& aTensor) const {
+	std::vector<int> productShape;
+	if (!MatmulShape(this->ref(), aTensor.ref(), productShape)) {
 		std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
 		std::exit(EXIT_FAILURE);
 	}
 
-	std::shared_ptr<OperationInterface> OperationPerformer;
-	std::vector<dataType> answer;
-	if (UseDevice == Device::cpu) {
-		OperationPerformer = std::make_shared<CPUOperation>();
-		OperationPerformer->performOperation(this->data, aTensor.data,
-			answer, OperationType::Addition, curCompatability);
+	Tensor answer(productShape, PromoteTypes(this->dtype, aTensor.dtype), StorageInit::Uninitialized);
+	::matmul(*this, aTensor, answer);
+	return answer;
+}
 
-		return Tensor(this->shape, answer);
+Tensor Tensor::matmul(const Tensor& aTensor, const Tensor& aBias, Activation aActivation, float aScale) const {
+	std::vector<int> productShape;
+	if (!MatmulShape(this->ref(), aTensor.ref(), productShape)) {
+		std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
+		std::exit(EXIT_FAILURE);
 	}
-	return *this;
+
+	Tensor answer(productShape, PromoteTypes(this->dtype, aTensor.dtype), StorageInit::Uninitialized);
+	MatmulInto(*this, aTensor, &aBias, aActivation, aScale, answer);
+	return answer;
 }
-Tensor Tensor::operator-(const Tensor& aTensor) const {
-	ShapeCompatibility curCompatability = CheckShapeCompatibility(aTensor, OperationType::Subtraction);
-	if (ShapeCompatibility::Incompatible == curCompatability) {
+
+Tensor Tensor::matmul(const Tensor& aTensor, Activation aActivation, float aScale) const {
+	std::vector<int> productShape;
+	if (!MatmulShape(this->ref(), aTensor.ref(), productShape)) {
 		std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
 		std::exit(EXIT_FAILURE);
 	}
 
-	std::shared_ptr<OperationInterface> OperationPerformer;
-	std::vector<dataType> answer;
-	if (UseDevice == Device::cpu) {
-		OperationPerformer = std::make_shared<CPUOperation>();
-		OperationPerformer->performOperation(this->data, aTensor.data,
-			answer, OperationType::Subtraction, curCompatability);
+	Tensor answer(productShape, PromoteTypes(this->dtype, aTensor.dtype), StorageInit::Uninitialized);
+	MatmulInto(*this, aTensor, nullptr, aActivation, aScale, answer);
+	return answer;
+}
 
-		return Tensor(this->shape, answer);
+// One batched operation on aDevice's backend
+static void RunBatchedMatmul(const std::vector<TensorRef>& a, const std::vector<TensorRef>& b,
+	const std::vector<TensorRef>& out, Device aDevice, const MatmulEpilogue& aEpilogue = MatmulEpilogue()) {
+	const int batch = static_cast<int>(out.size());
+	if (aDevice == Device::cpu) {
+		CPUOperation().BatchedMatrixMultiplication(a.data(), b.data(), out.data(), batch, aEpilogue);
+	}
+	else {
+		OpenCLOperation().BatchedMatrixMultiplication(a.data(), b.data(), out.data(), batch, aEpilogue);
 	}
-	return *this;
 }
-Tensor Tensor::operator*(const Tensor& aTensor) const {
-	ShapeCompatibility curCompatability = CheckShapeCompatibility(aTensor, OperationType::Multiplication);
-	if (ShapeCompatibility::Incompatible == curCompatability) {
-		std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
-		std::exit(EXIT_FAILURE);
+
+static const char* ActivationName(Activation aActivation) {
+	switch (aActivation) {
+	case Activation::ReLU: return "relu";
+	case Activation::GELU: return "gelu";
+	case Activation::Tanh: return "tanh";
+	default: return "none";
 	}
+}
 
-	std::shared_ptr<OperationInterface> OperationPerformer;
-	std::vector<dataType> answer;
-	if (UseDevice == Device::cpu) {
-		OperationPerformer = std::make_shared<CPUOperation>();
-		OperationPerformer->performOperation(this->data, aTensor.data,
-			answer, OperationType::Multiplication, curCompatability);
+void matmul(const Tensor& a, const Tensor& b, Tensor& aOut) {
+	Tensor::MatmulInto(a, b, nullptr, Activation::None, 1.0f, aOut);
+}
 
-		return Tensor(this->shape, answer);
-	}
-	return *this;
+void matmul(const Tensor& a, const Tensor& b, const Tensor& aBias, Tensor& aOut, Activation aActivation, float aScale) {
+	Tensor::MatmulInto(a, b, &aBias, aActivation, aScale, aOut);
 }
-Tensor Tensor::operator/(const Tensor& aTensor) const {
-	ShapeCompatibility curCompatability = CheckShapeCompatibility(aTensor, OperationType::Division);
-	if (ShapeCompatibility::Incompatible == curCompatability) {
+
+// The product is computed in (and rounded to) aOut's dtype, straight into aOut's storage
+void Tensor::MatmulInto(const Tensor& a, const Tensor& b, const Tensor* aBias, Activation aActivation,
+	float aScale, Tensor& aOut) {
+	std::vector<int> productShape;
+	if (!MatmulShape(a.ref(), b.ref(), productShape)) {
 		std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
 		std::exit(EXIT_FAILURE);
 	}
+	if (aOut.shape != productShape) {
+		std::cerr << "Error: Output tensor's shape does not match the product." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	const size_t rows = productShape.size() - 2;
+	const size_t cols = productShape.size() - 1;
+	MatmulEpilogue epilogue;
+	epilogue.scale = aScale;
+	epilogue.activation = aActivation;
+	if (aBias) {
+		// A row of the product's columns, read through its last stride
+		if (aBias->shape.empty() || aBias->shape.size() > 2 || aBias->numel() != productShape[cols] ||
+			aBias->shape.back() != productShape[cols]) {
+			std::cerr << "Error: Bias must be a row of the product's columns ([N] or [1, N])." << "\n";
+			std::exit(EXIT_FAILURE);
+		}
+		epilogue.bias = aBias->ref();
+		epilogue.bias.ndim = 1;
+		epilogue.bias.shape[0] = productShape[cols];
+		epilogue.bias.strides[0] = aBias->strides.back();
+	}
 
-	std::shared_ptr<OperationInterface> OperationPerformer;
-	std::vector<dataType> answer;
-	if (UseDevice == Device::cpu) {
-		OperationPerformer = std::make_shared<CPUOperation>();
-		OperationPerformer->performOperation(this->data, aTensor.data,
-			answer, OperationType::Division, curCompatability);
-		
-		return Tensor(this->shape, answer);
+	const Device device = Dispatcher::Instance().SelectMatmul(productShape[rows], a.shape.back(), productShape[rows + 1],
+		rows == 1 ? productShape[0] : 1, aOut.dtype);
+	TraceScope trace("matmul", device);
+	if (trace.Active()) {
+		trace.Input(a.ref()).Input(b.ref());
+		if (aBias) trace.Input(epilogue.bias);
+		if (!epilogue.IsIdentity()) trace.Arg("activation", ActivationName(aActivation));
+		trace.Output(aOut.ref());
+	}
+	// The GEMM writes C while it still reads A, B and the bias, and needs unit-stride rows of C.
+	// Other outputs receive the product through a temporary.
+	if (aOut.storage == a.storage || aOut.storage == b.storage || (aBias && aOut.storage == aBias->storage) ||
+		(aOut.strides[cols] != 1 && aOut.shape[cols] > 1)) {
+		Tensor product(productShape, aOut.dtype, StorageInit::Uninitialized);
+		MatmulInto(a, b, aBias, aActivation, aScale, product);
+		aOut.CopyFrom(product);
+		return;
+	}
+	if (aOut.numel() == 0) {
+		return;
+	}
+	if (TensorGraph::Capturing()) {
+		TensorGraph::CaptureMatmul(a, b, aBias, epilogue, aOut);
 	}
-	return *this;
-}
 
-// Operations with TensorProxy
-Tensor Tensor::operator+(const TensorAccessProxy& aTensorProxy) const {
-	return this->operator+(aTensorProxy.getTensor());
-}
-Tensor Tensor::operator-(const TensorAccessProxy& aTensorProxy) const {
-	return this->operator-(aTensorProxy.getTensor());
-}
-Tensor Tensor::operator*(const TensorAccessProxy& aTensorProxy) const {
-	return this->operator*(aTensorProxy.getTensor());
-}
-Tensor Tensor::operator/(const TensorAccessProxy& aTensorProxy) const {
-	return this->operator/(aTensorProxy.getTensor());
-}
+	// Views are passed through their strides, without materializing them
+	if (productShape.size() == 2) {
+		CPUOperation cpuPerformer;
+		OpenCLOperation openclPerformer;
+		OperationInterface& OperationPerformer = device == Device::cpu
+			? static_cast<OperationInterface&>(cpuPerformer) : static_cast<OperationInterface&>(openclPerformer);
+		OperationPerformer.Matrix2DMulitplication(a.ref(), b.ref(), aOut.ref(), epilogue);
+		return;
+	}
 
-// Operations with Scalar
-Tensor Tensor::operator+(const dataType& aScalar) const {
-	return this->operator+(Tensor({ 1, 1 }, { aScalar }));
-}
-Tensor Tensor::operator-(const dataType& aScalar) const {
-	return this->operator-(Tensor({ 1, 1 }, { aScalar }));
-}
-Tensor Tensor::operator*(const dataType& aScalar) const {
-	return this->operator*(Tensor({ 1, 1 }, { aScalar }));
+	// Batches: every entry of the strided operands in one batched operation
+	const int batch = productShape[0];
+	std::vector<TensorRef> entriesA(batch), entriesB(batch), entriesOut(batch);
+	for (int i = 0; i < batch; ++i) {
+		entriesA[i] = BatchEntry(a.ref(), i);
+		entriesB[i] = BatchEntry(b.ref(), i);
+		entriesOut[i] = BatchEntry(aOut.ref(), i);
+	}
+	RunBatchedMatmul(entriesA, entriesB, entriesOut, device, epilogue);
 }
-Tensor Tensor::operator/(const dataType& aScalar) const {
-	return this->operator/(Tensor({ 1, 1 }, { aScalar }));
+
+// Pointer-array batch: the matrices may live anywhere, but all have the same M, K and N
+void matmul(const std::vector<Tensor>& a, const std::vector<Tensor>& b, std::vector<Tensor>& aOut) {
+	const size_t batch = aOut.size();
+	if (a.empty() || b.empty() || (a.size() != batch && a.size() != 1) || (b.size() != batch && b.size() != 1)) {
+		std::cerr << "Error: Batched matmul needs one operand (or a single shared one) per output." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	const std::vector<int> shapeA = a[0].shape, shapeB = b[0].shape;
+	for (size_t i = 0; i < batch; ++i) {
+		const Tensor& entryA = a[a.size() == 1 ? 0 : i];
+		const Tensor& entryB = b[b.size() == 1 ? 0 : i];
+		if (entryA.shape != shapeA || entryB.shape != shapeB ||
+			ShapeCompatibility::Incompatible == CheckShapeCompatibility(entryA.ref(), entryB.ref(), OperationType::MatrixMultiplication) ||
+			entryA.shape.size() != 2 || entryB.shape.size() != 2) {
+			std::cerr << "Error: Batched matmul entries must be 2-D with the same compatible shapes." << "\n";
+			std::exit(EXIT_FAILURE);
+		}
+		if (aOut[i].shape != std::vector<int>{ shapeA[0], shapeB[1] } || aOut[i].dtype != aOut[0].dtype) {
+			std::cerr << "Error: Batched matmul outputs must match the product's shape and share one dtype." << "\n";
+			std::exit(EXIT_FAILURE);
+		}
+	}
+	if (batch == 0 || aOut[0].numel() == 0) {
+		return;
+	}
+	const Device device = Dispatcher::Instance().SelectMatmul(shapeA[0], shapeA[1], shapeB[1], (int)batch, aOut[0].dtype);
+	TraceScope trace("matmul_batch", device);
+	if (trace.Active()) {
+		trace.Input(a[0].ref()).Input(b[0].ref()).Output(aOut[0].ref()).Arg("batch", (long long)batch);
+	}
+
+	// Outputs that share storage with an operand, or lack unit-stride rows, go through temporaries
+	std::vector<Tensor> temporaries;
+	std::vector<int> temporaryOf(batch, -1);
+	std::vector<TensorRef> entriesA(batch), entriesB(batch), entriesOut(batch);
+	for (size_t i = 0; i < batch; ++i) {
+		entriesA[i] = a[a.size() == 1 ? 0 : i].ref();
+		entriesB[i] = b[b.size() == 1 ? 0 : i].ref();
+		bool direct = aOut[i].strides[1] == 1 || aOut[i].shape[1] == 1;
+		for (const std::vector<Tensor>* operands : { &a, &b }) {
+			for (const Tensor& operand : *operands) {
+				direct = direct && operand.storage != aOut[i].storage;
+			}
+		}
+		if (direct) {
+			entriesOut[i] = aOut[i].ref();
+		}
+		else {
+			temporaryOf[i] = static_cast<int>(temporaries.size());
+			temporaries.push_back(Tensor(aOut[i].shape, aOut[i].dtype, StorageInit::Uninitialized));
+		}
+	}
+	for (size_t i = 0; i < batch; ++i) {
+		if (temporaryOf[i] >= 0) entriesOut[i] = temporaries[temporaryOf[i]].ref();
+	}
+	RunBatchedMatmul(entriesA, entriesB, entriesOut, device);
+	for (size_t i = 0; i < batch; ++i) {
+		if (temporaryOf[i] >= 0) CopyTensorRef(entriesOut[i], aOut[i].ref());
+	}
 }
 
+std::vector<Tensor> matmul(const std::vector<Tensor>& a, const std::vector<Tensor>& b) {
+	const size_t batch = std::max(a.size(), b.size());
+	std::vector<Tensor> products;
+	if (a.empty() || b.empty()) {
+		matmul(a, b, products); // reports the error
+	}
+	DType productType = PromoteTypes(a[0].dtype, b[0].dtype);
+	for (const Tensor& entry : a) productType = PromoteTypes(productType, entry.dtype);
+	for (const Tensor& entry : b) productType = PromoteTypes(productType, entry.dtype);
+	const int rows = a[0].shape.empty() ? 0 : a[0].shape[0];
+	const int cols = b[0].shape.size() < 2 ? 0 : b[0].shape[1];
+	for (size_t i = 0; i < batch; ++i) {
+		products.push_back(Tensor({ rows, cols }, productType, StorageInit::Uninitialized));
+	}
+	matmul(a, b, products);
+	return products;
+}
+
+// Dtype
+DType Tensor::getDType() const {
+	return dtype;
+}
+// Reductions
+Tensor Tensor::sum(int aAxis) const { return Reduce(ReductionType::Sum, NormalizeAxis(aAxis)); }
+Tensor Tensor::sum() const { return Reduce(ReductionType::Sum, AllAxes); }
+Tensor Tensor::mean(int aAxis) const { return Reduce(ReductionType::Mean, NormalizeAxis(aAxis)); }
+Tensor Tensor::mean() const { return Reduce(ReductionType::Mean, AllAxes); }
+Tensor Tensor::max(int aAxis) const { return Reduce(ReductionType::Max, NormalizeAxis(aAxis)); }
+Tensor Tensor::max() const { return Reduce(ReductionType::Max, AllAxes); }
+Tensor Tensor::min(int aAxis) const { return Reduce(ReductionType::Min, NormalizeAxis(aAxis)); }
+Tensor Tensor::min() const { return Reduce(ReductionType::Min, AllAxes); }
+Tensor Tensor::argmax(int aAxis) const { return Reduce(ReductionType::ArgMax, NormalizeAxis(aAxis)); }
+Tensor Tensor::argmax() const { return Reduce(ReductionType::ArgMax, AllAxes); }
+
+int Tensor::NormalizeAxis(int aAxis) const {
+	const int rank = static_cast<int>(shape.size());
+	const int axis = aAxis < 0 ? aAxis + rank : aAxis;
+	if (axis < 0 || axis >= rank) {
+		std::cerr << "Error: Axis " << aAxis << " is out of range for a tensor of rank " << rank << "." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	return axis;
+}
 
-// Matrix multiplication
-Tensor Tensor::matmul(Tensor& aTensor) {
-	ShapeCompatibility curCompatability = CheckShapeCompatibility(aTensor, OperationType::MatrixMultiplication);
-	if (ShapeCompatibility::Incompatible == curCompatability) {
-		std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
+Tensor Tensor::Reduce(ReductionType aType, int aAxis) const {
+	std::vector<int> resultShape = shape;
+	int count = 1; // Elements per result
+	for (size_t d = 0; d < shape.size(); ++d) {
+		if (aAxis == AllAxes || (int)d == aAxis) {
+			count *= shape[d];
+			resultShape[d] = 1;
+		}
+	}
+	if (count == 0 && aType != ReductionType::Sum && aType != ReductionType::Mean) {
+		std::cerr << "Error: Cannot reduce an empty axis with max, min or argmax." << "\n";
 		std::exit(EXIT_FAILURE);
 	}
 
-	std::shared_ptr<OperationInterface> OperationPerformer;
-	std::vector<dataType> answer;
-	std::vector<int> shape1(this->shape);
-	std::vector<int> shape2(aTensor.shape);
-	std::vector<int> shapeOut{shape1[0], shape2[1]};
+	DType resultType = dtype;
+	if (aType == ReductionType::ArgMax) resultType = DType::int32;
+	else if (aType == ReductionType::Mean && dtype == DType::int32) resultType = DType::float32;
+	Tensor result(resultShape, resultType, StorageInit::Uninitialized);
 
-	if (UseDevice == Device::cpu) {
-		OperationPerformer = std::make_shared<CPUOperation>();
-		OperationPerformer->Matrix2DMulitplication(this->data, shape1,
-			aTensor.data, shape2, answer);
+	const Device device = Dispatcher::Instance().SelectReduction(numel(), dtype);
+	TraceScope trace(TraceName(aType), device);
+	if (trace.Active()) trace.Input(this->ref()).Output(result.ref()).Arg("axis", (long long)aAxis);
 
-		return Tensor(shapeOut, answer);
+	// Stateless performers on the stack, as for the elementwise operations
+	if (device == Device::cpu) {
+		CPUOperation().Reduce(this->ref(), result.ref(), aType, aAxis);
 	}
-	return *this;
+	else {
+		OpenCLOperation().Reduce(this->ref(), result.ref(), aType, aAxis);
+	}
+	if (TensorGraph::Capturing()) {
+		TensorGraph::CaptureReduction(*this, result, aType, aAxis);
+	}
+	return result;
+}
+
+Tensor Tensor::astype(DType aDType) const {
+	Tensor converted(shape, aDType, StorageInit::Uninitialized);
+	TraceScope trace("astype");
+	if (trace.Active()) trace.Input(this->ref()).Output(converted.ref());
+	converted.CopyFrom(*this); // contiguous sources convert in one vectorized pass
+	return converted;
 }
 
 // Utility functions
@@ -214,48 +405,150 @@ void Tensor::print() const {
 		std::cout << shape[i];
 		if (i < shape.size() - 1) std::cout << ", ";
 	}
-	std::cout << ")\nData: \n";
-
-	if (shape.size() == 2) { // For 2D tensors
-		for (int i = 0; i < shape[0]; ++i) {
-			for (int j = 0; j < shape[1]; ++j) {
-				std::cout << data[i * shape[1] + j] << " ";
-			}
-			std::cout << "\n";
-		}
+	std::cout << ")";
+	if (dtype != DType::float32) std::cout << " dtype: " << DTypeName(dtype);
+	std::cout << "\nData: \n";
+
+	// int32 values are printed as integers, not in the (6 significant digit) float format
+	auto printElement = [this](size_t index) {
+		double value = LoadElement(storage->data(), dtype, index);
+		if (dtype == DType::int32) std::cout << (long long)value << " ";
+		else std::cout << value << " ";
+	};
+	const int rank = static_cast<int>(shape.size());
+	if (rank == 0) { // Scalar
+		printElement(offset);
+		std::cout << "\n";
 	}
-	else if (shape.size() == 1) { // For 1D tensors (vectors)
+	else if (rank == 1) { // For 1D tensors (vectors)
 		for (int i = 0; i < shape[0]; ++i) {
-			std::cout << data[i] << " ";
+			printElement(offset + (size_t)i * strides[0]);
 		}
 		std::cout << "\n";
 	}
-	else {
-		// Extend this block to handle tensors with more dimensions
-		std::cout << "Printing for tensors with more than 2 dimensions is not implemented.\n";
+	else { // 2D and above: one matrix per index of the leading dimensions, e.g. "(1, 0, :, :)"
+		std::vector<int> index(rank - 2, 0);
+		const int numMatrices = numel() / std::max(1, shape[rank - 2] * shape[rank - 1]);
+		for (int m = 0; m < numMatrices; ++m) {
+			size_t base = offset;
+			if (rank > 2) {
+				std::cout << "(";
+				for (int d = 0; d < rank - 2; ++d) {
+					std::cout << index[d] << ", ";
+					base += (size_t)index[d] * strides[d];
+				}
+				std::cout << ":, :)\n";
+			}
+			for (int i = 0; i < shape[rank - 2]; ++i) {
+				for (int j = 0; j < shape[rank - 1]; ++j) {
+					printElement(base + (size_t)i * strides[rank - 2] + (size_t)j * strides[rank - 1]);
+				}
+				std::cout << "\n";
+			}
+			// Advance the index of the leading dimensions, last dimension fastest
+			for (int d = rank - 3; d >= 0; --d) {
+				if (++index[d] < shape[d]) break;
+				index[d] = 0;
+			}
+		}
 	}
 	//std::cout << "UseDevice: " << static_cast<int>(UseDevice) << std::endl;
 }
 
+std::vector<int> Tensor::getShape() const {
+	return shape;
+}
+std::vector<int> Tensor::getStrides() const {
+	return strides;
+}
+int Tensor::numel() const {
+	return std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>());
+}
+bool Tensor::isContiguous() const {
+	return strides == ContiguousStrides(shape) || ref().isContiguous();
+}
+bool Tensor::isView() const {
+	return storage.use_count() > 1;
+}
+Tensor Tensor::contiguous() const {
+	if (isContiguous()) {
+		return Tensor(storage, offset, dtype, shape, strides); // shares the storage
+	}
+	return Tensor(*this); // dense copy
+}
+Tensor Tensor::reshape(const std::vector<int>& aShape) const {
+	if (std::accumulate(aShape.begin(), aShape.end(), 1, std::multiplies<int>()) != numel()) {
+		std::cerr << "Error: Cannot reshape a tensor of " << numel() << " elements." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	Tensor dense = contiguous(); // shares the storage unless this is a strided view
+	return Tensor(dense.storage, dense.offset, dtype, aShape, ContiguousStrides(aShape));
+}
+
 /*************** HELPER METHODS ****************/
 // Check shape compatibility for operations
 ShapeCompatibility Tensor::CheckShapeCompatibility(const Tensor& aTensor, const OperationType opType) const {
-	std::vector<int> aShape = aTensor.shape;
+	return ::CheckShapeCompatibility(this->ref(), aTensor.ref(), opType);
+}
 
-	// for matrix multiplication
-	if (OperationType::MatrixMultiplication == opType) {
-		if (shape[1] == aShape[0]) return ShapeCompatibility::ColsRowsMatch;
-		return ShapeCompatibility::Incompatible;
+// Describe this tensor to the backends: base pointer at the view offset plus its strides
+TensorRef Tensor::ref() const {
+	if (shape.size() > TensorRef::MaxDims) {
+		std::cerr << "Error: Tensors are limited to " << TensorRef::MaxDims << " dimensions." << "\n";
+		std::exit(EXIT_FAILURE);
 	}
-	else {
-	// for all other operations
-		if (shape == aShape) return ShapeCompatibility::ShapeMatch;
-		if (aShape[0] == 1 && aShape[1] == 1) return ShapeCompatibility::IsScalar;
-		if (shape[0] == aShape[0] && aShape[1] == 1) return ShapeCompatibility::ColVector;
-		if (shape[1] == aShape[1] && aShape[0] == 1) return ShapeCompatibility::RowVector;
-		return ShapeCompatibility::Incompatible;
+	TensorRef aRef;
+	// The backends write results through the ref of a freshly allocated (non-const) output tensor
+	aRef.data = storage->data() + offset * DTypeSize(dtype);
+	aRef.dtype = dtype;
+	aRef.ndim = static_cast<int>(shape.size());
+	for (int d = 0; d < aRef.ndim; ++d) {
+		aRef.shape[d] = shape[d];
+		aRef.strides[d] = strides[d];
 	}
-	
+	return aRef;
+}
+
+// Copy aSource's elements into this tensor's, converting to its dtype, and record it in a capturing graph
+void Tensor::CopyFrom(const Tensor& aSource) {
+	CopyTensorRef(aSource.ref(), this->ref());
+	if (TensorGraph::Capturing()) {
+		TensorGraph::CaptureCopy(aSource, *this);
+	}
+}
+
+// Copy aCount elements of type aDType into fresh storage of the tensor's shape, keeping aDType
+void Tensor::InitFromData(const void* aData, DType aDType, size_t aCount) {
+	if ((size_t)numel() != aCount) {
+		std::cerr << "Error: Shape and data size do not match." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	dtype = aDType;
+	storage = std::make_shared<TensorStorage>(aCount * DTypeSize(dtype), StorageInit::Uninitialized);
+	std::memcpy(storage->data(), aData, aCount * DTypeSize(dtype));
+}
+
+size_t Tensor::ElementOffset(const std::vector<int>& aIndex) const {
+	if (aIndex.size() != shape.size()) {
+		std::cerr << "Error: Expected " << shape.size() << " indices, got " << aIndex.size() << "." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	size_t elementOffset = offset;
+	for (size_t d = 0; d < shape.size(); ++d) {
+		elementOffset += (size_t)aIndex[d] * strides[d];
+	}
+	return elementOffset;
+}
+
+// Row-major strides for a dense tensor of the given shape
+std::vector<int> Tensor::ContiguousStrides(const std::vector<int>& aShape) {
+	std::vector<int> aStrides(aShape.size());
+	int stride = 1;
+	for (int d = static_cast<int>(aShape.size()) - 1; d >= 0; --d) {
+		aStrides[d] = stride;
+		stride *= aShape[d];
+	}
+	return aStrides;
 }
 
 
@@ -267,153 +560,112 @@ TensorAccessProxy::TensorAccessProxy(Tensor& tensor, int index, std::vector<Slic
 
 // Assignment operator for both row and column
 TensorAccessProxy& TensorAccessProxy::operator=(const Tensor& src) {
+	Tensor target = this->operator Tensor(); // view of the addressed region
 	if (mode == AccessMode::Row) {
 		if (src.shape[1] != tensor.shape[1] || src.shape[0] != 1) {
 			std::cerr << "Error: Source tensor dimensions do not match target row." << "\n";
 			std::exit(EXIT_FAILURE);
 		}
-		for (int col = 0; col < tensor.shape[1]; ++col) {
-			tensor.data[index * tensor.shape[1] + col] = src.data[col];
-		}
 	}
 	else if (mode == AccessMode::Column) {
 		if (src.shape[0] != tensor.shape[0] || src.shape[1] != 1) {
 			std::cerr << "Error: Source tensor dimensions do not match target column." << "\n";
 			std::exit(EXIT_FAILURE);
 		}
-		for (int row = 0; row < tensor.shape[0]; ++row) {
-			tensor.data[row * tensor.shape[1] + index] = src.data[row];
-		}
 	}
 	else if (mode == AccessMode::Submatrix) {
-		std::vector<int> sliceShape{ slice[0].end - slice[0].start, slice[1].end - slice[1].start };
-		if (src.shape != sliceShape) {
+		if (src.shape != target.shape) {
 			std::cerr << "Error: Source tensor dimensions do not match target submatrix." << "\n";
 			std::exit(EXIT_FAILURE);
 		}
-		// assign the submatrix
-		int srcRowIndex = 0;
-		for (int rowIndex = slice[0].start; rowIndex < slice[0].end; ++rowIndex, ++srcRowIndex) {
-			int srcColIndex = 0;
-			for (int colIndex = slice[1].start; colIndex < slice[1].end; ++colIndex, ++srcColIndex) {
-				// Calculate the flat index for the target tensor
-				int targetIndex = rowIndex * tensor.shape[1] + colIndex;
-				// Calculate the flat index for the source tensor 
-				int sourceIndex = srcRowIndex * src.shape[1] + srcColIndex;
-				tensor.data[targetIndex] = src.data[sourceIndex];
-			}
-		}
+	}
+	TraceScope trace("proxy_assign");
+	if (trace.Active()) trace.Input(src.ref()).Output(target.ref());
+
+	// Write straight into the parent's storage through the view's strides. A source that shares
+	// the parent's storage may overlap the target, so it is copied out first.
+	if (src.storage == tensor.storage) {
+		Tensor source(src);
+		target.CopyFrom(source);
+	}
+	else {
+		target.CopyFrom(src);
 	}
 	return *this;
 }
 
+TensorAccessProxy& TensorAccessProxy::operator=(const TensorAccessProxy& src) {
+	return this->operator=(src.getTensor());
+}
+
 // Conversion operator to support extraction as a Tensor
+// The result is a view: it shares the parent's storage, with an offset and the parent's strides.
 TensorAccessProxy::operator Tensor() const {
-	std::vector<float> extractedData;
+	TraceScope trace("proxy_extract");
+	const std::vector<int>& parentStrides = tensor.strides;
+	size_t viewOffset = tensor.offset;
+	std::vector<int> viewShape;
 	if (mode == AccessMode::Row) {
-		extractedData.reserve(tensor.shape[1]);
-		for (int col = 0; col < tensor.shape[1]; ++col) {
-			extractedData.push_back(tensor.data[index * tensor.shape[1] + col]);
-		}
-		return Tensor({ 1, tensor.shape[1] }, extractedData);
+		viewOffset += (size_t)index * parentStrides[0];
+		viewShape = { 1, tensor.shape[1] };
 	}
 	else if (mode == AccessMode::Column) {
-		extractedData.reserve(tensor.shape[0]);
-		for (int row = 0; row < tensor.shape[0]; ++row) {
-			extractedData.push_back(tensor.data[row * tensor.shape[1] + index]);
-		}
-		return Tensor({ tensor.shape[0], 1 }, extractedData);
+		viewOffset += (size_t)index * parentStrides[1];
+		viewShape = { tensor.shape[0], 1 };
 	}
 	else { // Submatrix
-		std::vector<int> subShape = { slice[0].end - slice[0].start, slice[1].end - slice[1].start };
-		extractedData.reserve(subShape[0] * subShape[1]);
-		for (int i = slice[0].start; i < slice[0].end; ++i) {
-			for (int j = slice[1].start; j < slice[1].end; ++j) {
-				extractedData.push_back(tensor.data[i * tensor.shape[1] + j]);
-			}
-		}
-		return Tensor(subShape, extractedData);
+		viewShape = { slice[0].end - slice[0].start, slice[1].end - slice[1].start };
+		viewOffset += (size_t)slice[0].start * parentStrides[0] + (size_t)slice[1].start * parentStrides[1];
+	}
+	Tensor view(tensor.storage, viewOffset, tensor.dtype, viewShape, parentStrides);
+	if (trace.Active()) {
+		trace.View(view.ref()).Arg("mode", mode == AccessMode::Row ? "row" : mode == AccessMode::Column ? "column" : "submatrix");
 	}
+	return view;
 }
 
 
 // Extract the sliced-Tensor
-Tensor& TensorAccessProxy::getTensor() const {
+Tensor TensorAccessProxy::getTensor() const {
 	return this->operator Tensor(); // This is how we call custom operator
 }
 
-// Operations with TensorProxy
-Tensor TensorAccessProxy::operator+(const TensorAccessProxy& aTensorProxy) const {
-	return (this->getTensor() + aTensorProxy.getTensor());
-}
-Tensor TensorAccessProxy::operator-(const TensorAccessProxy& aTensorProxy) const {
-	return (this->getTensor() - aTensorProxy.getTensor());
-}
-Tensor TensorAccessProxy::operator*(const TensorAccessProxy& aTensorProxy) const {
-	return (this->getTensor() * aTensorProxy.getTensor());
-}
-Tensor TensorAccessProxy::operator/(const TensorAccessProxy& aTensorProxy) const {
-	return (this->getTensor() / aTensorProxy.getTensor());
-}
-
-// Operations with Tensor
-Tensor TensorAccessProxy::operator+(const Tensor& aTensor) const {
-	return (this->getTensor() + aTensor);
-}
-Tensor TensorAccessProxy::operator-(const Tensor& aTensor) const {
-	return (this->getTensor() - aTensor);
-}
-Tensor TensorAccessProxy::operator*(const Tensor& aTensor) const {
-	return (this->getTensor() * aTensor);
-}
-Tensor TensorAccessProxy::operator/(const Tensor& aTensor) const {
-	return (this->getTensor() / aTensor);
-}
-
-// Scalar operations
-Tensor TensorAccessProxy::operator+(const dataType& aScalar) const {
-	return (this->getTensor() + Tensor({1, 1}, {aScalar}));
-}
-Tensor TensorAccessProxy::operator-(const dataType& aScalar) const {
-	return (this->getTensor() - Tensor({ 1, 1 }, { aScalar }));
-}
-Tensor TensorAccessProxy::operator*(const dataType& aScalar) const {
-	return (this->getTensor() * Tensor({ 1, 1 }, { aScalar }));
-}
-Tensor TensorAccessProxy::operator/(const dataType& aScalar) const {
-	return (this->getTensor() / Tensor({ 1, 1 }, { aScalar }));
-}
-
 // Utility functions
 void TensorAccessProxy::print() const {
 	this->operator Tensor().print();
 }
+std::vector<int> TensorAccessProxy::getShape() const {
+	return this->operator Tensor().getShape();
+}
+int TensorAccessProxy::numel() const {
+	return this->operator Tensor().numel();
+}
 
 
 /******************************************************** NON-MEMBER FUNCTIONS *********************************************************/
-// Operations with Scalar on the left
-Tensor operator+(const dataType& aScalar, const Tensor& aTensor) {
-	return (Tensor({ 1, 1 }, { aScalar }) + aTensor);
-}
-Tensor operator-(const dataType& aScalar, const Tensor& aTensor) {
-	return (Tensor({ 1, 1 }, { aScalar }) - aTensor);
-}
-Tensor operator*(const dataType& aScalar, const Tensor& aTensor) {
-	return (Tensor({ 1, 1 }, { aScalar }) * aTensor);
-}
-Tensor operator/(const dataType& aScalar, const Tensor& aTensor) {
-	return (Tensor({ 1, 1 }, { aScalar }) / aTensor);
-}
+// Single elementwise operation on the backend the dispatcher selects (see TensorExpr.hpp)
+bool RunElementwiseOnBackend(const TensorRef& lhs, const TensorRef& rhs, const TensorRef& output, OperationType opType) {
+	// The backends take operands of any rank that broadcast to the output, all three of the same
+	// float32, float64 or int32 dtype
+	if (lhs.dtype != output.dtype || rhs.dtype != output.dtype || ComputeDType(output.dtype) != output.dtype) {
+		return false;
+	}
+	ShapeCompatibility curCompatability = CheckShapeCompatibility(lhs, rhs, opType);
+	if (ShapeCompatibility::Incompatible == curCompatability) {
+		return false;
+	}
 
-Tensor operator+(const dataType& aScalar, const TensorAccessProxy& aTensorProxy) {
-	return (Tensor({ 1, 1 }, { aScalar }) + aTensorProxy.getTensor());
-}
-Tensor operator-(const dataType& aScalar, const TensorAccessProxy& aTensorProxy) {
-	return (Tensor({ 1, 1 }, { aScalar }) - aTensorProxy.getTensor());
-}
-Tensor operator*(const dataType& aScalar, const TensorAccessProxy& aTensorProxy) {
-	return (Tensor({ 1, 1 }, { aScalar }) * aTensorProxy.getTensor());
+	const Device device = Dispatcher::Instance().SelectElementwise(output.numel(),
+		(lhs.numel() + rhs.numel() + output.numel()) * DTypeSize(output.dtype), output.dtype);
+	TraceScope trace(TraceName(opType), device);
+	if (trace.Active()) trace.Input(lhs).Input(rhs).Output(output).Arg("mode", TraceName(curCompatability));
+
+	// Stateless performers on the stack: no allocation per operation
+	if (device == Device::cpu) {
+		CPUOperation().performOperation(lhs, rhs, output, opType, curCompatability);
+	}
+	else {
+		OpenCLOperation().performOperation(lhs, rhs, output, opType, curCompatability);
+	}
+	return true;
 }
-Tensor operator/(const dataType& aScalar, const TensorAccessProxy& aTensorProxy) {
-	return (Tensor({ 1, 1 }, { aScalar }) / aTensorProxy.getTensor());
-}
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "TensorFile.hpp"
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+/*********FORMAT************/
+
+constexpr char TensorFileHeader::Magic[8];
+
+uint32_t TensorFileDType(DType aDType) {
+	switch (aDType) {
+	case DType::float32: return 0;
+	case DType::float64: return 1;
+	case DType::float16: return 2;
+	case DType::bfloat16: return 3;
+	default: return 4; // int32
+	}
+}
+
+bool DTypeFromTensorFile(uint32_t aCode, DType& aDType) {
+	static const DType codes[] = { DType::float32, DType::float64, DType::float16, DType::bfloat16, DType::int32 };
+	if (aCode >= sizeof(codes) / sizeof(codes[0])) {
+		return false;
+	}
+	aDType = codes[aCode];
+	return true;
+}
+
+
+/*********MAPPED FILE************/
+
+std::shared_ptr<MappedFile> MappedFile::Open(const std::string& aPath) {
+	std::shared_ptr<MappedFile> mapped(new MappedFile());
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(aPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		CloseHandle(file);
+		return nullptr;
+	}
+	// PAGE_WRITECOPY / FILE_MAP_COPY: the view is writable, but writes never reach the file
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping) {
+		return nullptr;
+	}
+	void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping); // The view keeps the mapping alive
+	if (!view) {
+		return nullptr;
+	}
+	mapped->base = static_cast<unsigned char*>(view);
+	mapped->length = (size_t)fileSize.QuadPart;
+#else
+	const int file = open(aPath.c_str(), O_RDONLY);
+	if (file < 0) {
+		return nullptr;
+	}
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0) {
+		close(file);
+		return nullptr;
+	}
+	// MAP_PRIVATE: the pages are writable, but writes never reach the file
+	void* view = mmap(NULL, (size_t)status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	close(file); // The mapping keeps the file open
+	if (view == MAP_FAILED) {
+		return nullptr;
+	}
+	mapped->base = static_cast<unsigned char*>(view);
+	mapped->length = (size_t)status.st_size;
+#endif
+	return mapped;
+}
+
+MappedFile::~MappedFile() {
+	if (!base) {
+		return;
+	}
+#if defined(_WIN32)
+	UnmapViewOfFile(base);
+#else
+	munmap(base, length);
+#endif
+}
+
+
+/*********SAVE AND LOAD************/
+
+TensorFileInfo ReadTensorFileInfo(const unsigned char* aBytes, size_t aAvailable, uint64_t aFileSize, const std::string& aPath) {
+	auto invalid = [&aPath](const char* aReason) {
+		std::cerr << "Error: " << aPath << " is not a valid tensor file: " << aReason << "." << "\n";
+		std::exit(EXIT_FAILURE);
+	};
+	TensorFileHeader header;
+	if (aAvailable < sizeof(header)) invalid("truncated header");
+	std::memcpy(&header, aBytes, sizeof(header));
+	if (std::memcmp(header.magic, TensorFileHeader::Magic, sizeof(header.magic)) != 0) invalid("bad magic");
+	if (header.version != TensorFileHeader::CurrentVersion) invalid("unsupported version");
+	TensorFileInfo info;
+	if (!DTypeFromTensorFile(header.dtype, info.dtype)) invalid("unknown dtype");
+	if (header.ndim > (uint32_t)TensorRef::MaxDims) invalid("too many dimensions");
+	const size_t headerBytes = sizeof(header) + header.ndim * sizeof(int64_t);
+	if (aAvailable < headerBytes) invalid("truncated header");
+	if (header.alignment == 0 || header.dataOffset % header.alignment != 0 || header.dataOffset < headerBytes ||
+		header.dataOffset > aFileSize || header.dataBytes > aFileSize - header.dataOffset) {
+		invalid("bad data layout");
+	}
+
+	info.shape.resize(header.ndim);
+	uint64_t count = 1;
+	for (uint32_t d = 0; d < header.ndim; ++d) {
+		int64_t dimension;
+		std::memcpy(&dimension, aBytes + sizeof(header) + d * sizeof(int64_t), sizeof(dimension));
+		if (dimension < 0 || dimension > INT_MAX) invalid("bad shape");
+		info.shape[d] = (int)dimension;
+		count *= (uint64_t)dimension;
+		if (count > (uint64_t)INT_MAX) invalid("too many elements");
+	}
+	if (count * DTypeSize(info.dtype) != header.dataBytes) invalid("size does not match the shape");
+	info.dataOffset = header.dataOffset;
+	info.dataBytes = header.dataBytes;
+	return info;
+}
+
+TensorFileHeader WriteTensorFileHeader(std::ostream& aFile, DType aDType, const std::vector<int>& aShape) {
+	const size_t ndim = aShape.size();
+	size_t count = 1;
+	for (int dimension : aShape) count *= (size_t)dimension;
+
+	TensorFileHeader header = {};
+	std::memcpy(header.magic, TensorFileHeader::Magic, sizeof(header.magic));
+	header.version = TensorFileHeader::CurrentVersion;
+	header.dtype = TensorFileDType(aDType);
+	header.ndim = (uint32_t)ndim;
+	header.alignment = (uint32_t)Allocator::Alignment;
+	const size_t headerBytes = sizeof(TensorFileHeader) + ndim * sizeof(int64_t);
+	header.dataOffset = (headerBytes + Allocator::Alignment - 1) / Allocator::Alignment * Allocator::Alignment;
+	header.dataBytes = (uint64_t)count * DTypeSize(aDType);
+
+	std::vector<int64_t> dimensions(aShape.begin(), aShape.end());
+	std::vector<char> padding(header.dataOffset - headerBytes, 0);
+	aFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	aFile.write(reinterpret_cast<const char*>(dimensions.data()), (std::streamsize)(ndim * sizeof(int64_t)));
+	aFile.write(padding.data(), (std::streamsize)padding.size());
+	return header;
+}
+
+void Tensor::save(const std::string& aPath) const {
+	const Tensor dense = contiguous(); // Views are written as their own elements
+	std::ofstream file(aPath, std::ios::binary | std::ios::trunc);
+	const TensorFileHeader header = WriteTensorFileHeader(file, dtype, shape);
+	file.write(static_cast<const char*>(dense.ref().data), (std::streamsize)header.dataBytes);
+	if (!file) {
+		std::cerr << "Error: Cannot write the tensor file " << aPath << "." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+}
+
+Tensor Tensor::load(const std::string& aPath) {
+	std::shared_ptr<MappedFile> mapped = MappedFile::Open(aPath);
+	if (!mapped) {
+		std::cerr << "Error: Cannot open the tensor file " << aPath << "." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	// Only the header and the dimensions are read here; the elements stay on disk until used
+	const TensorFileInfo info = ReadTensorFileInfo(mapped->data(), mapped->size(), mapped->size(), aPath);
+
+	// The storage points into the mapping and keeps it alive, also for views of the tensor
+	auto storage = std::make_shared<TensorStorage>(mapped->data() + info.dataOffset, (size_t)info.dataBytes, mapped);
+	return Tensor(storage, 0, info.dtype, info.shape, ContiguousStrides(info.shape));
+}
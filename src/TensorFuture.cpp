@@ -0,0 +1,144 @@
+#include "TensorFuture.hpp"
+#include "dispatcher.h"
+#include "tracer.h"
+#include <chrono>
+
+
+/*********TENSOR FUTURE************/
+
+bool TensorFuture::ready() const {
+	if (!state) return false;
+	const bool hostDone = !state->hostWork.valid() ||
+		state->hostWork.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	return hostDone && state->deviceWork.Ready();
+}
+
+void TensorFuture::wait() {
+	if (!state) {
+		std::cerr << "Error: The future holds no result." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	const cl_int err = state->deviceWork.Wait();
+	if (err != CL_SUCCESS) {
+		std::cerr << "Error: Asynchronous OpenCL operation failed with error " << err << "." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	if (state->hostWork.valid()) {
+		state->hostWork.get(); // rethrows what the worker threw
+	}
+	state->operands.clear();
+}
+
+Tensor TensorFuture::get() {
+	wait();
+	Tensor result = std::move(state->result);
+	state.reset();
+	return result;
+}
+
+
+/*********ASYNCHRONOUS OPERATIONS************/
+
+// The backend is selected once, on the calling thread, when the operation is issued, and then
+// called directly
+TensorFuture TensorFuture::Matmul(const Tensor& a, const Tensor& b) {
+	std::vector<int> productShape;
+	if (!MatmulShape(a.ref(), b.ref(), productShape)) {
+		std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	TensorFuture future;
+	future.state = std::make_unique<State>();
+	State& state = *future.state;
+	state.result = Tensor(productShape, PromoteTypes(a.dtype, b.dtype), StorageInit::Uninitialized);
+	state.operands = { a.storage, b.storage };
+	// A 2-D product is a batch of one
+	const int batch = productShape.size() == 3 ? productShape[0] : 1;
+	const size_t rows = productShape.size() - 2;
+	const Device device = Dispatcher::Instance().SelectMatmul(productShape[rows], a.shape.back(), productShape[rows + 1],
+		batch, state.result.dtype);
+	TraceScope trace("matmulAsync", device); // The issue; the device commands show when the work ran
+	if (trace.Active()) trace.Input(a.ref()).Input(b.ref()).Output(state.result.ref());
+	if (state.result.numel() == 0) {
+		return future;
+	}
+
+	std::vector<TensorRef> entriesA(batch), entriesB(batch), entriesOut(batch);
+	for (int i = 0; i < batch; ++i) {
+		entriesA[i] = BatchEntry(a.ref(), i);
+		entriesB[i] = BatchEntry(b.ref(), i);
+		entriesOut[i] = BatchEntry(state.result.ref(), i);
+	}
+	if (device == Device::gpu && OpenCLOperation().BatchedMatrixMultiplicationAsync(
+		entriesA.data(), entriesB.data(), entriesOut.data(), batch, state.deviceWork)) {
+		return future;
+	}
+	state.hostWork = std::async(std::launch::async, [entriesA, entriesB, entriesOut, batch]() {
+		TraceScope work("matmul", Device::cpu);
+		if (work.Active()) work.Input(entriesA[0]).Input(entriesB[0]).Output(entriesOut[0]).Arg("batch", (long long)batch);
+		CPUOperation().BatchedMatrixMultiplication(entriesA.data(), entriesB.data(), entriesOut.data(), batch);
+	});
+	return future;
+}
+
+TensorFuture TensorFuture::Elementwise(const Tensor& a, const Tensor& b, OperationType opType) {
+	std::vector<int> outShape;
+	if (!BroadcastShapes(a.shape, b.shape, outShape)) {
+		std::cerr << "Error: Operand tensor's shape is incompatible." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	TensorFuture future;
+	future.state = std::make_unique<State>();
+	State& state = *future.state;
+	const DType resultType = PromoteTypes(a.dtype, b.dtype);
+	const DType computeType = ComputeDType(resultType);
+	state.result = Tensor(outShape, resultType, StorageInit::Uninitialized);
+
+	// The backends take operands of the compute dtype; others are converted here, on the calling
+	// thread, and the converted copies kept until the operation is done
+	auto operand = [&state, computeType](const Tensor& aTensor) {
+		if (aTensor.dtype == computeType) {
+			state.operands.push_back(aTensor.storage);
+			return aTensor.ref();
+		}
+		Tensor converted = aTensor.astype(computeType);
+		state.operands.push_back(converted.storage);
+		return converted.ref();
+	};
+	const TensorRef lhs = operand(a), rhs = operand(b);
+	const TensorRef output = state.result.ref();
+	const Device device = Dispatcher::Instance().SelectElementwise(output.numel(),
+		(lhs.numel() + rhs.numel() + output.numel()) * DTypeSize(computeType), computeType);
+	TraceScope trace("elementwiseAsync", device);
+	if (trace.Active()) trace.Input(lhs).Input(rhs).Output(output).Arg("operation", TraceName(opType));
+	if (state.result.numel() == 0) {
+		return future;
+	}
+
+	if (device == Device::gpu && OpenCLOperation().performOperationAsync(lhs, rhs, output, opType, state.deviceWork)) {
+		return future;
+	}
+	// float16 and bfloat16 results are computed in float32 and rounded at the end
+	state.hostWork = std::async(std::launch::async, [lhs, rhs, output, opType, computeType]() {
+		const ShapeCompatibility spCompat = CheckShapeCompatibility(lhs, rhs, opType);
+		TraceScope work(TraceName(opType), Device::cpu);
+		if (work.Active()) work.Input(lhs).Input(rhs).Output(output).Arg("mode", TraceName(spCompat));
+		if (output.dtype == computeType) {
+			CPUOperation().performOperation(lhs, rhs, output, opType, spCompat);
+			return;
+		}
+		std::vector<unsigned char> buffer(output.numel() * DTypeSize(computeType));
+		TensorRef staging = output;
+		staging.data = buffer.data();
+		staging.dtype = computeType;
+		CPUOperation().performOperation(lhs, rhs, staging, opType, spCompat);
+		CopyTensorRef(staging, output);
+	});
+	return future;
+}
+
+TensorFuture matmulAsync(const Tensor& a, const Tensor& b) { return TensorFuture::Matmul(a, b); }
+TensorFuture addAsync(const Tensor& a, const Tensor& b) { return TensorFuture::Elementwise(a, b, OperationType::Addition); }
+TensorFuture subtractAsync(const Tensor& a, const Tensor& b) { return TensorFuture::Elementwise(a, b, OperationType::Subtraction); }
+TensorFuture multiplyAsync(const Tensor& a, const Tensor& b) { return TensorFuture::Elementwise(a, b, OperationType::Multiplication); }
+TensorFuture divideAsync(const Tensor& a, const Tensor& b) { return TensorFuture::Elementwise(a, b, OperationType::Division); }
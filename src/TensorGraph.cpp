@@ -0,0 +1,248 @@
+#include "TensorGraph.hpp"
+#include "Tensor.hpp"
+#include "tracer.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+thread_local TensorGraph* TensorGraph::capturing = nullptr;
+
+namespace {
+
+size_t AlignedBytes(size_t aBytes) {
+	return (aBytes + Allocator::Alignment - 1) / Allocator::Alignment * Allocator::Alignment;
+}
+
+// A write that covers every byte of the storage, so nothing of its earlier contents is read
+bool WritesWholeStorage(const TensorRef& aRef, const TensorStorage& aStorage) {
+	return aRef.data == aStorage.data() && aRef.isContiguous() && aRef.numel() * DTypeSize(aRef.dtype) == aStorage.size();
+}
+
+struct MatmulStep {
+	TensorRef a, b, out;
+	MatmulEpilogue epilogue;
+	std::vector<TensorRef> entriesA, entriesB, entriesOut; // Batch entries, sized once
+
+	static void Run(void* aState) {
+		MatmulStep& step = *static_cast<MatmulStep*>(aState);
+		CPUOperation cpu;
+		if (step.out.ndim == 2) {
+			cpu.Matrix2DMulitplication(step.a, step.b, step.out, step.epilogue);
+			return;
+		}
+		const int batch = (int)step.entriesOut.size();
+		for (int i = 0; i < batch; ++i) {
+			step.entriesA[i] = BatchEntry(step.a, i);
+			step.entriesB[i] = BatchEntry(step.b, i);
+			step.entriesOut[i] = BatchEntry(step.out, i);
+		}
+		cpu.BatchedMatrixMultiplication(step.entriesA.data(), step.entriesB.data(), step.entriesOut.data(), batch,
+			step.epilogue);
+	}
+};
+
+struct ReduceStep {
+	TensorRef input, output;
+	ReductionType type = ReductionType::Sum;
+	int axis = 0;
+	ReductionScratch scratch;
+
+	static void Run(void* aState) {
+		ReduceStep& step = *static_cast<ReduceStep*>(aState);
+		CPUOperation().Reduce(step.input, step.output, step.type, step.axis, step.scratch);
+	}
+};
+
+struct CopyStep {
+	TensorRef source, target;
+
+	static void Run(void* aState) {
+		const CopyStep& step = *static_cast<const CopyStep*>(aState);
+		CopyTensorRef(step.source, step.target);
+	}
+};
+
+} // namespace
+
+TensorGraph::~TensorGraph() {
+	if (capturing == this) capturing = nullptr;
+}
+
+void TensorGraph::beginCapture() {
+	if (capturing) {
+		std::cerr << "Error: This thread is already capturing a graph." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	steps.clear();
+	usages.clear();
+	arena.reset();
+	captured = false;
+	summary = GraphStats();
+	capturing = this;
+}
+
+void TensorGraph::Record(GraphStep aStep) {
+	TensorGraph& graph = *capturing;
+	const size_t index = graph.steps.size();
+	for (const GraphOperand& operand : aStep.operands) {
+		if (!operand.storage) continue; // Empty tensor
+		auto found = graph.usages.find(operand.storage.get());
+		if (found == graph.usages.end()) {
+			Usage usage;
+			usage.intermediate = operand.written && WritesWholeStorage(*operand.ref, *operand.storage);
+			usage.first = index;
+			found = graph.usages.emplace(operand.storage.get(), usage).first;
+		}
+		found->second.last = index;
+	}
+	graph.steps.push_back(std::move(aStep));
+}
+
+void TensorGraph::CaptureMatmul(const Tensor& a, const Tensor& b, const Tensor* aBias, const MatmulEpilogue& aEpilogue,
+	const Tensor& aOut) {
+	auto state = std::make_shared<MatmulStep>();
+	state->a = a.ref();
+	state->b = b.ref();
+	state->out = aOut.ref();
+	state->epilogue = aEpilogue;
+	if (state->out.ndim == 3) {
+		const size_t batch = (size_t)state->out.shape[0];
+		state->entriesA.resize(batch);
+		state->entriesB.resize(batch);
+		state->entriesOut.resize(batch);
+	}
+	GraphStep step;
+	step.name = "matmul";
+	step.run = &MatmulStep::Run;
+	step.operands = { { &state->a, a.storage, false }, { &state->b, b.storage, false } };
+	if (aBias) step.operands.push_back({ &state->epilogue.bias, aBias->storage, false });
+	step.operands.push_back({ &state->out, aOut.storage, true });
+	step.state = state;
+	Record(std::move(step));
+}
+
+void TensorGraph::CaptureReduction(const Tensor& aInput, const Tensor& aOutput, ReductionType aType, int aAxis) {
+	auto state = std::make_shared<ReduceStep>();
+	state->input = aInput.ref();
+	state->output = aOutput.ref();
+	state->type = aType;
+	state->axis = aAxis;
+	GraphStep step;
+	step.name = "reduce";
+	step.run = &ReduceStep::Run;
+	step.operands = { { &state->input, aInput.storage, false }, { &state->output, aOutput.storage, true } };
+	step.state = state;
+	Record(std::move(step));
+}
+
+void TensorGraph::CaptureCopy(const Tensor& aSource, const Tensor& aTarget) {
+	if (aTarget.numel() == 0) return;
+	auto state = std::make_shared<CopyStep>();
+	state->source = aSource.ref();
+	state->target = aTarget.ref();
+	GraphStep step;
+	step.name = "copy";
+	step.run = &CopyStep::Run;
+	step.operands = { { &state->source, aSource.storage, false }, { &state->target, aTarget.storage, true } };
+	step.state = state;
+	Record(std::move(step));
+}
+
+// Greedy placement: the largest intermediates first, each at the lowest offset where it overlaps
+// no placed intermediate that is live during any of its steps
+void TensorGraph::PlanArena(const std::vector<TensorStorage*>& aOutputs) {
+	for (TensorStorage* output : aOutputs) {
+		auto found = usages.find(output);
+		if (found != usages.end()) found->second.last = steps.size(); // Live after the last step
+	}
+
+	std::vector<std::pair<TensorStorage*, Usage*>> order;
+	for (auto& entry : usages) {
+		if (entry.second.intermediate) order.emplace_back(entry.first, &entry.second);
+		else ++summary.inputs;
+	}
+	std::stable_sort(order.begin(), order.end(), [](const auto& x, const auto& y) { return x.first->size() > y.first->size(); });
+
+	std::vector<std::pair<TensorStorage*, Usage*>> placed;
+	std::vector<std::pair<size_t, size_t>> conflicts; // [begin, end) in the arena
+	size_t arenaBytes = 0;
+	for (auto& item : order) {
+		const size_t bytes = AlignedBytes(item.first->size());
+		conflicts.clear();
+		for (const auto& other : placed) {
+			if (other.second->first <= item.second->last && item.second->first <= other.second->last) {
+				conflicts.emplace_back(other.second->offset, other.second->offset + AlignedBytes(other.first->size()));
+			}
+		}
+		std::sort(conflicts.begin(), conflicts.end());
+		size_t offset = 0;
+		for (const auto& conflict : conflicts) {
+			if (offset + bytes <= conflict.first) break;
+			offset = std::max(offset, conflict.second);
+		}
+		item.second->offset = offset;
+		placed.push_back(item);
+		arenaBytes = std::max(arenaBytes, offset + bytes);
+		++summary.intermediates;
+		summary.intermediateBytes += item.first->size();
+	}
+	summary.arenaBytes = arenaBytes;
+}
+
+void TensorGraph::endCapture(const std::vector<Tensor*>& aOutputs) {
+	if (capturing != this) {
+		std::cerr << "Error: endCapture without a matching beginCapture." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	capturing = nullptr;
+
+	std::vector<TensorStorage*> outputStorages;
+	for (const Tensor* output : aOutputs) outputStorages.push_back(output->storage.get());
+	PlanArena(outputStorages);
+	arena = std::make_shared<TensorStorage>(std::max<size_t>(summary.arenaBytes, 1), StorageInit::Uninitialized);
+
+	// Point the steps into the arena and let go of the intermediates' own storage
+	for (GraphStep& step : steps) {
+		for (GraphOperand& operand : step.operands) {
+			if (!operand.storage) continue;
+			const Usage& usage = usages.at(operand.storage.get());
+			if (!usage.intermediate) continue;
+			unsigned char* data = static_cast<unsigned char*>(operand.ref->data);
+			operand.ref->data = arena->data() + usage.offset + (data - operand.storage->data());
+			operand.storage.reset();
+		}
+	}
+
+	// The outputs move into the arena with the values they were captured with
+	std::vector<TensorStorage*> moved;
+	for (Tensor* output : aOutputs) {
+		auto found = usages.find(output->storage.get());
+		if (found == usages.end() || !found->second.intermediate) continue;
+		unsigned char* place = arena->data() + found->second.offset;
+		if (std::find(moved.begin(), moved.end(), found->first) == moved.end()) {
+			std::memcpy(place, found->first->data(), found->first->size());
+			moved.push_back(found->first);
+		}
+		output->offset = (found->second.offset + output->offset * DTypeSize(output->dtype)) / DTypeSize(output->dtype);
+		output->storage = arena;
+	}
+
+	summary.steps = steps.size();
+	usages.clear();
+	captured = true;
+}
+
+void TensorGraph::replay() {
+	if (!captured) {
+		std::cerr << "Error: Replay of a graph that has not been captured." << "\n";
+		std::exit(EXIT_FAILURE);
+	}
+	for (GraphStep& step : steps) {
+		TraceScope trace(step.name, Device::cpu);
+		step.run(step.state.get());
+	}
+}
+
+GraphStats TensorGraph::stats() const {
+	return summary;
+}
@@ -0,0 +1,159 @@
+#include "cpu_elementwise.h"
+#include "cpu_features.h"
+#include <type_traits>
+
+#if defined(TENSOR_X86)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/*********** Scalar form *************/
+// Resolved at compile time, so the loops below contain no switch and no NaN or zero checks.
+// Only integer division needs a guard, since dividing an int by zero traps.
+template<OperationType Op, class T>
+inline T ApplyScalar(T a, T b) {
+    if constexpr (Op == OperationType::Addition) return a + b;
+    else if constexpr (Op == OperationType::Subtraction) return a - b;
+    else if constexpr (Op == OperationType::Multiplication) return a * b;
+    else if constexpr (std::is_integral<T>::value) return b == 0 ? T(0) : a / b;
+    else return a / b;
+}
+
+/*********** Portable kernel *************/
+// Unit-stride and broadcast runs are separate 'omp simd' loops the compiler vectorizes for the
+// baseline ISA; any other stride falls through to a plain strided loop.
+template<OperationType Op, class T>
+void RunGeneric(const void* aPtr, int sa, const void* bPtr, int sb, void* outPtr, int so, int n) {
+    const T* a = static_cast<const T*>(aPtr);
+    const T* b = static_cast<const T*>(bPtr);
+    T* out = static_cast<T*>(outPtr);
+    if (so == 1 && sa == 1 && sb == 1) {
+        #pragma omp simd
+        for (int k = 0; k < n; ++k) out[k] = ApplyScalar<Op>(a[k], b[k]);
+    }
+    else if (so == 1 && sa == 1 && sb == 0) {
+        const T scalar = b[0];
+        #pragma omp simd
+        for (int k = 0; k < n; ++k) out[k] = ApplyScalar<Op>(a[k], scalar);
+    }
+    else if (so == 1 && sa == 0 && sb == 1) {
+        const T scalar = a[0];
+        #pragma omp simd
+        for (int k = 0; k < n; ++k) out[k] = ApplyScalar<Op>(scalar, b[k]);
+    }
+    else {
+        for (int k = 0; k < n; ++k) {
+            out[(size_t)k * so] = ApplyScalar<Op>(a[(size_t)k * sa], b[(size_t)k * sb]);
+        }
+    }
+}
+
+#if defined(TENSOR_X86)
+/*********** SIMD kernels *************/
+// NAME<Op> handles runs with a unit-stride output and unit-stride or broadcast inputs using the
+// given intrinsics (REG holds W elements of T); other strides go to RunGeneric.
+#define DEFINE_SIMD_RUN(NAME, TARGET, T, REG, W, LOADU, STOREU, SET1, ADD, SUB, MUL, DIV) \
+    template<OperationType Op> \
+    TARGET inline REG NAME##Apply(REG a, REG b) { \
+        if constexpr (Op == OperationType::Addition) return ADD(a, b); \
+        else if constexpr (Op == OperationType::Subtraction) return SUB(a, b); \
+        else if constexpr (Op == OperationType::Multiplication) return MUL(a, b); \
+        else return DIV(a, b); \
+    } \
+    template<OperationType Op> \
+    TARGET void NAME(const void* aPtr, int sa, const void* bPtr, int sb, void* outPtr, int so, int n) { \
+        if (so != 1 || (sa != 0 && sa != 1) || (sb != 0 && sb != 1)) { \
+            return RunGeneric<Op, T>(aPtr, sa, bPtr, sb, outPtr, so, n); \
+        } \
+        const T* a = static_cast<const T*>(aPtr); \
+        const T* b = static_cast<const T*>(bPtr); \
+        T* out = static_cast<T*>(outPtr); \
+        int k = 0; \
+        if (sa == 1 && sb == 1) { \
+            for (; k + W <= n; k += W) STOREU(out + k, NAME##Apply<Op>(LOADU(a + k), LOADU(b + k))); \
+        } \
+        else if (sa == 1) { \
+            const REG vb = SET1(b[0]); \
+            for (; k + W <= n; k += W) STOREU(out + k, NAME##Apply<Op>(LOADU(a + k), vb)); \
+        } \
+        else if (sb == 1) { \
+            const REG va = SET1(a[0]); \
+            for (; k + W <= n; k += W) STOREU(out + k, NAME##Apply<Op>(va, LOADU(b + k))); \
+        } \
+        else { \
+            const REG value = NAME##Apply<Op>(SET1(a[0]), SET1(b[0])); \
+            for (; k + W <= n; k += W) STOREU(out + k, value); \
+        } \
+        for (; k < n; ++k) out[k] = ApplyScalar<Op>(a[(size_t)k * sa], b[(size_t)k * sb]); \
+    }
+
+DEFINE_SIMD_RUN(RunAVX2Float, TARGET_AVX2, float, __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps,
+    _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_div_ps)
+DEFINE_SIMD_RUN(RunAVX2Double, TARGET_AVX2, double, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd,
+    _mm256_set1_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd)
+DEFINE_SIMD_RUN(RunAVX512Float, TARGET_AVX512, float, __m512, 16, _mm512_loadu_ps, _mm512_storeu_ps,
+    _mm512_set1_ps, _mm512_add_ps, _mm512_sub_ps, _mm512_mul_ps, _mm512_div_ps)
+DEFINE_SIMD_RUN(RunAVX512Double, TARGET_AVX512, double, __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd,
+    _mm512_set1_pd, _mm512_add_pd, _mm512_sub_pd, _mm512_mul_pd, _mm512_div_pd)
+
+#undef DEFINE_SIMD_RUN
+#endif // TENSOR_X86
+
+enum class SimdLevel { Generic, AVX2, AVX512 };
+
+SimdLevel SelectSimdLevel() {
+    static const SimdLevel level = []() {
+#if defined(TENSOR_X86)
+        const CPUFeatures& features = GetCPUFeatures();
+        if (features.avx512f) return SimdLevel::AVX512;
+        if (features.avx2 && features.fma) return SimdLevel::AVX2;
+#endif
+        return SimdLevel::Generic;
+    }();
+    return level;
+}
+
+template<OperationType Op>
+ElementwiseKernel SelectForOperation(DType dtype) {
+    const SimdLevel level = SelectSimdLevel();
+    switch (dtype) {
+    case DType::float32:
+#if defined(TENSOR_X86)
+        if (level == SimdLevel::AVX512) return RunAVX512Float<Op>;
+        if (level == SimdLevel::AVX2) return RunAVX2Float<Op>;
+#endif
+        return RunGeneric<Op, float>;
+    case DType::float64:
+#if defined(TENSOR_X86)
+        if (level == SimdLevel::AVX512) return RunAVX512Double<Op>;
+        if (level == SimdLevel::AVX2) return RunAVX2Double<Op>;
+#endif
+        return RunGeneric<Op, double>;
+    case DType::int32:
+        return RunGeneric<Op, int32_t>;
+    default:
+        return nullptr; // float16/bfloat16 are computed in float32 by the fused expression loop
+    }
+}
+
+} // namespace
+
+
+ElementwiseKernel SelectElementwiseKernel(OperationType opType, DType dtype) {
+    switch (opType) {
+    case OperationType::Addition: return SelectForOperation<OperationType::Addition>(dtype);
+    case OperationType::Subtraction: return SelectForOperation<OperationType::Subtraction>(dtype);
+    case OperationType::Multiplication: return SelectForOperation<OperationType::Multiplication>(dtype);
+    case OperationType::Division: return SelectForOperation<OperationType::Division>(dtype);
+    default: return nullptr;
+    }
+}
+
+const char* ElementwiseCPUKernelName() {
+    switch (SelectSimdLevel()) {
+    case SimdLevel::AVX512: return "avx512";
+    case SimdLevel::AVX2: return "avx2";
+    default: return "generic";
+    }
+}
@@ -0,0 +1,51 @@
+#include "cpu_features.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace {
+
+CPUFeatures DetectCPUFeatures() {
+    CPUFeatures features;
+#if !defined(TENSOR_X86)
+    // Non-x86 hosts use the portable code paths
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    if (maxLeaf < 7) return features;
+
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool f16c = (info[2] & (1 << 29)) != 0;
+    if (!osxsave) return features;
+
+    // The OS must save the YMM (and for AVX-512, the opmask/ZMM) state on context switches
+    unsigned long long xcr0 = _xgetbv(0);
+    bool ymmState = (xcr0 & 0x6) == 0x6;
+    bool zmmState = (xcr0 & 0xE6) == 0xE6;
+
+    __cpuidex(info, 7, 0);
+    features.avx2 = ymmState && (info[1] & (1 << 5)) != 0;
+    features.fma = ymmState && fma;
+    features.f16c = ymmState && f16c;
+    features.avx512f = zmmState && (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 17)) != 0;
+#elif defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    features.avx2 = __builtin_cpu_supports("avx2");
+    features.fma = __builtin_cpu_supports("fma");
+    // __builtin_cpu_supports has no "f16c" on older compilers; every AVX2 CPU has F16C
+    features.f16c = features.avx2;
+    features.avx512f = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+#endif
+    return features;
+}
+
+} // namespace
+
+const CPUFeatures& GetCPUFeatures() {
+    static const CPUFeatures features = DetectCPUFeatures();
+    return features;
+}
@@ -0,0 +1,533 @@
+#include "cpu_gemm.h"
+#include "cpu_features.h"
+#include "thread_pool.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+
+#if defined(TENSOR_X86)
+#include <immintrin.h>
+#endif
+
+/* Blocking parameters
+*******************************************
+* KC: depth of a packed panel. An MR x KC sliver of A plus a KC x NR sliver of B stay in L1/L2.
+*     256 for float, 128 for double, so a panel takes the same number of bytes.
+* MC: rows of A packed per block (MC x KC elements, ~144 KB, sized for L2).
+* NC: columns of B packed per panel (KC x NC elements, sized for L3).
+* MC and NC are multiples of every micro-kernel's MR and NR.
+*/
+namespace {
+
+template<class T>
+constexpr int KCFor() { return 1024 / (int)sizeof(T); }
+constexpr int MC = 144;
+constexpr int NC = 4096;
+
+// Below this many multiply-adds sharing the work out costs more than the product itself
+constexpr long long ParallelThreshold = 64LL * 64 * 64;
+
+// Computes an MR x NR tile of C from a packed A sliver (kc x MR, MR-interleaved) and a packed
+// B sliver (kc x NR, NR-interleaved). Overwrites the tile, or adds to it when accumulate is set.
+template<class T>
+using MicroKernel = void (*)(int kc, const T* Ap, const T* Bp, T* C, int ldc, bool accumulate);
+
+template<class T>
+struct KernelInfo {
+    MicroKernel<T> kernel;
+    int MR;
+    int NR;
+    const char* name;
+};
+
+/*********** Portable micro-kernel *************/
+constexpr int GenericMR = 4;
+constexpr int GenericNR = 8;
+
+template<class T>
+void MicroKernelGeneric(int kc, const T* Ap, const T* Bp, T* C, int ldc, bool accumulate) {
+    T acc[GenericMR][GenericNR] = {};
+    for (int p = 0; p < kc; ++p) {
+        for (int i = 0; i < GenericMR; ++i) {
+            const T a = Ap[i];
+            for (int j = 0; j < GenericNR; ++j) {
+                acc[i][j] += a * Bp[j];
+            }
+        }
+        Ap += GenericMR;
+        Bp += GenericNR;
+    }
+    for (int i = 0; i < GenericMR; ++i) {
+        for (int j = 0; j < GenericNR; ++j) {
+            C[i * ldc + j] = accumulate ? C[i * ldc + j] + acc[i][j] : acc[i][j];
+        }
+    }
+}
+
+#if defined(TENSOR_X86)
+/*********** AVX2/FMA micro-kernel: 6 x 16, 12 ymm accumulators *************/
+#define GEMM_FMA_ROW_AVX2(i) \
+    a = _mm256_broadcast_ss(Ap + i); \
+    c##i##0 = _mm256_fmadd_ps(a, b0, c##i##0); \
+    c##i##1 = _mm256_fmadd_ps(a, b1, c##i##1);
+
+#define GEMM_STORE_ROW_AVX2(i) \
+    if (accumulate) { \
+        c##i##0 = _mm256_add_ps(c##i##0, _mm256_loadu_ps(C + i * ldc)); \
+        c##i##1 = _mm256_add_ps(c##i##1, _mm256_loadu_ps(C + i * ldc + 8)); \
+    } \
+    _mm256_storeu_ps(C + i * ldc, c##i##0); \
+    _mm256_storeu_ps(C + i * ldc + 8, c##i##1);
+
+TARGET_AVX2 void MicroKernelAVX2(int kc, const float* Ap, const float* Bp, float* C, int ldc, bool accumulate) {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+    for (int p = 0; p < kc; ++p) {
+        const __m256 b0 = _mm256_loadu_ps(Bp);
+        const __m256 b1 = _mm256_loadu_ps(Bp + 8);
+        __m256 a;
+        GEMM_FMA_ROW_AVX2(0)
+        GEMM_FMA_ROW_AVX2(1)
+        GEMM_FMA_ROW_AVX2(2)
+        GEMM_FMA_ROW_AVX2(3)
+        GEMM_FMA_ROW_AVX2(4)
+        GEMM_FMA_ROW_AVX2(5)
+        Ap += 6;
+        Bp += 16;
+    }
+
+    GEMM_STORE_ROW_AVX2(0)
+    GEMM_STORE_ROW_AVX2(1)
+    GEMM_STORE_ROW_AVX2(2)
+    GEMM_STORE_ROW_AVX2(3)
+    GEMM_STORE_ROW_AVX2(4)
+    GEMM_STORE_ROW_AVX2(5)
+}
+
+/*********** AVX-512 micro-kernel: 6 x 32, 12 zmm accumulators *************/
+#define GEMM_FMA_ROW_AVX512(i) \
+    a = _mm512_set1_ps(Ap[i]); \
+    c##i##0 = _mm512_fmadd_ps(a, b0, c##i##0); \
+    c##i##1 = _mm512_fmadd_ps(a, b1, c##i##1);
+
+#define GEMM_STORE_ROW_AVX512(i) \
+    if (accumulate) { \
+        c##i##0 = _mm512_add_ps(c##i##0, _mm512_loadu_ps(C + i * ldc)); \
+        c##i##1 = _mm512_add_ps(c##i##1, _mm512_loadu_ps(C + i * ldc + 16)); \
+    } \
+    _mm512_storeu_ps(C + i * ldc, c##i##0); \
+    _mm512_storeu_ps(C + i * ldc + 16, c##i##1);
+
+TARGET_AVX512 void MicroKernelAVX512(int kc, const float* Ap, const float* Bp, float* C, int ldc, bool accumulate) {
+    __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps();
+    __m512 c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();
+    __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps();
+    __m512 c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();
+    __m512 c40 = _mm512_setzero_ps(), c41 = _mm512_setzero_ps();
+    __m512 c50 = _mm512_setzero_ps(), c51 = _mm512_setzero_ps();
+
+    for (int p = 0; p < kc; ++p) {
+        const __m512 b0 = _mm512_loadu_ps(Bp);
+        const __m512 b1 = _mm512_loadu_ps(Bp + 16);
+        __m512 a;
+        GEMM_FMA_ROW_AVX512(0)
+        GEMM_FMA_ROW_AVX512(1)
+        GEMM_FMA_ROW_AVX512(2)
+        GEMM_FMA_ROW_AVX512(3)
+        GEMM_FMA_ROW_AVX512(4)
+        GEMM_FMA_ROW_AVX512(5)
+        Ap += 6;
+        Bp += 32;
+    }
+
+    GEMM_STORE_ROW_AVX512(0)
+    GEMM_STORE_ROW_AVX512(1)
+    GEMM_STORE_ROW_AVX512(2)
+    GEMM_STORE_ROW_AVX512(3)
+    GEMM_STORE_ROW_AVX512(4)
+    GEMM_STORE_ROW_AVX512(5)
+}
+
+/*********** Double precision AVX2/FMA micro-kernel: 6 x 8, 12 ymm accumulators *************/
+#define DGEMM_FMA_ROW_AVX2(i) \
+    a = _mm256_broadcast_sd(Ap + i); \
+    c##i##0 = _mm256_fmadd_pd(a, b0, c##i##0); \
+    c##i##1 = _mm256_fmadd_pd(a, b1, c##i##1);
+
+#define DGEMM_STORE_ROW_AVX2(i) \
+    if (accumulate) { \
+        c##i##0 = _mm256_add_pd(c##i##0, _mm256_loadu_pd(C + i * ldc)); \
+        c##i##1 = _mm256_add_pd(c##i##1, _mm256_loadu_pd(C + i * ldc + 4)); \
+    } \
+    _mm256_storeu_pd(C + i * ldc, c##i##0); \
+    _mm256_storeu_pd(C + i * ldc + 4, c##i##1);
+
+TARGET_AVX2 void DMicroKernelAVX2(int kc, const double* Ap, const double* Bp, double* C, int ldc, bool accumulate) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+
+    for (int p = 0; p < kc; ++p) {
+        const __m256d b0 = _mm256_loadu_pd(Bp);
+        const __m256d b1 = _mm256_loadu_pd(Bp + 4);
+        __m256d a;
+        DGEMM_FMA_ROW_AVX2(0)
+        DGEMM_FMA_ROW_AVX2(1)
+        DGEMM_FMA_ROW_AVX2(2)
+        DGEMM_FMA_ROW_AVX2(3)
+        DGEMM_FMA_ROW_AVX2(4)
+        DGEMM_FMA_ROW_AVX2(5)
+        Ap += 6;
+        Bp += 8;
+    }
+
+    DGEMM_STORE_ROW_AVX2(0)
+    DGEMM_STORE_ROW_AVX2(1)
+    DGEMM_STORE_ROW_AVX2(2)
+    DGEMM_STORE_ROW_AVX2(3)
+    DGEMM_STORE_ROW_AVX2(4)
+    DGEMM_STORE_ROW_AVX2(5)
+}
+
+/*********** Double precision AVX-512 micro-kernel: 6 x 16, 12 zmm accumulators *************/
+#define DGEMM_FMA_ROW_AVX512(i) \
+    a = _mm512_set1_pd(Ap[i]); \
+    c##i##0 = _mm512_fmadd_pd(a, b0, c##i##0); \
+    c##i##1 = _mm512_fmadd_pd(a, b1, c##i##1);
+
+#define DGEMM_STORE_ROW_AVX512(i) \
+    if (accumulate) { \
+        c##i##0 = _mm512_add_pd(c##i##0, _mm512_loadu_pd(C + i * ldc)); \
+        c##i##1 = _mm512_add_pd(c##i##1, _mm512_loadu_pd(C + i * ldc + 8)); \
+    } \
+    _mm512_storeu_pd(C + i * ldc, c##i##0); \
+    _mm512_storeu_pd(C + i * ldc + 8, c##i##1);
+
+TARGET_AVX512 void DMicroKernelAVX512(int kc, const double* Ap, const double* Bp, double* C, int ldc, bool accumulate) {
+    __m512d c00 = _mm512_setzero_pd(), c01 = _mm512_setzero_pd();
+    __m512d c10 = _mm512_setzero_pd(), c11 = _mm512_setzero_pd();
+    __m512d c20 = _mm512_setzero_pd(), c21 = _mm512_setzero_pd();
+    __m512d c30 = _mm512_setzero_pd(), c31 = _mm512_setzero_pd();
+    __m512d c40 = _mm512_setzero_pd(), c41 = _mm512_setzero_pd();
+    __m512d c50 = _mm512_setzero_pd(), c51 = _mm512_setzero_pd();
+
+    for (int p = 0; p < kc; ++p) {
+        const __m512d b0 = _mm512_loadu_pd(Bp);
+        const __m512d b1 = _mm512_loadu_pd(Bp + 8);
+        __m512d a;
+        DGEMM_FMA_ROW_AVX512(0)
+        DGEMM_FMA_ROW_AVX512(1)
+        DGEMM_FMA_ROW_AVX512(2)
+        DGEMM_FMA_ROW_AVX512(3)
+        DGEMM_FMA_ROW_AVX512(4)
+        DGEMM_FMA_ROW_AVX512(5)
+        Ap += 6;
+        Bp += 16;
+    }
+
+    DGEMM_STORE_ROW_AVX512(0)
+    DGEMM_STORE_ROW_AVX512(1)
+    DGEMM_STORE_ROW_AVX512(2)
+    DGEMM_STORE_ROW_AVX512(3)
+    DGEMM_STORE_ROW_AVX512(4)
+    DGEMM_STORE_ROW_AVX512(5)
+}
+#endif // TENSOR_X86
+
+template<class T>
+const KernelInfo<T>& SelectKernel();
+
+template<>
+const KernelInfo<float>& SelectKernel<float>() {
+    static const KernelInfo<float> selected = []() {
+#if defined(TENSOR_X86)
+        const CPUFeatures& features = GetCPUFeatures();
+        if (features.avx512f) return KernelInfo<float>{ MicroKernelAVX512, 6, 32, "avx512" };
+        if (features.avx2 && features.fma) return KernelInfo<float>{ MicroKernelAVX2, 6, 16, "avx2" };
+#endif
+        return KernelInfo<float>{ MicroKernelGeneric<float>, GenericMR, GenericNR, "generic" };
+    }();
+    return selected;
+}
+
+template<>
+const KernelInfo<double>& SelectKernel<double>() {
+    static const KernelInfo<double> selected = []() {
+#if defined(TENSOR_X86)
+        const CPUFeatures& features = GetCPUFeatures();
+        if (features.avx512f) return KernelInfo<double>{ DMicroKernelAVX512, 6, 16, "avx512" };
+        if (features.avx2 && features.fma) return KernelInfo<double>{ DMicroKernelAVX2, 6, 8, "avx2" };
+#endif
+        return KernelInfo<double>{ MicroKernelGeneric<double>, GenericMR, GenericNR, "generic" };
+    }();
+    return selected;
+}
+
+/*********** Packing *************/
+// Pack rows [0, mc) x depth [0, kc) of A into MR-row micro-panels: panel r holds
+// Ap[(r * kc + p) * MR + i] = A(r * MR + i, p). Rows past mc are zero-filled.
+template<class T>
+void PackPanelA(int mc, int kc, const T* A, int rsA, int csA, T* Ap, int MR, int panel) {
+    const int rowStart = panel * MR;
+    const int rows = std::min(MR, mc - rowStart);
+    T* dst = Ap + (size_t)panel * kc * MR;
+    for (int p = 0; p < kc; ++p) {
+        int i = 0;
+        for (; i < rows; ++i) {
+            dst[p * MR + i] = A[(size_t)(rowStart + i) * rsA + (size_t)p * csA];
+        }
+        for (; i < MR; ++i) {
+            dst[p * MR + i] = T(0);
+        }
+    }
+}
+
+// Pack depth [0, kc) x columns [0, nc) of B into NR-column micro-panels: panel c holds
+// Bp[(c * kc + p) * NR + j] = B(p, c * NR + j). Columns past nc are zero-filled.
+template<class T>
+void PackPanelB(int kc, int nc, const T* B, int rsB, int csB, T* Bp, int NR, int panel) {
+    const int colStart = panel * NR;
+    const int cols = std::min(NR, nc - colStart);
+    T* dst = Bp + (size_t)panel * kc * NR;
+    for (int p = 0; p < kc; ++p) {
+        const T* src = B + (size_t)p * rsB + (size_t)colStart * csB;
+        int j = 0;
+        if (csB == 1) {
+            for (; j < cols; ++j) dst[p * NR + j] = src[j];
+        }
+        else {
+            for (; j < cols; ++j) dst[p * NR + j] = src[(size_t)j * csB];
+        }
+        for (; j < NR; ++j) {
+            dst[p * NR + j] = T(0);
+        }
+    }
+}
+
+/*********** Epilogue *************/
+// Rational approximations of erf and tanh in float32, within a few ulp of std::erf and std::tanh.
+// Being only multiply-adds, a division and clamps, they vectorize in the tile loops, where the
+// library calls would not. GCC if-converts the clamps only without -ftrapping-math, which
+// CMakeLists.txt turns off for this file.
+inline float ErfFloat(float a) {
+    const float x = std::min(std::max(a, -4.0f), 4.0f); // erf is +-1 in float32 outside
+    const float x2 = x * x;
+    float p = x2 * -2.72614225801306e-10f + 2.77068142495902e-08f;
+    p = x2 * p + -2.10102402082508e-06f;
+    p = x2 * p + -5.69250639462346e-05f;
+    p = x2 * p + -7.34990630326855e-04f;
+    p = x2 * p + -2.95459980854025e-03f;
+    p = x2 * p + -1.60960333262415e-02f;
+    float q = x2 * -1.45660718464996e-05f + -2.13374055278905e-04f;
+    q = x2 * q + -1.68282697438203e-03f;
+    q = x2 * q + -7.37332916720468e-03f;
+    q = x2 * q + -1.42647390514189e-02f;
+    return x * p / q;
+}
+
+inline float TanhFloat(float a) {
+    const float x = std::min(std::max(a, -7.99881172180175781f), 7.99881172180175781f); // tanh is +-1 in float32 outside
+    const float x2 = x * x;
+    float p = x2 * -2.76076847742355e-16f + 2.00018790482477e-13f;
+    p = x2 * p + -8.60467152213735e-11f;
+    p = x2 * p + 5.12229709037114e-08f;
+    p = x2 * p + 1.48572235717979e-05f;
+    p = x2 * p + 6.37261928875436e-04f;
+    p = x2 * p + 4.89352455891786e-03f;
+    float q = x2 * 1.19825839466702e-06f + 1.18534705686654e-04f;
+    q = x2 * q + 2.26843463243900e-03f;
+    q = x2 * q + 4.89352518554385e-03f;
+    return std::abs(a) < 0.0004f ? a : x * p / q;
+}
+
+template<class T>
+inline T Erf(T x) {
+    if constexpr (std::is_same<T, float>::value) return ErfFloat(x);
+    else return std::erf(x);
+}
+
+template<class T>
+inline T Tanh(T x) {
+    if constexpr (std::is_same<T, float>::value) return TanhFloat(x);
+    else return std::tanh(x);
+}
+
+template<Activation A, class T>
+inline T Activate(T x) {
+    if constexpr (A == Activation::ReLU) return std::max(x, T(0));
+    else if constexpr (A == Activation::GELU) return T(0.5) * x * (T(1) + Erf(x * T(0.70710678118654752)));
+    else if constexpr (A == Activation::Tanh) return Tanh(x);
+    else return x;
+}
+
+template<Activation A, class T>
+void FinishTileAs(T* C, int ldc, int rows, int cols, const T* bias, T scale) {
+    for (int i = 0; i < rows; ++i) {
+        T* row = C + (size_t)i * ldc;
+        if (bias) {
+#pragma omp simd
+            for (int j = 0; j < cols; ++j) row[j] = Activate<A>(scale * row[j] + bias[j]);
+        }
+        else {
+#pragma omp simd
+            for (int j = 0; j < cols; ++j) row[j] = Activate<A>(scale * row[j]);
+        }
+    }
+}
+
+// Apply the epilogue to a rows x cols tile of C whose first column is column j0 of the product
+template<class T>
+void FinishTile(T* C, int ldc, int rows, int cols, int j0, const GemmEpilogue<T>& epilogue) {
+    const T* bias = epilogue.bias ? epilogue.bias + j0 : nullptr;
+    switch (epilogue.activation) {
+    case Activation::ReLU: return FinishTileAs<Activation::ReLU>(C, ldc, rows, cols, bias, epilogue.scale);
+    case Activation::GELU: return FinishTileAs<Activation::GELU>(C, ldc, rows, cols, bias, epilogue.scale);
+    case Activation::Tanh: return FinishTileAs<Activation::Tanh>(C, ldc, rows, cols, bias, epilogue.scale);
+    default: return FinishTileAs<Activation::None>(C, ldc, rows, cols, bias, epilogue.scale);
+    }
+}
+
+// Packed panels of the calling thread, kept between products and only ever grown, so repeated
+// products of the same shapes (e.g. TensorGraph::replay) allocate nothing. Loops issued from a
+// pool chunk run inline, so a thread is never inside two products at once.
+template<class T>
+struct PackingBuffers {
+    std::vector<T> a;
+    std::vector<T> b;
+};
+
+template<class T>
+PackingBuffers<T>& ThreadPackingBuffers() {
+    thread_local PackingBuffers<T> buffers;
+    return buffers;
+}
+
+template<class T>
+void GemmCPU(int M, int N, int K,
+    const T* A, int rsA, int csA,
+    const T* B, int rsB, int csB,
+    T* C, int ldc, const GemmEpilogue<T>& epilogue) {
+    if (M <= 0 || N <= 0) return;
+    const bool finish = epilogue.Active();
+    if (K <= 0) {
+        for (int i = 0; i < M; ++i) {
+            std::fill(C + (size_t)i * ldc, C + (size_t)i * ldc + N, T(0));
+        }
+        if (finish) FinishTile(C, ldc, M, N, 0, epilogue);
+        return;
+    }
+
+    const KernelInfo<T>& info = SelectKernel<T>();
+    const int KC = KCFor<T>();
+    const int MR = info.MR;
+    const int NR = info.NR;
+
+    PackingBuffers<T>& buffers = ThreadPackingBuffers<T>();
+    const size_t sizeA = (size_t)MC * KC;
+    const size_t sizeB = (size_t)KC * std::min(NC, (N + NR - 1) / NR * NR);
+    if (buffers.a.size() < sizeA) buffers.a.resize(sizeA);
+    if (buffers.b.size() < sizeB) buffers.b.resize(sizeB);
+    T* const packedA = buffers.a.data(); // The pool threads share the caller's buffers
+    T* const packedB = buffers.b.data();
+    const bool parallel = (long long)M * N * K >= ParallelThreshold;
+
+    // Each step below is one loop over the pool, which returns when every thread is done with it
+    ThreadPool& pool = ThreadPool::Instance();
+    auto forEach = [&pool, parallel](int aCount, auto&& aBody) {
+        pool.ParallelFor(aCount, parallel ? 1 : aCount, [&aBody](size_t aBegin, size_t aEnd) {
+            for (size_t i = aBegin; i < aEnd; ++i) aBody((int)i);
+        });
+    };
+
+    for (int jc = 0; jc < N; jc += NC) {
+        const int nc = std::min(NC, N - jc);
+        const int numPanelsB = (nc + NR - 1) / NR;
+
+        for (int pc = 0; pc < K; pc += KC) {
+            const int kc = std::min(KC, K - pc);
+            const bool accumulate = pc > 0; // first depth block overwrites C
+            const bool last = pc + kc == K; // and the last one finishes it
+
+            // All threads cooperatively pack the shared B panel
+            forEach(numPanelsB, [&](int panel) {
+                PackPanelB(kc, nc, B + (size_t)pc * rsB + (size_t)jc * csB, rsB, csB,
+                    packedB, NR, panel);
+            });
+
+            for (int ic = 0; ic < M; ic += MC) {
+                const int mc = std::min(MC, M - ic);
+                const int numPanelsA = (mc + MR - 1) / MR;
+
+                forEach(numPanelsA, [&](int panel) {
+                    PackPanelA(mc, kc, A + (size_t)ic * rsA + (size_t)pc * csA, rsA, csA,
+                        packedA, MR, panel);
+                });
+
+                // Macro-kernel: micro-tiles ordered so a thread reuses one B sliver across
+                // consecutive A slivers. Stolen tiles come from the far end of another thread's
+                // share, so each thread still walks a contiguous run of them.
+                const int numTiles = numPanelsA * numPanelsB;
+                forEach(numTiles, [&](int tile) {
+                    const int jr = tile / numPanelsA;
+                    const int ir = tile % numPanelsA;
+                    const int mr = std::min(MR, mc - ir * MR);
+                    const int nr = std::min(NR, nc - jr * NR);
+                    const T* Ap = packedA + (size_t)ir * kc * MR;
+                    const T* Bp = packedB + (size_t)jr * kc * NR;
+                    T* Ctile = C + (size_t)(ic + ir * MR) * ldc + jc + jr * NR;
+
+                    if (mr == MR && nr == NR) {
+                        info.kernel(kc, Ap, Bp, Ctile, ldc, accumulate);
+                    }
+                    else {
+                        // Edge tiles are computed into this scratch tile and then merged into C
+                        T edgeTile[32 * 32];
+                        info.kernel(kc, Ap, Bp, edgeTile, NR, false);
+                        for (int i = 0; i < mr; ++i) {
+                            for (int j = 0; j < nr; ++j) {
+                                T value = edgeTile[i * NR + j];
+                                Ctile[(size_t)i * ldc + j] = accumulate ? Ctile[(size_t)i * ldc + j] + value : value;
+                            }
+                        }
+                    }
+                    if (finish && last) FinishTile(Ctile, ldc, mr, nr, jc + jr * NR, epilogue);
+                });
+                // The loop returns once every tile is done, so packedA can be repacked
+            }
+        }
+    }
+}
+
+} // namespace
+
+
+void SgemmCPU(int M, int N, int K,
+    const float* A, int rsA, int csA,
+    const float* B, int rsB, int csB,
+    float* C, int ldc, const GemmEpilogue<float>& epilogue) {
+    GemmCPU<float>(M, N, K, A, rsA, csA, B, rsB, csB, C, ldc, epilogue);
+}
+
+void DgemmCPU(int M, int N, int K,
+    const double* A, int rsA, int csA,
+    const double* B, int rsB, int csB,
+    double* C, int ldc, const GemmEpilogue<double>& epilogue) {
+    GemmCPU<double>(M, N, K, A, rsA, csA, B, rsB, csB, C, ldc, epilogue);
+}
+
+const char* SgemmCPUKernelName() {
+    return SelectKernel<float>().name;
+}
+
+const char* DgemmCPUKernelName() {
+    return SelectKernel<double>().name;
+}
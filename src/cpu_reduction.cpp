@@ -0,0 +1,210 @@
+#include "cpu_reduction.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+// Reductions of fewer elements than this run on the calling thread
+constexpr size_t ReductionParallelThreshold = 1 << 15;
+// Columns accumulated together when reducing over a non-innermost dimension
+constexpr int ColumnBlock = 256;
+// Shortest part of a long run reduced by one thread
+constexpr long long RunPartLength = 1 << 13;
+// Most parts a run is split into, so their partial results fit on the stack
+constexpr long long MaxRunParts = 256;
+
+template<class T>
+using AccType = typename std::conditional<std::is_integral<T>::value, int64_t, double>::type;
+
+template<class T>
+inline bool IsNaN(T x) { return x != x; } // Always false for integers
+
+/*********** Contiguous runs *************/
+// Reduce x[0], ..., x[n - 1] in an 'omp simd' loop with one partial result per lane. Max, Min and
+// ArgMax need n > 0.
+template<ReductionType R, class T>
+void ReduceRun(const T* x, long long n, double& value, int& index) {
+    if constexpr (R == ReductionType::Sum) {
+        AccType<T> acc = 0;
+        #pragma omp simd reduction(+:acc)
+        for (long long k = 0; k < n; ++k) acc += x[k];
+        value = (double)acc;
+    }
+    else {
+        T best = x[0];
+        bool nan = false;
+        if constexpr (R == ReductionType::Min) {
+            #pragma omp simd reduction(min:best) reduction(||:nan)
+            for (long long k = 0; k < n; ++k) {
+                best = x[k] < best ? x[k] : best;
+                nan = nan || IsNaN(x[k]);
+            }
+        }
+        else {
+            #pragma omp simd reduction(max:best) reduction(||:nan)
+            for (long long k = 0; k < n; ++k) {
+                best = x[k] > best ? x[k] : best;
+                nan = nan || IsNaN(x[k]);
+            }
+        }
+        value = nan ? std::numeric_limits<double>::quiet_NaN() : (double)best;
+
+        if constexpr (R == ReductionType::ArgMax) {
+            // Second pass for the first position holding the maximum (or a NaN)
+            long long first = n;
+            #pragma omp simd reduction(min:first)
+            for (long long k = 0; k < n; ++k) {
+                const bool match = nan ? IsNaN(x[k]) : x[k] == best;
+                first = match && k < first ? k : first;
+            }
+            index = (int)first;
+        }
+    }
+}
+
+// A long run split into parts reduced on the pool's threads, whose results are combined in order:
+// the first NaN, else the first part holding the maximum (minimum), so ArgMax still finds the
+// first position. Sums add the parts' sums.
+template<ReductionType R, class T>
+void ReduceRunParallel(const T* x, long long n, double& value, int& index) {
+    ThreadPool& pool = ThreadPool::Instance();
+    const long long parts = std::max(1LL, std::min<long long>({ (long long)pool.Threads() * ThreadPool::ChunksPerThread,
+        n / RunPartLength, MaxRunParts }));
+    double partValues[MaxRunParts];
+    int partIndices[MaxRunParts];
+    auto partBegin = [n, parts](long long aPart) { return n * aPart / parts; };
+    pool.ParallelFor((size_t)parts, 1, [&](size_t aBegin, size_t aEnd) {
+        for (size_t p = aBegin; p < aEnd; ++p) {
+            const long long begin = partBegin((long long)p);
+            ReduceRun<R>(x + begin, partBegin((long long)p + 1) - begin, partValues[p], partIndices[p]);
+        }
+    });
+
+    value = partValues[0];
+    index = partIndices[0];
+    for (long long p = 1; p < parts; ++p) {
+        const double v = partValues[p];
+        if constexpr (R == ReductionType::Sum) {
+            value += v;
+            continue;
+        }
+        if (std::isnan(value)) break;
+        if (std::isnan(v) || (R == ReductionType::Min ? v < value : v > value)) {
+            value = v;
+            index = (int)(partBegin(p) + partIndices[p]);
+        }
+    }
+}
+
+/*********** Column blocks *************/
+// Reduce columns j0 .. j0 + count - 1 of the n x inner matrix x over its rows. Each row updates
+// the block's partial results in one 'omp simd' loop, so memory is read row by row.
+template<ReductionType R, class T>
+void ReduceColumns(const T* x, int n, int inner, int j0, int count, double* values, int* indices) {
+    constexpr bool IsMin = R == ReductionType::Min;
+    AccType<T> acc[ColumnBlock];
+    T best[ColumnBlock];
+    int bestIndex[ColumnBlock];
+    bool nan[ColumnBlock];
+
+    if constexpr (R == ReductionType::Sum) {
+        std::fill(acc, acc + count, AccType<T>(0));
+        for (int k = 0; k < n; ++k) {
+            const T* row = x + (size_t)k * inner + j0;
+            #pragma omp simd
+            for (int j = 0; j < count; ++j) acc[j] += row[j];
+        }
+        for (int j = 0; j < count; ++j) values[j0 + j] = (double)acc[j];
+        return;
+    }
+
+    for (int j = 0; j < count; ++j) {
+        best[j] = x[j0 + j];
+        bestIndex[j] = 0;
+        nan[j] = IsNaN(best[j]);
+    }
+    for (int k = 1; k < n; ++k) {
+        const T* row = x + (size_t)k * inner + j0;
+        #pragma omp simd
+        for (int j = 0; j < count; ++j) {
+            const T v = row[j];
+            const bool better = IsMin ? v < best[j] : v > best[j];
+            best[j] = better ? v : best[j];
+            if constexpr (R == ReductionType::ArgMax) {
+                bestIndex[j] = !nan[j] && (better || IsNaN(v)) ? k : bestIndex[j];
+            }
+            nan[j] = nan[j] || IsNaN(v);
+        }
+    }
+    for (int j = 0; j < count; ++j) {
+        values[j0 + j] = nan[j] ? std::numeric_limits<double>::quiet_NaN() : (double)best[j];
+        if constexpr (R == ReductionType::ArgMax) indices[j0 + j] = bestIndex[j];
+    }
+}
+
+template<ReductionType R, class T>
+void ReduceTyped(const T* x, int outer, int n, int inner, double* values, int* indices) {
+    const size_t numel = (size_t)outer * n * inner;
+    const bool parallel = numel > ReductionParallelThreshold;
+    ThreadPool& pool = ThreadPool::Instance();
+    if (inner == 1) {
+        // Many runs: one per thread at a time. Few long runs: each one split across the threads.
+        if (outer >= pool.Threads()) {
+            pool.ParallelFor(outer, parallel ? 1 : outer, [&](size_t aBegin, size_t aEnd) {
+                for (size_t o = aBegin; o < aEnd; ++o) {
+                    int index = 0;
+                    ReduceRun<R>(x + o * n, n, values[o], index);
+                    if (indices) indices[o] = index;
+                }
+            });
+        }
+        else {
+            for (int o = 0; o < outer; ++o) {
+                int index = 0;
+                if (parallel) ReduceRunParallel<R>(x + (size_t)o * n, n, values[o], index);
+                else ReduceRun<R>(x + (size_t)o * n, n, values[o], index);
+                if (indices) indices[o] = index;
+            }
+        }
+        return;
+    }
+    const int blocks = (inner + ColumnBlock - 1) / ColumnBlock;
+    const size_t numBlocks = (size_t)outer * blocks;
+    pool.ParallelFor(numBlocks, parallel ? 1 : numBlocks, [&](size_t aBegin, size_t aEnd) {
+        for (size_t block = aBegin; block < aEnd; ++block) {
+            const size_t o = block / blocks;
+            const int j0 = (int)(block % blocks) * ColumnBlock;
+            ReduceColumns<R>(x + o * n * inner, n, inner, j0, std::min(ColumnBlock, inner - j0),
+                values + o * inner, indices ? indices + o * inner : nullptr);
+        }
+    });
+}
+
+template<ReductionType R>
+void ReduceDType(const void* data, DType dtype, int outer, int n, int inner, double* values, int* indices) {
+    switch (dtype) {
+    case DType::float32: return ReduceTyped<R>(static_cast<const float*>(data), outer, n, inner, values, indices);
+    case DType::float64: return ReduceTyped<R>(static_cast<const double*>(data), outer, n, inner, values, indices);
+    case DType::int32: return ReduceTyped<R>(static_cast<const int32_t*>(data), outer, n, inner, values, indices);
+    default: throw std::invalid_argument("Reductions run on float32, float64 or int32 data.");
+    }
+}
+
+} // namespace
+
+void ReduceCPU(const void* data, DType dtype, int outer, int n, int inner, ReductionType type,
+    double* values, int* indices) {
+    switch (type) {
+    case ReductionType::Sum:
+    case ReductionType::Mean: return ReduceDType<ReductionType::Sum>(data, dtype, outer, n, inner, values, nullptr);
+    case ReductionType::Max: return ReduceDType<ReductionType::Max>(data, dtype, outer, n, inner, values, nullptr);
+    case ReductionType::Min: return ReduceDType<ReductionType::Min>(data, dtype, outer, n, inner, values, nullptr);
+    case ReductionType::ArgMax: return ReduceDType<ReductionType::ArgMax>(data, dtype, outer, n, inner, values, indices);
+    }
+}
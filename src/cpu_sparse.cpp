@@ -0,0 +1,75 @@
+#include "cpu_sparse.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+void SpmvRows(const CSRRef& A, const float* x, int ldx, float* y, int ldy, int rowBegin, int rowEnd) {
+    for (int r = rowBegin; r < rowEnd; ++r) {
+        float acc = 0.0f;
+        const int end = A.rowPointers[r + 1];
+        #pragma omp simd reduction(+:acc)
+        for (int k = A.rowPointers[r]; k < end; ++k) {
+            acc += A.values[k] * x[(size_t)A.columnIndices[k] * ldx];
+        }
+        y[(size_t)r * ldy] = acc;
+    }
+}
+
+void SpmmRows(const CSRRef& A, const float* B, int ldb, float* C, int ldc, int N, int rowBegin, int rowEnd) {
+    for (int r = rowBegin; r < rowEnd; ++r) {
+        float* c = C + (size_t)r * ldc;
+        std::fill(c, c + N, 0.0f);
+        for (int k = A.rowPointers[r]; k < A.rowPointers[r + 1]; ++k) {
+            const float v = A.values[k];
+            const float* b = B + (size_t)A.columnIndices[k] * ldb;
+            #pragma omp simd
+            for (int n = 0; n < N; ++n) c[n] += v * b[n];
+        }
+    }
+}
+
+// First row of each of parts ranges holding about equal shares of rowPointers[r] + r, the
+// nonzeros plus rows before row r. The cost is increasing in r, so each boundary is a binary search.
+std::vector<int> BalancedRowRanges(const CSRRef& A, int parts) {
+    const long long total = (long long)A.nnz() + A.rows;
+    std::vector<int> begins(parts + 1);
+    begins[0] = 0;
+    begins[parts] = A.rows;
+    for (int p = 1; p < parts; ++p) {
+        const long long target = total * p / parts;
+        int low = begins[p - 1], high = A.rows;
+        while (low < high) {
+            const int mid = low + (high - low) / 2;
+            if ((long long)A.rowPointers[mid] + mid < target) low = mid + 1;
+            else high = mid;
+        }
+        begins[p] = low;
+    }
+    return begins;
+}
+
+} // namespace
+
+void SpmmCPU(const CSRRef& A, const float* B, int ldb, float* C, int ldc, int N) {
+    if (A.rows == 0 || N == 0) return;
+    auto rows = [&](int aBegin, int aEnd) {
+        if (N == 1) SpmvRows(A, B, ldb, C, ldc, aBegin, aEnd);
+        else SpmmRows(A, B, ldb, C, ldc, N, aBegin, aEnd);
+    };
+
+    ThreadPool& pool = ThreadPool::Instance();
+    const size_t work = A.nnz() * (size_t)N + A.rows;
+    if (pool.Threads() == 1 || work < SparseParallelThreshold) {
+        rows(0, A.rows);
+        return;
+    }
+    // ChunksPerThread ranges per thread, as the pool would cut a dense loop, but of equal cost
+    // rather than equal length; one range per chunk so that stealing still evens out the rest
+    const int parts = std::min(A.rows, pool.Threads() * ThreadPool::ChunksPerThread);
+    const std::vector<int> begins = BalancedRowRanges(A, parts);
+    pool.ParallelFor(parts, 1, [&](size_t aBegin, size_t aEnd) {
+        for (size_t p = aBegin; p < aEnd; ++p) rows(begins[p], begins[p + 1]);
+    });
+}
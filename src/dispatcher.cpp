@@ -0,0 +1,207 @@
+#include "dispatcher.h"
+#include "opencl_setup.h"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace {
+
+thread_local int pinnedDevice = -1; // Device of the innermost ScopedDevice, or -1
+
+TensorRef DenseRef(std::vector<float>& aData, int aRows, int aCols) {
+    TensorRef ref;
+    ref.data = aData.data();
+    ref.dtype = DType::float32;
+    ref.ndim = 2;
+    ref.shape[0] = aRows;
+    ref.shape[1] = aCols;
+    ref.strides[0] = aCols;
+    ref.strides[1] = 1;
+    return ref;
+}
+
+// Fastest of a few runs, in seconds, after one untimed run
+template<class F>
+double BestSeconds(int aRuns, F&& aRun) {
+    aRun();
+    double best = 1e30;
+    for (int i = 0; i < aRuns; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        aRun();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+double MatmulSeconds(OperationInterface& aPerformer, int n, int aRuns) {
+    std::vector<float> a((size_t)n * n, 1.0f), b((size_t)n * n, 0.5f), c((size_t)n * n);
+    const TensorRef A = DenseRef(a, n, n), B = DenseRef(b, n, n), C = DenseRef(c, n, n);
+    return BestSeconds(aRuns, [&]() { aPerformer.Matrix2DMulitplication(A, B, C); });
+}
+
+double AddSeconds(OperationInterface& aPerformer, int aRows, int aCols, int aRuns) {
+    std::vector<float> a((size_t)aRows * aCols, 1.0f), b((size_t)aRows * aCols, 2.0f), c((size_t)aRows * aCols);
+    const TensorRef A = DenseRef(a, aRows, aCols), B = DenseRef(b, aRows, aCols), C = DenseRef(c, aRows, aCols);
+    return BestSeconds(aRuns, [&]() {
+        aPerformer.performOperation(A, B, C, OperationType::Addition, ShapeCompatibility::ShapeMatch);
+    });
+}
+
+} // namespace
+
+Dispatcher& Dispatcher::Instance() {
+    static Dispatcher dispatcher;
+    return dispatcher;
+}
+
+Device Dispatcher::Requested() {
+    return pinnedDevice >= 0 ? static_cast<Device>(pinnedDevice) : UseDevice;
+}
+
+bool Dispatcher::DeviceAvailable() {
+    std::lock_guard<std::mutex> lock(profileMutex);
+    if (openCL < 0) {
+        openCL = OpenCLAvailable() ? 1 : 0;
+        fp64 = openCL && OpenCLRuntime::Instance().SupportsFP64();
+    }
+    return openCL == 1;
+}
+
+bool Dispatcher::SupportsFP64() {
+    return DeviceAvailable() && fp64;
+}
+
+Device Dispatcher::Select(const OperationCost& aCost) {
+    const Device requested = Requested();
+    if (requested != Device::automatic) {
+        return requested;
+    }
+    if (!aCost.deviceCapable || !DeviceAvailable()) {
+        return Device::cpu;
+    }
+    return DeviceSeconds(aCost) < HostSeconds(aCost) ? Device::gpu : Device::cpu;
+}
+
+Device Dispatcher::SelectMatmul(int M, int K, int N, int batch, DType dtype) {
+    if (Requested() != Device::automatic) {
+        return Requested();
+    }
+    const double elementSize = (double)DTypeSize(dtype);
+    OperationCost cost;
+    cost.flops = 2.0 * M * N * K * batch;
+    cost.hostBytes = ((double)M * K + (double)K * N + (double)M * N) * batch * elementSize;
+    cost.transferBytes = cost.hostBytes;
+    cost.deviceCapable = dtype != DType::float64 || SupportsFP64();
+    return Select(cost);
+}
+
+Device Dispatcher::SelectElementwise(size_t numel, size_t bytes, DType dtype) {
+    if (Requested() != Device::automatic) {
+        return Requested();
+    }
+    OperationCost cost;
+    cost.flops = (double)numel;
+    cost.hostBytes = (double)bytes;
+    cost.transferBytes = (double)bytes;
+    cost.deviceCapable = dtype != DType::float64 || SupportsFP64();
+    return Select(cost);
+}
+
+Device Dispatcher::SelectReduction(size_t numel, DType dtype) {
+    if (Requested() != Device::automatic) {
+        return Requested();
+    }
+    OperationCost cost;
+    cost.flops = (double)numel;
+    cost.hostBytes = (double)numel * DTypeSize(dtype);
+    cost.transferBytes = cost.hostBytes; // The partial results coming back are comparatively small
+    cost.deviceCapable = dtype != DType::float64 || SupportsFP64();
+    return Select(cost);
+}
+
+Device Dispatcher::SelectSparseMatmul(size_t nnz, int rows, int cols, int N) {
+    if (Requested() != Device::automatic) {
+        return Requested();
+    }
+    // The host reads each nonzero (value and column) and a row of B for it, the device gets the
+    // CSR arrays and all of B; both write C
+    OperationCost cost;
+    cost.flops = 2.0 * nnz * N;
+    const double csrBytes = (double)nnz * 8 + ((double)rows + 1) * 4;
+    const double outputBytes = (double)rows * N * 4;
+    cost.hostBytes = csrBytes + std::min((double)nnz, (double)cols) * N * 4 + outputBytes;
+    cost.transferBytes = csrBytes + (double)cols * N * 4 + outputBytes;
+    return Select(cost);
+}
+
+double Dispatcher::HostSeconds(const OperationCost& aCost) {
+    const DeviceProfile current = CalibratedProfile();
+    return std::max(aCost.flops / (current.hostGflops * 1e9), aCost.hostBytes / (current.hostGBps * 1e9));
+}
+
+double Dispatcher::DeviceSeconds(const OperationCost& aCost) {
+    const DeviceProfile current = CalibratedProfile();
+    return current.launchSeconds + aCost.transferBytes / (current.transferGBps * 1e9) +
+        aCost.flops / (current.deviceGflops * 1e9);
+}
+
+DeviceProfile Dispatcher::Profile() {
+    std::lock_guard<std::mutex> lock(profileMutex);
+    return profile;
+}
+
+void Dispatcher::setProfile(const DeviceProfile& aProfile) {
+    std::lock_guard<std::mutex> lock(profileMutex);
+    profile = aProfile;
+    profile.calibrated = true;
+}
+
+DeviceProfile Dispatcher::CalibratedProfile() {
+    {
+        std::lock_guard<std::mutex> lock(profileMutex);
+        if (profile.calibrated) {
+            return profile;
+        }
+    }
+    Calibrate();
+    return Profile();
+}
+
+void Dispatcher::Calibrate() {
+    // The backends are timed directly, with float32 operands: a GEMM for the arithmetic
+    // throughput and a large addition for the memory (host) or transfer (device) throughput. On
+    // the device, a tiny GEMM gives the fixed cost of a round trip, which the others are net of.
+    DeviceProfile measured;
+    CPUOperation cpu;
+    const int hostN = 256;
+    measured.hostGflops = 2.0 * hostN * hostN * hostN / MatmulSeconds(cpu, hostN, 3) * 1e-9;
+    const int rows = 1024, cols = 4096;
+    const double addBytes = 3.0 * rows * cols * sizeof(float);
+    measured.hostGBps = addBytes / AddSeconds(cpu, rows, cols, 3) * 1e-9;
+
+    if (DeviceAvailable()) {
+        OpenCLOperation device;
+        measured.launchSeconds = MatmulSeconds(device, 8, 5);
+        const double addSeconds = AddSeconds(device, rows, cols, 3);
+        measured.transferGBps = addBytes / std::max(addSeconds - measured.launchSeconds, addSeconds * 0.1) * 1e-9;
+
+        const int deviceN = 1024;
+        const double flops = 2.0 * deviceN * deviceN * deviceN;
+        const double gemmSeconds = MatmulSeconds(device, deviceN, 2);
+        const double transferSeconds = 3.0 * deviceN * deviceN * sizeof(float) / (measured.transferGBps * 1e9);
+        const double computeSeconds = std::max(gemmSeconds - measured.launchSeconds - transferSeconds, gemmSeconds * 0.1);
+        measured.deviceGflops = flops / computeSeconds * 1e-9;
+    }
+    setProfile(measured);
+}
+
+
+/*********SCOPED DEVICE************/
+
+ScopedDevice::ScopedDevice(Device aDevice) : previous(pinnedDevice) {
+    pinnedDevice = static_cast<int>(aDevice);
+}
+
+ScopedDevice::~ScopedDevice() {
+    pinnedDevice = previous;
+}
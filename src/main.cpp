@@ -10,15 +10,72 @@ Device UseDevice = Device::cpu;
 
 int main(int argc, const char* argv[]) {
     srand(time(NULL));
-    std::string TestCommand = "MatrixMultiplication";
+    std::string TestCommand = argc > 1 ? argv[1] : "MatrixMultiplication";
     Testing theTester{};
 
     if (TestCommand == "Indexing") {
         theTester.TestIndexing();
     }
+    if (TestCommand == "Views") {
+        theTester.TestViews();
+    }
     if (TestCommand == "ElementWiseOperations") {
         theTester.TestElementWiseOperations();
     }
+    if (TestCommand == "Broadcasting") {
+        theTester.TestBroadcasting();
+    }
+    if (TestCommand == "DTypes") {
+        theTester.TestDTypes();
+    }
+    if (TestCommand == "OpenCLElementWiseOperations") {
+        theTester.TestOpenCLElementWiseOperations();
+    }
+    if (TestCommand == "InPlaceOperations") {
+        theTester.TestInPlaceOperations();
+    }
+    if (TestCommand == "Allocator") {
+        theTester.TestAllocator();
+    }
+    if (TestCommand == "Reductions") {
+        theTester.TestReductions();
+    }
+    if (TestCommand == "GemmTuner") {
+        theTester.TestGemmTuner();
+    }
+    if (TestCommand == "BatchedMatmul") {
+        theTester.TestBatchedMatmul();
+    }
+    if (TestCommand == "Async") {
+        theTester.TestAsync();
+    }
+    if (TestCommand == "ProgramCache") {
+        theTester.TestProgramCache();
+    }
+    if (TestCommand == "Tracing") {
+        theTester.TestTracing();
+    }
+    if (TestCommand == "TensorFile") {
+        theTester.TestTensorFile();
+    }
+    if (TestCommand == "OutOfCore") {
+        theTester.TestOutOfCore();
+    }
+    if (TestCommand == "Dispatcher") {
+        theTester.TestDispatcher();
+    }
+    if (TestCommand == "ThreadPool") {
+        theTester.TestThreadPool();
+    }
+    if (TestCommand == "Sparse") {
+        theTester.TestSparse();
+    }
+    if (TestCommand == "Graph") {
+        theTester.TestGraph();
+    }
+    if (TestCommand == "FusedMatmul") {
+        theTester.TestFusedMatmul();
+    }
     if (TestCommand == "MatrixMultiplication") {
         theTester.TestMatrixMultiplication();
     }
@@ -0,0 +1,240 @@
+// Kernel sources declared in opencl_kernels.h. That header also defines the GEMM kernels and is
+// included by Operations.cpp alone, so these are defined extern here without including it.
+
+// Element type macros, prepended to every kernel
+extern const char* const elementTypeKernelPrelude = R"CLC(
+#if defined(DTYPE_FLOAT64)
+    #pragma OPENCL EXTENSION cl_khr_fp64 : enable
+    typedef double ELEM;
+    typedef double ACC;
+    #define LOAD(p, i) ((p)[i])
+    #define STORE(p, i, v) ((p)[i] = (v))
+#elif defined(DTYPE_FLOAT16)
+    typedef half ELEM; // storage only: vload_half/vstore_half convert to and from float
+    typedef float ACC;
+    #define LOAD(p, i) vload_half((i), (p))
+    #define STORE(p, i, v) vstore_half_rte((v), (i), (p))
+#elif defined(DTYPE_BFLOAT16)
+    typedef ushort ELEM; // upper 16 bits of a float
+    typedef float ACC;
+    #define LOAD(p, i) as_float((uint)(p)[i] << 16)
+    #define STORE(p, i, v) ((p)[i] = FloatToBFloat16(v))
+    ushort FloatToBFloat16(float v) {
+        uint bits = as_uint(v);
+        if ((bits & 0x7fffffffu) > 0x7f800000u) return (ushort)((bits >> 16) | 0x40);
+        return (ushort)((bits + 0x7fffu + ((bits >> 16) & 1u)) >> 16);
+    }
+#elif defined(DTYPE_INT32)
+    typedef int ELEM;
+    typedef long ACC;
+    #define LOAD(p, i) ((ACC)(p)[i])
+    #define STORE(p, i, v) ((p)[i] = (int)(v))
+#else
+    typedef float ELEM;
+    typedef float ACC;
+    #define LOAD(p, i) ((p)[i])
+    #define STORE(p, i, v) ((p)[i] = (v))
+#endif
+)CLC";
+
+// Elementwise arithmetic, dense and broadcast
+extern const char* const elementwiseKernelSource = R"CLC(
+#if defined(DTYPE_FLOAT64)
+    typedef double4 VEC;
+    #define VEC_WIDTH 4
+    #define VLOAD vload4
+    #define VSTORE vstore4
+#elif defined(DTYPE_INT32)
+    typedef int8 VEC;
+    #define VEC_WIDTH 8
+    #define VLOAD vload8
+    #define VSTORE vstore8
+#else
+    typedef float8 VEC;
+    #define VEC_WIDTH 8
+    #define VLOAD vload8
+    #define VSTORE vstore8
+#endif
+
+#if defined(OP_ADD)
+    #define APPLY(x, y) ((x) + (y))
+#elif defined(OP_SUB)
+    #define APPLY(x, y) ((x) - (y))
+#elif defined(OP_MUL)
+    #define APPLY(x, y) ((x) * (y))
+#elif defined(DTYPE_INT32)
+    // Divide by 1 where the divisor is 0, then select 0 there: works for int and int8 alike
+    #define APPLY(x, y) select((x) / select((y), (y) - (y) + 1, (y) == 0), (x) - (x), (y) == 0)
+#else
+    #define APPLY(x, y) ((x) / (y))
+#endif
+
+// Dense operands: each work-item computes VEC_WIDTH consecutive outputs. An operand flagged as
+// scalar is a single element broadcast over the whole output.
+__kernel void elementwise_dense(const __global ELEM* A, const int aScalar,
+                                const __global ELEM* B, const int bScalar,
+                                __global ELEM* C, const int n) {
+    const int i = get_global_id(0) * VEC_WIDTH;
+    if (i + VEC_WIDTH <= n) {
+        const VEC a = aScalar ? (VEC)(A[0]) : VLOAD(0, A + i);
+        const VEC b = bScalar ? (VEC)(B[0]) : VLOAD(0, B + i);
+        VSTORE(APPLY(a, b), 0, C + i);
+    }
+    else {
+        for (int k = i; k < n; ++k) {
+            const ELEM a = A[aScalar ? 0 : k];
+            const ELEM b = B[bScalar ? 0 : k];
+            C[k] = APPLY(a, b);
+        }
+    }
+}
+
+// Broadcast and strided operands. Dimension 0 of the launch walks the innermost dimension, so
+// neighbouring work-items touch neighbouring outputs; dimension 1 enumerates the rest. layout
+// holds the shape followed by the element strides of A and of B (rank entries each, 0 for a
+// broadcast dimension). The output is dense.
+__kernel void elementwise_strided(const __global ELEM* A, const __global ELEM* B, __global ELEM* C,
+                                  __constant int* layout, const int rank) {
+    const int inner = get_global_id(0);
+    const int innerSize = layout[rank - 1];
+    if (inner >= innerSize) return;
+
+    long outer = get_global_id(1);
+    const long offsetC = outer * innerSize + inner;
+    long offsetA = (long)inner * layout[2 * rank - 1];
+    long offsetB = (long)inner * layout[3 * rank - 1];
+    for (int d = rank - 2; d >= 0; --d) {
+        const int idx = (int)(outer % layout[d]);
+        outer /= layout[d];
+        offsetA += (long)idx * layout[rank + d];
+        offsetB += (long)idx * layout[2 * rank + d];
+    }
+    C[offsetC] = APPLY(A[offsetA], B[offsetB]);
+}
+)CLC";
+
+// Work-group reductions to partial results
+extern const char* const reductionKernelSource = R"CLC(
+#define IS_NAN(x) ((x) != (x))
+
+#if defined(RED_SUM)
+    #define IDENTITY ((ACC)0)
+    #define COMBINE(best, bestIndex, v, i) best += (v)
+#else
+    #if defined(RED_MIN)
+        #define BEYOND(a, b) ((a) < (b))
+        #if defined(DTYPE_INT32)
+            #define IDENTITY LONG_MAX
+        #else
+            #define IDENTITY INFINITY
+        #endif
+    #else
+        #define BEYOND(a, b) ((a) > (b))
+        #if defined(DTYPE_INT32)
+            #define IDENTITY LONG_MIN
+        #else
+            #define IDENTITY (-INFINITY)
+        #endif
+    #endif
+    #define TAKES(v, i, best, bestIndex) (IS_NAN(best) ? (IS_NAN(v) && (i) < (bestIndex)) : \
+        (IS_NAN(v) || BEYOND(v, best) || ((v) == (best) && (i) < (bestIndex))))
+    #define COMBINE(best, bestIndex, v, i) if (TAKES(v, i, best, bestIndex)) { best = (v); bestIndex = (i); }
+#endif
+
+// Contiguous runs (inner == 1): one work-group per chunk. Work-items stride through the chunk,
+// then combine their results as a tree in local memory.
+__kernel void reduce_runs(const __global ELEM* A, __global ACC* partialValues, __global int* partialIndices,
+                          const int n, const int chunk, const int parts) {
+    const int group = get_group_id(0);
+    const int lid = get_local_id(0);
+    const int run = group / parts;
+    const int begin = (group % parts) * chunk;
+    const int end = min(n, begin + chunk);
+
+    ACC best = IDENTITY;
+    int bestIndex = INT_MAX;
+    for (int k = begin + lid; k < end; k += GROUP_SIZE) {
+        const ACC v = LOAD(A, (size_t)run * n + k);
+        COMBINE(best, bestIndex, v, k);
+    }
+
+    __local ACC values[GROUP_SIZE];
+    __local int indices[GROUP_SIZE];
+    values[lid] = best;
+    indices[lid] = bestIndex;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int stride = GROUP_SIZE / 2; stride > 0; stride >>= 1) {
+        if (lid < stride) {
+            COMBINE(best, bestIndex, values[lid + stride], indices[lid + stride]);
+            values[lid] = best;
+            indices[lid] = bestIndex;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) {
+        partialValues[group] = best;
+        partialIndices[group] = bestIndex;
+    }
+}
+
+// Strided runs (inner > 1): one work-item per column and chunk, so neighbouring work-items read
+// neighbouring elements. Dimension 0 is the column, dimension 1 the outer index times parts.
+__kernel void reduce_columns(const __global ELEM* A, __global ACC* partialValues, __global int* partialIndices,
+                             const int n, const int inner, const int chunk, const int parts) {
+    const int col = get_global_id(0);
+    if (col >= inner) return;
+    const int outerIndex = get_global_id(1) / parts;
+    const int part = get_global_id(1) % parts;
+    const int begin = part * chunk;
+    const int end = min(n, begin + chunk);
+
+    ACC best = IDENTITY;
+    int bestIndex = INT_MAX;
+    for (int k = begin; k < end; k++) {
+        const ACC v = LOAD(A, ((size_t)outerIndex * n + k) * inner + col);
+        COMBINE(best, bestIndex, v, k);
+    }
+    const size_t run = (size_t)outerIndex * inner + col;
+    partialValues[run * parts + part] = best;
+    partialIndices[run * parts + part] = bestIndex;
+}
+)CLC";
+
+// CSR sparse-dense products
+extern const char* const sparseKernelSource = R"CLC(
+// One work-item per output; dimension 0 is the column, so the work-items of a row walk its
+// nonzeros together and read neighbouring elements of each row of B
+__kernel void spmm_csr(const __global int* rowPointers, const __global int* columnIndices,
+                       const __global float* values, const __global float* B, const int ldb,
+                       __global float* C, const int ldc, const int rows, const int N) {
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+    if (col >= N || row >= rows) return;
+    float acc = 0.0f;
+    for (int k = rowPointers[row]; k < rowPointers[row + 1]; k++) {
+        acc += values[k] * B[(size_t)columnIndices[k] * ldb + col];
+    }
+    C[(size_t)row * ldc + col] = acc;
+}
+
+// N == 1: one work-group per row, whose items take every GROUP_SIZE-th nonzero and add their
+// sums up in a tree in local memory, so long rows are split over many items
+__kernel void spmv_csr(const __global int* rowPointers, const __global int* columnIndices,
+                       const __global float* values, const __global float* x, const int ldx,
+                       __global float* y, const int ldy) {
+    __local float sums[GROUP_SIZE];
+    const int row = get_group_id(0);
+    const int lid = get_local_id(0);
+    float acc = 0.0f;
+    for (int k = rowPointers[row] + lid; k < rowPointers[row + 1]; k += GROUP_SIZE) {
+        acc += values[k] * x[(size_t)columnIndices[k] * ldx];
+    }
+    sums[lid] = acc;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int stride = GROUP_SIZE / 2; stride > 0; stride /= 2) {
+        if (lid < stride) sums[lid] += sums[lid + stride];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) y[(size_t)row * ldy] = sums[0];
+}
+)CLC";
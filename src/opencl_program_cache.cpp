@@ -0,0 +1,162 @@
+#include "opencl_program_cache.h"
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdio.h>
+#include <vector>
+
+namespace {
+
+const char* const FormatLine = "TensorFramework OpenCL program binary v1";
+
+// 64-bit FNV-1a: names the cache files and fingerprints the kernel source; the full key is
+// compared on load, so a collision only costs a rebuild
+unsigned long long Fnv1a(const char* aData, size_t aSize) {
+    unsigned long long hash = 14695981039346656037ull;
+    for (size_t i = 0; i < aSize; ++i) {
+        hash ^= (unsigned char)aData[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string DeviceString(cl_device_id device, cl_device_info param) {
+    size_t size = 0;
+    if (clGetDeviceInfo(device, param, 0, NULL, &size) != CL_SUCCESS || size == 0) {
+        return "";
+    }
+    std::string value(size, '\0');
+    clGetDeviceInfo(device, param, size, &value[0], NULL);
+    return value.c_str(); // drop the terminating null
+}
+
+// Keeps the key one field per line
+std::string OneLine(std::string aValue) {
+    for (char& c : aValue) {
+        if (c == '\n' || c == '\r') c = ' ';
+    }
+    return aValue;
+}
+
+} // namespace
+
+ProgramBinaryCache::ProgramBinaryCache(cl_device_id aDevice)
+    : device(aDevice),
+      deviceName(OneLine(DeviceString(aDevice, CL_DEVICE_NAME))),
+      driverVersion(OneLine(DeviceString(aDevice, CL_DRIVER_VERSION))) {
+    const char* path = std::getenv("TENSOR_KERNEL_CACHE_DIR");
+    directory = path ? path : "opencl_kernel_cache";
+}
+
+std::string ProgramBinaryCache::Header(const char* kernelSource, const std::string& buildOptions) const {
+    const size_t sourceLength = strlen(kernelSource);
+    char sourceHash[17];
+    snprintf(sourceHash, sizeof(sourceHash), "%016llx", Fnv1a(kernelSource, sourceLength));
+    std::ostringstream header;
+    header << FormatLine << "\n"
+           << "device\t" << deviceName << "\n"
+           << "driver\t" << driverVersion << "\n"
+           << "options\t" << OneLine(buildOptions) << "\n"
+           << "source\t" << sourceHash << " " << sourceLength << "\n";
+    return header.str();
+}
+
+std::string ProgramBinaryCache::FilePath(const std::string& aHeader) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", Fnv1a(aHeader.data(), aHeader.size()));
+    return (std::filesystem::path(directory) / name).string();
+}
+
+cl_program ProgramBinaryCache::Load(cl_context context, const char* kernelSource, const std::string& buildOptions) {
+    if (!Enabled()) {
+        return NULL;
+    }
+    const std::string header = Header(kernelSource, buildOptions);
+    std::ifstream file(FilePath(header), std::ios::binary);
+    if (!file) {
+        ++misses;
+        return NULL;
+    }
+
+    // The stored key must match exactly; a different device, driver, source or option set is stale
+    std::string storedHeader(header.size(), '\0');
+    std::string sizeLine;
+    file.read(&storedHeader[0], (std::streamsize)storedHeader.size());
+    size_t binarySize = 0;
+    if (!file || storedHeader != header || !std::getline(file, sizeLine) ||
+        sscanf(sizeLine.c_str(), "binary\t%zu", &binarySize) != 1 || binarySize == 0) {
+        ++misses;
+        return NULL;
+    }
+    std::vector<unsigned char> binary(binarySize);
+    file.read((char*)binary.data(), (std::streamsize)binarySize);
+    if ((size_t)file.gcount() != binarySize) {
+        ++misses;
+        return NULL;
+    }
+
+    // A driver may still reject a binary it produced (e.g. after an in-place update), or fail
+    // to build it; either way the caller falls back to the source
+    const unsigned char* binaryData = binary.data();
+    cl_int binaryStatus = CL_SUCCESS;
+    cl_int err;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &binarySize, &binaryData, &binaryStatus, &err);
+    if (err != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+        if (program) clReleaseProgram(program);
+        ++misses;
+        return NULL;
+    }
+    err = clBuildProgram(program, 1, &device, buildOptions.c_str(), NULL, NULL);
+    if (err != CL_SUCCESS) {
+        clReleaseProgram(program);
+        ++misses;
+        return NULL;
+    }
+    ++hits;
+    return program;
+}
+
+void ProgramBinaryCache::Store(cl_program program, const char* kernelSource, const std::string& buildOptions) {
+    if (!Enabled()) {
+        return;
+    }
+    size_t binarySize = 0;
+    cl_int err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL);
+    if (err != CL_SUCCESS || binarySize == 0) {
+        return; // The implementation keeps no binary for this program
+    }
+    std::vector<unsigned char> binary(binarySize);
+    unsigned char* binaryData = binary.data();
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binaryData, NULL);
+    if (err != CL_SUCCESS) {
+        return;
+    }
+
+    // Written to a temporary file and renamed into place, so that a concurrent process never
+    // reads a partial binary
+    const std::string header = Header(kernelSource, buildOptions);
+    const std::string path = FilePath(header);
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    std::ostringstream temporary;
+    temporary << path << "." << std::hex << std::random_device()() << ".tmp";
+    {
+        std::ofstream file(temporary.str(), std::ios::binary | std::ios::trunc);
+        file << header << "binary\t" << binarySize << "\n";
+        file.write((const char*)binary.data(), (std::streamsize)binarySize);
+        if (!file) {
+            printf("Failed to write the OpenCL program cache file %s\n", path.c_str());
+            file.close();
+            std::filesystem::remove(temporary.str(), ec);
+            return;
+        }
+    }
+    std::filesystem::rename(temporary.str(), path, ec);
+    if (ec) {
+        printf("Failed to write the OpenCL program cache file %s\n", path.c_str());
+        std::filesystem::remove(temporary.str(), ec);
+    }
+}
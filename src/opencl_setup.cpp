@@ -1,7 +1,11 @@
 #include "opencl_setup.h"
+#include "tracer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+
+extern const char* const elementTypeKernelPrelude; // Element type macros, defined in opencl_kernels.cpp
 
 /* Available platforms and devices on my PC
 *******************************************
@@ -17,6 +21,11 @@
 * Platform 3: Intel(R) FPGA SDK for OpenCL(TM)
 */
 
+bool OpenCLAvailable() {
+    cl_uint numPlatforms = 0;
+    return clGetPlatformIDs(0, NULL, &numPlatforms) == CL_SUCCESS && numPlatforms > 0;
+}
+
 void SelectTargetDevice(cl_platform_id* selectedPlatform, cl_device_id* selectedDevice) {
     cl_int clStatus;
     cl_uint numPlatforms;
@@ -49,9 +58,14 @@ void SelectTargetDevice(cl_platform_id* selectedPlatform, cl_device_id* selected
     }
 
     if (*selectedPlatform == NULL) {
-        printf("Target platform '%s' not found.\n", targetPlatformName);
-        free(platforms);
-        exit(EXIT_FAILURE);
+        // Fall back to the first platform, e.g. PoCL on a machine without the Intel runtime
+        *selectedPlatform = platforms[0];
+        size_t nameSize;
+        clGetPlatformInfo(platforms[0], CL_PLATFORM_NAME, 0, NULL, &nameSize);
+        char* platformName = (char*)malloc(nameSize);
+        clGetPlatformInfo(platforms[0], CL_PLATFORM_NAME, nameSize, platformName, NULL);
+        printf("Target platform '%s' not found. Selected platform: %s\n", targetPlatformName, platformName);
+        free(platformName);
     }
 
     // Select the first device of the chosen platform
@@ -130,71 +144,761 @@ cl_command_queue CreateCommandQueue(cl_context context, cl_device_id* device) {
 }
 
 
-/**************** Kernel based operations ******************/
+/**************** OpenCL runtime ******************/
 
-void MatrixMultiplyKernelBased(std::vector<dataType>& input1, std::vector<int>& shape1,
-    std::vector<dataType>& input2, std::vector<int>& shape2,
-    std::vector<dataType>& output, const char** KernelSource) {
-    // Implementation of naive matrix multiplication using OpenCL
-    // Use the OpenCL setup functions defined in opencl_setup.c
+OpenCLRuntime& OpenCLRuntime::Instance() {
+    // Constructed on first use, destroyed (and the OpenCL objects released) at process exit
+    static OpenCLRuntime runtime;
+    return runtime;
+}
 
-    // Set up OpenCL environment: context, command queue, and device are assumed to be initialized already.
-    cl_platform_id platform;
-    cl_device_id device;
+OpenCLRuntime::OpenCLRuntime() {
     SelectTargetDevice(&platform, &device);
-    cl_context context = CreateOpenCLContext(&platform, &device);
-    cl_command_queue queue = CreateCommandQueue(context, &device);
-    cl_int err; 
-    cl_event event = NULL;
+    context = CreateOpenCLContext(&platform, &device);
+    queue = CreateCommandQueue(context, &device);
+    uploadQueue = CreateCommandQueue(context, &device);
+    downloadQueue = CreateCommandQueue(context, &device);
+
+    size_t extensionsSize = 0;
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &extensionsSize);
+    std::string extensions(extensionsSize, '\0');
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, extensionsSize, &extensions[0], NULL);
+    fp64 = extensions.find("cl_khr_fp64") != std::string::npos;
+
+    cl_ulong localMem = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMem, NULL);
+    localMemSize = (size_t)localMem;
+    binaryCache = std::make_unique<ProgramBinaryCache>(device);
+}
 
-    // Prepare data for OpenCL
-    size_t bytesA = shape1[0] * shape1[1] * sizeof(dataType);
-    size_t bytesB = shape2[0] * shape2[1] * sizeof(dataType);
-    size_t bytesC = shape1[0] * shape2[1] * sizeof(dataType);
-    output.resize(shape1[0] * shape2[1]); // Ensure output vector is correctly sized
+std::string OpenCLRuntime::DeviceName() const {
+    size_t nameSize = 0;
+    clGetDeviceInfo(device, CL_DEVICE_NAME, 0, NULL, &nameSize);
+    std::string name(nameSize, '\0');
+    clGetDeviceInfo(device, CL_DEVICE_NAME, nameSize, &name[0], NULL);
+    return name.c_str(); // drop the terminating null
+}
 
-    cl_mem bufA = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytesA, input1.data(), NULL);
-    cl_mem bufB = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytesB, input2.data(), NULL);
-    cl_mem bufC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytesC, NULL, NULL);
+OpenCLRuntime::~OpenCLRuntime() {
+    Shutdown();
+}
 
-    // Create and build the program
-    cl_program program = clCreateProgramWithSource(context, 1, KernelSource, NULL, NULL);
-    clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+void OpenCLRuntime::Shutdown() {
+    if (Tracer::Enabled()) {
+        Tracer::Instance().CollectCommands(true); // Before the queues go
+    }
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    for (auto& entry : kernels) {
+        clReleaseKernel(entry.second.kernel);
+    }
+    kernels.clear();
+    for (auto& entry : programs) {
+        clReleaseProgram(entry.second);
+    }
+    programs.clear();
+
+    for (cl_command_queue* each : { &uploadQueue, &queue, &downloadQueue }) {
+        if (*each) {
+            clFinish(*each);
+            clReleaseCommandQueue(*each);
+            *each = NULL;
+        }
+    }
+    if (context) {
+        clReleaseContext(context);
+        context = NULL;
+    }
+}
+
+cl_program OpenCLRuntime::GetProgram(const char* kernelSource, const std::string& buildOptions) {
+    // Caller holds cacheMutex
+    ProgramKey key(kernelSource, buildOptions);
+    auto found = programs.find(key);
+    if (found != programs.end()) {
+        return found->second;
+    }
+
+    cl_program program = binaryCache->Load(context, kernelSource, buildOptions);
+    if (program) {
+        programs.emplace(std::move(key), program);
+        return program;
+    }
+
+    cl_int err;
+    program = clCreateProgramWithSource(context, 1, &kernelSource, NULL, &err);
+    if (err != CL_SUCCESS) {
+        printf("Failed to create the OpenCL program. Error %d\n", err);
+        exit(EXIT_FAILURE);
+    }
+    err = clBuildProgram(program, 1, &device, buildOptions.c_str(), NULL, NULL);
     PrintKernelBuildLog(program, device); // Print any compilation errors of the Kernel source
-    cl_kernel kernel = clCreateKernel(program, "matrix_multiply", &err);
+    if (err != CL_SUCCESS) {
+        printf("Failed to build the OpenCL program. Error %d\n", err);
+        exit(EXIT_FAILURE);
+    }
+    binaryCache->Store(program, kernelSource, buildOptions);
+
+    programs.emplace(std::move(key), program);
+    return program;
+}
+
+LockedKernel OpenCLRuntime::GetKernel(const char* kernelSource, const char* kernelName, const std::string& buildOptions) {
+    CachedKernel* cached;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        cl_program program = GetProgram(kernelSource, buildOptions);
+        cached = &kernels[std::make_pair(program, std::string(kernelName))];
+        if (!cached->kernel) {
+            cl_int err;
+            cached->kernel = clCreateKernel(program, kernelName, &err);
+            if (err != CL_SUCCESS) {
+                printf("Failed to create kernel '%s'. Error %d\n", kernelName, err);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    // Another thread's launch of the same kernel is waited for without blocking the cache
+    return LockedKernel(cached->kernel, cached->launchMutex);
+}
+
+
+/**************** Kernel based operations ******************/
+
+// Copy a host matrix with row stride ld into a dense device buffer (rows x cols), offset bytes in
+static void WriteRowsToBuffer(cl_command_queue queue, cl_mem buffer, const void* host,
+    int rows, int cols, int ld, size_t elementSize, size_t offset = 0) {
+    if (ld == cols || rows == 1) {
+        const size_t bytes = (size_t)rows * cols * elementSize;
+        clEnqueueWriteBuffer(queue, buffer, CL_FALSE, offset, bytes, host, 0, NULL, TracedCommand("upload", queue, bytes));
+        return;
+    }
+    const size_t bufferOrigin[3] = { offset, 0, 0 };
+    const size_t hostOrigin[3] = { 0, 0, 0 };
+    const size_t region[3] = { cols * elementSize, (size_t)rows, 1 };
+    clEnqueueWriteBufferRect(queue, buffer, CL_FALSE, bufferOrigin, hostOrigin, region,
+        cols * elementSize, 0, ld * elementSize, 0, host, 0, NULL, TracedCommand("upload", queue, region[0] * rows));
+}
+
+// Byte distance between consecutive matrices of a batch when they are evenly spaced with a common
+// row stride that a rectangular transfer can describe (slices at least rows x ld apart and whole
+// rows); 0 otherwise
+static size_t BatchPitch(const void* const* host, const int* ld, int count, int rows, int cols, size_t elementSize) {
+    const unsigned char* first = static_cast<const unsigned char*>(host[0]);
+    const unsigned char* second = static_cast<const unsigned char*>(host[1]);
+    if (second <= first || ld[0] < cols) return 0;
+    const size_t pitch = second - first;
+    const size_t rowPitch = ld[0] * elementSize;
+    if (pitch < rows * rowPitch || pitch % rowPitch != 0) return 0;
+    for (int i = 1; i < count; ++i) {
+        if (ld[i] != ld[0] || static_cast<const unsigned char*>(host[i]) != first + i * pitch) return 0;
+    }
+    return pitch;
+}
+
+// Copy count host matrices (rows x cols, row strides ld) into consecutive dense matrices of a
+// device buffer: in one transfer when BatchPitch finds them evenly spaced, else one by one
+static void WriteBatchToBuffer(cl_command_queue queue, cl_mem buffer, const void* const* host, const int* ld,
+    int count, int rows, int cols, size_t elementSize) {
+    const size_t matrixBytes = (size_t)rows * cols * elementSize;
+    const size_t pitch = count > 1 ? BatchPitch(host, ld, count, rows, cols, elementSize) : 0;
+    if (pitch == 0) {
+        for (int i = 0; i < count; ++i) {
+            WriteRowsToBuffer(queue, buffer, host[i], rows, cols, ld[i], elementSize, i * matrixBytes);
+        }
+        return;
+    }
+    if (pitch == matrixBytes) {
+        clEnqueueWriteBuffer(queue, buffer, CL_FALSE, 0, count * matrixBytes, host[0], 0, NULL,
+            TracedCommand("upload", queue, count * matrixBytes));
+        return;
+    }
+    const size_t origin[3] = { 0, 0, 0 };
+    const size_t region[3] = { cols * elementSize, (size_t)rows, (size_t)count };
+    clEnqueueWriteBufferRect(queue, buffer, CL_FALSE, origin, origin, region,
+        cols * elementSize, matrixBytes, ld[0] * elementSize, pitch, host[0], 0, NULL,
+        TracedCommand("upload", queue, count * matrixBytes));
+}
+
+// Counterpart of WriteBatchToBuffer for the results, without blocking: the reads start once
+// waitFor has completed
+static void EnqueueReadBatch(cl_command_queue queue, cl_mem buffer, void* const* host, const int* ld,
+    int count, int rows, int cols, size_t elementSize, cl_event waitFor) {
+    const size_t matrixBytes = (size_t)rows * cols * elementSize;
+    const size_t pitch = count > 1 ? BatchPitch(host, ld, count, rows, cols, elementSize) : 0;
+    const size_t origin[3] = { 0, 0, 0 };
+    if (pitch == matrixBytes || (count == 1 && (ld[0] == cols || rows == 1))) {
+        clEnqueueReadBuffer(queue, buffer, CL_FALSE, 0, count * matrixBytes, host[0], 1, &waitFor,
+            TracedCommand("download", queue, count * matrixBytes));
+        return;
+    }
+    if (pitch != 0) {
+        const size_t region[3] = { cols * elementSize, (size_t)rows, (size_t)count };
+        clEnqueueReadBufferRect(queue, buffer, CL_FALSE, origin, origin, region,
+            cols * elementSize, matrixBytes, ld[0] * elementSize, pitch, host[0], 1, &waitFor,
+            TracedCommand("download", queue, count * matrixBytes));
+        return;
+    }
+    const size_t region[3] = { cols * elementSize, (size_t)rows, 1 };
+    for (int i = 0; i < count; ++i) {
+        const size_t bufferOrigin[3] = { i * matrixBytes, 0, 0 };
+        clEnqueueReadBufferRect(queue, buffer, CL_FALSE, bufferOrigin, origin, region,
+            cols * elementSize, 0, (rows == 1 ? cols : ld[i]) * elementSize, 0, host[i], 1, &waitFor,
+            TracedCommand("download", queue, matrixBytes));
+    }
+}
+
+// Event completing every command enqueued so far on the in-order queue
+static cl_event MarkQueue(cl_command_queue queue) {
+    cl_event marker = NULL;
+    clEnqueueMarkerWithWaitList(queue, 0, NULL, &marker);
+    return marker;
+}
+
+// Last step of a pipelined operation: the downloads have been enqueued on the download queue.
+// Submit the queues, then hand the work over to pending, or wait for it without one.
+static void FinishPipeline(PendingKernelWork& work, PendingKernelWork* pending) {
+    OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    work.done = MarkQueue(runtime.DownloadQueue());
+    clFlush(runtime.UploadQueue());
+    clFlush(runtime.Queue());
+    clFlush(runtime.DownloadQueue());
+    if (pending) {
+        *pending = std::move(work);
+        return;
+    }
+    const cl_int err = work.Wait();
+    if (err != CL_SUCCESS) {
+        printf("OpenCL operation failed. Error %d\n", err);
+    }
+}
+
+PendingKernelWork::PendingKernelWork(PendingKernelWork&& aOther) noexcept
+    : done(aOther.done), deviceBuffers(std::move(aOther.deviceBuffers)), hostBuffers(std::move(aOther.hostBuffers)) {
+    aOther.done = NULL;
+}
+
+PendingKernelWork& PendingKernelWork::operator=(PendingKernelWork&& aOther) noexcept {
+    if (this != &aOther) {
+        Wait();
+        done = aOther.done;
+        deviceBuffers = std::move(aOther.deviceBuffers);
+        hostBuffers = std::move(aOther.hostBuffers);
+        aOther.done = NULL;
+    }
+    return *this;
+}
+
+bool PendingKernelWork::Ready() const {
+    if (!done) return true;
+    cl_int status = CL_COMPLETE;
+    clGetEventInfo(done, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+    return status <= CL_COMPLETE; // Complete, or failed (negative)
+}
+
+cl_int PendingKernelWork::Wait() {
+    cl_int status = CL_COMPLETE;
+    if (done) {
+        clWaitForEvents(1, &done);
+        clGetEventInfo(done, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+        clReleaseEvent(done);
+        done = NULL;
+    }
+    for (cl_mem buffer : deviceBuffers) {
+        clReleaseMemObject(buffer);
+    }
+    deviceBuffers.clear();
+    hostBuffers.clear();
+    return status < 0 ? status : CL_SUCCESS;
+}
+
+void ElementwiseKernelBased(int rank, const int* shape,
+    const void* A, const int* stridesA, size_t spanA,
+    const void* B, const int* stridesB, size_t spanB,
+    void* C, DType dtype, const char* operationBuildOption, const char* const* KernelSource,
+    PendingKernelWork* pending) {
+    OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    cl_context context = runtime.Context();
+    cl_command_queue queue = runtime.Queue();
+    const std::string source = std::string(elementTypeKernelPrelude) + *KernelSource;
+    const std::string options = std::string(KernelTypeBuildOption(dtype)) + " " + operationBuildOption;
+    cl_int err;
+
+    size_t numel = 1;
+    for (int d = 0; d < rank; ++d) numel *= shape[d];
+    const size_t elementSize = DTypeSize(dtype);
+
+    // Only the span of each operand is transferred: one element for a broadcast scalar, one row
+    // for a row vector, and so on
+    cl_mem bufA = clCreateBuffer(context, CL_MEM_READ_ONLY, spanA * elementSize, NULL, NULL);
+    cl_mem bufB = clCreateBuffer(context, CL_MEM_READ_ONLY, spanB * elementSize, NULL, NULL);
+    cl_mem bufC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, numel * elementSize, NULL, NULL);
+    clEnqueueWriteBuffer(runtime.UploadQueue(), bufA, CL_FALSE, 0, spanA * elementSize, A, 0, NULL,
+        TracedCommand("upload", runtime.UploadQueue(), spanA * elementSize));
+    clEnqueueWriteBuffer(runtime.UploadQueue(), bufB, CL_FALSE, 0, spanB * elementSize, B, 0, NULL,
+        TracedCommand("upload", runtime.UploadQueue(), spanB * elementSize));
+    cl_event uploaded = MarkQueue(runtime.UploadQueue());
+    cl_event computed = NULL;
+
+    // Global sizes are rounded up to whole work-groups of this many items; the kernels skip the extra ones
+    const size_t groupSize = 64;
+    cl_mem bufLayout = NULL;
+    const bool dense = rank == 1 && stridesA[0] <= 1 && stridesB[0] <= 1;
+    if (dense) {
+        LockedKernel kernel = runtime.GetKernel(source.c_str(), "elementwise_dense", options);
+        const int aScalar = stridesA[0] == 0, bScalar = stridesB[0] == 0, n = (int)numel;
+        kernel.SetArg(0, bufA);
+        kernel.SetArg(1, aScalar);
+        kernel.SetArg(2, bufB);
+        kernel.SetArg(3, bScalar);
+        kernel.SetArg(4, bufC);
+        kernel.SetArg(5, n);
+
+        const int vecWidth = dtype == DType::float64 ? 4 : 8; // VEC_WIDTH in elementwiseKernelSource
+        const size_t items = (numel + vecWidth - 1) / vecWidth;
+        size_t globalSize[1] = { (items + groupSize - 1) / groupSize * groupSize };
+        err = kernel.Status();
+        if (err == CL_SUCCESS) {
+            err = clEnqueueNDRangeKernel(queue, kernel.get(), 1, NULL, globalSize, NULL, 1, &uploaded,
+                TracedCommand("elementwise_dense", queue, 0, &computed));
+        }
+    }
+    else {
+        LockedKernel kernel = runtime.GetKernel(source.c_str(), "elementwise_strided", options);
+        std::vector<int> layout(shape, shape + rank);
+        layout.insert(layout.end(), stridesA, stridesA + rank);
+        layout.insert(layout.end(), stridesB, stridesB + rank);
+        bufLayout = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            layout.size() * sizeof(int), layout.data(), NULL);
+        kernel.SetArg(0, bufA);
+        kernel.SetArg(1, bufB);
+        kernel.SetArg(2, bufC);
+        kernel.SetArg(3, bufLayout);
+        kernel.SetArg(4, rank);
+
+        const size_t inner = (size_t)shape[rank - 1];
+        size_t globalSize[2] = { (inner + groupSize - 1) / groupSize * groupSize, numel / inner };
+        err = kernel.Status();
+        if (err == CL_SUCCESS) {
+            err = clEnqueueNDRangeKernel(queue, kernel.get(), 2, NULL, globalSize, NULL, 1, &uploaded,
+                TracedCommand("elementwise_strided", queue, 0, &computed));
+        }
+    }
+    if (err != CL_SUCCESS) {
+        printf("Failed to launch the elementwise kernel. Error %d\n", err);
+        clEnqueueMarkerWithWaitList(queue, 1, &uploaded, &computed); // The download still waits for the uploads
+    }
+
+    // The download starts when the kernel has finished
+    clEnqueueReadBuffer(runtime.DownloadQueue(), bufC, CL_FALSE, 0, numel * elementSize, C, 1, &computed,
+        TracedCommand("download", runtime.DownloadQueue(), numel * elementSize));
+    clReleaseEvent(uploaded);
+    clReleaseEvent(computed);
+
+    PendingKernelWork work;
+    work.deviceBuffers = { bufA, bufB, bufC };
+    if (bufLayout) {
+        work.deviceBuffers.push_back(bufLayout);
+    }
+    FinishPipeline(work, pending);
+}
+
+int ReduceKernelBased(int outer, int n, int inner, const void* A, DType dtype,
+    const char* reductionBuildOption, std::vector<double>& partialValues, std::vector<int>& partialIndices,
+    const char* const* KernelSource) {
+    OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    cl_context context = runtime.Context();
+    cl_command_queue queue = runtime.Queue();
+    cl_int err;
+
+    // Work-groups of up to 256 items, a power of two for the tree in local memory
+    size_t groupSize = 1;
+    while (groupSize * 2 <= 256 && groupSize * 2 <= runtime.MaxWorkGroupSize()) groupSize *= 2;
+    const std::string source = std::string(elementTypeKernelPrelude) + *KernelSource;
+    const std::string options = std::string(KernelTypeBuildOption(dtype)) + " " + reductionBuildOption +
+        " -D GROUP_SIZE=" + std::to_string(groupSize);
+
+    // Split long runs so that there is enough parallel work: about 256 work-groups for
+    // contiguous runs, 64K work-items for strided ones, each with a chunk of at least 64 elements
+    const size_t runs = (size_t)outer * inner;
+    const size_t wanted = inner == 1 ? 256 : 65536;
+    const size_t maxParts = std::max<size_t>(1, (n + 63) / 64);
+    const int parts = (int)std::min(maxParts, std::max<size_t>(1, wanted / std::max<size_t>(runs, 1)));
+    const int chunk = (n + parts - 1) / parts;
+
+    // Partials are ACC values: double for float64, long for int32, float otherwise
+    const size_t accSize = dtype == DType::float64 || dtype == DType::int32 ? 8 : 4;
+    const size_t numPartials = runs * parts;
+    const size_t bytesA = (size_t)outer * n * inner * DTypeSize(dtype);
+    cl_mem bufA = clCreateBuffer(context, CL_MEM_READ_ONLY, bytesA, NULL, NULL);
+    cl_mem bufValues = clCreateBuffer(context, CL_MEM_WRITE_ONLY, numPartials * accSize, NULL, NULL);
+    cl_mem bufIndices = clCreateBuffer(context, CL_MEM_WRITE_ONLY, numPartials * sizeof(int), NULL, NULL);
+    clEnqueueWriteBuffer(queue, bufA, CL_FALSE, 0, bytesA, A, 0, NULL, TracedCommand("upload", queue, bytesA));
+
+    if (inner == 1) {
+        LockedKernel kernel = runtime.GetKernel(source.c_str(), "reduce_runs", options);
+        kernel.SetArg(0, bufA);
+        kernel.SetArg(1, bufValues);
+        kernel.SetArg(2, bufIndices);
+        kernel.SetArg(3, n);
+        kernel.SetArg(4, chunk);
+        kernel.SetArg(5, parts);
+        size_t localSize[1] = { groupSize };
+        size_t globalSize[1] = { numPartials * groupSize };
+        err = kernel.Status();
+        if (err == CL_SUCCESS) {
+            err = clEnqueueNDRangeKernel(queue, kernel.get(), 1, NULL, globalSize, localSize, 0, NULL, TracedCommand("reduce_runs", queue));
+        }
+    }
+    else {
+        LockedKernel kernel = runtime.GetKernel(source.c_str(), "reduce_columns", options);
+        kernel.SetArg(0, bufA);
+        kernel.SetArg(1, bufValues);
+        kernel.SetArg(2, bufIndices);
+        kernel.SetArg(3, n);
+        kernel.SetArg(4, inner);
+        kernel.SetArg(5, chunk);
+        kernel.SetArg(6, parts);
+        const size_t columnGroup = std::min<size_t>(groupSize, 64);
+        size_t globalSize[2] = { (inner + columnGroup - 1) / columnGroup * columnGroup, (size_t)outer * parts };
+        err = kernel.Status();
+        if (err == CL_SUCCESS) {
+            err = clEnqueueNDRangeKernel(queue, kernel.get(), 2, NULL, globalSize, NULL, 0, NULL, TracedCommand("reduce_columns", queue));
+        }
+    }
+    if (err != CL_SUCCESS) {
+        printf("Failed to launch the reduction kernel. Error %d\n", err);
+    }
+
+    // The queue is in-order, so the blocking reads also wait for the upload and the kernel
+    std::vector<unsigned char> accValues(numPartials * accSize);
+    partialIndices.resize(numPartials);
+    clEnqueueReadBuffer(queue, bufValues, CL_TRUE, 0, accValues.size(), accValues.data(), 0, NULL,
+        TracedCommand("download", queue, accValues.size()));
+    clEnqueueReadBuffer(queue, bufIndices, CL_TRUE, 0, numPartials * sizeof(int), partialIndices.data(), 0, NULL,
+        TracedCommand("download", queue, numPartials * sizeof(int)));
+    partialValues.resize(numPartials);
+    for (size_t p = 0; p < numPartials; ++p) {
+        const unsigned char* value = accValues.data() + p * accSize;
+        if (dtype == DType::float64) partialValues[p] = *reinterpret_cast<const double*>(value);
+        else if (dtype == DType::int32) partialValues[p] = (double)*reinterpret_cast<const long long*>(value);
+        else partialValues[p] = *reinterpret_cast<const float*>(value);
+    }
+
+    clReleaseMemObject(bufA);
+    clReleaseMemObject(bufValues);
+    clReleaseMemObject(bufIndices);
+    return parts;
+}
+
+void SparseMatrixMultiplyKernelBased(int rows, int cols, int N,
+    const int* rowPointers, const int* columnIndices, const float* values,
+    const float* B, int ldb, float* C, int ldc, const char* const* KernelSource) {
+    if (rows == 0 || N == 0) return;
+    const size_t nnz = (size_t)rowPointers[rows];
+    if (nnz == 0 || cols == 0) {
+        // Nothing to multiply, and OpenCL has no empty buffers
+        for (int r = 0; r < rows; ++r) std::fill(C + (size_t)r * ldc, C + (size_t)r * ldc + N, 0.0f);
+        return;
+    }
+    OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    cl_context context = runtime.Context();
+    cl_command_queue queue = runtime.Queue();
+    cl_int err;
+
+    // spmv_csr's work-groups are up to 64 items, a power of two for the tree in local memory
+    size_t groupSize = 1;
+    while (groupSize * 2 <= 64 && groupSize * 2 <= runtime.MaxWorkGroupSize()) groupSize *= 2;
+    const std::string options = "-D GROUP_SIZE=" + std::to_string(groupSize);
+
+    // The matrix moves as its three CSR arrays; B and C are dense on the device
+    const size_t bytesPointers = (size_t)(rows + 1) * sizeof(int);
+    const size_t bytesB = (size_t)cols * N * sizeof(float);
+    const size_t bytesC = (size_t)rows * N * sizeof(float);
+    cl_mem bufPointers = clCreateBuffer(context, CL_MEM_READ_ONLY, bytesPointers, NULL, NULL);
+    cl_mem bufColumns = clCreateBuffer(context, CL_MEM_READ_ONLY, nnz * sizeof(int), NULL, NULL);
+    cl_mem bufValues = clCreateBuffer(context, CL_MEM_READ_ONLY, nnz * sizeof(float), NULL, NULL);
+    cl_mem bufB = clCreateBuffer(context, CL_MEM_READ_ONLY, bytesB, NULL, NULL);
+    cl_mem bufC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytesC, NULL, NULL);
+    clEnqueueWriteBuffer(queue, bufPointers, CL_FALSE, 0, bytesPointers, rowPointers, 0, NULL,
+        TracedCommand("upload", queue, bytesPointers));
+    clEnqueueWriteBuffer(queue, bufColumns, CL_FALSE, 0, nnz * sizeof(int), columnIndices, 0, NULL,
+        TracedCommand("upload", queue, nnz * sizeof(int)));
+    clEnqueueWriteBuffer(queue, bufValues, CL_FALSE, 0, nnz * sizeof(float), values, 0, NULL,
+        TracedCommand("upload", queue, nnz * sizeof(float)));
+    WriteRowsToBuffer(queue, bufB, B, cols, N, ldb, sizeof(float));
+
+    const int ld = N; // of B and C on the device
+    if (N == 1) {
+        LockedKernel kernel = runtime.GetKernel(*KernelSource, "spmv_csr", options);
+        kernel.SetArg(0, bufPointers);
+        kernel.SetArg(1, bufColumns);
+        kernel.SetArg(2, bufValues);
+        kernel.SetArg(3, bufB);
+        kernel.SetArg(4, ld);
+        kernel.SetArg(5, bufC);
+        kernel.SetArg(6, ld);
+        size_t globalSize[1] = { (size_t)rows * groupSize };
+        size_t localSize[1] = { groupSize };
+        err = kernel.Status();
+        if (err == CL_SUCCESS) {
+            err = clEnqueueNDRangeKernel(queue, kernel.get(), 1, NULL, globalSize, localSize, 0, NULL, TracedCommand("spmv_csr", queue));
+        }
+    }
+    else {
+        LockedKernel kernel = runtime.GetKernel(*KernelSource, "spmm_csr", options);
+        kernel.SetArg(0, bufPointers);
+        kernel.SetArg(1, bufColumns);
+        kernel.SetArg(2, bufValues);
+        kernel.SetArg(3, bufB);
+        kernel.SetArg(4, ld);
+        kernel.SetArg(5, bufC);
+        kernel.SetArg(6, ld);
+        kernel.SetArg(7, rows);
+        kernel.SetArg(8, N);
+        const size_t columnGroup = 64;
+        size_t globalSize[2] = { (N + columnGroup - 1) / columnGroup * columnGroup, (size_t)rows };
+        err = kernel.Status();
+        if (err == CL_SUCCESS) {
+            err = clEnqueueNDRangeKernel(queue, kernel.get(), 2, NULL, globalSize, NULL, 0, NULL, TracedCommand("spmm_csr", queue));
+        }
+    }
+    if (err != CL_SUCCESS) {
+        printf("Failed to launch the sparse matrix multiplication kernel. Error %d\n", err);
+    }
+
+    // The queue is in-order, so the blocking read also waits for the uploads and the kernel
+    if (ldc == N) {
+        clEnqueueReadBuffer(queue, bufC, CL_TRUE, 0, bytesC, C, 0, NULL, TracedCommand("download", queue, bytesC));
+    }
+    else {
+        const size_t origin[3] = { 0, 0, 0 };
+        const size_t region[3] = { N * sizeof(float), (size_t)rows, 1 };
+        clEnqueueReadBufferRect(queue, bufC, CL_TRUE, origin, origin, region,
+            N * sizeof(float), 0, ldc * sizeof(float), 0, C, 0, NULL, TracedCommand("download", queue, bytesC));
+    }
+
+    clReleaseMemObject(bufPointers);
+    clReleaseMemObject(bufColumns);
+    clReleaseMemObject(bufValues);
+    clReleaseMemObject(bufB);
+    clReleaseMemObject(bufC);
+}
+
+const char* KernelTypeBuildOption(DType aDType) {
+    switch (aDType) {
+    case DType::float64: return "-D DTYPE_FLOAT64";
+    case DType::float16: return "-D DTYPE_FLOAT16";
+    case DType::bfloat16: return "-D DTYPE_BFLOAT16";
+    case DType::int32: return "-D DTYPE_INT32";
+    default: return "-D DTYPE_FLOAT32";
+    }
+}
+
+std::string GemmKernelConfig::BuildOptions() const {
+    return "-D TSM=" + std::to_string(tileM) + " -D TSN=" + std::to_string(tileN) +
+        " -D TSK=" + std::to_string(tileK) + " -D WPTM=" + std::to_string(workPerThreadM) +
+        " -D WPTN=" + std::to_string(workPerThreadN) + " -D WIDTH=" + std::to_string(vectorWidth);
+}
+
+std::string GemmKernelConfig::Name() const {
+    return std::to_string(tileM) + "x" + std::to_string(tileN) + "x" + std::to_string(tileK) + " " +
+        std::to_string(workPerThreadM) + "x" + std::to_string(workPerThreadN) + " w" + std::to_string(vectorWidth);
+}
+
+bool GemmKernelConfig::IsValid() const {
+    if (tileM <= 0 || tileN <= 0 || tileK <= 0 || workPerThreadM <= 0 || workPerThreadN <= 0) return false;
+    if (vectorWidth != 1 && vectorWidth != 2 && vectorWidth != 4 && vectorWidth != 8) return false;
+    if (tileM % workPerThreadM != 0 || tileN % workPerThreadN != 0) return false;
+    if (tileK % vectorWidth != 0 || tileN % vectorWidth != 0) return false;
+    const size_t threads = WorkGroupSize();
+    return (size_t)tileM * tileK / vectorWidth % threads == 0 && (size_t)tileK * tileN / vectorWidth % threads == 0;
+}
+
+std::string GemmKernelEpilogue::BuildOptions() const {
+    std::string options = "-D EPILOGUE";
+    if (bias) options += " -D HAS_BIAS";
+    if (*activationBuildOption) options += std::string(" ") + activationBuildOption;
+    return options;
+}
+
+size_t GemmKernelConfig::LocalMemBytes(DType dtype) const {
+    // ACC in elementTypeKernelPrelude: double for float64, long for int32, float otherwise
+    const size_t accSize = dtype == DType::float64 || dtype == DType::int32 ? 8 : 4;
+    return ((size_t)tileM * tileK + (size_t)tileK * tileN) * accSize;
+}
 
-    
-    // Set kernel arguments
-    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &bufA);
-    err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &bufB);
-    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &bufC);
-    err = clSetKernelArg(kernel, 3, sizeof(int), &shape1[0]);
-    err = clSetKernelArg(kernel, 4, sizeof(int), &shape1[1]);
-    err = clSetKernelArg(kernel, 5, sizeof(int), &shape2[1]);
+cl_int EnqueueMatrixMultiply(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, DType dtype,
+    const char** KernelSource, const GemmKernelConfig* config, cl_event* event,
+    const GemmKernelEpilogue* epilogue, cl_mem bias) {
+    if (config) {
+        return EnqueueBatchedMatrixMultiply(A, B, C, M, K, N, 1, 0, 0, dtype, KernelSource, *config, NULL, event,
+            epilogue, bias);
+    }
+    OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    const std::string source = std::string(elementTypeKernelPrelude) + *KernelSource;
+    const std::string options = KernelTypeBuildOption(dtype);
+    LockedKernel kernel = runtime.GetKernel(source.c_str(), "matrix_multiply", options);
+
+    // Set kernel arguments. The cached kernel is shared, so arguments are set on every launch.
+    kernel.SetArg(0, A);
+    kernel.SetArg(1, B);
+    kernel.SetArg(2, C);
+    kernel.SetArg(3, M);
+    kernel.SetArg(4, K);
+    kernel.SetArg(5, N);
+    if (kernel.Status() != CL_SUCCESS) {
+        return kernel.Status();
+    }
+
+    size_t globalSize[2] = { (size_t)M, (size_t)N };
+    return clEnqueueNDRangeKernel(runtime.Queue(), kernel.get(), 2, NULL, globalSize, NULL, 0, NULL,
+        TracedCommand("matrix_multiply", runtime.Queue(), 0, event));
+}
+
+cl_int EnqueueBatchedMatrixMultiply(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, int batch,
+    size_t batchStrideA, size_t batchStrideB, DType dtype, const char** KernelSource,
+    const GemmKernelConfig& config, cl_event waitFor, cl_event* event,
+    const GemmKernelEpilogue* epilogue, cl_mem bias) {
+    OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    const std::string source = std::string(elementTypeKernelPrelude) + *KernelSource;
+    std::string options = std::string(KernelTypeBuildOption(dtype)) + " " + config.BuildOptions();
+    if (epilogue) options += " " + epilogue->BuildOptions();
+    LockedKernel kernel = runtime.GetKernel(source.c_str(), "matrix_multiply", options);
+
+    const cl_ulong strideA = batchStrideA, strideB = batchStrideB;
+    kernel.SetArg(0, A);
+    kernel.SetArg(1, B);
+    kernel.SetArg(2, C);
+    kernel.SetArg(3, M);
+    kernel.SetArg(4, K);
+    kernel.SetArg(5, N);
+    kernel.SetArg(6, strideA);
+    kernel.SetArg(7, strideB);
+    if (epilogue) {
+        kernel.SetArg(8, epilogue->scale);
+        if (epilogue->bias) kernel.SetArg(9, bias);
+    }
+    if (kernel.Status() != CL_SUCCESS) {
+        return kernel.Status();
+    }
+
+    // Work-groups of (TSN / WPTN) x (TSM / WPTM) items each cover a TSM x TSN tile of C, columns
+    // first, and dimension 2 runs over the batch. The grid is rounded up to whole tiles; the kernel
+    // skips the outputs past the edges.
+    const size_t RTSN = config.tileN / config.workPerThreadN, RTSM = config.tileM / config.workPerThreadM;
+    size_t localSize[3] = { RTSN, RTSM, 1 };
+    size_t globalSize[3] = { (N + config.tileN - 1) / config.tileN * RTSN,
+        (M + config.tileM - 1) / config.tileM * RTSM, (size_t)batch };
+    return clEnqueueNDRangeKernel(runtime.Queue(), kernel.get(), 3, NULL, globalSize, localSize,
+        waitFor ? 1 : 0, waitFor ? &waitFor : NULL, TracedCommand("matrix_multiply", runtime.Queue(), 0, event));
+}
+
+void MatrixMultiplyKernelBased(int M, int K, int N,
+    const void* A, int lda, const void* B, int ldb,
+    void* C, int ldc, DType dtype, const char** KernelSource, const GemmKernelConfig* config,
+    const GemmKernelEpilogue* epilogue) {
+    // Context, device, command queue and the compiled kernel come from the process-wide runtime,
+    // so a call only pays for the buffer transfers and the kernel launch.
+    OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    cl_context context = runtime.Context();
+    cl_command_queue queue = runtime.Queue();
+    cl_int err;
+
+    // Prepare data for OpenCL
+    const size_t elementSize = DTypeSize(dtype);
+    size_t bytesA = (size_t)M * K * elementSize;
+    size_t bytesB = (size_t)K * N * elementSize;
+    size_t bytesC = (size_t)M * N * elementSize;
+
+    cl_mem bufA = clCreateBuffer(context, CL_MEM_READ_ONLY, bytesA, NULL, NULL);
+    cl_mem bufB = clCreateBuffer(context, CL_MEM_READ_ONLY, bytesB, NULL, NULL);
+    cl_mem bufC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytesC, NULL, NULL);
+    WriteRowsToBuffer(queue, bufA, A, M, K, lda, elementSize);
+    WriteRowsToBuffer(queue, bufB, B, K, N, ldb, elementSize);
+    cl_mem bufBias = NULL;
+    if (epilogue && epilogue->bias) {
+        bufBias = clCreateBuffer(context, CL_MEM_READ_ONLY, N * elementSize, NULL, NULL);
+        WriteRowsToBuffer(queue, bufBias, epilogue->bias, 1, N, N, elementSize);
+    }
 
     // Execute the kernel
-    const int TS = 16; // Max work group size of the current device is 512. ### CAUTION: Make sure this is the same in the Kernel source code also (opencl_kernels.h) 
-    size_t localSize[2] = { TS, TS };
-    size_t globalSize[2] = { shape1[0], shape2[1] };
-    err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalSize, localSize, 0, NULL, NULL);
-    //err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalSize, NULL, 0, NULL, &event);
-   
-    err = clWaitForEvents(1, &event);
-    // Read the result back into the output vector
-    err = clEnqueueReadBuffer(queue, bufC, CL_TRUE, 0, bytesC, output.data(), 0, NULL, NULL);
+    err = EnqueueMatrixMultiply(bufA, bufB, bufC, M, K, N, dtype, KernelSource, config, NULL, epilogue, bufBias);
+    if (err != CL_SUCCESS) {
+        printf("Failed to launch the matrix multiplication kernel. Error %d\n", err);
+    }
 
-    // Cleanup
+    // Read the result back. The queue is in-order, so the blocking read also waits for the
+    // uploads and the kernel to finish.
+    if (ldc == N) {
+        err = clEnqueueReadBuffer(queue, bufC, CL_TRUE, 0, bytesC, C, 0, NULL, TracedCommand("download", queue, bytesC));
+    }
+    else {
+        const size_t origin[3] = { 0, 0, 0 };
+        const size_t region[3] = { N * elementSize, (size_t)M, 1 };
+        err = clEnqueueReadBufferRect(queue, bufC, CL_TRUE, origin, origin, region,
+            N * elementSize, 0, ldc * elementSize, 0, C, 0, NULL, TracedCommand("download", queue, bytesC));
+    }
+
+    // Cleanup: only the per-call buffers. Kernel, program, queue and context stay cached.
     clReleaseMemObject(bufA);
     clReleaseMemObject(bufB);
     clReleaseMemObject(bufC);
-    clReleaseProgram(program);
-    clReleaseKernel(kernel);
-    clReleaseCommandQueue(queue);
-    clReleaseContext(context);
+    if (bufBias) clReleaseMemObject(bufBias);
 
     return;
 }
 
+void BatchedMatrixMultiplyKernelBased(int batch, int M, int K, int N,
+    const void* const* A, const int* lda, const void* const* B, const int* ldb,
+    void* const* C, const int* ldc, DType dtype, const char** KernelSource, const GemmKernelConfig& config,
+    PendingKernelWork* pending, const GemmKernelEpilogue* epilogue) {
+    OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    cl_context context = runtime.Context();
+    cl_int err;
+
+    // An operand given as the same matrix for every entry is uploaded once, with batch stride 0
+    auto shared = [batch](const void* const* host, const int* ld) {
+        for (int i = 1; i < batch; ++i) {
+            if (host[i] != host[0] || ld[i] != ld[0]) return false;
+        }
+        return true;
+    };
+    const int countA = shared(A, lda) ? 1 : batch;
+    const int countB = shared(B, ldb) ? 1 : batch;
+
+    const size_t elementSize = DTypeSize(dtype);
+    const size_t sizeA = (size_t)M * K, sizeB = (size_t)K * N, sizeC = (size_t)M * N;
+    cl_mem bufA = clCreateBuffer(context, CL_MEM_READ_ONLY, countA * sizeA * elementSize, NULL, NULL);
+    cl_mem bufB = clCreateBuffer(context, CL_MEM_READ_ONLY, countB * sizeB * elementSize, NULL, NULL);
+    cl_mem bufC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, batch * sizeC * elementSize, NULL, NULL);
+    WriteBatchToBuffer(runtime.UploadQueue(), bufA, A, lda, countA, M, K, elementSize);
+    WriteBatchToBuffer(runtime.UploadQueue(), bufB, B, ldb, countB, K, N, elementSize);
+    cl_mem bufBias = NULL;
+    if (epilogue && epilogue->bias) {
+        bufBias = clCreateBuffer(context, CL_MEM_READ_ONLY, N * elementSize, NULL, NULL);
+        WriteRowsToBuffer(runtime.UploadQueue(), bufBias, epilogue->bias, 1, N, N, elementSize);
+    }
+    cl_event uploaded = MarkQueue(runtime.UploadQueue());
+
+    // One launch for the whole batch, once the uploads are done
+    cl_event computed = NULL;
+    err = EnqueueBatchedMatrixMultiply(bufA, bufB, bufC, M, K, N, batch, countA > 1 ? sizeA : 0,
+        countB > 1 ? sizeB : 0, dtype, KernelSource, config, uploaded, &computed, epilogue, bufBias);
+    if (err != CL_SUCCESS) {
+        printf("Failed to launch the batched matrix multiplication kernel. Error %d\n", err);
+        clEnqueueMarkerWithWaitList(runtime.Queue(), 1, &uploaded, &computed);
+    }
+    EnqueueReadBatch(runtime.DownloadQueue(), bufC, C, ldc, batch, M, N, elementSize, computed);
+    clReleaseEvent(uploaded);
+    clReleaseEvent(computed);
+
+    PendingKernelWork work;
+    work.deviceBuffers = { bufA, bufB, bufC };
+    if (bufBias) work.deviceBuffers.push_back(bufBias);
+    FinishPipeline(work, pending);
+}
+
 
 void PrintKernelBuildLog(cl_program program, cl_device_id device) {
     size_t logSize;
@@ -0,0 +1,206 @@
+#include "opencl_tuner.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+
+extern const char* matrixMultTilingKernelSource; // Tunable GEMM kernel, defined in opencl_kernels.h
+
+namespace {
+
+const int TileSizes[] = { 32, 64, 128 }; // TSM = TSN
+const int TileKs[] = { 8, 16, 32 };
+const int MicroTiles[][2] = { { 2, 2 }, { 4, 4 }, { 8, 4 }, { 8, 8 } }; // WPTM x WPTN
+const int VectorWidths[] = { 1, 4 };
+const int TimedLaunches = 3; // Per candidate, after one untimed launch; the fastest counts
+
+int RoundUpPowerOfTwo(int aValue, int aMin, int aMax) {
+    int rounded = aMin;
+    while (rounded < aValue && rounded < aMax) rounded *= 2;
+    return rounded;
+}
+
+} // namespace
+
+GemmTuner& GemmTuner::Instance() {
+    static GemmTuner tuner;
+    return tuner;
+}
+
+GemmTuner::GemmTuner() {
+    const char* path = std::getenv("TENSOR_GEMM_TUNING_FILE");
+    tuningFile = path && *path ? path : "opencl_gemm_tuning.txt";
+    const char* tune = std::getenv("TENSOR_GEMM_AUTOTUNE");
+    autoTune = tune && std::string(tune) == "1";
+}
+
+void GemmTuner::setAutoTune(bool aAutoTune) {
+    std::lock_guard<std::mutex> lock(tableMutex);
+    autoTune = aAutoTune;
+}
+
+void GemmTuner::setTuningFile(const std::string& aPath) {
+    std::lock_guard<std::mutex> lock(tableMutex);
+    tuningFile = aPath;
+    table.clear();
+    loaded = false;
+}
+
+std::string GemmTuner::ShapeClass(int M, int K, int N) {
+    std::ostringstream name;
+    name << RoundUpPowerOfTwo(M, 64, 4096) << "x" << RoundUpPowerOfTwo(K, 64, 4096) << "x"
+         << RoundUpPowerOfTwo(N, 64, 4096);
+    return name.str();
+}
+
+bool GemmTuner::Supports(const GemmKernelConfig& aConfig, DType dtype) const {
+    const OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    return aConfig.IsValid() && aConfig.WorkGroupSize() <= runtime.MaxWorkGroupSize() &&
+        aConfig.LocalMemBytes(dtype) <= runtime.LocalMemSize();
+}
+
+std::vector<GemmKernelConfig> GemmTuner::Candidates(DType dtype) const {
+    std::vector<GemmKernelConfig> candidates;
+    for (int tileSize : TileSizes) {
+        for (int tileK : TileKs) {
+            for (const auto& microTile : MicroTiles) {
+                for (int vectorWidth : VectorWidths) {
+                    const GemmKernelConfig config{ tileSize, tileSize, tileK, microTile[0], microTile[1], vectorWidth };
+                    if (Supports(config, dtype)) {
+                        candidates.push_back(config);
+                    }
+                }
+            }
+        }
+    }
+    return candidates;
+}
+
+GemmKernelConfig GemmTuner::Select(int M, int K, int N, DType dtype) {
+    std::unique_lock<std::mutex> lock(tableMutex);
+    if (!loaded) Load();
+    const Key key(OpenCLRuntime::Instance().DeviceName(), DTypeName(dtype), ShapeClass(M, K, N));
+    auto found = table.find(key);
+    if (found != table.end()) {
+        return found->second.config;
+    }
+
+    if (autoTune) {
+        lock.unlock();
+        return Tune(M, K, N, dtype);
+    }
+    return Untuned(dtype);
+}
+
+GemmKernelConfig GemmTuner::Untuned(DType dtype) const {
+    if (Supports(GemmKernelConfig(), dtype)) {
+        return GemmKernelConfig();
+    }
+    const std::vector<GemmKernelConfig> candidates = Candidates(dtype);
+    return candidates.empty() ? GemmKernelConfig() : candidates.front();
+}
+
+double GemmTuner::TimeConfig(const GemmKernelConfig& aConfig, int M, int K, int N, DType dtype,
+    cl_mem A, cl_mem B, cl_mem C) {
+    double best = -1;
+    for (int launch = 0; launch <= TimedLaunches; ++launch) {
+        cl_event event = NULL;
+        cl_int err = EnqueueMatrixMultiply(A, B, C, M, K, N, dtype, &matrixMultTilingKernelSource, &aConfig, &event);
+        if (err != CL_SUCCESS) {
+            return -1; // e.g. the compiled kernel supports fewer work-items per group than the device
+        }
+        clWaitForEvents(1, &event);
+        cl_ulong start = 0, end = 0;
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        clReleaseEvent(event);
+        const double milliseconds = (end - start) * 1e-6;
+        if (launch > 0 && (best < 0 || milliseconds < best)) best = milliseconds; // Launch 0 warms up
+    }
+    return best;
+}
+
+GemmKernelConfig GemmTuner::Tune(int M, int K, int N, DType dtype) {
+    std::lock_guard<std::mutex> lock(tableMutex); // One shape at a time: candidates must not share the device
+    if (!loaded) Load();
+    OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    const Key key(runtime.DeviceName(), DTypeName(dtype), ShapeClass(M, K, N));
+
+    // Operands filled with zeros: the timings do not depend on the values
+    const size_t elementSize = DTypeSize(dtype);
+    const unsigned char zero = 0;
+    cl_mem buffers[3];
+    const size_t bytes[3] = { (size_t)M * K * elementSize, (size_t)K * N * elementSize, (size_t)M * N * elementSize };
+    for (int i = 0; i < 3; ++i) {
+        buffers[i] = clCreateBuffer(runtime.Context(), CL_MEM_READ_WRITE, bytes[i], NULL, NULL);
+        clEnqueueFillBuffer(runtime.Queue(), buffers[i], &zero, 1, 0, bytes[i], 0, NULL, NULL);
+    }
+
+    Entry winner;
+    bool tuned = false;
+    for (const GemmKernelConfig& config : Candidates(dtype)) {
+        const double milliseconds = TimeConfig(config, M, K, N, dtype, buffers[0], buffers[1], buffers[2]);
+        if (milliseconds >= 0 && (!tuned || milliseconds < winner.milliseconds)) {
+            winner.config = config;
+            winner.milliseconds = milliseconds;
+            tuned = true;
+        }
+    }
+    for (cl_mem buffer : buffers) {
+        clReleaseMemObject(buffer);
+    }
+
+    if (!tuned) {
+        // No candidate could be launched. The untuned configuration stands for this shape class from
+        // now on, in memory only, so that later Select() calls do not sweep the candidates again.
+        winner.config = Untuned(dtype);
+        table[key] = winner;
+        return winner.config;
+    }
+    printf("Tuned GEMM %s %s on %s: %s (%.3f ms)\n", std::get<1>(key).c_str(), std::get<2>(key).c_str(),
+        std::get<0>(key).c_str(), winner.config.Name().c_str(), winner.milliseconds);
+    table[key] = winner;
+    Append(key, winner);
+    return winner.config;
+}
+
+// One entry per line: device, dtype, shape class, TSM, TSN, TSK, WPTM, WPTN, WIDTH and kernel
+// milliseconds, separated by tabs. Later lines override earlier ones for the same key.
+void GemmTuner::Load() {
+    loaded = true;
+    std::ifstream file(tuningFile);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream fields(line);
+        std::string device, dtype, shapeClass, values;
+        if (!std::getline(fields, device, '\t') || !std::getline(fields, dtype, '\t') ||
+            !std::getline(fields, shapeClass, '\t') || !std::getline(fields, values)) {
+            continue;
+        }
+        Entry entry;
+        GemmKernelConfig& config = entry.config;
+        std::istringstream numbers(values);
+        if (numbers >> config.tileM >> config.tileN >> config.tileK >> config.workPerThreadM >>
+            config.workPerThreadN >> config.vectorWidth >> entry.milliseconds && config.IsValid()) {
+            table[Key(device, dtype, shapeClass)] = entry;
+        }
+    }
+}
+
+void GemmTuner::Append(const Key& aKey, const Entry& aEntry) {
+    const bool exists = std::ifstream(tuningFile).good();
+    std::ofstream file(tuningFile, std::ios::app);
+    if (!file) {
+        printf("Failed to write the GEMM tuning file %s\n", tuningFile.c_str());
+        return;
+    }
+    if (!exists) {
+        file << "# OpenCL GEMM tuning: device, dtype, shape class (M x K x N), TSM, TSN, TSK, WPTM, WPTN, WIDTH, kernel ms\n";
+    }
+    const GemmKernelConfig& config = aEntry.config;
+    file << std::get<0>(aKey) << '\t' << std::get<1>(aKey) << '\t' << std::get<2>(aKey) << '\t'
+         << config.tileM << '\t' << config.tileN << '\t' << config.tileK << '\t' << config.workPerThreadM << '\t'
+         << config.workPerThreadN << '\t' << config.vectorWidth << '\t' << aEntry.milliseconds << '\n';
+}
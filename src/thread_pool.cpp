@@ -0,0 +1,277 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <omp.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t PageBytes = 4096;
+constexpr size_t TouchGrainPages = 16;
+constexpr size_t FillGrainBytes = 64 * 1024;
+
+thread_local bool insideJob = false; // The calling thread is running a chunk
+
+// A thread's share of the chunks left, [front, back), in one word so the owner (taking from the
+// front) and thieves (taking from the back) agree with a single compare-and-swap
+uint64_t PackShare(uint32_t aFront, uint32_t aBack) {
+    return (uint64_t)aBack << 32 | aFront;
+}
+
+bool TakeFront(std::atomic<uint64_t>& aShare, uint32_t& aChunk) {
+    uint64_t share = aShare.load(std::memory_order_acquire);
+    for (;;) {
+        const uint32_t front = (uint32_t)share, back = (uint32_t)(share >> 32);
+        if (front >= back) return false;
+        if (aShare.compare_exchange_weak(share, PackShare(front + 1, back), std::memory_order_acq_rel)) {
+            aChunk = front;
+            return true;
+        }
+    }
+}
+
+bool TakeBack(std::atomic<uint64_t>& aShare, uint32_t& aChunk) {
+    uint64_t share = aShare.load(std::memory_order_acquire);
+    for (;;) {
+        const uint32_t front = (uint32_t)share, back = (uint32_t)(share >> 32);
+        if (front >= back) return false;
+        if (aShare.compare_exchange_weak(share, PackShare(front, back - 1), std::memory_order_acq_rel)) {
+            aChunk = back - 1;
+            return true;
+        }
+    }
+}
+
+long long Nanoseconds(Clock::duration aDuration) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(aDuration).count();
+}
+
+// CPUs the process may run on, in increasing order
+std::vector<int> AllowedCPUs() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+#endif
+    return cpus;
+}
+
+void PinCurrentThread(int aCPU) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(aCPU, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)aCPU;
+#endif
+}
+
+} // namespace
+
+struct ThreadPool::Job {
+    RangeFunction function = nullptr;
+    const void* body = nullptr;
+    size_t count = 0;
+    size_t chunkSize = 0;
+    std::atomic<uint32_t> remaining{ 0 }; // Chunks not finished
+    int participants = 0; // Threads inside RunChunks; guarded by jobMutex
+};
+
+struct alignas(64) ThreadPool::Slot {
+    std::atomic<uint64_t> share{ 0 };
+    std::atomic<size_t> tasks{ 0 };
+    std::atomic<size_t> steals{ 0 };
+    std::atomic<long long> busyNanoseconds{ 0 };
+    std::atomic<long long> idleNanoseconds{ 0 };
+    int cpu = -1;
+    unsigned long long joined = 0; // Generation of the last job taken part in; guarded by jobMutex
+    Clock::time_point finished; // When it ran out of chunks in that job
+};
+
+ThreadPool& ThreadPool::Instance() {
+    // Leaked, like the allocators: operations may still run while static objects are destroyed
+    static ThreadPool* pool = new ThreadPool();
+    return *pool;
+}
+
+ThreadPool::ThreadPool() {
+    numThreads = omp_get_max_threads();
+    if (const char* requested = std::getenv("TENSOR_NUM_THREADS")) {
+        if (std::atoi(requested) > 0) numThreads = std::atoi(requested);
+    }
+    numThreads = std::max(numThreads, 1);
+    slots.reset(new Slot[numThreads]);
+
+    const char* pin = std::getenv("TENSOR_PIN_THREADS");
+    const std::vector<int> cpus = AllowedCPUs();
+    if (!(pin && std::strcmp(pin, "0") == 0) && numThreads <= (int)cpus.size()) {
+        // The calling thread is left where it is; its CPU is the first one, left to it
+        for (int s = 1; s < numThreads; ++s) slots[s].cpu = cpus[s];
+    }
+    for (int s = 1; s < numThreads; ++s) {
+        std::thread(&ThreadPool::WorkerLoop, this, s).detach(); // The workers live as long as the process
+    }
+}
+
+void ThreadPool::Run(size_t aCount, size_t aGrain, RangeFunction aFunction, const void* aBody) {
+    if (aCount == 0) return;
+    const size_t grain = std::max<size_t>(aGrain, 1);
+    if (numThreads == 1 || insideJob || aCount <= grain) {
+        inlineJobs.fetch_add(1, std::memory_order_relaxed);
+        aFunction(aBody, 0, aCount);
+        return;
+    }
+
+    std::lock_guard<std::mutex> submit(submitMutex);
+    Job job;
+    job.function = aFunction;
+    job.body = aBody;
+    job.count = aCount;
+    const size_t maxChunks = (size_t)numThreads * ChunksPerThread;
+    job.chunkSize = std::max(grain, (aCount + maxChunks - 1) / maxChunks);
+    const uint32_t numChunks = (uint32_t)((aCount + job.chunkSize - 1) / job.chunkSize);
+    job.remaining.store(numChunks, std::memory_order_relaxed);
+    for (int s = 0; s < numThreads; ++s) {
+        slots[s].share.store(PackShare((uint32_t)((uint64_t)numChunks * s / numThreads),
+            (uint32_t)((uint64_t)numChunks * (s + 1) / numThreads)), std::memory_order_relaxed);
+    }
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        current = &job;
+        ++generation;
+        job.participants = 1;
+        slots[0].joined = generation;
+    }
+    jobReady.notify_all();
+    jobs.fetch_add(1, std::memory_order_relaxed);
+
+    RunChunks(job, 0);
+
+    std::unique_lock<std::mutex> lock(jobMutex);
+    jobDone.wait(lock, [&job]() {
+        return job.participants == 1 && job.remaining.load(std::memory_order_acquire) == 0;
+    });
+    current = nullptr;
+    // The job ended when its last thread ran out of chunks; the others were idle until then
+    Clock::time_point end = slots[0].finished;
+    for (int s = 1; s < numThreads; ++s) {
+        if (slots[s].joined == generation) end = std::max(end, slots[s].finished);
+    }
+    for (int s = 0; s < numThreads; ++s) {
+        if (slots[s].joined == generation) {
+            slots[s].idleNanoseconds.fetch_add(Nanoseconds(end - slots[s].finished), std::memory_order_relaxed);
+        }
+    }
+}
+
+// Own chunks first, front to back; then chunks stolen from the back of the other shares
+void ThreadPool::RunChunks(Job& aJob, int aSlot) {
+    Slot& own = slots[aSlot];
+    insideJob = true;
+    for (;;) {
+        uint32_t chunk = 0;
+        bool stolen = false;
+        if (!TakeFront(own.share, chunk)) {
+            for (int k = 1; k < numThreads && !stolen; ++k) {
+                stolen = TakeBack(slots[(aSlot + k) % numThreads].share, chunk);
+            }
+            if (!stolen) break;
+        }
+        const size_t begin = (size_t)chunk * aJob.chunkSize;
+        const Clock::time_point start = Clock::now();
+        aJob.function(aJob.body, begin, std::min(aJob.count, begin + aJob.chunkSize));
+        own.busyNanoseconds.fetch_add(Nanoseconds(Clock::now() - start), std::memory_order_relaxed);
+        own.tasks.fetch_add(1, std::memory_order_relaxed);
+        if (stolen) own.steals.fetch_add(1, std::memory_order_relaxed);
+        aJob.remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    insideJob = false;
+    own.finished = Clock::now();
+}
+
+void ThreadPool::WorkerLoop(int aSlot) {
+    if (slots[aSlot].cpu >= 0) PinCurrentThread(slots[aSlot].cpu);
+    unsigned long long seen = 0;
+    for (;;) {
+        Job* job = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            jobReady.wait(lock, [this, &seen]() { return generation != seen; });
+            seen = generation;
+            job = current;
+            if (job) {
+                ++job->participants;
+                slots[aSlot].joined = seen;
+            }
+        }
+        if (!job) continue; // Woken after that job was over
+        RunChunks(*job, aSlot);
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            --job->participants;
+        }
+        jobDone.notify_one();
+    }
+}
+
+void ThreadPool::FirstTouch(void* aData, size_t aBytes) {
+    volatile unsigned char* bytes = static_cast<unsigned char*>(aData);
+    const size_t pages = (aBytes + PageBytes - 1) / PageBytes;
+    ParallelFor(pages, TouchGrainPages, [bytes](size_t aBegin, size_t aEnd) {
+        for (size_t page = aBegin; page < aEnd; ++page) bytes[page * PageBytes] = 0;
+    });
+}
+
+void ThreadPool::Fill(void* aData, size_t aBytes, unsigned char aValue) {
+    unsigned char* bytes = static_cast<unsigned char*>(aData);
+    ParallelFor(aBytes, FillGrainBytes, [bytes, aValue](size_t aBegin, size_t aEnd) {
+        std::memset(bytes + aBegin, aValue, aEnd - aBegin);
+    });
+}
+
+ThreadPoolStats ThreadPool::Stats() const {
+    ThreadPoolStats stats;
+    stats.threads = numThreads;
+    stats.jobs = jobs.load(std::memory_order_relaxed);
+    stats.inlineJobs = inlineJobs.load(std::memory_order_relaxed);
+    for (int s = 0; s < numThreads; ++s) {
+        ThreadStats thread;
+        thread.cpu = slots[s].cpu;
+        thread.tasks = slots[s].tasks.load(std::memory_order_relaxed);
+        thread.steals = slots[s].steals.load(std::memory_order_relaxed);
+        thread.busySeconds = slots[s].busyNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+        thread.idleSeconds = slots[s].idleNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+        stats.tasks += thread.tasks;
+        stats.steals += thread.steals;
+        stats.busySeconds += thread.busySeconds;
+        stats.idleSeconds += thread.idleSeconds;
+        stats.perThread.push_back(thread);
+    }
+    return stats;
+}
+
+void ThreadPool::ResetStats() {
+    jobs.store(0, std::memory_order_relaxed);
+    inlineJobs.store(0, std::memory_order_relaxed);
+    for (int s = 0; s < numThreads; ++s) {
+        slots[s].tasks.store(0, std::memory_order_relaxed);
+        slots[s].steals.store(0, std::memory_order_relaxed);
+        slots[s].busyNanoseconds.store(0, std::memory_order_relaxed);
+        slots[s].idleNanoseconds.store(0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,332 @@
+#include "tracer.h"
+#include "opencl_setup.h"
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+
+std::atomic<bool> Tracer::enabled{ false };
+
+namespace {
+
+const int HostProcess = 1;
+const int DeviceProcess = 2;
+const char* const QueueNames[] = { "", "upload queue", "compute queue", "download queue", "other queue" };
+
+thread_local const char* currentOperation = "";
+
+// Started at launch when TENSOR_TRACE_FILE is set, so the whole run is recorded
+[[maybe_unused]] const bool tracedFromLaunch = std::getenv("TENSOR_TRACE_FILE") ? (Tracer::Instance(), true) : false;
+
+std::string Escape(const std::string& aText) {
+    std::string escaped;
+    for (char c : aText) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        if ((unsigned char)c < 0x20) c = ' ';
+        escaped += c;
+    }
+    return escaped;
+}
+
+std::string Number(double aValue) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.3f", aValue);
+    return text;
+}
+
+void AppendMember(std::string& aArgs, const char* aKey, const std::string& aJsonValue) {
+    if (!aArgs.empty()) aArgs += ", ";
+    aArgs += "\"";
+    aArgs += aKey;
+    aArgs += "\": ";
+    aArgs += aJsonValue;
+}
+
+// "[64, 128] float32"
+std::string Describe(const TensorRef& aOperand) {
+    std::string text = "[";
+    for (int d = 0; d < aOperand.ndim; ++d) {
+        if (d) text += ", ";
+        text += std::to_string(aOperand.shape[d]);
+    }
+    return text + "] " + DTypeName(aOperand.dtype);
+}
+
+// Thread of the trace's device process that shows the commands of a queue
+int QueueId(cl_command_queue aQueue) {
+    const OpenCLRuntime& runtime = OpenCLRuntime::Instance();
+    if (aQueue == runtime.UploadQueue()) return 1;
+    if (aQueue == runtime.Queue()) return 2;
+    if (aQueue == runtime.DownloadQueue()) return 3;
+    return 4;
+}
+
+} // namespace
+
+
+/**************** Tracer ******************/
+
+Tracer& Tracer::Instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+Tracer::Tracer() : epoch(std::chrono::steady_clock::now()) {
+    const char* path = std::getenv("TENSOR_TRACE_FILE");
+    if (path && *path) {
+        exitFile = path;
+        enabled = true;
+    }
+}
+
+Tracer::~Tracer() {
+    if (exitFile.empty()) {
+        return;
+    }
+    Stop();
+    if (Write(exitFile)) {
+        printf("Trace of %zu events written to %s\n", events.size(), exitFile.c_str());
+    }
+}
+
+void Tracer::Start() {
+    Stop();
+    std::lock_guard<std::mutex> lock(eventMutex);
+    events.clear();
+    enabled = true;
+}
+
+void Tracer::Stop() {
+    enabled = false;
+    CollectCommands(true);
+}
+
+size_t Tracer::EventCount() {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    return events.size();
+}
+
+double Tracer::Now() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+int Tracer::ThreadId() {
+    static std::atomic<int> threads{ 0 };
+    thread_local const int id = ++threads;
+    return id;
+}
+
+void Tracer::Record(Event aEvent) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    events.push_back(std::move(aEvent));
+}
+
+void Tracer::RecordCommand(cl_event aEvent, const char* aName, cl_command_queue aQueue, size_t aBytes,
+    double aEnqueued, const char* aOperation) {
+    const int queue = QueueId(aQueue);
+    clRetainEvent(aEvent);
+    std::lock_guard<std::mutex> lock(eventMutex);
+    if (deviceName.empty()) {
+        deviceName = OpenCLRuntime::Instance().DeviceName();
+    }
+    pending.push_back({ aEvent, aName, aOperation, queue, aBytes, aEnqueued });
+}
+
+void Tracer::CollectCommands(bool aWait) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    size_t kept = 0;
+    for (PendingCommand& command : pending) {
+        if (aWait) {
+            clWaitForEvents(1, &command.event);
+        }
+        cl_int status = CL_COMPLETE;
+        clGetEventInfo(command.event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+        if (status > CL_COMPLETE) {
+            pending[kept++] = std::move(command);
+            continue;
+        }
+
+        // Device timestamps are in nanoseconds on the device's clock; the command was queued when
+        // the host enqueued it, which places the others on the host's timeline
+        cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+        const bool profiled =
+            clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL) == CL_SUCCESS &&
+            clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &submit, NULL) == CL_SUCCESS &&
+            clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) == CL_SUCCESS &&
+            clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) == CL_SUCCESS;
+        clReleaseEvent(command.event);
+        auto host = [&](cl_ulong aTime) { return command.enqueued + (double)(aTime - queued) / 1000.0; };
+
+        Event event{ command.name, "opencl", DeviceProcess, command.queue, command.enqueued, 0, "" };
+        AppendMember(event.args, "operation", "\"" + Escape(command.operation) + "\"");
+        AppendMember(event.args, "bytes", std::to_string(command.bytes));
+        if (status < 0) {
+            AppendMember(event.args, "error", std::to_string(status));
+        }
+        if (profiled) {
+            event.start = host(start);
+            event.duration = (double)(end - start) / 1000.0;
+            AppendMember(event.args, "queued_us", Number(command.enqueued));
+            AppendMember(event.args, "submit_us", Number(host(submit)));
+            AppendMember(event.args, "start_us", Number(host(start)));
+            AppendMember(event.args, "end_us", Number(host(end)));
+            AppendMember(event.args, "wait_us", Number((double)(start - queued) / 1000.0));
+        }
+        events.push_back(std::move(event));
+    }
+    pending.resize(kept);
+}
+
+bool Tracer::Write(const std::string& aPath) {
+    CollectCommands(true);
+    std::lock_guard<std::mutex> lock(eventMutex);
+    std::ofstream file(aPath, std::ios::trunc);
+    if (!file) {
+        printf("Failed to write the trace file %s\n", aPath.c_str());
+        return false;
+    }
+
+    // Names of the processes and threads, then the events ("X": complete events with a duration)
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    file << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << HostProcess
+         << ", \"args\": {\"name\": \"TensorFramework host\"}}";
+    if (!deviceName.empty()) {
+        file << ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << DeviceProcess
+             << ", \"args\": {\"name\": \"OpenCL " << Escape(deviceName) << "\"}}";
+        for (int queue = 1; queue <= 4; ++queue) {
+            file << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << DeviceProcess << ", \"tid\": " << queue
+                 << ", \"args\": {\"name\": \"" << QueueNames[queue] << "\"}}";
+        }
+    }
+    for (const Event& event : events) {
+        file << ",\n{\"name\": \"" << Escape(event.name) << "\", \"cat\": \"" << event.category
+             << "\", \"ph\": \"X\", \"pid\": " << event.pid << ", \"tid\": " << event.tid
+             << ", \"ts\": " << Number(event.start) << ", \"dur\": " << Number(event.duration)
+             << ", \"args\": {" << event.args << "}}";
+    }
+    file << "\n]}\n";
+    if (!file) {
+        printf("Failed to write the trace file %s\n", aPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/**************** Trace scope ******************/
+
+TraceScope::TraceScope(const char* aName, Device aDevice) : name(aName), device(aDevice), active(Tracer::Enabled()) {
+    if (active) {
+        start = Tracer::Instance().Now();
+        enclosing = currentOperation;
+        currentOperation = name;
+    }
+}
+
+TraceScope::~TraceScope() {
+    if (!active) {
+        return;
+    }
+    currentOperation = enclosing;
+    Tracer& tracer = Tracer::Instance();
+    Tracer::Event event{ name, "op", HostProcess, Tracer::ThreadId(), start, tracer.Now() - start, "" };
+    AppendMember(event.args, "device",
+        device == Device::cpu ? "\"cpu\"" : device == Device::gpu ? "\"opencl\"" : "\"auto\"");
+    if (!inputs.empty()) AppendMember(event.args, "inputs", "\"" + inputs + "\"");
+    if (!output.empty()) AppendMember(event.args, "output", "\"" + output + "\"");
+    AppendMember(event.args, "bytes", std::to_string(bytes));
+    if (!args.empty()) event.args += ", " + args;
+    tracer.Record(std::move(event));
+    tracer.CollectCommands(false);
+}
+
+TraceScope& TraceScope::Input(const TensorRef& aOperand) {
+    if (!inputs.empty()) inputs += ", ";
+    inputs += Describe(aOperand);
+    bytes += (long long)(aOperand.numel() * DTypeSize(aOperand.dtype));
+    return *this;
+}
+
+TraceScope& TraceScope::Output(const TensorRef& aOperand) {
+    output = Describe(aOperand);
+    bytes += (long long)(aOperand.numel() * DTypeSize(aOperand.dtype));
+    return *this;
+}
+
+TraceScope& TraceScope::View(const TensorRef& aResult) {
+    output = Describe(aResult) + " view";
+    return *this;
+}
+
+TraceScope& TraceScope::Arg(const char* aKey, const std::string& aValue) {
+    AppendMember(args, aKey, "\"" + Escape(aValue) + "\"");
+    return *this;
+}
+
+TraceScope& TraceScope::Arg(const char* aKey, long long aValue) {
+    AppendMember(args, aKey, std::to_string(aValue));
+    return *this;
+}
+
+const char* TraceScope::Current() {
+    return currentOperation;
+}
+
+const char* TraceName(OperationType aType) {
+    switch (aType) {
+    case OperationType::Addition: return "add";
+    case OperationType::Subtraction: return "subtract";
+    case OperationType::Multiplication: return "multiply";
+    case OperationType::Division: return "divide";
+    default: return "matmul";
+    }
+}
+
+const char* TraceName(ReductionType aType) {
+    switch (aType) {
+    case ReductionType::Sum: return "sum";
+    case ReductionType::Mean: return "mean";
+    case ReductionType::Max: return "max";
+    case ReductionType::Min: return "min";
+    default: return "argmax";
+    }
+}
+
+const char* TraceName(ShapeCompatibility aMode) {
+    switch (aMode) {
+    case ShapeCompatibility::ShapeMatch: return "ShapeMatch";
+    case ShapeCompatibility::Broadcast: return "Broadcast";
+    case ShapeCompatibility::ColsRowsMatch: return "ColsRowsMatch";
+    default: return "Incompatible";
+    }
+}
+
+
+/**************** Traced OpenCL command ******************/
+
+TracedCommand::TracedCommand(const char* aName, cl_command_queue aQueue, size_t aBytes, cl_event* aEvent)
+    : name(aName), queue(aQueue), bytes(aBytes), callerEvent(aEvent), active(Tracer::Enabled()) {
+    if (active) {
+        enqueued = Tracer::Instance().Now();
+    }
+}
+
+TracedCommand::~TracedCommand() {
+    if (!active) {
+        return;
+    }
+    cl_event traced = callerEvent ? *callerEvent : event;
+    if (traced) {
+        Tracer::Instance().RecordCommand(traced, name, queue, bytes, enqueued, TraceScope::Current());
+    }
+    if (event) {
+        clReleaseEvent(event);
+    }
+}
+
+TracedCommand::operator cl_event*() {
+    if (!active || callerEvent) {
+        return callerEvent;
+    }
+    return &event;
+}